@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Measure the challenge table with many approvals pending at once.
+ *
+ * Fills the table with count entries of random lifetime up to ttl seconds,
+ * looks each up, answers half of them and lets the rest expire on a
+ * simulated clock, checking every entry expires within one tick of its
+ * deadline and never before.
+ *
+ * Usage: bench_challenge [-n count] [-t ttl] [-k tick_ms]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "challenge.h"
+
+typedef struct {
+        char chat_id[CHALLENGE_MAX_CHAT_ID + 1];
+        char nonce[CHALLENGE_MAX_NONCE + 1];
+        uint64_t deadline;      /* ms on the simulated clock */
+        int expired;
+} pending;
+
+typedef struct {
+        uint64_t now;
+        unsigned int tick_ms;
+        size_t early, late;
+} expiry_check;
+
+static double now_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void on_expire(void *data, void *userdata)
+{
+        pending *p = data;
+        expiry_check *check = userdata;
+
+        p->expired++;
+        if (check->now < p->deadline)
+                check->early++;
+        else if (check->now >= p->deadline + 2 * check->tick_ms)
+                check->late++;
+}
+
+static void usage(const char *prog)
+{
+        fprintf(stderr, "Usage: %s [-n count] [-t ttl] [-k tick_ms]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+        int count = 50000, ttl = 120;
+        unsigned int tick_ms = 100;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "n:t:k:h")) != -1) {
+                switch (opt) {
+                case 'n': count = atoi(optarg); break;
+                case 't': ttl = atoi(optarg); break;
+                case 'k': tick_ms = atoi(optarg); break;
+                default:
+                        usage(argv[0]);
+                        return (opt == 'h') ? 0 : EXIT_FAILURE;
+                }
+        }
+        if (count <= 0 || ttl <= 0 || tick_ms == 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        pending *entries = calloc(count, sizeof(*entries));
+        challenge_table *t = challenge_create(count, tick_ms, 0);
+        if (!entries || !t) {
+                fprintf(stderr, "ERROR: Out of memory.\n");
+                return EXIT_FAILURE;
+        }
+
+        expiry_check check = { .now = 0, .tick_ms = tick_ms };
+        srand(1);
+
+        /* keys of 1000 users, made up front so only the table is timed */
+        for (int i = 0; i < count; i++) {
+                sprintf(entries[i].chat_id, "%d", 100000000 + i % 1000);
+                sprintf(entries[i].nonce, "%08x%08x%08x%08x",
+                        rand(), rand(), rand(), (unsigned int) i);
+                entries[i].deadline = 1000 + (uint64_t) rand() % ((uint64_t) ttl * 1000);
+        }
+
+        double start = now_ns();
+        for (int i = 0; i < count; i++) {
+                if (!challenge_insert(t, entries[i].chat_id, entries[i].nonce,
+                                      &entries[i], entries[i].deadline)) {
+                        fprintf(stderr, "ERROR: insert %d failed.\n", i);
+                        return EXIT_FAILURE;
+                }
+        }
+        double insert_ns = (now_ns() - start) / count;
+
+        /* table is full, one more must be refused */
+        if (challenge_insert(t, "1", "overflow", NULL, 1000)) {
+                fprintf(stderr, "ERROR: insert into full table succeeded.\n");
+                return EXIT_FAILURE;
+        }
+
+        start = now_ns();
+        for (int i = 0; i < count; i++) {
+                if (challenge_lookup(t, entries[i].chat_id, entries[i].nonce) != &entries[i]) {
+                        fprintf(stderr, "ERROR: lookup %d failed.\n", i);
+                        return EXIT_FAILURE;
+                }
+        }
+        double lookup_ns = (now_ns() - start) / count;
+
+        /* every other login answered */
+        int answered = 0;
+        start = now_ns();
+        for (int i = 0; i < count; i += 2, answered++) {
+                if (challenge_remove(t, entries[i].chat_id, entries[i].nonce) != &entries[i]) {
+                        fprintf(stderr, "ERROR: remove %d failed.\n", i);
+                        return EXIT_FAILURE;
+                }
+        }
+        double remove_ns = (now_ns() - start) / answered;
+
+        size_t expired = 0;
+        start = now_ns();
+        while (challenge_count(t) > 0) {
+                check.now += tick_ms;
+                expired += challenge_expire(t, check.now, on_expire, &check);
+        }
+        double expire_ns = (now_ns() - start) / (expired ? expired : 1);
+
+        size_t wrong = 0;
+        for (int i = 0; i < count; i++)
+                wrong += entries[i].expired != (i % 2 ? 1 : 0);
+
+        printf("pending n=%d ttl=%ds tick=%ums\n", count, ttl, tick_ms);
+        printf("insert  %.1fns/op\n", insert_ns);
+        printf("lookup  %.1fns/op\n", lookup_ns);
+        printf("remove  %.1fns/op n=%d\n", remove_ns, answered);
+        printf("expire  %.1fns/op n=%zu ticks=%lu early=%zu late=%zu wrong=%zu\n",
+               expire_ns, expired, (unsigned long) (check.now / tick_ms),
+               check.early, check.late, wrong);
+
+        challenge_destroy(t);
+        free(entries);
+
+        return (check.early || check.late || wrong) ? EXIT_FAILURE : 0;
+}
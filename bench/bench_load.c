@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Cost of pam_telegram_authenticator.so for a user without config.
+ *
+ * Every sample is a fresh process, like an sshd child: it dlopen()s the
+ * module, then runs pam_authenticate() through libpam for a user with no
+ * config, which the module answers with PAM_IGNORE. Reports the time to load
+ * the module, the first and the following authentications, and whether
+ * libcurl or json-c got mapped into the process on the way.
+ *
+ * This program links neither, so whatever is mapped came from the module.
+ *
+ * Usage: bench_load [-n samples] [-k auths] [-u user] <module.so> [module args...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <sys/wait.h>
+
+#include <security/pam_appl.h>
+
+#define SERVICE "telegram-authenticator-bench-load"
+
+typedef struct {
+        double load_ms;         /* dlopen() of module */
+        double first_ms;        /* first pam_authenticate() */
+        double next_ms;         /* mean of the following ones */
+        int rc;                 /* of the first pam_authenticate() */
+        int curl_mapped;
+        int json_c_mapped;
+} sample;
+
+static double now_ms(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+        double x = *(const double *) a, y = *(const double *) b;
+        return (x > y) - (x < y);
+}
+
+static void report(const char *name, double *values, int count)
+{
+        double sum = 0;
+        for (int i = 0; i < count; i++)
+                sum += values[i];
+
+        qsort(values, count, sizeof(double), cmp_double);
+        printf("%-14s mean=%.3fms p50=%.3fms p95=%.3fms max=%.3fms\n", name, sum / count,
+               values[count / 2], values[count * 95 / 100], values[count - 1]);
+}
+
+static int conversation(int num_msg, const struct pam_message **msg,
+                        struct pam_response **resp, void *appdata_ptr)
+{
+        /* no prompt is expected for a user without config */
+        return PAM_CONV_ERR;
+}
+
+/* Write PAM service file which only uses our module */
+static char *make_confdir(int argc, char *argv[])
+{
+        static char dir[] = "/tmp/bench_load.XXXXXX";
+        char path[sizeof(dir) + sizeof(SERVICE) + 1];
+
+        if (!mkdtemp(dir)) {
+                perror("mkdtemp()");
+                exit(EXIT_FAILURE);
+        }
+
+        snprintf(path, sizeof(path), "%s/%s", dir, SERVICE);
+        FILE *f = fopen(path, "w");
+        if (!f) {
+                perror("fopen()");
+                exit(EXIT_FAILURE);
+        }
+
+        fprintf(f, "auth required %s nobroker", argv[0]);
+        for (int i = 1; i < argc; i++)
+                fprintf(f, " %s", argv[i]);
+        fprintf(f, "\n");
+        fclose(f);
+
+        return dir;
+}
+
+static void check_maps(sample *s)
+{
+        char line[512];
+        FILE *f = fopen("/proc/self/maps", "r");
+        if (!f)
+                return;
+
+        while (fgets(line, sizeof(line), f)) {
+                if (strstr(line, "libcurl"))
+                        s->curl_mapped = 1;
+                if (strstr(line, "libjson-c"))
+                        s->json_c_mapped = 1;
+        }
+        fclose(f);
+}
+
+/* One sshd child */
+static void run_sample(const char *module, const char *confdir, const char *user, int auths, sample *s)
+{
+        double start = now_ms();
+        void *handle = dlopen(module, RTLD_NOW | RTLD_LOCAL);
+        s->load_ms = now_ms() - start;
+        if (!handle) {
+                fprintf(stderr, "ERROR: %s\n", dlerror());
+                exit(EXIT_FAILURE);
+        }
+
+        struct pam_conv conv = { conversation, NULL };
+        for (int i = 0; i < auths; i++) {
+                pam_handle_t *pamh = NULL;
+                if (PAM_SUCCESS != pam_start_confdir(SERVICE, user, &conv, confdir, &pamh)) {
+                        fprintf(stderr, "ERROR: pam_start_confdir() failed.\n");
+                        exit(EXIT_FAILURE);
+                }
+
+                start = now_ms();
+                int rc = pam_authenticate(pamh, 0);
+                double ms = now_ms() - start;
+                pam_end(pamh, rc);
+
+                if (0 == i) {
+                        s->first_ms = ms;
+                        s->rc = rc;
+                } else {
+                        s->next_ms += ms / (auths - 1);
+                }
+        }
+
+        check_maps(s);
+}
+
+static void usage(const char *prog)
+{
+        fprintf(stderr, "Usage: %s [-n samples] [-k auths] [-u user] <module.so> [module args...]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+        int samples = 50, auths = 100;
+        const char *user = "nobody";
+        int opt;
+
+        while ((opt = getopt(argc, argv, "+n:k:u:h")) != -1) {
+                switch (opt) {
+                case 'n': samples = atoi(optarg); break;
+                case 'k': auths = atoi(optarg); break;
+                case 'u': user = optarg; break;
+                default:
+                        usage(argv[0]);
+                        return (opt == 'h') ? 0 : EXIT_FAILURE;
+                }
+        }
+
+        if (optind >= argc || samples <= 0 || auths < 2) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        const char *module = argv[optind];
+        char *confdir = make_confdir(argc - optind, argv + optind);
+
+        double *load = calloc(samples, sizeof(double));
+        double *first = calloc(samples, sizeof(double));
+        double *next = calloc(samples, sizeof(double));
+        int curl = 0, json_c = 0, ignored = 0;
+
+        for (int i = 0; i < samples; i++) {
+                int fds[2];
+                sample s = { 0 };
+
+                if (pipe(fds)) {
+                        perror("pipe()");
+                        return EXIT_FAILURE;
+                }
+
+                pid_t pid = fork();
+                if (0 == pid) {
+                        close(fds[0]);
+                        run_sample(module, confdir, user, auths, &s);
+                        _exit(write(fds[1], &s, sizeof(s)) == sizeof(s) ? 0 : EXIT_FAILURE);
+                }
+
+                close(fds[1]);
+                ssize_t n = pid > 0 ? read(fds[0], &s, sizeof(s)) : -1;
+                close(fds[0]);
+                if (pid > 0)
+                        waitpid(pid, NULL, 0);
+                if (n != sizeof(s)) {
+                        fprintf(stderr, "ERROR: sample %d failed.\n", i);
+                        return EXIT_FAILURE;
+                }
+
+                load[i] = s.load_ms;
+                first[i] = s.first_ms;
+                next[i] = s.next_ms;
+                curl += s.curl_mapped;
+                json_c += s.json_c_mapped;
+                ignored += PAM_SUCCESS != s.rc;
+        }
+
+        printf("samples=%d auths=%d user=%s not_authenticated=%d libcurl_mapped=%d libjson-c_mapped=%d\n",
+               samples, auths, user, ignored, curl, json_c);
+        report("load", load, samples);
+        report("first auth", first, samples);
+        report("next auths", next, samples);
+
+        char path[256];
+        snprintf(path, sizeof(path), "%s/%s", confdir, SERVICE);
+        unlink(path);
+        rmdir(confdir);
+
+        free(load);
+        free(first);
+        free(next);
+        return 0;
+}
@@ -0,0 +1,414 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Micro benchmarks of hot paths, with every heap allocation counted.
+ *
+ * malloc() and friends are replaced by counting wrappers around glibc's, so
+ * allocs/op covers this program and every library it calls.
+ *
+ * Every benchmark runs on its own: warmed up, its iterations calibrated to
+ * take about CALIBRATE_MS unless -n is given, then timed over several runs of
+ * which the median is reported. The config benchmarks read a config in a
+ * temporary $HOME, for a uid without passwd entry.
+ *
+ * Usage: bench_micro [-n iterations] [-r runs] [-j] [-b baseline [-t percent] [-a percent]]
+ *
+ *   -n iterations  per run, calibrated for each benchmark by default
+ *   -r runs        timed runs of each benchmark (default 5)
+ *   -j             print results as json, the format of the baseline
+ *   -b baseline    compare with results in this json file, exit 1 on regression
+ *   -t percent     ns/op allowed above the baseline (default 50)
+ *   -a percent     allocs/op and bytes/op allowed above the baseline (default 0),
+ *                  not checked for benchmarks whose allocations are NSS's
+ *
+ * The baseline's ns/op, and the allocations of NSS, are of the machine it was
+ * made on: regenerate it with -j on each machine the comparison runs on.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <json-c/json.h>
+
+#include "config.h"
+#include "config_cache.h"
+#include "random.h"
+#include "telegram.h"
+
+/* Counting allocator */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static size_t alloc_count, alloc_bytes;
+
+void *malloc(size_t size)
+{
+        __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&alloc_bytes, size, __ATOMIC_RELAXED);
+        return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+        __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&alloc_bytes, nmemb * size, __ATOMIC_RELAXED);
+        return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+        __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&alloc_bytes, size, __ATOMIC_RELAXED);
+        return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+        __libc_free(ptr);
+}
+
+/* Benchmarks */
+
+#define CHAT_ID "-1001234567890"
+#define TOKEN   "123456789:AAHdqTcvCH1vGWJxfSeofSAs0K5PALDsaw"
+#define MESSAGE "Your ssh login code: 12345"
+#define NONCE   "0123456789abcdef0123456789abcdef"
+
+/* A uid nobody has, so config_file() falls back to $HOME */
+#define BENCH_UID 2147483000
+
+/* CODE_DIGITS of the module, passwdgen() is random_digits() of that many */
+#define CODE_DIGITS 5
+
+#define CALIBRATE_MS 100
+#define WARMUP_MS    10
+
+static char body[1024];
+static char config_path[64];
+static volatile size_t sink;
+
+static void config_file_path(void)
+{
+        const char *path = config_file(BENCH_UID);
+        sink += path != NULL;
+        free((char *) path);
+}
+
+static void config_exists_uid(void)
+{
+        sink += config_exists(BENCH_UID);
+}
+
+/* Through the config cache when root, else parsed every time */
+static void config_read_uid(void)
+{
+        config_t cfg = config_read(BENCH_UID);
+        sink += cfg.token != NULL;
+        config_free(cfg);
+}
+
+static void config_read_parse(void)
+{
+        config_t cfg = config_read_file(config_path, NULL);
+        sink += cfg.token != NULL;
+        config_free(cfg);
+}
+
+static void passwdgen(void)
+{
+        char code[CODE_DIGITS + 1];
+        sink += random_digits(code, CODE_DIGITS);
+}
+
+static void api_url(void)
+{
+        char url[TELEGRAM_URL_MAX];
+        sink += telegram_api_url(NULL, TOKEN, "/sendMessage", url, sizeof(url));
+}
+
+static void message_body(void)
+{
+        sink += telegram_message_body(body, sizeof(body), CHAT_ID, MESSAGE, NULL);
+}
+
+static void approval_body(void)
+{
+        sink += telegram_message_body(body, sizeof(body), CHAT_ID, MESSAGE, NONCE);
+}
+
+static void escaped_body(void)
+{
+        sink += telegram_message_body(body, sizeof(body), CHAT_ID,
+                                      "Login from \"host\"\n\tat C:\\path\x01", NULL);
+}
+
+/* The json-c tree sendMessage was built with before */
+static void json_c_body(void)
+{
+        json_object *jobj = json_object_new_object();
+        json_object_object_add(jobj, "chat_id", json_object_new_string(CHAT_ID));
+        json_object_object_add(jobj, "text", json_object_new_string(MESSAGE));
+        sink += strlen(json_object_to_json_string(jobj));
+        json_object_put(jobj);
+}
+
+/* The passwd lookup of config_file and config_exists allocates in libc and
+ * the NSS modules of the host (files, sssd, ldap...), those allocations are
+ * not ours to gate */
+static const struct {
+        const char *name;
+        void (*run)(void);
+        bool nss;               /* allocs/op and bytes/op are mostly NSS */
+} benchmarks[] = {
+        { "config_file",      config_file_path,  true },
+        { "config_exists",    config_exists_uid, true },
+        { "config_read",      config_read_uid,   false },
+        { "config_read_file", config_read_parse, false },
+        { "passwdgen",        passwdgen,         false },
+        { "api_url",          api_url,           false },
+        { "message_body",     message_body,      false },
+        { "approval_body",    approval_body,     false },
+        { "escaped_body",     escaped_body,      false },
+        { "json_c_body",      json_c_body,       false },
+};
+
+#define NBENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+typedef struct {
+        double ns;              /* per op, median of the runs */
+        double allocs;          /* per op */
+        double bytes;
+} result;
+
+static double now_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+        double x = *(const double *) a, y = *(const double *) b;
+        return (x > y) - (x < y);
+}
+
+/* ns taken by iterations of run */
+static double time_run(void (*run)(void), long iterations)
+{
+        double start = now_ns();
+        for (long i = 0; i < iterations; i++)
+                run();
+        return now_ns() - start;
+}
+
+/* Iterations taking about ms, doubling from one */
+static long calibrate(void (*run)(void), double ms)
+{
+        long iterations = 1;
+        while (time_run(run, iterations) < ms * 1e6 && iterations < (1L << 30))
+                iterations *= 2;
+        return iterations;
+}
+
+static void measure(void (*run)(void), long iterations, int runs, result *r)
+{
+        /* warm up, so pools and lazy init are not counted */
+        calibrate(run, WARMUP_MS);
+        if (iterations <= 0)
+                iterations = calibrate(run, CALIBRATE_MS);
+
+        double ns[runs];
+        size_t count = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+        size_t bytes = __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED);
+
+        for (int i = 0; i < runs; i++)
+                ns[i] = time_run(run, iterations) / iterations;
+
+        count = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED) - count;
+        bytes = __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED) - bytes;
+
+        qsort(ns, runs, sizeof(double), cmp_double);
+        r->ns = ns[runs / 2];
+        r->allocs = (double) count / iterations / runs;
+        r->bytes = (double) bytes / iterations / runs;
+}
+
+/* Config file in a temporary $HOME, read by the config benchmarks */
+static char *make_home(void)
+{
+        static char dir[] = "/tmp/bench_micro.XXXXXX";
+        char cache[64];
+
+        if (!mkdtemp(dir)) {
+                perror("mkdtemp()");
+                exit(EXIT_FAILURE);
+        }
+
+        snprintf(config_path, sizeof(config_path), "%s/.telegram_authenticator", dir);
+        FILE *f = fopen(config_path, "w");
+        if (!f) {
+                perror("fopen()");
+                exit(EXIT_FAILURE);
+        }
+        fprintf(f, "{ \"token\": \"%s\", \"chat_id\": \"%s\", \"mode\": \"code\",\n"
+                "  \"chats\": [ \"222\", { \"chat_id\": \"-100333\", \"token\": \"%s\" } ] }\n",
+                TOKEN, CHAT_ID, TOKEN);
+        fclose(f);
+
+        /* a cache of our own, never the system one */
+        snprintf(cache, sizeof(cache), "%s/config.cache", dir);
+        config_cache_set_file(strdup(cache));
+        setenv("HOME", dir, 1);
+
+        return dir;
+}
+
+static void remove_home(const char *dir)
+{
+        char path[64];
+
+        unlink(config_path);
+        snprintf(path, sizeof(path), "%s/config.cache", dir);
+        unlink(path);
+        rmdir(dir);
+}
+
+/**
+ * Compare results with baseline.
+ *
+ * @return number of benchmarks slower or allocating more than allowed
+ */
+static int compare(const char *path, const result *results, double ns_pct, double alloc_pct)
+{
+        json_object *baseline = json_object_from_file(path);
+        json_object *entries;
+        int regressions = 0;
+
+        if (!baseline || !json_object_object_get_ex(baseline, "results", &entries)) {
+                fprintf(stderr, "ERROR: invalid baseline %s\n", path);
+                json_object_put(baseline);
+                return -1;
+        }
+
+        for (size_t b = 0; b < NBENCHMARKS; b++) {
+                json_object *entry, *ns, *allocs, *bytes;
+                if (!json_object_object_get_ex(entries, benchmarks[b].name, &entry) ||
+                    !json_object_object_get_ex(entry, "ns_per_op", &ns) ||
+                    !json_object_object_get_ex(entry, "allocs_per_op", &allocs) ||
+                    !json_object_object_get_ex(entry, "bytes_per_op", &bytes)) {
+                        fprintf(stderr, "%-16s not in baseline\n", benchmarks[b].name);
+                        continue;
+                }
+
+                const result *r = &results[b];
+                double base_ns = json_object_get_double(ns);
+                double base_allocs = json_object_get_double(allocs);
+                double base_bytes = json_object_get_double(bytes);
+
+                /* a little slack for rounding in the json */
+                bool slow = r->ns > base_ns * (1 + ns_pct / 100);
+                bool fat = !benchmarks[b].nss &&
+                        (r->allocs > base_allocs * (1 + alloc_pct / 100) + 0.005 ||
+                         r->bytes > base_bytes * (1 + alloc_pct / 100) + 0.5);
+
+                fprintf(stderr, "%-16s %+7.1f%% ns/op %+6.2f allocs/op %+8.1f bytes/op%s%s\n",
+                        benchmarks[b].name, base_ns > 0 ? (r->ns / base_ns - 1) * 100 : 0,
+                        r->allocs - base_allocs, r->bytes - base_bytes,
+                        benchmarks[b].nss ? " (NSS, not gated)" : "",
+                        slow || fat ? "  REGRESSION" : "");
+                regressions += slow || fat;
+        }
+
+        json_object_put(baseline);
+        return regressions;
+}
+
+static void usage(const char *prog)
+{
+        fprintf(stderr, "Usage: %s [-n iterations] [-r runs] [-j] [-b baseline [-t percent] [-a percent]]\n",
+                prog);
+}
+
+int main(int argc, char *argv[])
+{
+        long iterations = 0;
+        int runs = 5;
+        bool json = false;
+        const char *baseline = NULL;
+        double ns_pct = 50, alloc_pct = 0;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "n:r:jb:t:a:h")) != -1) {
+                switch (opt) {
+                case 'n': iterations = atol(optarg); break;
+                case 'r': runs = atoi(optarg); break;
+                case 'j': json = true; break;
+                case 'b': baseline = optarg; break;
+                case 't': ns_pct = atof(optarg); break;
+                case 'a': alloc_pct = atof(optarg); break;
+                default:
+                        usage(argv[0]);
+                        return (opt == 'h') ? 0 : EXIT_FAILURE;
+                }
+        }
+        if (runs <= 0 || ns_pct < 0 || alloc_pct < 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        char *home = make_home();
+        result results[NBENCHMARKS];
+
+        for (size_t b = 0; b < NBENCHMARKS; b++)
+                measure(benchmarks[b].run, iterations, runs, &results[b]);
+
+        if (json) {
+                printf("{\"benchmark\":\"micro\",\"results\":{");
+                for (size_t b = 0; b < NBENCHMARKS; b++)
+                        printf("%s\n  \"%s\":{\"ns_per_op\":%.1f,\"allocs_per_op\":%.2f,\"bytes_per_op\":%.1f}",
+                               b ? "," : "", benchmarks[b].name,
+                               results[b].ns, results[b].allocs, results[b].bytes);
+                printf("\n}}\n");
+        } else {
+                for (size_t b = 0; b < NBENCHMARKS; b++)
+                        printf("%-16s %10.1f ns/op %8.2f allocs/op %10.1f bytes/op\n", benchmarks[b].name,
+                               results[b].ns, results[b].allocs, results[b].bytes);
+
+                /* what the escaping looks like */
+                telegram_message_body(body, sizeof(body), CHAT_ID, "a \"b\"\n\\c\x01", NULL);
+                printf("%s\n", body);
+        }
+
+        remove_home(home);
+
+        int regressions = baseline ? compare(baseline, results, ns_pct, alloc_pct) : 0;
+        if (regressions)
+                fprintf(stderr, "%s\n", regressions < 0 ? "no comparison" : "regressions against baseline");
+
+        return regressions ? EXIT_FAILURE : 0;
+}
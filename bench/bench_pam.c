@@ -0,0 +1,602 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * End-to-end benchmark of pam_telegram_authenticator.so.
+ *
+ * A mock Bot API server runs in this process, and N workers drive the module
+ * through libpam's pam_start_confdir()/pam_authenticate(). Each worker is a
+ * different user listed in a generated credential store, the conversation
+ * function answers each prompt with the code the mock server received.
+ * In approve mode, it presses the button of the message instead when the
+ * module tells the user to approve the login.
+ *
+ * Usage: bench_pam [options] <module.so> [module args...]
+ *
+ *   -n count       total authentications (default 100)
+ *   -c workers     concurrent workers (default 1)
+ *   -l ms          latency injected by mock server
+ *   -e percent     errors injected by mock server
+ *   -b backlog     pending updates in mock getUpdates
+ *   -w             answer a wrong code, or press Deny
+ *   -a             users in approve mode
+ *   -m chats       every user has this many more chats to send the code to
+ *   -q quorum      chats that must get the code, with -m
+ *   -d daemon      run telegram-authenticatord at this path against the mock
+ *                  server with a webhook, and send through it
+ *   -s kb          soak test: fail if resident memory grows more than kb
+ *                  between 10% and 100% of the authentications
+ *   -j             print result as json
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+
+#include <security/pam_appl.h>
+
+#include "mock_bot_api.h"
+#include "store.h"
+
+#define SERVICE "telegram-authenticator-bench"
+
+/* How long a user waits for the code before giving up, plus injected latency */
+#define WAIT_CODE_MS 2000
+
+/* Resident memory is sampled at every tenth of the authentications */
+#define SOAK_SAMPLES 10
+
+typedef struct {
+        int count;
+        int workers;
+        bool wrong_code;
+        bool approve;
+        int chats;              /* more chats of every user */
+        int quorum;
+        bool json;
+        const char *daemon;     /* telegram-authenticatord to run, NULL for none */
+        int soak_kb;            /* allowed growth of resident memory, -1 for no soak test */
+        mock_options mock;
+} bench_options;
+
+typedef struct {
+        int id;
+        char user[32];
+        char chat_id[32];
+        int count;              /* authentications to run */
+        double *latency;        /* per authentication, ms */
+        double *to_prompt;
+        int prompted;
+        int ok;
+        int failed;
+        const bench_options *opts;
+        const char *confdir;
+        pthread_t thread;
+} worker;
+
+typedef struct {
+        worker *w;
+        double start;           /* when pam_authenticate() called */
+        double prompt;          /* when first prompt arrived, 0 if none */
+} conv_state;
+
+/* Authentications finished by all workers, accessed with __atomic builtins */
+static int finished;
+
+static double now_ms(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+        double x = *(const double *) a, y = *(const double *) b;
+        return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int count, int pct)
+{
+        if (count <= 0)
+                return 0;
+        int i = (count * pct) / 100;
+        return sorted[i < count ? i : count - 1];
+}
+
+/* Resident memory of this process in kB, -1 on error */
+static long rss_kb(void)
+{
+        char buf[128];
+        long size, resident;
+
+        int fd = open("/proc/self/statm", O_RDONLY);
+        if (fd < 0)
+                return -1;
+        ssize_t n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (n <= 0)
+                return -1;
+        buf[n] = '\0';
+
+        if (sscanf(buf, "%ld %ld", &size, &resident) != 2)
+                return -1;
+        return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* Press the button of the approval message sent to this worker's chat, like
+ * the telegram client would send it */
+static void press_button(conv_state *state)
+{
+        char text[512], data[65];
+        if (!mock_wait_message(state->w->chat_id, WAIT_CODE_MS + 4 * state->w->opts->mock.latency_ms,
+                               text, sizeof(text), data, sizeof(data)) || !data[0])
+                return;
+
+        /* first button approves, deny has the same nonce */
+        const char *nonce = strchr(data, ':');
+        char fields[512];
+        snprintf(fields, sizeof(fields),
+                 "\"callback_query\":{\"id\":\"%d%ld\",\"from\":{\"id\":%s},"
+                 "\"message\":{\"message_id\":1,\"chat\":{\"id\":%s}},\"data\":\"%s%s\"}",
+                 state->w->id, random(), state->w->chat_id, state->w->chat_id,
+                 state->w->opts->wrong_code ? "deny" : "approve", nonce ? nonce : "");
+        mock_push_update(fields);
+}
+
+/* Answer the prompt with the code sent to this worker's chat */
+static int conversation(int num_msg, const struct pam_message **msg,
+                        struct pam_response **resp, void *appdata_ptr)
+{
+        conv_state *state = appdata_ptr;
+        struct pam_response *reply = calloc(num_msg, sizeof(struct pam_response));
+        if (!reply)
+                return PAM_BUF_ERR;
+
+        for (int i = 0; i < num_msg; i++) {
+                if (PAM_TEXT_INFO == msg[i]->msg_style && state->w->opts->approve) {
+                        if (0 == state->prompt)
+                                state->prompt = now_ms();
+                        press_button(state);
+                        continue;
+                }
+
+                if (PAM_PROMPT_ECHO_OFF != msg[i]->msg_style &&
+                    PAM_PROMPT_ECHO_ON != msg[i]->msg_style)
+                        continue;
+
+                if (0 == state->prompt)
+                        state->prompt = now_ms();
+
+                char text[512] = "";
+                const char *code = "0";
+                if (mock_wait_message(state->w->chat_id,
+                                      WAIT_CODE_MS + 4 * state->w->opts->mock.latency_ms,
+                                      text, sizeof(text), NULL, 0)) {
+                        const char *p = strrchr(text, ' ');
+                        code = p ? p + 1 : text;
+                }
+
+                reply[i].resp = strdup(state->w->opts->wrong_code ? "0" : code);
+        }
+
+        *resp = reply;
+        return PAM_SUCCESS;
+}
+
+static void *worker_thread(void *arg)
+{
+        worker *w = arg;
+
+        for (int i = 0; i < w->count; i++) {
+                conv_state state = { w, 0, 0 };
+                struct pam_conv conv = { conversation, &state };
+                pam_handle_t *pamh;
+
+                int rc = pam_start_confdir(SERVICE, w->user, &conv, w->confdir, &pamh);
+                if (PAM_SUCCESS != rc) {
+                        fprintf(stderr, "ERROR: pam_start_confdir() failed: %d\n", rc);
+                        w->failed++;
+                        continue;
+                }
+
+                state.start = now_ms();
+                rc = pam_authenticate(pamh, PAM_SILENT);
+                w->latency[i] = now_ms() - state.start;
+
+                if (state.prompt)
+                        w->to_prompt[w->prompted++] = state.prompt - state.start;
+
+                if (PAM_SUCCESS == rc)
+                        w->ok++;
+                else
+                        w->failed++;
+
+                pam_end(pamh, rc);
+                __atomic_add_fetch(&finished, 1, __ATOMIC_RELAXED);
+        }
+
+        return NULL;
+}
+
+/* Write PAM service file which only uses our module */
+static char *make_confdir(int port, const char *store, const char *broker, int argc, char *argv[])
+{
+        static char dir[] = "/tmp/bench_pam.XXXXXX";
+        char path[sizeof(dir) + sizeof(SERVICE) + 1];
+
+        if (!mkdtemp(dir)) {
+                perror("mkdtemp()");
+                exit(EXIT_FAILURE);
+        }
+
+        snprintf(path, sizeof(path), "%s/%s", dir, SERVICE);
+        FILE *f = fopen(path, "w");
+        if (!f) {
+                perror("fopen()");
+                exit(EXIT_FAILURE);
+        }
+
+        /* our settings first, so the ones given on command line win */
+        fprintf(f, "auth required %s api_url=http://127.0.0.1:%d store=%s ratelimit=0:0",
+                argv[0], port, store);
+        if (broker)
+                fprintf(f, " broker=%s", broker);
+        else
+                fprintf(f, " nobroker");
+        for (int i = 1; i < argc; i++)
+                fprintf(f, " %s", argv[i]);
+        fprintf(f, "\n");
+        fclose(f);
+
+        return dir;
+}
+
+/* Credential store with one user per worker */
+static void make_store(const char *path, worker *workers, int n, const bench_options *opts)
+{
+        store_entry *entries = calloc(n, sizeof(store_entry));
+        config_chat *chats = calloc(n * opts->chats + 1, sizeof(config_chat));
+        char (*chat_ids)[48] = calloc(n * opts->chats + 1, sizeof(*chat_ids));
+        if (!entries || !chats || !chat_ids) {
+                perror("calloc()");
+                exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < n; i++) {
+                entries[i].uid = 100000 + i;
+                entries[i].name = workers[i].user;
+                entries[i].token = "123456:bench";
+                entries[i].chat_id = workers[i].chat_id;
+                entries[i].mode = opts->approve ? CONFIG_MODE_APPROVE : CONFIG_MODE_CODE;
+                entries[i].chats = chats + i * opts->chats;
+                entries[i].nchats = opts->chats;
+                entries[i].quorum = opts->quorum;
+
+                for (int k = 0; k < opts->chats; k++) {
+                        snprintf(chat_ids[i * opts->chats + k], sizeof(*chat_ids), "%s%d",
+                                 workers[i].chat_id, k + 1);
+                        chats[i * opts->chats + k].chat_id = chat_ids[i * opts->chats + k];
+                }
+        }
+
+        if (!store_build(path, entries, n)) {
+                fprintf(stderr, "ERROR: failed to write store %s\n", path);
+                exit(EXIT_FAILURE);
+        }
+
+        free(chat_ids);
+        free(chats);
+        free(entries);
+}
+
+/* A port nobody listens on right now */
+static int free_port(void)
+{
+        struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+        socklen_t len = sizeof(addr);
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int port = -1;
+
+        if (fd >= 0 && bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0 &&
+            getsockname(fd, (struct sockaddr *) &addr, &len) == 0)
+                port = ntohs(addr.sin_port);
+        if (fd >= 0)
+                close(fd);
+        return port;
+}
+
+/* Run telegram-authenticatord talking to the mock server, with its webhook
+ * listener registered at the mock, and wait until it accepts requests */
+static pid_t start_daemon(const char *path, int mock_port, const char *socket_path)
+{
+        int port = free_port();
+        if (port < 0) {
+                fprintf(stderr, "ERROR: no free port for webhook\n");
+                exit(EXIT_FAILURE);
+        }
+
+        char api_url[64], listen[32], url[64];
+        snprintf(api_url, sizeof(api_url), "http://127.0.0.1:%d", mock_port);
+        snprintf(listen, sizeof(listen), "127.0.0.1:%d", port);
+        snprintf(url, sizeof(url), "http://127.0.0.1:%d/webhook", port);
+
+        pid_t pid = fork();
+        if (pid < 0) {
+                perror("fork()");
+                exit(EXIT_FAILURE);
+        }
+        if (0 == pid) {
+                execl(path, path, "-s", socket_path, "-a", api_url, "-r", "1000000", "-c", "1000000",
+                      "-q", "100000", "-w", listen, "-u", url, (char *) NULL);
+                perror("execl()");
+                _exit(127);
+        }
+
+        for (int i = 0; i < 300; i++) {
+                struct stat st;
+                if (stat(socket_path, &st) == 0)
+                        return pid;
+                if (waitpid(pid, NULL, WNOHANG) == pid)
+                        break;
+                usleep(10000);
+        }
+
+        fprintf(stderr, "ERROR: %s did not start\n", path);
+        kill(pid, SIGTERM);
+        exit(EXIT_FAILURE);
+}
+
+/* rss is resident memory at every tenth of the authentications, NULL without soak test */
+static void report(const bench_options *opts, worker *workers, double seconds, const long *rss)
+{
+        double *latency = calloc(opts->count, sizeof(double));
+        double *to_prompt = calloc(opts->count, sizeof(double));
+        int nlatency = 0, nprompt = 0, ok = 0, failed = 0;
+
+        for (int i = 0; i < opts->workers; i++) {
+                worker *w = &workers[i];
+                memcpy(latency + nlatency, w->latency, w->count * sizeof(double));
+                memcpy(to_prompt + nprompt, w->to_prompt, w->prompted * sizeof(double));
+                nlatency += w->count;
+                nprompt += w->prompted;
+                ok += w->ok;
+                failed += w->failed;
+        }
+
+        qsort(latency, nlatency, sizeof(double), cmp_double);
+        qsort(to_prompt, nprompt, sizeof(double), cmp_double);
+
+        mock_stats stats;
+        mock_get_stats(&stats);
+
+        double throughput = seconds > 0 ? nlatency / seconds : 0;
+
+        if (opts->json) {
+                printf("{\"benchmark\":\"pam\",\"workers\":%d,\"count\":%d,\"ok\":%d,\"failed\":%d,"
+                       "\"seconds\":%.3f,\"throughput\":%.2f,"
+                       "\"latency_ms\":{\"p50\":%.3f,\"p95\":%.3f,\"p99\":%.3f,\"max\":%.3f},"
+                       "\"time_to_prompt_ms\":{\"p50\":%.3f,\"p95\":%.3f,\"p99\":%.3f,\"max\":%.3f},"
+                       "\"mock\":{\"connections\":%lu,\"requests\":%lu,\"send_message\":%lu,"
+                       "\"get_updates\":%lu,\"webhook_posts\":%lu,\"errors\":%lu}",
+                       opts->workers, nlatency, ok, failed, seconds, throughput,
+                       percentile(latency, nlatency, 50), percentile(latency, nlatency, 95),
+                       percentile(latency, nlatency, 99), percentile(latency, nlatency, 100),
+                       percentile(to_prompt, nprompt, 50), percentile(to_prompt, nprompt, 95),
+                       percentile(to_prompt, nprompt, 99), percentile(to_prompt, nprompt, 100),
+                       stats.connections, stats.requests, stats.send_message,
+                       stats.get_updates, stats.webhook_posts, stats.errors);
+                if (rss) {
+                        printf(",\"rss_kb\":[");
+                        for (int i = 0; i <= SOAK_SAMPLES; i++)
+                                printf("%s%ld", i ? "," : "", rss[i]);
+                        printf("],\"rss_growth_kb\":%ld", rss[SOAK_SAMPLES] - rss[1]);
+                }
+                printf("}\n");
+        } else {
+                printf("workers=%d count=%d ok=%d failed=%d seconds=%.3f throughput=%.2f/s\n",
+                       opts->workers, nlatency, ok, failed, seconds, throughput);
+                printf("%-16s p50=%.2fms p95=%.2fms p99=%.2fms max=%.2fms\n", "authenticate",
+                       percentile(latency, nlatency, 50), percentile(latency, nlatency, 95),
+                       percentile(latency, nlatency, 99), percentile(latency, nlatency, 100));
+                printf("%-16s p50=%.2fms p95=%.2fms p99=%.2fms max=%.2fms\n", "time-to-prompt",
+                       percentile(to_prompt, nprompt, 50), percentile(to_prompt, nprompt, 95),
+                       percentile(to_prompt, nprompt, 99), percentile(to_prompt, nprompt, 100));
+                printf("mock: connections=%lu requests=%lu sendMessage=%lu getUpdates=%lu "
+                       "webhook=%lu errors=%lu\n",
+                       stats.connections, stats.requests, stats.send_message,
+                       stats.get_updates, stats.webhook_posts, stats.errors);
+                if (rss) {
+                        printf("rss:");
+                        for (int i = 0; i <= SOAK_SAMPLES; i++)
+                                printf(" %d%%=%ldkB", i * 100 / SOAK_SAMPLES, rss[i]);
+                        printf("\nrss growth after warmup=%ldkB limit=%dkB\n",
+                               rss[SOAK_SAMPLES] - rss[1], opts->soak_kb);
+                }
+        }
+
+        free(latency);
+        free(to_prompt);
+}
+
+static void usage(const char *prog)
+{
+        fprintf(stderr,
+                "Usage: %s [options] <module.so> [module args...]\n"
+                "\n"
+                "  -n count     total authentications (default 100)\n"
+                "  -c workers   concurrent workers (default 1)\n"
+                "  -l ms        latency injected by mock server\n"
+                "  -e percent   errors injected by mock server\n"
+                "  -b backlog   pending updates in mock getUpdates\n"
+                "  -w           answer a wrong code, or press Deny\n"
+                "  -a           users in approve mode\n"
+                "  -m chats     every user has this many more chats to send the code to\n"
+                "  -q quorum    chats that must get the code, with -m\n"
+                "  -d daemon    send through telegram-authenticatord at this path,\n"
+                "               receiving updates by webhook\n"
+                "  -s kb        soak test: fail if resident memory grows more than kb\n"
+                "               between 10%% and 100%% of the authentications\n"
+                "  -j           print result as json\n",
+                prog);
+}
+
+int main(int argc, char *argv[])
+{
+        bench_options opts = { .count = 100, .workers = 1, .soak_kb = -1 };
+        int opt;
+
+        while ((opt = getopt(argc, argv, "+n:c:l:e:b:wam:q:d:s:jh")) != -1) {
+                switch (opt) {
+                case 'n': opts.count = atoi(optarg); break;
+                case 'c': opts.workers = atoi(optarg); break;
+                case 'l': opts.mock.latency_ms = atoi(optarg); break;
+                case 'e': opts.mock.error_percent = atoi(optarg); break;
+                case 'b': opts.mock.backlog = atoi(optarg); break;
+                case 'w': opts.wrong_code = true; break;
+                case 'a': opts.approve = true; break;
+                case 'm': opts.chats = atoi(optarg); break;
+                case 'q': opts.quorum = atoi(optarg); break;
+                case 'd': opts.daemon = optarg; break;
+                case 's': opts.soak_kb = atoi(optarg); break;
+                case 'j': opts.json = true; break;
+                default:
+                        usage(argv[0]);
+                        return (opt == 'h') ? 0 : EXIT_FAILURE;
+                }
+        }
+
+        if (optind >= argc || opts.count <= 0 || opts.workers <= 0 ||
+            opts.chats < 0 || opts.chats > CONFIG_MAX_CHATS || opts.quorum < 0 || opts.quorum > opts.chats + 1) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        if (opts.workers > opts.count)
+                opts.workers = opts.count;
+
+        int port = mock_start(&opts.mock);
+        if (port < 0)
+                return EXIT_FAILURE;
+
+        worker *workers = calloc(opts.workers, sizeof(worker));
+        if (!workers) {
+                perror("calloc()");
+                return EXIT_FAILURE;
+        }
+
+        for (int i = 0; i < opts.workers; i++) {
+                worker *w = &workers[i];
+                w->id = i;
+                w->opts = &opts;
+                w->count = opts.count / opts.workers + (i < opts.count % opts.workers);
+                w->latency = calloc(w->count, sizeof(double));
+                w->to_prompt = calloc(w->count, sizeof(double));
+                snprintf(w->user, sizeof(w->user), "bench%04d", i);
+                snprintf(w->chat_id, sizeof(w->chat_id), "%d", 1000000 + i);
+                if (!w->latency || !w->to_prompt) {
+                        perror("calloc()");
+                        return EXIT_FAILURE;
+                }
+                /* fault in result arrays now, they would look like growth later */
+                if (opts.soak_kb >= 0) {
+                        memset(w->latency, 0, w->count * sizeof(double));
+                        memset(w->to_prompt, 0, w->count * sizeof(double));
+                }
+        }
+
+        char store[64];
+        snprintf(store, sizeof(store), "/tmp/bench_pam_store.%d", (int) getpid());
+        make_store(store, workers, opts.workers, &opts);
+
+        char broker[64];
+        pid_t daemon = 0;
+        if (opts.daemon) {
+                snprintf(broker, sizeof(broker), "/tmp/bench_pam_broker.%d", (int) getpid());
+                daemon = start_daemon(opts.daemon, port, broker);
+        }
+
+        const char *confdir = make_confdir(port, store, opts.daemon ? broker : NULL,
+                                           argc - optind, argv + optind);
+
+        long rss[SOAK_SAMPLES + 1];
+        rss[0] = rss_kb();
+
+        double start = now_ms();
+        for (int i = 0; i < opts.workers; i++) {
+                workers[i].confdir = confdir;
+                if (pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i])) {
+                        fprintf(stderr, "ERROR: Failed on pthread_create().\n");
+                        return EXIT_FAILURE;
+                }
+        }
+        if (opts.soak_kb >= 0) {
+                int next = 1;
+                while (next < SOAK_SAMPLES) {
+                        if (__atomic_load_n(&finished, __ATOMIC_RELAXED) >=
+                            (long long) opts.count * next / SOAK_SAMPLES)
+                                rss[next++] = rss_kb();
+                        else
+                                usleep(10000);
+                }
+        }
+        for (int i = 0; i < opts.workers; i++)
+                pthread_join(workers[i].thread, NULL);
+        double seconds = (now_ms() - start) / 1e3;
+        rss[SOAK_SAMPLES] = rss_kb();
+
+        /* the first tenth warms up connection pools, caches and thread stacks */
+        bool leaked = opts.soak_kb >= 0 && rss[SOAK_SAMPLES] - rss[1] > opts.soak_kb;
+
+        report(&opts, workers, seconds, opts.soak_kb >= 0 ? rss : NULL);
+        if (leaked)
+                fprintf(stderr, "ERROR: resident memory grew %ldkB, more than %dkB\n",
+                        rss[SOAK_SAMPLES] - rss[1], opts.soak_kb);
+
+        if (daemon) {
+                kill(daemon, SIGTERM);
+                waitpid(daemon, NULL, 0);
+        }
+        mock_stop();
+
+        char path[256];
+        snprintf(path, sizeof(path), "%s/%s", confdir, SERVICE);
+        unlink(path);
+        rmdir(confdir);
+        unlink(store);
+
+        for (int i = 0; i < opts.workers; i++) {
+                free(workers[i].latency);
+                free(workers[i].to_prompt);
+        }
+        free(workers);
+
+        return leaked ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Measure per-message latency of telegram_send().
+ *
+ * cold: telegram_cleanup() before every send, each message pays DNS + TCP + TLS
+ * warm: reuse the shared transport, only the first message pays the handshake
+ *
+ * storm: many threads send at once to an in-process mock server which
+ *        answers 429 over its rate limit, shows how many messages per second
+ *        the send scheduler gets through without being throttled
+ *
+ * Usage: bench_send <token> <chat_id> [count]
+ *        bench_send -s threads [-n count] [-k chats] [-r rate] [-e percent]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "mock_bot_api.h"
+#include "telegram.h"
+
+typedef struct {
+        int count;              /* messages this thread sends */
+        int first;              /* index of its first message */
+        int chats;
+        int failed;
+        pthread_t thread;
+} storm_worker;
+
+static double now_ms(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+        double x = *(const double *) a, y = *(const double *) b;
+        return (x > y) - (x < y);
+}
+
+static void report(const char *name, double *samples, int count)
+{
+        double sum = 0;
+        for (int i = 0; i < count; i++)
+                sum += samples[i];
+
+        qsort(samples, count, sizeof(double), cmp_double);
+        printf("%-6s n=%d mean=%.2fms p50=%.2fms p90=%.2fms max=%.2fms\n",
+               name, count, sum / count,
+               samples[count / 2], samples[count * 9 / 10], samples[count - 1]);
+}
+
+static void run(const char *name, const char *token, const char *chat_id, int count, int cold)
+{
+        double *samples = calloc(count, sizeof(double));
+        char msg[128];
+        int failed = 0;
+
+        if (!samples) {
+                perror("calloc()");
+                exit(EXIT_FAILURE);
+        }
+
+        /* make sure the warm run starts with an established connection */
+        if (!cold)
+                telegram_send(token, chat_id, "bench_send: warm up");
+
+        for (int i = 0; i < count; i++) {
+                if (cold)
+                        telegram_cleanup();
+
+                snprintf(msg, sizeof(msg), "bench_send: %s %d/%d", name, i + 1, count);
+
+                double start = now_ms();
+                if (!telegram_send(token, chat_id, msg))
+                        failed++;
+                samples[i] = now_ms() - start;
+        }
+
+        report(name, samples, count);
+        if (failed)
+                printf("%-6s %d send failed\n", name, failed);
+
+        free(samples);
+}
+
+static void *storm_thread(void *arg)
+{
+        storm_worker *w = arg;
+        char chat_id[32], msg[64];
+
+        for (int i = w->first; i < w->first + w->count; i++) {
+                snprintf(chat_id, sizeof(chat_id), "%d", 2000000 + i % w->chats);
+                snprintf(msg, sizeof(msg), "bench_send: storm %d", i);
+                if (!telegram_send("123456:storm", chat_id, msg))
+                        w->failed++;
+        }
+
+        return NULL;
+}
+
+static int storm(int threads, int count, int chats, const mock_options *mock_opts)
+{
+        char url[64];
+        int port = mock_start(mock_opts);
+        if (port < 0)
+                return EXIT_FAILURE;
+
+        snprintf(url, sizeof(url), "http://127.0.0.1:%d/bot", port);
+        telegram_set_api_url(url);
+
+        storm_worker *workers = calloc(threads, sizeof(storm_worker));
+        if (!workers) {
+                perror("calloc()");
+                return EXIT_FAILURE;
+        }
+
+        double start = now_ms();
+        for (int i = 0, first = 0; i < threads; i++) {
+                workers[i].count = count / threads + (i < count % threads);
+                workers[i].first = first;
+                workers[i].chats = chats;
+                first += workers[i].count;
+                pthread_create(&workers[i].thread, NULL, storm_thread, &workers[i]);
+        }
+
+        int failed = 0;
+        for (int i = 0; i < threads; i++) {
+                pthread_join(workers[i].thread, NULL);
+                failed += workers[i].failed;
+        }
+        double seconds = (now_ms() - start) / 1e3;
+
+        telegram_send_stats stats;
+        telegram_get_send_stats(&stats);
+        mock_stats mstats;
+        mock_get_stats(&mstats);
+
+        printf("storm  threads=%d chats=%d sent=%d failed=%d seconds=%.2f delivered=%.1f/s\n",
+               threads, chats, count - failed, failed, seconds, (count - failed) / seconds);
+        printf("queue  peak_depth=%zu wait_mean=%.1fms wait_max=%.1fms retries=%zu throttled=%zu rejected=%zu\n",
+               stats.peak_depth, stats.sent ? stats.wait_total_ms / stats.sent : 0,
+               stats.wait_max_ms, stats.retries, stats.throttled, stats.rejected);
+        printf("mock   requests=%lu sendMessage=%lu 429=%lu errors=%lu\n",
+               mstats.requests, mstats.send_message, mstats.throttled, mstats.errors);
+
+        mock_stop();
+        free(workers);
+        return 0;
+}
+
+static void usage(const char *prog)
+{
+        fprintf(stderr,
+                "Usage: %s <token> <chat_id> [count]\n"
+                "       %s -s threads [-n count] [-k chats] [-r rate] [-e percent]\n",
+                prog, prog);
+}
+
+int main(int argc, char *argv[])
+{
+        mock_options mock_opts = { .rate_limit = 30 };
+        int threads = 0, count = 0, chats = 100;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "s:n:k:r:e:h")) != -1) {
+                switch (opt) {
+                case 's': threads = atoi(optarg); break;
+                case 'n': count = atoi(optarg); break;
+                case 'k': chats = atoi(optarg); break;
+                case 'r': mock_opts.rate_limit = atoi(optarg); break;
+                case 'e': mock_opts.error_percent = atoi(optarg); break;
+                default:
+                        usage(argv[0]);
+                        return (opt == 'h') ? 0 : EXIT_FAILURE;
+                }
+        }
+
+        if (threads > 0)
+                return storm(threads, count > 0 ? count : 300, chats > 0 ? chats : 1, &mock_opts);
+
+        if (argc - optind < 2) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        if (argc - optind > 2)
+                count = atoi(argv[optind + 2]);
+        if (count <= 0)
+                count = 20;
+
+        run("cold", argv[optind], argv[optind + 1], count, 1);
+        run("warm", argv[optind], argv[optind + 1], count, 0);
+
+        telegram_buffer_stats stats;
+        telegram_get_buffer_stats(&stats);
+        printf("buffers: total=%zu bytes peak=%zu bytes allocations=%zu reused=%zu\n",
+               stats.total_bytes, stats.peak_bytes, stats.allocations, stats.reused);
+
+        telegram_cleanup();
+        return 0;
+}
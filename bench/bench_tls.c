@@ -0,0 +1,383 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * First Bot API request of fresh processes over TLS, with and without the
+ * cross-process TLS session cache.
+ *
+ * A small TLS server runs in a child process with a self-signed certificate.
+ * It answers every request like a successful sendMessage and counts full and
+ * resumed handshakes. Every sample is a fresh process, like an sshd child,
+ * which sends one message with telegram_send(). The samples run twice: with
+ * the cache disabled, then with a cache file of their own.
+ *
+ * Usage: bench_tls [-n samples] [-2]
+ *
+ *   -n samples     processes of each run (default 50)
+ *   -2             TLS 1.2 at most, where resumption also saves a round trip
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <curl/curl.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#include "telegram.h"
+#include "tls_cache.h"
+
+#define REPLY_BODY "{\"ok\":true,\"result\":{\"message_id\":1}}"
+
+/* Handshakes seen by the server, shared with it */
+typedef struct {
+        unsigned long full;
+        unsigned long resumed;
+} server_stats;
+
+typedef struct {
+        int ok;
+        int new_connection;
+        double tls_ms;          /* handshake, as timed by curl */
+        double total_ms;        /* whole telegram_send() */
+} sample;
+
+static double now_ms(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+        double x = *(const double *) a, y = *(const double *) b;
+        return (x > y) - (x < y);
+}
+
+static void report(const char *name, const char *phase, double *values, int count)
+{
+        double sum = 0;
+        for (int i = 0; i < count; i++)
+                sum += values[i];
+
+        qsort(values, count, sizeof(double), cmp_double);
+        printf("%-8s %-6s mean=%.3fms p50=%.3fms p95=%.3fms max=%.3fms\n", name, phase,
+               sum / count, values[count / 2], values[count * 95 / 100], values[count - 1]);
+}
+
+/* Self-signed certificate for 127.0.0.1, its PEM is what the client trusts */
+static void make_cert(SSL_CTX *ctx, const char *pem)
+{
+        EVP_PKEY *key = EVP_EC_gen("P-256");
+        X509 *cert = X509_new();
+        if (!key || !cert) {
+                fprintf(stderr, "ERROR: failed to make certificate\n");
+                exit(EXIT_FAILURE);
+        }
+
+        X509_set_version(cert, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+        X509_gmtime_adj(X509_getm_notBefore(cert), -60);
+        X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+        X509_set_pubkey(cert, key);
+
+        X509_NAME *name = X509_get_subject_name(cert);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *) "127.0.0.1", -1, -1, 0);
+        X509_set_issuer_name(cert, name);
+
+        X509V3_CTX v3;
+        X509V3_set_ctx(&v3, cert, cert, NULL, NULL, 0);
+        X509_EXTENSION *san = X509V3_EXT_conf_nid(NULL, &v3, NID_subject_alt_name, "IP:127.0.0.1");
+        X509_EXTENSION *bc = X509V3_EXT_conf_nid(NULL, &v3, NID_basic_constraints, "critical,CA:TRUE");
+        if (!san || !bc || !X509_add_ext(cert, san, -1) || !X509_add_ext(cert, bc, -1) ||
+            !X509_sign(cert, key, EVP_sha256())) {
+                fprintf(stderr, "ERROR: failed to sign certificate\n");
+                exit(EXIT_FAILURE);
+        }
+        X509_EXTENSION_free(san);
+        X509_EXTENSION_free(bc);
+
+        FILE *f = fopen(pem, "w");
+        if (!f || !PEM_write_X509(f, cert)) {
+                perror("fopen()");
+                exit(EXIT_FAILURE);
+        }
+        fclose(f);
+
+        if (!SSL_CTX_use_certificate(ctx, cert) || !SSL_CTX_use_PrivateKey(ctx, key)) {
+                fprintf(stderr, "ERROR: failed to use certificate\n");
+                exit(EXIT_FAILURE);
+        }
+
+        X509_free(cert);
+        EVP_PKEY_free(key);
+}
+
+/* Answer requests of one connection until the client closes it */
+static void serve(SSL *ssl)
+{
+        char buf[8192];
+        size_t used = 0;
+
+        for (;;) {
+                char *end;
+                buf[used] = '\0';
+                while (!(end = strstr(buf, "\r\n\r\n"))) {
+                        int n = used < sizeof(buf) - 1 ? SSL_read(ssl, buf + used, sizeof(buf) - 1 - used) : 0;
+                        if (n <= 0)
+                                return;
+                        used += n;
+                        buf[used] = '\0';
+                }
+
+                size_t head = end + 4 - buf, body = 0;
+                for (char *p = buf; p < end; p++) {
+                        if (('\n' == *p || p == buf) && !strncasecmp(p + ('\n' == *p), "Content-Length:", 15))
+                                body = strtoul(p + ('\n' == *p) + 15, NULL, 10);
+                }
+                if (head + body > sizeof(buf) - 1)
+                        return;
+
+                while (used < head + body) {
+                        int n = SSL_read(ssl, buf + used, sizeof(buf) - 1 - used);
+                        if (n <= 0)
+                                return;
+                        used += n;
+                }
+
+                char reply[256];
+                int len = snprintf(reply, sizeof(reply),
+                                   "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+                                   "Content-Length: %zu\r\n\r\n%s", strlen(REPLY_BODY), REPLY_BODY);
+                if (SSL_write(ssl, reply, len) <= 0)
+                        return;
+
+                memmove(buf, buf + head + body, used - head - body);
+                used -= head + body;
+        }
+}
+
+/* TLS server in a child process, one connection at a time like the samples */
+static pid_t start_server(const char *pem, bool tls12, server_stats *stats, int *port)
+{
+        SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+        if (!ctx) {
+                fprintf(stderr, "ERROR: Failed on SSL_CTX_new().\n");
+                exit(EXIT_FAILURE);
+        }
+        if (tls12)
+                SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+        make_cert(ctx, pem);
+
+        struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+        socklen_t len = sizeof(addr);
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 16) < 0 ||
+            getsockname(fd, (struct sockaddr *) &addr, &len) < 0) {
+                perror("listen()");
+                exit(EXIT_FAILURE);
+        }
+        *port = ntohs(addr.sin_port);
+
+        pid_t pid = fork();
+        if (pid < 0) {
+                perror("fork()");
+                exit(EXIT_FAILURE);
+        }
+        if (pid > 0) {
+                close(fd);
+                SSL_CTX_free(ctx);
+                return pid;
+        }
+
+        for (;;) {
+                int conn = accept(fd, NULL, NULL);
+                if (conn < 0)
+                        continue;
+
+                /* session tickets go out in their own small writes */
+                int one = 1;
+                setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+                SSL *ssl = SSL_new(ctx);
+                SSL_set_fd(ssl, conn);
+                if (SSL_accept(ssl) > 0) {
+                        if (SSL_session_reused(ssl))
+                                __atomic_add_fetch(&stats->resumed, 1, __ATOMIC_RELAXED);
+                        else
+                                __atomic_add_fetch(&stats->full, 1, __ATOMIC_RELAXED);
+                        serve(ssl);
+                        SSL_shutdown(ssl);
+                }
+                SSL_free(ssl);
+                close(conn);
+        }
+}
+
+/* One sshd child, sending its first message */
+static void run_sample(const char *url, const char *pem, const char *cache, sample *s)
+{
+        telegram_set_api_url(url);
+        telegram_set_ca_file(pem);
+        tls_cache_set_file(cache);
+
+        double start = now_ms();
+        s->ok = telegram_send("123456:bench", "1000000", "bench_tls");
+        s->total_ms = now_ms() - start;
+
+        telegram_timing t;
+        telegram_get_last_timing(&t);
+        s->new_connection = t.new_connection;
+        s->tls_ms = t.tls * 1e3;
+}
+
+static void run(const char *name, int samples, const char *url, const char *pem, const char *cache,
+                server_stats *stats)
+{
+        double *tls = calloc(samples, sizeof(double));
+        double *total = calloc(samples, sizeof(double));
+        int failed = 0;
+
+        if (!tls || !total) {
+                perror("calloc()");
+                exit(EXIT_FAILURE);
+        }
+
+        server_stats before = *stats;
+
+        for (int i = 0; i < samples; i++) {
+                int fds[2];
+                sample s = { 0 };
+
+                if (pipe(fds)) {
+                        perror("pipe()");
+                        exit(EXIT_FAILURE);
+                }
+
+                pid_t pid = fork();
+                if (0 == pid) {
+                        close(fds[0]);
+                        run_sample(url, pem, cache, &s);
+                        _exit(write(fds[1], &s, sizeof(s)) == sizeof(s) ? 0 : EXIT_FAILURE);
+                }
+
+                close(fds[1]);
+                ssize_t n = pid > 0 ? read(fds[0], &s, sizeof(s)) : -1;
+                close(fds[0]);
+                if (pid > 0)
+                        waitpid(pid, NULL, 0);
+                if (n != sizeof(s) || !s.ok)
+                        failed++;
+
+                tls[i] = s.tls_ms;
+                total[i] = s.total_ms;
+        }
+
+        printf("%-8s samples=%d failed=%d full_handshakes=%lu resumed=%lu\n", name, samples, failed,
+               __atomic_load_n(&stats->full, __ATOMIC_RELAXED) - before.full,
+               __atomic_load_n(&stats->resumed, __ATOMIC_RELAXED) - before.resumed);
+        report(name, "tls", tls, samples);
+        report(name, "send", total, samples);
+
+        free(tls);
+        free(total);
+}
+
+static void usage(const char *prog)
+{
+        fprintf(stderr, "Usage: %s [-n samples] [-2]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+        int samples = 50;
+        bool tls12 = false;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "n:2h")) != -1) {
+                switch (opt) {
+                case 'n': samples = atoi(optarg); break;
+                case '2': tls12 = true; break;
+                default:
+                        usage(argv[0]);
+                        return (opt == 'h') ? 0 : EXIT_FAILURE;
+                }
+        }
+
+        if (samples <= 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        if (0 != geteuid())
+                fprintf(stderr, "WARNING: not root, the tls cache can't be created\n");
+
+        /* without it both runs do full handshakes */
+        const curl_version_info_data *info = curl_version_info(CURLVERSION_NOW);
+        bool ssls = false;
+        for (const char *const *name = info->feature_names; name && *name; name++)
+                ssls = ssls || !strcmp(*name, "SSLS-EXPORT");
+        printf("libcurl %s session export: %s\n", info->version, ssls ? "yes" : "no");
+
+        char dir[] = "/tmp/bench_tls.XXXXXX";
+        if (!mkdtemp(dir)) {
+                perror("mkdtemp()");
+                return EXIT_FAILURE;
+        }
+
+        char pem[64], cache[64], url[64];
+        snprintf(pem, sizeof(pem), "%s/cert.pem", dir);
+        snprintf(cache, sizeof(cache), "%s/tls.cache", dir);
+
+        server_stats *stats = mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == stats) {
+                perror("mmap()");
+                return EXIT_FAILURE;
+        }
+
+        int port;
+        pid_t server = start_server(pem, tls12, stats, &port);
+        snprintf(url, sizeof(url), "https://127.0.0.1:%d", port);
+
+        run("nocache", samples, url, pem, NULL, stats);
+        run("cache", samples, url, pem, cache, stats);
+
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+
+        unlink(cache);
+        unlink(pem);
+        rmdir(dir);
+
+        return 0;
+}
@@ -0,0 +1,320 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Check and measure the cross-process TLS session cache.
+ *
+ * Drives tls_cache_save() and tls_cache_load() on a cache file of its own:
+ * round trip, replacing a session by key or by shmac, expiry by the server's
+ * time and by TLS_CACHE_TTL, eviction of an expired slot and then of the
+ * oldest one, a slot left torn by a writer that died, and sessions that don't
+ * fit. Then forked writers replace sessions while readers load them for a few
+ * seconds, every session read must be one that was saved as a whole.
+ *
+ * tls_cache.c is compiled in, the checks reach into its slots to age them.
+ * Needs root, only root may create the cache.
+ *
+ * Usage: bench_tls_cache [-n count] [-s seconds] [-w writers]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "tls_cache.c"
+
+static int failures;
+
+#define CHECK(cond, ...) do {                                   \
+                if (!(cond)) {                                  \
+                        fprintf(stderr, "ERROR: " __VA_ARGS__); \
+                        fprintf(stderr, "\n");                  \
+                        failures++;                             \
+                }                                               \
+        } while (0)
+
+static double now_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Sessions of the test carry their generation in every data byte, so a
+ * torn copy is seen as mixed bytes */
+static size_t make_data(unsigned char *data, unsigned int gen, size_t len)
+{
+        memset(data, (unsigned char) gen, len);
+        return len;
+}
+
+/* What tls_cache_load() handed out */
+typedef struct {
+        int n;
+        char keys[TLS_CACHE_SLOTS + 1][TLS_CACHE_MAX_KEY];
+        unsigned char first[TLS_CACHE_SLOTS + 1];       /* first data byte */
+        size_t data_len[TLS_CACHE_SLOTS + 1];
+        int64_t valid_until[TLS_CACHE_SLOTS + 1];
+        int torn;                                       /* sessions of mixed bytes */
+} loaded;
+
+static void on_session(const tls_session *session, void *userdata)
+{
+        loaded *l = userdata;
+
+        for (size_t i = 1; i < session->data_len; i++) {
+                if (session->data[i] != session->data[0]) {
+                        l->torn++;
+                        break;
+                }
+        }
+
+        if (l->n > TLS_CACHE_SLOTS)
+                return;
+        snprintf(l->keys[l->n], sizeof(l->keys[l->n]), "%s",
+                 session->key[0] ? session->key : "(shmac)");
+        l->first[l->n] = session->data_len ? session->data[0] : 0;
+        l->data_len[l->n] = session->data_len;
+        l->valid_until[l->n] = session->valid_until;
+        l->n++;
+}
+
+static loaded load(void)
+{
+        loaded l;
+        memset(&l, 0, sizeof(l));
+        tls_cache_load(on_session, &l);
+        return l;
+}
+
+/* Index of key in what was loaded, -1 if not there */
+static int find(const loaded *l, const char *key)
+{
+        for (int i = 0; i < l->n; i++)
+                if (!strcmp(l->keys[i], key))
+                        return i;
+        return -1;
+}
+
+static cache_slot *slot_of(const char *key)
+{
+        cache_file *file = cache.map.addr;
+        for (int i = 0; i < TLS_CACHE_SLOTS; i++)
+                if (file->slots[i].used && !strcmp(file->slots[i].key, key))
+                        return &file->slots[i];
+        return NULL;
+}
+
+static void clear(void)
+{
+        cache_file *file = cache.map.addr;
+        memset(file->slots, 0, sizeof(file->slots));
+}
+
+static void check_functions(void)
+{
+        unsigned char data[TLS_CACHE_MAX_DATA + 1];
+        unsigned char shmac[TLS_CACHE_MAX_SHMAC];
+        int64_t now = time(NULL);
+        char key[32];
+        loaded l;
+
+        memset(shmac, 0x5a, sizeof(shmac));
+
+        /* round trip */
+        CHECK(tls_cache_save("a:443", NULL, 0, data, make_data(data, 1, 1000), now + 600),
+              "save failed.");
+        l = load();
+        CHECK(1 == l.n && !strcmp(l.keys[0], "a:443") && 1 == l.first[0] &&
+              1000 == l.data_len[0] && now + 600 == l.valid_until[0],
+              "round trip: %d sessions.", l.n);
+
+        /* same key replaces, by key or by shmac only */
+        tls_cache_save("a:443", NULL, 0, data, make_data(data, 2, 700), 0);
+        tls_cache_save(NULL, shmac, sizeof(shmac), data, make_data(data, 3, 10), 0);
+        tls_cache_save(NULL, shmac, sizeof(shmac), data, make_data(data, 4, 20), 0);
+        l = load();
+        int a = find(&l, "a:443"), s = find(&l, "(shmac)");
+        CHECK(2 == l.n && a >= 0 && 2 == l.first[a] && 700 == l.data_len[a] &&
+              s >= 0 && 4 == l.first[s] && 20 == l.data_len[s],
+              "replace: %d sessions.", l.n);
+
+        /* what doesn't fit is refused */
+        CHECK(!tls_cache_save("b:443", NULL, 0, data, TLS_CACHE_MAX_DATA + 1, 0),
+              "session larger than TLS_CACHE_MAX_DATA saved.");
+        memset(data, 'k', TLS_CACHE_MAX_KEY);
+        data[TLS_CACHE_MAX_KEY] = '\0';
+        CHECK(!tls_cache_save((char *) data, NULL, 0, data, 10, 0), "key of TLS_CACHE_MAX_KEY saved.");
+        CHECK(!tls_cache_save(NULL, NULL, 0, data, 10, 0), "session without key nor shmac saved.");
+        CHECK(!tls_cache_save("b:443", NULL, 0, data, 0, 0), "empty session saved.");
+
+        /* expiry by the server's time, by our TTL, and a clock gone back */
+        clear();
+        tls_cache_save("past:443", NULL, 0, data, make_data(data, 5, 10), now - 1);
+        tls_cache_save("ttl:443", NULL, 0, data, make_data(data, 6, 10), 0);
+        tls_cache_save("future:443", NULL, 0, data, make_data(data, 7, 10), 0);
+        tls_cache_save("fresh:443", NULL, 0, data, make_data(data, 8, 10), 0);
+        slot_of("ttl:443")->stored = now - TLS_CACHE_TTL - 1;
+        slot_of("future:443")->stored = now + 3600;
+        l = load();
+        CHECK(1 == l.n && !strcmp(l.keys[0], "fresh:443"), "expiry: %d sessions.", l.n);
+
+        /* full: an expired slot goes first, then the oldest one */
+        clear();
+        for (int i = 0; i < TLS_CACHE_SLOTS; i++) {
+                snprintf(key, sizeof(key), "host%d:443", i);
+                tls_cache_save(key, NULL, 0, data, make_data(data, 10 + i, 10), 0);
+                slot_of(key)->stored = now - 100 + i;
+        }
+        slot_of("host7:443")->valid_until = now - 1;
+        tls_cache_save("new1:443", NULL, 0, data, make_data(data, 40, 10), 0);
+        tls_cache_save("new2:443", NULL, 0, data, make_data(data, 41, 10), 0);
+        l = load();
+        CHECK(TLS_CACHE_SLOTS == l.n && find(&l, "new1:443") >= 0 && find(&l, "new2:443") >= 0 &&
+              find(&l, "host7:443") < 0 && find(&l, "host0:443") < 0 && find(&l, "host1:443") >= 0,
+              "eviction: %d sessions.", l.n);
+
+        /* writer died in the middle: skipped, and fixed by the next save */
+        clear();
+        tls_cache_save("torn:443", NULL, 0, data, make_data(data, 50, 100), 0);
+        tls_cache_save("whole:443", NULL, 0, data, make_data(data, 51, 100), 0);
+        cache_slot *torn = slot_of("torn:443");
+        torn->seq |= 1;
+        torn->data[10] = 99;
+        l = load();
+        CHECK(1 == l.n && !strcmp(l.keys[0], "whole:443") && !l.torn, "torn slot loaded.");
+        tls_cache_save("torn:443", NULL, 0, data, make_data(data, 52, 100), 0);
+        l = load();
+        int t = find(&l, "torn:443");
+        CHECK(2 == l.n && t >= 0 && 52 == l.first[t] && !l.torn && !(torn->seq & 1),
+              "save over torn slot: %d sessions.", l.n);
+}
+
+/* Keep replacing sessions of a few peers with whole new generations */
+static void writer(int id, unsigned int seed)
+{
+        unsigned char data[TLS_CACHE_MAX_DATA];
+        char key[32];
+
+        for (unsigned int gen = 1; ; gen++) {
+                snprintf(key, sizeof(key), "peer%u:443", rand_r(&seed) % (TLS_CACHE_SLOTS + 4));
+                tls_cache_save(key, NULL, 0, data,
+                               make_data(data, id * 64 + gen % 64, 64 + rand_r(&seed) % (TLS_CACHE_MAX_DATA - 64)),
+                               0);
+        }
+}
+
+static void usage(const char *prog)
+{
+        fprintf(stderr, "Usage: %s [-n count] [-s seconds] [-w writers]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+        int count = 100000, seconds = 2, writers = 2;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "n:s:w:h")) != -1) {
+                switch (opt) {
+                case 'n': count = atoi(optarg); break;
+                case 's': seconds = atoi(optarg); break;
+                case 'w': writers = atoi(optarg); break;
+                default:
+                        usage(argv[0]);
+                        return (opt == 'h') ? 0 : EXIT_FAILURE;
+                }
+        }
+
+        if (count <= 0 || seconds < 0 || writers < 0 || writers > 3) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        if (0 != geteuid()) {
+                fprintf(stderr, "ERROR: Run as root, only root may create the cache.\n");
+                return EXIT_FAILURE;
+        }
+
+        char path[64];
+        snprintf(path, sizeof(path), "/tmp/bench_tls_cache.%d", (int) getpid());
+        tls_cache_set_file(path);
+        if (!cache_open()) {
+                fprintf(stderr, "ERROR: Cannot map %s.\n", path);
+                return EXIT_FAILURE;
+        }
+
+        check_functions();
+
+        /* cost of the two calls, with a full table of usual sessions */
+        unsigned char data[TLS_CACHE_MAX_DATA];
+        char key[32];
+        clear();
+        double start = now_ns();
+        for (int i = 0; i < count; i++) {
+                snprintf(key, sizeof(key), "host%d:443", i % TLS_CACHE_SLOTS);
+                tls_cache_save(key, NULL, 0, data, make_data(data, i, 1500), 0);
+        }
+        double save_ns = (now_ns() - start) / count;
+
+        int loads = count / 10 + 1;
+        start = now_ns();
+        for (int i = 0; i < loads; i++)
+                load();
+        double load_ns = (now_ns() - start) / loads;
+
+        /* readers never lock, what they get must still be whole */
+        pid_t pids[3];
+        for (int i = 0; i < writers; i++) {
+                pids[i] = fork();
+                if (0 == pids[i]) {
+                        writer(i + 1, (unsigned int) getpid());
+                        _exit(0);
+                }
+        }
+
+        unsigned long rounds = 0, sessions = 0, torn = 0;
+        double end = now_ns() + seconds * 1e9;
+        while (now_ns() < end) {
+                loaded l = load();
+                sessions += l.n;
+                torn += l.torn;
+                rounds++;
+        }
+        for (int i = 0; i < writers; i++) {
+                kill(pids[i], SIGKILL);
+                waitpid(pids[i], NULL, 0);
+        }
+        CHECK(0 == torn, "%lu torn sessions loaded while written.", torn);
+
+        unlink(path);
+
+        printf("save    %.1fns/op n=%d\n", save_ns, count);
+        printf("load    %.1fns/op n=%d slots=%d\n", load_ns, loads, TLS_CACHE_SLOTS);
+        printf("race    writers=%d seconds=%d loads=%lu sessions=%lu torn=%lu\n",
+               writers, seconds, rounds, sessions, torn);
+        printf("checks  %s\n", failures ? "FAILED" : "ok");
+
+        return failures ? EXIT_FAILURE : 0;
+}
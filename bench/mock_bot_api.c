@@ -0,0 +1,687 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "json_scan.h"
+#include "mock_bot_api.h"
+
+#define MOCK_REQUEST_MAX   (64 * 1024)
+#define MOCK_TEXT_MAX      512
+#define MOCK_CHAT_ID_MAX   32
+#define MOCK_UPDATES_LIMIT 100
+#define MOCK_DATA_MAX      65
+
+typedef struct mock_message {
+        char chat_id[MOCK_CHAT_ID_MAX];
+        char text[MOCK_TEXT_MAX];
+        char data[MOCK_DATA_MAX];       /* callback_data of first button */
+        struct mock_message *next;
+} mock_message;
+
+typedef struct mock_update {
+        long long update_id;
+        char *json;                     /* complete update object */
+        struct mock_update *next;
+} mock_update;
+
+static struct {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;            /* new message or update */
+        mock_options opts;
+        int listen_fd;
+        int running;                    /* accessed with __atomic builtins */
+        mock_message *messages, **messages_tail;
+        mock_update *updates, **updates_tail;
+        long long next_update_id;
+        char webhook_url[256];          /* updates are posted here when set */
+        char webhook_secret[257];
+        time_t window;                  /* second counted for rate_limit */
+        int window_count;
+        mock_stats stats;
+} mock = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+        .listen_fd = -1,
+        .next_update_id = 1,
+};
+
+static bool running(void)
+{
+        return __atomic_load_n(&mock.running, __ATOMIC_RELAXED);
+}
+
+/* Add time to a CLOCK_REALTIME deadline for pthread_cond_timedwait() */
+static void deadline_after(struct timespec *ts, int ms)
+{
+        clock_gettime(CLOCK_REALTIME, ts);
+        ts->tv_sec += ms / 1000;
+        ts->tv_nsec += (long) (ms % 1000) * 1000000;
+        if (ts->tv_nsec >= 1000000000) {
+                ts->tv_sec++;
+                ts->tv_nsec -= 1000000000;
+        }
+}
+
+static bool write_all(int fd, const char *buf, size_t len)
+{
+        while (len > 0) {
+                ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+                if (n < 0 && EINTR == errno)
+                        continue;
+                if (n <= 0)
+                        return false;
+                buf += n;
+                len -= n;
+        }
+        return true;
+}
+
+/* Must be called with mock.lock held */
+static void push_update_locked(const char *fields)
+{
+        mock_update *u = calloc(1, sizeof(*u));
+        size_t len = strlen(fields) + 64;
+        if (!u || !(u->json = malloc(len))) {
+                free(u);
+                return;
+        }
+
+        u->update_id = mock.next_update_id++;
+        snprintf(u->json, len, "{\"update_id\":%lld,%s}", u->update_id, fields);
+
+        *mock.updates_tail = u;
+        mock.updates_tail = &u->next;
+}
+
+/**
+ * Post update to webhook like telegram does, only http://a.b.c.d:port/path
+ * urls are supported.
+ *
+ * @return  false   webhook didn't answer 200
+ *          true    update delivered
+ */
+static bool post_webhook(const char *url, const char *secret, const char *json)
+{
+        char host[64], path[192] = "/";
+        int port;
+        if (sscanf(url, "http://%63[0-9.]:%d%191s", host, &port, path) < 2)
+                return false;
+
+        struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+        if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+                return false;
+
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+                return false;
+
+        bool ok = false;
+        if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+                size_t len = strlen(json);
+                char *req = malloc(len + 1024);
+                if (req) {
+                        int n = snprintf(req, len + 1024,
+                                         "POST %s HTTP/1.1\r\nHost: %s:%d\r\n"
+                                         "Content-Type: application/json\r\n"
+                                         "X-Telegram-Bot-Api-Secret-Token: %s\r\n"
+                                         "Content-Length: %zu\r\nConnection: close\r\n\r\n%s",
+                                         path, host, port, secret, len, json);
+
+                        char status[32] = "";
+                        ok = write_all(fd, req, n) && recv(fd, status, sizeof(status) - 1, 0) > 0 &&
+                                !strncmp(status, "HTTP/1.1 200", 12);
+                        free(req);
+                }
+        }
+
+        close(fd);
+        return ok;
+}
+
+/**
+ * Queue an update for getUpdates, or post it right away when a webhook is set.
+ *
+ * @param fields    json members of the update without update_id,
+ *                  e.g. "\"message\":{...}"
+ */
+void mock_push_update(const char *fields)
+{
+        pthread_mutex_lock(&mock.lock);
+        if (mock.webhook_url[0]) {
+                char url[sizeof(mock.webhook_url)], secret[sizeof(mock.webhook_secret)];
+                memcpy(url, mock.webhook_url, sizeof(url));
+                memcpy(secret, mock.webhook_secret, sizeof(secret));
+
+                size_t len = strlen(fields) + 64;
+                char *json = malloc(len);
+                if (json)
+                        snprintf(json, len, "{\"update_id\":%lld,%s}", mock.next_update_id++, fields);
+                pthread_mutex_unlock(&mock.lock);
+
+                bool ok = json && post_webhook(url, secret, json);
+                free(json);
+
+                pthread_mutex_lock(&mock.lock);
+                mock.stats.webhook_posts++;
+                if (!ok)
+                        mock.stats.webhook_errors++;
+                pthread_mutex_unlock(&mock.lock);
+                return;
+        }
+
+        push_update_locked(fields);
+        pthread_cond_broadcast(&mock.cond);
+        pthread_mutex_unlock(&mock.lock);
+}
+
+/**
+ * Wait for a message sent to chat_id with sendMessage, and remove it.
+ *
+ * @param chat_id       chat the message was sent to
+ * @param timeout_ms    max time to wait
+ * @param text          filled with the message text
+ * @param size          size of text
+ * @param data          if not NULL, filled with callback_data of the first
+ *                      inline keyboard button, empty without keyboard
+ * @param data_size     size of data
+ *
+ * @return  false   no message before timeout
+ *          true    text filled
+ */
+bool mock_wait_message(const char *chat_id, int timeout_ms, char *text, size_t size,
+                       char *data, size_t data_size)
+{
+        struct timespec deadline;
+        bool found = false;
+
+        deadline_after(&deadline, timeout_ms);
+
+        pthread_mutex_lock(&mock.lock);
+        while (!found) {
+                for (mock_message **pp = &mock.messages; *pp; pp = &(*pp)->next) {
+                        mock_message *m = *pp;
+                        if (strcmp(m->chat_id, chat_id))
+                                continue;
+
+                        snprintf(text, size, "%s", m->text);
+                        if (data)
+                                snprintf(data, data_size, "%s", m->data);
+                        *pp = m->next;
+                        if (!*pp)
+                                mock.messages_tail = pp;
+                        free(m);
+                        found = true;
+                        break;
+                }
+
+                if (!found && pthread_cond_timedwait(&mock.cond, &mock.lock, &deadline) == ETIMEDOUT)
+                        break;
+        }
+        pthread_mutex_unlock(&mock.lock);
+
+        return found;
+}
+
+/**
+ * Get request counters.
+ *
+ * @param stats     filled with current counters
+ */
+void mock_get_stats(mock_stats *stats)
+{
+        pthread_mutex_lock(&mock.lock);
+        *stats = mock.stats;
+        pthread_mutex_unlock(&mock.lock);
+}
+
+
+/* Write status line, headers and body with one send() */
+static bool reply(int fd, int status, const char *body, size_t len)
+{
+        char head[256];
+        int hlen = snprintf(head, sizeof(head),
+                            "HTTP/1.1 %d %s\r\n"
+                            "Content-Type: application/json\r\n"
+                            "Content-Length: %zu\r\n"
+                            "\r\n",
+                            status, (200 == status) ? "OK" : "Error", len);
+
+        char *buf = malloc(hlen + len);
+        if (!buf)
+                return false;
+
+        memcpy(buf, head, hlen);
+        memcpy(buf + hlen, body, len);
+        bool ok = write_all(fd, buf, hlen + len);
+        free(buf);
+
+        return ok;
+}
+
+static bool reply_str(int fd, int status, const char *body)
+{
+        return reply(fd, status, body, strlen(body));
+}
+
+/* Fields we read from sendMessage body */
+typedef struct {
+        char chat_id[MOCK_CHAT_ID_MAX];
+        char text[MOCK_TEXT_MAX];
+        char data[MOCK_DATA_MAX];
+} send_request;
+
+static void send_on_value(json_scanner *s, json_scan_type type,
+                          const char *value, size_t len, void *userdata)
+{
+        send_request *req = userdata;
+        const char *path = json_scan_path(s);
+
+        if (!strcmp(path, "chat_id"))
+                snprintf(req->chat_id, sizeof(req->chat_id), "%s", value);
+        else if (!strcmp(path, "text"))
+                snprintf(req->text, sizeof(req->text), "%s", value);
+        else if (!strcmp(path, "reply_markup.inline_keyboard[][].callback_data") && !req->data[0])
+                snprintf(req->data, sizeof(req->data), "%s", value);
+}
+
+static bool handle_send_message(int fd, const char *body, size_t len)
+{
+        send_request req = { "", "", "" };
+        json_scanner scanner;
+
+        json_scan_init(&scanner, send_on_value, NULL, &req);
+        if (!json_scan_feed(&scanner, body, len) || !json_scan_finish(&scanner) || !req.chat_id[0])
+                return reply_str(fd, 400, "{\"ok\":false,\"error_code\":400,\"description\":\"Bad Request: chat_id is empty\"}");
+
+        /* flood control like the real server, per bot and per second */
+        if (mock.opts.rate_limit > 0) {
+                struct timespec ts;
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+
+                pthread_mutex_lock(&mock.lock);
+                if (ts.tv_sec != mock.window) {
+                        mock.window = ts.tv_sec;
+                        mock.window_count = 0;
+                }
+                bool over = ++mock.window_count > mock.opts.rate_limit;
+                if (over)
+                        mock.stats.throttled++;
+                pthread_mutex_unlock(&mock.lock);
+
+                if (over)
+                        return reply_str(fd, 429, "{\"ok\":false,\"error_code\":429,"
+                                         "\"description\":\"Too Many Requests: retry after 1\","
+                                         "\"parameters\":{\"retry_after\":1}}");
+        }
+
+        mock_message *m = calloc(1, sizeof(*m));
+        if (m) {
+                memcpy(m->chat_id, req.chat_id, sizeof(m->chat_id));
+                memcpy(m->text, req.text, sizeof(m->text));
+                memcpy(m->data, req.data, sizeof(m->data));
+        }
+
+        pthread_mutex_lock(&mock.lock);
+        long long message_id = ++mock.stats.send_message;
+        if (m) {
+                *mock.messages_tail = m;
+                mock.messages_tail = &m->next;
+        }
+        pthread_cond_broadcast(&mock.cond);
+        pthread_mutex_unlock(&mock.lock);
+
+        char out[256];
+        snprintf(out, sizeof(out),
+                 "{\"ok\":true,\"result\":{\"message_id\":%lld,\"chat\":{\"id\":%s}}}",
+                 message_id, req.chat_id);
+        return reply_str(fd, 200, out);
+}
+
+/* Fields we read from setWebhook body */
+typedef struct {
+        char url[256];
+        char secret[257];
+} webhook_request;
+
+static void webhook_on_value(json_scanner *s, json_scan_type type,
+                             const char *value, size_t len, void *userdata)
+{
+        webhook_request *req = userdata;
+        const char *path = json_scan_path(s);
+
+        if (!strcmp(path, "url"))
+                snprintf(req->url, sizeof(req->url), "%s", value);
+        else if (!strcmp(path, "secret_token"))
+                snprintf(req->secret, sizeof(req->secret), "%s", value);
+}
+
+/* setWebhook with empty url, and deleteWebhook, go back to getUpdates */
+static bool handle_set_webhook(int fd, const char *body, size_t len)
+{
+        webhook_request req = { "", "" };
+        json_scanner scanner;
+
+        json_scan_init(&scanner, webhook_on_value, NULL, &req);
+        if (!json_scan_feed(&scanner, body, len) || !json_scan_finish(&scanner))
+                return reply_str(fd, 400, "{\"ok\":false,\"error_code\":400,\"description\":\"Bad Request\"}");
+
+        pthread_mutex_lock(&mock.lock);
+        memcpy(mock.webhook_url, req.url, sizeof(mock.webhook_url));
+        memcpy(mock.webhook_secret, req.secret, sizeof(mock.webhook_secret));
+        pthread_mutex_unlock(&mock.lock);
+
+        return reply_str(fd, 200, "{\"ok\":true,\"result\":true}");
+}
+
+/* Value of query parameter name, or def if missing */
+static long long query_param(const char *query, const char *name, long long def)
+{
+        size_t len = strlen(name);
+        for (const char *p = query; p && *p; p = strchr(p, '&'), p = p ? p + 1 : NULL) {
+                if (!strncmp(p, name, len) && '=' == p[len])
+                        return strtoll(p + len + 1, NULL, 10);
+        }
+        return def;
+}
+
+static bool handle_get_updates(int fd, const char *query)
+{
+        long long offset = query_param(query, "offset", 0);
+        long long timeout = query_param(query, "timeout", 0);
+        long long limit = query_param(query, "limit", MOCK_UPDATES_LIMIT);
+        struct timespec deadline;
+
+        if (limit <= 0 || limit > MOCK_UPDATES_LIMIT)
+                limit = MOCK_UPDATES_LIMIT;
+
+        deadline_after(&deadline, timeout * 1000);
+
+        pthread_mutex_lock(&mock.lock);
+        mock.stats.get_updates++;
+
+        if (mock.webhook_url[0]) {
+                pthread_mutex_unlock(&mock.lock);
+                return reply_str(fd, 409, "{\"ok\":false,\"error_code\":409,\"description\":"
+                                 "\"Conflict: can't use getUpdates method while webhook is active\"}");
+        }
+
+        /* updates before offset are confirmed, forget them */
+        while (mock.updates && mock.updates->update_id < offset) {
+                mock_update *u = mock.updates;
+                mock.updates = u->next;
+                free(u->json);
+                free(u);
+        }
+        if (!mock.updates)
+                mock.updates_tail = &mock.updates;
+
+        /* long polling */
+        while (!mock.updates && timeout > 0 && running() &&
+               pthread_cond_timedwait(&mock.cond, &mock.lock, &deadline) != ETIMEDOUT)
+                ;
+
+        size_t cap = 64, len = 0;
+        for (mock_update *u = mock.updates; u; u = u->next)
+                cap += strlen(u->json) + 1;
+
+        char *out = malloc(cap);
+        if (out) {
+                len = sprintf(out, "{\"ok\":true,\"result\":[");
+                long long n = 0;
+                for (mock_update *u = mock.updates; u && n < limit; u = u->next, n++)
+                        len += sprintf(out + len, "%s%s", n ? "," : "", u->json);
+                len += sprintf(out + len, "]}");
+        }
+        pthread_mutex_unlock(&mock.lock);
+
+        if (!out)
+                return reply_str(fd, 500, "{\"ok\":false,\"error_code\":500,\"description\":\"Internal Server Error\"}");
+
+        bool ok = reply(fd, 200, out, len);
+        free(out);
+        return ok;
+}
+
+/* Route one request, return false to close connection */
+static bool handle_request(int fd, const char *method, const char *target,
+                           const char *body, size_t len, unsigned int *seed)
+{
+        pthread_mutex_lock(&mock.lock);
+        mock.stats.requests++;
+        bool inject = mock.opts.error_percent > 0 &&
+                (int) (rand_r(seed) % 100) < mock.opts.error_percent;
+        if (inject)
+                mock.stats.errors++;
+        pthread_mutex_unlock(&mock.lock);
+
+        if (mock.opts.latency_ms > 0)
+                usleep(mock.opts.latency_ms * 1000);
+
+        if (inject)
+                return reply_str(fd, 502, "{\"ok\":false,\"error_code\":502,\"description\":\"Bad Gateway\"}");
+
+        /* target is /bot<token>/<method>[?query] */
+        const char *api = strrchr(target, '/');
+        if (strncmp(target, "/bot", 4) || !api)
+                return reply_str(fd, 404, "{\"ok\":false,\"error_code\":404,\"description\":\"Not Found\"}");
+
+        api++;
+        const char *query = strchr(api, '?');
+        size_t api_len = query ? (size_t) (query - api) : strlen(api);
+
+        if (api_len == 11 && !strncmp(api, "sendMessage", 11) && !strcmp(method, "POST"))
+                return handle_send_message(fd, body, len);
+        if (api_len == 10 && !strncmp(api, "getUpdates", 10))
+                return handle_get_updates(fd, query ? query + 1 : "");
+        if (api_len == 10 && !strncmp(api, "setWebhook", 10) && !strcmp(method, "POST"))
+                return handle_set_webhook(fd, body, len);
+        if (api_len == 13 && !strncmp(api, "deleteWebhook", 13))
+                return handle_set_webhook(fd, "{}", 2);
+        if (api_len == 19 && !strncmp(api, "answerCallbackQuery", 19) && !strcmp(method, "POST"))
+                return reply_str(fd, 200, "{\"ok\":true,\"result\":true}");
+
+        return reply_str(fd, 404, "{\"ok\":false,\"error_code\":404,\"description\":\"Not Found: method not found\"}");
+}
+
+/* Serve requests of one keep-alive connection */
+static void *connection_thread(void *arg)
+{
+        int fd = (int) (intptr_t) arg;
+        char *buf = malloc(MOCK_REQUEST_MAX + 1);
+        size_t used = 0;
+        unsigned int seed = (unsigned int) time(NULL) ^ (unsigned int) fd;
+
+        if (buf)
+                buf[0] = '\0';
+
+        while (buf && running()) {
+                /* wait for complete headers */
+                char *end = NULL;
+                while (!(end = strstr(buf, "\r\n\r\n"))) {
+                        if (used >= MOCK_REQUEST_MAX)
+                                goto out;
+                        ssize_t n = recv(fd, buf + used, MOCK_REQUEST_MAX - used, 0);
+                        if (n < 0 && EINTR == errno)
+                                continue;
+                        if (n <= 0)
+                                goto out;
+                        used += n;
+                        buf[used] = '\0';
+                }
+
+                char method[16], target[1024];
+                if (sscanf(buf, "%15s %1023s", method, target) != 2)
+                        goto out;
+
+                size_t header_len = end + 4 - buf;
+                size_t body_len = 0;
+                bool keep_alive = true;
+
+                for (char *line = strstr(buf, "\r\n") + 2; line < end; line = strstr(line, "\r\n") + 2) {
+                        if (!strncasecmp(line, "Content-Length:", 15))
+                                body_len = strtoul(line + 15, NULL, 10);
+                        else if (!strncasecmp(line, "Connection:", 11) && strstr(line, "close"))
+                                keep_alive = false;
+                }
+
+                if (header_len + body_len > MOCK_REQUEST_MAX)
+                        goto out;
+
+                while (used < header_len + body_len) {
+                        ssize_t n = recv(fd, buf + used, MOCK_REQUEST_MAX - used, 0);
+                        if (n < 0 && EINTR == errno)
+                                continue;
+                        if (n <= 0)
+                                goto out;
+                        used += n;
+                }
+                buf[used] = '\0';
+
+                /* body is not NUL terminated on its own, copy it */
+                char *body = strndup(buf + header_len, body_len);
+                bool ok = body && handle_request(fd, method, target, body, body_len, &seed);
+                free(body);
+
+                if (!ok || !keep_alive)
+                        goto out;
+
+                /* keep pipelined data of next request */
+                used -= header_len + body_len;
+                memmove(buf, buf + header_len + body_len, used);
+                buf[used] = '\0';
+        }
+
+out:
+        free(buf);
+        close(fd);
+        return NULL;
+}
+
+static void *accept_thread(void *arg)
+{
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+        while (running()) {
+                struct pollfd pfd = { .fd = mock.listen_fd, .events = POLLIN };
+                if (poll(&pfd, 1, 100) <= 0)
+                        continue;
+
+                int fd = accept(mock.listen_fd, NULL, NULL);
+                if (fd < 0)
+                        continue;
+
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+                pthread_mutex_lock(&mock.lock);
+                mock.stats.connections++;
+                pthread_mutex_unlock(&mock.lock);
+
+                pthread_t tid;
+                if (pthread_create(&tid, &attr, connection_thread, (void *) (intptr_t) fd))
+                        close(fd);
+        }
+
+        pthread_attr_destroy(&attr);
+        return NULL;
+}
+
+/**
+ * Start the server on background threads.
+ *
+ * @param opts  server options
+ *
+ * @return port server listens on, -1 on failure
+ */
+int mock_start(const mock_options *opts)
+{
+        mock.opts = *opts;
+        mock.messages_tail = &mock.messages;
+        mock.updates_tail = &mock.updates;
+
+        /* synthetic backlog of chat noise */
+        for (int i = 0; i < opts->backlog; i++)
+                push_update_locked("\"message\":{\"message_id\":1,\"chat\":{\"id\":1,\"type\":\"private\"},"
+                                   "\"from\":{\"id\":1,\"is_bot\":false,\"first_name\":\"bench\"},"
+                                   "\"date\":0,\"text\":\"hello from the backlog\"}");
+
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                perror("socket()");
+                return -1;
+        }
+
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        struct sockaddr_in addr = {
+                .sin_family = AF_INET,
+                .sin_port = htons(opts->port),
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        };
+        socklen_t addrlen = sizeof(addr);
+
+        if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+            listen(fd, SOMAXCONN) < 0 ||
+            getsockname(fd, (struct sockaddr *) &addr, &addrlen) < 0) {
+                perror("bind()");
+                close(fd);
+                return -1;
+        }
+
+        mock.listen_fd = fd;
+        __atomic_store_n(&mock.running, 1, __ATOMIC_RELAXED);
+
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, accept_thread, NULL)) {
+                close(fd);
+                return -1;
+        }
+        pthread_detach(tid);
+
+        return ntohs(addr.sin_port);
+}
+
+/**
+ * Stop accepting new connections.
+ */
+void mock_stop(void)
+{
+        pthread_mutex_lock(&mock.lock);
+        __atomic_store_n(&mock.running, 0, __ATOMIC_RELAXED);
+        pthread_cond_broadcast(&mock.cond);
+        pthread_mutex_unlock(&mock.lock);
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _TELEGRAM_AUTHENTICATOR_MOCK_BOT_API_H_
+#define _TELEGRAM_AUTHENTICATOR_MOCK_BOT_API_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Local stand-in for api.telegram.org, speaks plain HTTP/1.1 on 127.0.0.1.
+ * Point the module to it with api_url=http://127.0.0.1:<port>/bot
+ */
+
+typedef struct {
+        int port;               /* 0 for any free port */
+        int latency_ms;         /* delay added before every reply */
+        int error_percent;      /* percent of requests answered with an error */
+        int backlog;            /* synthetic updates pending in getUpdates */
+        int rate_limit;         /* sendMessage per second before 429, 0 for none */
+} mock_options;
+
+typedef struct {
+        unsigned long connections;
+        unsigned long requests;
+        unsigned long send_message;
+        unsigned long get_updates;
+        unsigned long errors;   /* injected errors */
+        unsigned long throttled; /* 429 replies over rate_limit */
+        unsigned long webhook_posts; /* updates posted to webhook */
+        unsigned long webhook_errors;
+} mock_stats;
+
+/**
+ * Start the server on background threads.
+ *
+ * @param opts  server options
+ *
+ * @return port server listens on, -1 on failure
+ */
+int mock_start(const mock_options *opts);
+
+/**
+ * Stop accepting new connections.
+ */
+void mock_stop(void);
+
+/**
+ * Wait for a message sent to chat_id with sendMessage, and remove it.
+ *
+ * @param chat_id       chat the message was sent to
+ * @param timeout_ms    max time to wait
+ * @param text          filled with the message text
+ * @param size          size of text
+ * @param data          if not NULL, filled with callback_data of the first
+ *                      inline keyboard button, empty without keyboard
+ * @param data_size     size of data
+ *
+ * @return  false   no message before timeout
+ *          true    text filled
+ */
+bool mock_wait_message(const char *chat_id, int timeout_ms, char *text, size_t size,
+                       char *data, size_t data_size);
+
+/**
+ * Queue an update for getUpdates, or post it right away when a webhook was
+ * set with setWebhook. Webhook urls must be http://a.b.c.d:port[/path].
+ *
+ * @param fields    json members of the update without update_id,
+ *                  e.g. "\"message\":{...}"
+ */
+void mock_push_update(const char *fields);
+
+/**
+ * Get request counters.
+ *
+ * @param stats     filled with current counters
+ */
+void mock_get_stats(mock_stats *stats);
+
+#endif /* _TELEGRAM_AUTHENTICATOR_MOCK_BOT_API_H_ */
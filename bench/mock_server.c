@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Standalone mock Bot API server.
+ *
+ * Usage: mock_bot_api [-p port] [-l latency_ms] [-e error_percent] [-b backlog] [-r rate]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "mock_bot_api.h"
+
+int main(int argc, char *argv[])
+{
+        mock_options opts = { 8081, 0, 0, 0, 0 };
+        int opt;
+
+        while ((opt = getopt(argc, argv, "p:l:e:b:r:h")) != -1) {
+                switch (opt) {
+                case 'p': opts.port = atoi(optarg); break;
+                case 'l': opts.latency_ms = atoi(optarg); break;
+                case 'e': opts.error_percent = atoi(optarg); break;
+                case 'b': opts.backlog = atoi(optarg); break;
+                case 'r': opts.rate_limit = atoi(optarg); break;
+                default:
+                        fprintf(stderr, "Usage: %s [-p port] [-l latency_ms] [-e error_percent] [-b backlog] [-r rate]\n", argv[0]);
+                        return (opt == 'h') ? 0 : EXIT_FAILURE;
+                }
+        }
+
+        int port = mock_start(&opts);
+        if (port < 0)
+                return EXIT_FAILURE;
+
+        printf("mock Bot API listening on http://127.0.0.1:%d/bot\n", port);
+        fflush(stdout);
+
+        for (;;)
+                pause();
+
+        return 0;
+}
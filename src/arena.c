@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "arena.h"
+
+struct arena_chunk {
+        arena_chunk *next;
+        max_align_t data[];
+};
+
+#define ARENA_ALIGN (sizeof(max_align_t))
+
+/**
+ * Start an arena on buf, which must outlive the arena.
+ *
+ * @param arena     arena to initialize
+ * @param buf       first block, NULL to start on the heap
+ * @param size      size of buf
+ */
+void arena_init(arena_t *arena, void *buf, size_t size)
+{
+        memset(arena, 0, sizeof(*arena));
+        if (!buf)
+                return;
+
+        /* the caller's buffer may not be aligned as we promise */
+        uintptr_t start = ((uintptr_t) buf + ARENA_ALIGN - 1) & ~(uintptr_t) (ARENA_ALIGN - 1);
+        if (start - (uintptr_t) buf >= size)
+                return;
+
+        arena->buf = (char *) start;
+        arena->size = size - (start - (uintptr_t) buf);
+}
+
+/**
+ * Allocate memory aligned for any type, valid until arena_release().
+ *
+ * @param arena     arena
+ * @param size      bytes needed
+ *
+ * @return memory, NULL when out of memory
+ */
+void *arena_alloc(arena_t *arena, size_t size)
+{
+        size_t need = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+        if (need < size)
+                return NULL;
+
+        if (!arena->buf || arena->size - arena->used < need) {
+                size_t block = need > ARENA_CHUNK ? need : ARENA_CHUNK;
+                arena_chunk *chunk = malloc(sizeof(arena_chunk) + block);
+                if (!chunk)
+                        return NULL;
+
+                chunk->next = arena->chunks;
+                arena->chunks = chunk;
+                arena->heap += block;
+                arena->buf = (char *) chunk->data;
+                arena->size = block;
+                arena->used = 0;
+        }
+
+        void *p = arena->buf + arena->used;
+        arena->used += need;
+        arena->allocated += size;
+        return p;
+}
+
+/**
+ * Copy string into arena.
+ *
+ * @param arena     arena
+ * @param s         string to copy
+ *
+ * @return copy, NULL when out of memory
+ */
+char *arena_strdup(arena_t *arena, const char *s)
+{
+        size_t len = strlen(s) + 1;
+        char *copy = arena_alloc(arena, len);
+        if (copy)
+                memcpy(copy, s, len);
+        return copy;
+}
+
+/**
+ * Free every heap block of the arena, arena_init() it again to reuse it.
+ *
+ * @param arena     arena
+ */
+void arena_release(arena_t *arena)
+{
+        while (arena->chunks) {
+                arena_chunk *next = arena->chunks->next;
+                free(arena->chunks);
+                arena->chunks = next;
+        }
+        memset(arena, 0, sizeof(*arena));
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _TELEGRAM_AUTHENTICATOR_ARENA_H_
+#define _TELEGRAM_AUTHENTICATOR_ARENA_H_
+
+#include <stddef.h>
+
+/* Heap blocks are at least this large */
+#define ARENA_CHUNK 4096
+
+typedef struct arena_chunk arena_chunk;
+
+/*
+ * Bump allocator for everything one authentication allocates. Memory is
+ * never freed piecemeal, arena_release() gives it all back at once. The first
+ * block is usually on the caller's stack, so a typical authentication never
+ * touches the heap.
+ */
+typedef struct {
+        char *buf;              /* block being allocated from */
+        size_t size;
+        size_t used;
+        arena_chunk *chunks;    /* heap blocks, freed by arena_release() */
+        size_t allocated;       /* bytes handed out, for accounting */
+        size_t heap;            /* bytes of heap blocks */
+} arena_t;
+
+/**
+ * Start an arena on buf, which must outlive the arena.
+ *
+ * @param arena     arena to initialize
+ * @param buf       first block, NULL to start on the heap
+ * @param size      size of buf
+ */
+void arena_init(arena_t *arena, void *buf, size_t size);
+
+/**
+ * Allocate memory aligned for any type, valid until arena_release().
+ *
+ * @param arena     arena
+ * @param size      bytes needed
+ *
+ * @return memory, NULL when out of memory
+ */
+void *arena_alloc(arena_t *arena, size_t size);
+
+/**
+ * Copy string into arena.
+ *
+ * @param arena     arena
+ * @param s         string to copy
+ *
+ * @return copy, NULL when out of memory
+ */
+char *arena_strdup(arena_t *arena, const char *s);
+
+/**
+ * Free every heap block of the arena, arena_init() it again to reuse it.
+ *
+ * @param arena     arena
+ */
+void arena_release(arena_t *arena);
+
+#endif /* _TELEGRAM_AUTHENTICATOR_ARENA_H_ */
@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Circuit breaker of bot api servers, shared by every process.
+ *
+ * When the server is down, each sshd child would otherwise find out by
+ * itself, stalling on connect until its own timeout. Once a few sends in a
+ * row failed, the breaker opens and every process refuses to send at once.
+ * After a cooldown one process gets to probe the server, its result closes
+ * the breaker or opens it for another cooldown.
+ *
+ * Processes which can't map the file (not root) keep a breaker of their own.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "breaker.h"
+#include "mapfile.h"
+
+#define BREAKER_MAGIC   0x4b524254      /* "TBRK" */
+#define BREAKER_VERSION 1
+
+/* Bot api servers we keep a breaker for, most hosts talk to one */
+#define BREAKER_SLOTS 16
+
+typedef enum {
+        STATE_CLOSED,
+        STATE_OPEN,
+        STATE_HALF_OPEN,                /* one probe in flight */
+} breaker_state;
+
+/* State and the time it was entered are packed in one word, so every
+ * transition is one compare and swap */
+#define STATE_BITS 2
+#define STATE_MASK ((1 << STATE_BITS) - 1)
+
+typedef struct {
+        uint64_t endpoint;              /* hash of server url, 0 for free slot */
+        uint64_t state;                 /* ms << STATE_BITS | breaker_state */
+        uint32_t failures;              /* sends failed in a row */
+        uint32_t reserved;
+} breaker_slot;
+
+typedef struct {
+        uint32_t magic;
+        uint32_t version;
+        breaker_slot slots[BREAKER_SLOTS];
+} breaker_file;
+
+static struct {
+        pthread_mutex_t lock;
+        bool tried;
+        mapfile_t map;
+        breaker_file *file;             /* shared file, or local below */
+        breaker_file local;
+} breaker = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .map  = { .fd = -1 },
+};
+
+/**
+ * Map the breaker file once per process, fallback to local memory.
+ */
+static
+breaker_file *breaker_open(void)
+{
+        breaker_file *file = __atomic_load_n(&breaker.file, __ATOMIC_ACQUIRE);
+        if (file)
+                return file;
+
+        pthread_mutex_lock(&breaker.lock);
+        if (!breaker.tried) {
+                breaker.tried = true;
+                file = &breaker.local;
+
+                if (mapfile_open(&breaker.map, BREAKER_FILE, sizeof(breaker_file), 0 == geteuid())) {
+                        file = breaker.map.addr;
+
+                        mapfile_lock(&breaker.map);
+                        if (BREAKER_MAGIC != file->magic || BREAKER_VERSION != file->version) {
+                                memset(file, 0, sizeof(*file));
+                                file->magic = BREAKER_MAGIC;
+                                file->version = BREAKER_VERSION;
+                        }
+                        mapfile_unlock(&breaker.map);
+                }
+
+                __atomic_store_n(&breaker.file, file, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&breaker.lock);
+
+        return breaker.file;
+}
+
+/* Same clock in every process, and BREAKER_FILE doesn't outlive a boot */
+static
+uint64_t now_ms(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static
+uint64_t state_pack(uint64_t ms, breaker_state state)
+{
+        return ms << STATE_BITS | state;
+}
+
+/**
+ * Find the breaker of a server, claim a free slot for a new one.
+ */
+static
+breaker_slot *slot_find(const char *endpoint)
+{
+        breaker_file *file = breaker_open();
+
+        /* FNV-1a, 0 marks a free slot */
+        uint64_t key = 0xcbf29ce484222325ULL;
+        for (const unsigned char *p = (const unsigned char *) endpoint; *p; p++)
+                key = (key ^ *p) * 0x100000001b3ULL;
+        if (0 == key)
+                key = 1;
+
+        for (unsigned int i = 0; i < BREAKER_SLOTS; i++) {
+                breaker_slot *slot = &file->slots[(key + i) % BREAKER_SLOTS];
+                uint64_t cur = __atomic_load_n(&slot->endpoint, __ATOMIC_ACQUIRE);
+                if (0 == cur && __atomic_compare_exchange_n(&slot->endpoint, &cur, key, false,
+                                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                        return slot;
+                if (key == cur)
+                        return slot;
+        }
+
+        /* more servers than slots, they share one and trip together */
+        return &file->slots[key % BREAKER_SLOTS];
+}
+
+/**
+ * Decide if a message should be sent to a bot api server. After the cooldown
+ * of an open breaker, exactly one caller across all processes gets
+ * BREAKER_PROBE, the others keep getting BREAKER_DENY until it reports.
+ *
+ * Never blocks, the state is read and changed with atomics only.
+ *
+ * @param endpoint  bot api server url, "" for the default one
+ * @param cooldown  seconds an open breaker denies sends
+ *
+ * @return verdict to pass to breaker_report() after sending
+ */
+breaker_verdict breaker_check(const char *endpoint, int cooldown)
+{
+        breaker_slot *slot = slot_find(endpoint);
+        uint64_t word = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        uint64_t now = now_ms();
+
+        for (;;) {
+                breaker_state state = word & STATE_MASK;
+                uint64_t since = word >> STATE_BITS;
+
+                if (STATE_CLOSED == state)
+                        return BREAKER_ALLOW;
+
+                uint64_t wait = 1000ULL * (STATE_OPEN == state ? cooldown : BREAKER_PROBE_TIMEOUT);
+                if (since <= now && now - since < wait)
+                        return BREAKER_DENY;
+
+                /* cooldown over, or the last probe got lost: we probe, unless
+                 * another process was faster and word is reloaded */
+                if (__atomic_compare_exchange_n(&slot->state, &word, state_pack(now, STATE_HALF_OPEN),
+                                                false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                        return BREAKER_PROBE;
+        }
+}
+
+/**
+ * Report result of a send allowed by breaker_check().
+ *
+ * @param endpoint  same as given to breaker_check()
+ * @param verdict   returned by breaker_check()
+ * @param ok        message delivered
+ * @param failures  failed sends in a row that open the breaker
+ */
+void breaker_report(const char *endpoint, breaker_verdict verdict, bool ok, int failures)
+{
+        if (BREAKER_DENY == verdict)
+                return;
+
+        breaker_slot *slot = slot_find(endpoint);
+        uint64_t word = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+
+        /* any delivery shows the server is back, only write when that's news
+         * so the cache line isn't bounced between processes on every login */
+        if (ok) {
+                if (__atomic_load_n(&slot->failures, __ATOMIC_RELAXED))
+                        __atomic_store_n(&slot->failures, 0, __ATOMIC_RELAXED);
+                if (STATE_CLOSED != (word & STATE_MASK))
+                        __atomic_store_n(&slot->state, state_pack(now_ms(), STATE_CLOSED), __ATOMIC_RELEASE);
+                return;
+        }
+
+        /* failed probe, wait another cooldown */
+        if (BREAKER_PROBE == verdict) {
+                __atomic_store_n(&slot->state, state_pack(now_ms(), STATE_OPEN), __ATOMIC_RELEASE);
+                return;
+        }
+
+        if (__atomic_add_fetch(&slot->failures, 1, __ATOMIC_RELAXED) < (uint32_t) failures)
+                return;
+
+        /* only one of the processes failing at once opens it */
+        if (STATE_CLOSED == (word & STATE_MASK) &&
+            __atomic_compare_exchange_n(&slot->state, &word, state_pack(now_ms(), STATE_OPEN),
+                                        false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                __atomic_store_n(&slot->failures, 0, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _TELEGRAM_AUTHENTICATOR_BREAKER_H_
+#define _TELEGRAM_AUTHENTICATOR_BREAKER_H_
+
+#include <stdbool.h>
+
+/* State shared by every process loading the PAM module, gone after reboot */
+#define BREAKER_FILE "/run/telegram-authenticator/breaker"
+
+/* Failed sends in a row that open the breaker, and seconds it stays open */
+#define BREAKER_FAILURES 5
+#define BREAKER_COOLDOWN 30
+
+/* A probe not reported by then is taken as lost, e.g. its process was
+ * killed, and another one may start. Above the send deadline of telegram.c */
+#define BREAKER_PROBE_TIMEOUT 25
+
+typedef enum {
+        BREAKER_ALLOW,          /* closed, send as usual */
+        BREAKER_PROBE,          /* open, this send checks if the server is back */
+        BREAKER_DENY,           /* open, don't even try */
+} breaker_verdict;
+
+/**
+ * Decide if a message should be sent to a bot api server. After the cooldown
+ * of an open breaker, exactly one caller across all processes gets
+ * BREAKER_PROBE, the others keep getting BREAKER_DENY until it reports.
+ *
+ * Never blocks, the state is read and changed with atomics only.
+ *
+ * @param endpoint  bot api server url, "" for the default one
+ * @param cooldown  seconds an open breaker denies sends
+ *
+ * @return verdict to pass to breaker_report() after sending
+ */
+breaker_verdict breaker_check(const char *endpoint, int cooldown);
+
+/**
+ * Report result of a send allowed by breaker_check().
+ *
+ * @param endpoint  same as given to breaker_check()
+ * @param verdict   returned by breaker_check()
+ * @param ok        message delivered
+ * @param failures  failed sends in a row that open the breaker
+ */
+void breaker_report(const char *endpoint, breaker_verdict verdict, bool ok, int failures);
+
+#endif /* _TELEGRAM_AUTHENTICATOR_BREAKER_H_ */
@@ -0,0 +1,473 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "broker.h"
+
+#define BROKER_VERSION 3
+
+/* How long we wait for daemon's ack, in seconds */
+#define BROKER_ACK_TIMEOUT 30
+
+/*
+ * Wire format, all integers in host byte order since both ends are on the same host:
+ *
+ *   request:  header + token + chat_id + msg + nonce + code  (strings are not NUL terminated)
+ *   ack:      one byte broker_status, once the message is sent or the code checked
+ *   answer:   BROKER_APPROVE only, one byte telegram_approval after the ack
+ *
+ * A daemon speaking another version drops the connection, the module then
+ * sends by itself.
+ */
+typedef struct {
+        uint8_t  version;
+        uint8_t  type;                  /* broker_type */
+        uint16_t token_len;
+        uint16_t chat_id_len;
+        uint16_t msg_len;
+        uint16_t nonce_len;
+        uint16_t code_len;
+        uint16_t timeout;               /* seconds the daemon may wait for a button,
+                                         * or a code is valid */
+} broker_header;
+
+static
+bool write_all(int fd, const void *buf, size_t len)
+{
+        const char *p = buf;
+        while (len > 0) {
+                ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+                if (n < 0 && EINTR == errno)
+                        continue;
+                if (n <= 0)
+                        return false;
+                p += n;
+                len -= n;
+        }
+        return true;
+}
+
+static
+bool read_all(int fd, void *buf, size_t len)
+{
+        char *p = buf;
+        while (len > 0) {
+                ssize_t n = recv(fd, p, len, 0);
+                if (n < 0 && EINTR == errno)
+                        continue;
+                if (n <= 0)
+                        return false;
+                p += n;
+                len -= n;
+        }
+        return true;
+}
+
+/**
+ * Fill unix socket address, return false if path is too long.
+ */
+static
+bool broker_addr(const char *path, struct sockaddr_un *addr)
+{
+        memset(addr, 0, sizeof(*addr));
+        addr->sun_family = AF_UNIX;
+
+        if (strlen(path) >= sizeof(addr->sun_path)) {
+                fprintf(stderr, "ERROR: broker socket path too long: %s\n", path);
+                return false;
+        }
+
+        strcpy(addr->sun_path, path);
+        return true;
+}
+
+/**
+ * Send request to telegram-authenticatord and read its ack.
+ *
+ * @param path      daemon's unix socket path
+ * @param hdr       request header, lengths filled
+ * @param ack_ms    milliseconds to wait for the ack, at most BROKER_ACK_TIMEOUT
+ * @param ack       filled with the ack
+ * @param conn      if not NULL, set to the connection left open for more
+ *                  replies, otherwise the connection is closed
+ *
+ * @return  false   can't talk to daemon
+ *          true    ack filled
+ */
+static
+bool broker_call(const char *path, const broker_header *hdr, const char *token,
+                 const char *chat_id, const char *msg, const char *nonce, const char *code,
+                 int ack_ms, uint8_t *ack, int *conn)
+{
+        /* too large for the daemon, let caller send it by itself */
+        if (hdr->token_len > BROKER_MAX_TOKEN ||
+            hdr->chat_id_len > BROKER_MAX_CHAT_ID ||
+            hdr->msg_len > BROKER_MAX_MSG ||
+            hdr->nonce_len > BROKER_MAX_NONCE ||
+            hdr->code_len > BROKER_MAX_CODE)
+                return false;
+
+        struct sockaddr_un addr;
+        if (!broker_addr(path, &addr))
+                return false;
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+                return false;
+
+        /* daemon not running, socket doesn't exist or nobody listens on it */
+        if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+                close(fd);
+                return false;
+        }
+
+        if (ack_ms <= 0 || ack_ms > BROKER_ACK_TIMEOUT * 1000)
+                ack_ms = BROKER_ACK_TIMEOUT * 1000;
+        struct timeval tv = { .tv_sec = ack_ms / 1000, .tv_usec = ack_ms % 1000 * 1000 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        /* send header and payload in one packet */
+        char buf[sizeof(*hdr) + BROKER_MAX_TOKEN + BROKER_MAX_CHAT_ID + BROKER_MAX_MSG + BROKER_MAX_NONCE +
+                 BROKER_MAX_CODE];
+        char *p = buf;
+        memcpy(p, hdr, sizeof(*hdr));           p += sizeof(*hdr);
+        memcpy(p, token, hdr->token_len);       p += hdr->token_len;
+        memcpy(p, chat_id, hdr->chat_id_len);   p += hdr->chat_id_len;
+        memcpy(p, msg, hdr->msg_len);           p += hdr->msg_len;
+        memcpy(p, nonce, hdr->nonce_len);       p += hdr->nonce_len;
+        memcpy(p, code, hdr->code_len);         p += hdr->code_len;
+
+        bool ok = write_all(fd, buf, p - buf) && read_all(fd, ack, sizeof(*ack));
+
+        /* the code is in the request */
+        explicit_bzero(buf, sizeof(buf));
+
+        if (ok && conn)
+                *conn = fd;
+        else
+                close(fd);
+        return ok;
+}
+
+/**
+ * Ask telegram-authenticatord to send message to telegram channel, and wait for its ack.
+ *
+ * @param path      daemon's unix socket path
+ * @param token     telegram bot token
+ * @param chat_id   telegram chat channel id
+ * @param msg       message send to telegram
+ * @param timeout   milliseconds to wait for the ack, 0 for BROKER_ACK_TIMEOUT
+ *
+ * @return  BROKER_OK           message sent
+ *          BROKER_FAILED       daemon failed to send message
+ *          BROKER_REJECTED     bot api server refused the message
+ *          BROKER_UNAVAILABLE  can't talk to daemon, or no ack in time
+ */
+broker_status broker_send(const char *path, const char *token, const char *chat_id, const char *msg,
+                          int timeout)
+{
+        broker_header hdr = {
+                .version     = BROKER_VERSION,
+                .type        = BROKER_SEND,
+                .token_len   = strlen(token),
+                .chat_id_len = strlen(chat_id),
+                .msg_len     = strlen(msg),
+        };
+
+        uint8_t ack;
+        if (!broker_call(path, &hdr, token, chat_id, msg, "", "", timeout, &ack, NULL))
+                return BROKER_UNAVAILABLE;
+
+        return (BROKER_OK == ack || BROKER_REJECTED == ack) ? ack : BROKER_FAILED;
+}
+
+/**
+ * Ask telegram-authenticatord to send message with Approve and Deny buttons.
+ * The daemon only does it when it receives updates by webhook, the answer is
+ * then read with broker_approve_wait().
+ *
+ * @param path      daemon's unix socket path
+ * @param token     telegram bot token
+ * @param chat_id   telegram chat channel id
+ * @param msg       message send to telegram
+ * @param nonce     nonce of the buttons
+ * @param timeout   seconds the daemon waits for a button
+ * @param conn      set to the connection to wait on, for BROKER_OK
+ *
+ * @return  BROKER_OK           message sent
+ *          BROKER_FAILED       daemon failed to send message
+ *          BROKER_REJECTED     bot api server refused the message
+ *          BROKER_UNAVAILABLE  can't talk to daemon, or it has no webhook
+ */
+broker_status broker_approve(const char *path, const char *token, const char *chat_id,
+                             const char *msg, const char *nonce, int timeout, int *conn)
+{
+        broker_header hdr = {
+                .version     = BROKER_VERSION,
+                .type        = BROKER_APPROVE,
+                .token_len   = strlen(token),
+                .chat_id_len = strlen(chat_id),
+                .msg_len     = strlen(msg),
+                .nonce_len   = strlen(nonce),
+                .timeout     = timeout > UINT16_MAX ? UINT16_MAX : timeout,
+        };
+
+        uint8_t ack;
+        int fd;
+        /* a message delivered after the user gave up waiting is useless */
+        if (!broker_call(path, &hdr, token, chat_id, msg, nonce, "", hdr.timeout * 1000, &ack, &fd))
+                return BROKER_UNAVAILABLE;
+
+        if (BROKER_OK != ack) {
+                close(fd);
+                return (BROKER_UNAVAILABLE == ack || BROKER_REJECTED == ack) ? ack : BROKER_FAILED;
+        }
+
+        /* the daemon answers by itself when the timeout passed */
+        struct timeval tv = { .tv_sec = hdr.timeout + BROKER_ACK_TIMEOUT };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        *conn = fd;
+        return BROKER_OK;
+}
+
+/**
+ * Wait for the button of broker_approve(), and close the connection.
+ *
+ * @param conn      connection set by broker_approve()
+ *
+ * @return  TELEGRAM_APPROVAL_APPROVED  approve pressed
+ *          TELEGRAM_APPROVAL_DENIED    deny pressed
+ *          TELEGRAM_APPROVAL_TIMEOUT   nothing pressed before timeout
+ *          TELEGRAM_APPROVAL_ERROR     lost the daemon
+ */
+telegram_approval broker_approve_wait(int conn)
+{
+        uint8_t answer;
+        bool ok = read_all(conn, &answer, sizeof(answer));
+
+        close(conn);
+        if (!ok)
+                return TELEGRAM_APPROVAL_ERROR;
+
+        return (TELEGRAM_APPROVAL_APPROVED == answer || TELEGRAM_APPROVAL_DENIED == answer) ?
+                answer : TELEGRAM_APPROVAL_TIMEOUT;
+}
+
+/**
+ * Ask telegram-authenticatord to send login code and hold it, and wait for
+ * its ack. The daemon drops the code after its lifetime, the answer is
+ * checked with broker_check_code().
+ *
+ * @param path      daemon's unix socket path
+ * @param token     telegram bot token
+ * @param chat_id   telegram chat channel id
+ * @param msg       message send to telegram, with the code
+ * @param key       user name and tag of the login
+ * @param code      login code
+ * @param lifetime  seconds the code is valid, 0 for no limit of our own
+ * @param timeout   milliseconds to wait for the ack, 0 for BROKER_ACK_TIMEOUT
+ *
+ * @return  BROKER_OK           message sent and code held
+ *          BROKER_FAILED       daemon failed to send message
+ *          BROKER_REJECTED     bot api server refused the message
+ *          BROKER_UNAVAILABLE  can't talk to daemon, no ack in time, or it
+ *                              can't hold the code
+ */
+broker_status broker_send_code(const char *path, const char *token, const char *chat_id,
+                               const char *msg, const char *key, const char *code,
+                               int lifetime, int timeout)
+{
+        broker_header hdr = {
+                .version     = BROKER_VERSION,
+                .type        = BROKER_CODE,
+                .token_len   = strlen(token),
+                .chat_id_len = strlen(chat_id),
+                .msg_len     = strlen(msg),
+                .nonce_len   = strlen(key),
+                .code_len    = strlen(code),
+                .timeout     = lifetime > UINT16_MAX ? UINT16_MAX : lifetime,
+        };
+
+        uint8_t ack;
+        if (!broker_call(path, &hdr, token, chat_id, msg, key, code, timeout, &ack, NULL))
+                return BROKER_UNAVAILABLE;
+
+        return (BROKER_OK == ack || BROKER_REJECTED == ack || BROKER_UNAVAILABLE == ack) ?
+                ack : BROKER_FAILED;
+}
+
+/**
+ * Ask telegram-authenticatord to check answer to a code of broker_send_code().
+ * The code is dropped whatever the answer, an empty answer just drops it.
+ *
+ * @param path      daemon's unix socket path
+ * @param chat_id   telegram chat channel id
+ * @param key       user name and tag of the login
+ * @param answer    typed by the user
+ *
+ * @return  BROKER_OK           answer is the code
+ *          BROKER_REJECTED     wrong answer
+ *          BROKER_EXPIRED      code expired
+ *          BROKER_UNAVAILABLE  can't talk to daemon
+ */
+broker_status broker_check_code(const char *path, const char *chat_id, const char *key,
+                                const char *answer)
+{
+        /* an answer too long for any code is wrong, still drop the code */
+        size_t answer_len = strlen(answer);
+        broker_header hdr = {
+                .version     = BROKER_VERSION,
+                .type        = BROKER_CHECK,
+                .chat_id_len = strlen(chat_id),
+                .nonce_len   = strlen(key),
+                .code_len    = answer_len > BROKER_MAX_CODE ? 0 : answer_len,
+        };
+
+        uint8_t ack;
+        if (!broker_call(path, &hdr, "", chat_id, "", key, answer, 0, &ack, NULL))
+                return BROKER_UNAVAILABLE;
+
+        return (BROKER_OK == ack || BROKER_EXPIRED == ack) ? ack : BROKER_REJECTED;
+}
+
+/**
+ * Create the listening unix socket for daemon.
+ *
+ * @param path  unix socket path, removed first if it already exists
+ *
+ * @return  listening socket fd, -1 on failure
+ */
+int broker_listen(const char *path)
+{
+        struct sockaddr_un addr;
+        if (!broker_addr(path, &addr))
+                return -1;
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                perror("socket()");
+                return -1;
+        }
+
+        unlink(path);
+
+        /* only root (sshd) should be able to talk to us */
+        mode_t mask = umask(0077);
+        int ret = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+        umask(mask);
+
+        if (ret < 0) {
+                perror("bind()");
+                close(fd);
+                return -1;
+        }
+
+        if (listen(fd, SOMAXCONN) < 0) {
+                perror("listen()");
+                close(fd);
+                return -1;
+        }
+
+        return fd;
+}
+
+/**
+ * Read one request sent by broker_send() and the like.
+ *
+ * @param fd    connected client socket
+ * @param req   request to fill
+ *
+ * @return  false   malformed request or connection error
+ *          true    request read
+ */
+bool broker_read_request(int fd, broker_request *req)
+{
+        broker_header hdr;
+
+        if (!read_all(fd, &hdr, sizeof(hdr)))
+                return false;
+
+        if (BROKER_VERSION != hdr.version ||
+            hdr.type > BROKER_CHECK ||
+            hdr.token_len > BROKER_MAX_TOKEN ||
+            hdr.chat_id_len > BROKER_MAX_CHAT_ID ||
+            hdr.msg_len > BROKER_MAX_MSG ||
+            hdr.nonce_len > BROKER_MAX_NONCE ||
+            hdr.code_len > BROKER_MAX_CODE)
+                return false;
+
+        if (!read_all(fd, req->token, hdr.token_len) ||
+            !read_all(fd, req->chat_id, hdr.chat_id_len) ||
+            !read_all(fd, req->msg, hdr.msg_len) ||
+            !read_all(fd, req->nonce, hdr.nonce_len) ||
+            !read_all(fd, req->code, hdr.code_len))
+                return false;
+
+        req->type = hdr.type;
+        req->token[hdr.token_len] = '\0';
+        req->chat_id[hdr.chat_id_len] = '\0';
+        req->msg[hdr.msg_len] = '\0';
+        req->nonce[hdr.nonce_len] = '\0';
+        req->code[hdr.code_len] = '\0';
+        req->timeout = hdr.timeout;
+
+        return true;
+}
+
+/**
+ * Reply to a request with the delivery status, or the result of a check.
+ *
+ * @param fd        connected client socket
+ * @param status    BROKER_OK, BROKER_FAILED, BROKER_REJECTED, or BROKER_EXPIRED
+ *                  and BROKER_UNAVAILABLE for codes
+ *
+ * @return  false   failed to write ack
+ *          true    ack written
+ */
+bool broker_write_ack(int fd, broker_status status)
+{
+        uint8_t ack = status;
+        return write_all(fd, &ack, sizeof(ack));
+}
+
+/**
+ * Tell broker_approve_wait() which button was pressed, after the ack.
+ *
+ * @param fd        connected client socket
+ * @param answer    button pressed, or TELEGRAM_APPROVAL_TIMEOUT
+ *
+ * @return  false   failed to write answer
+ *          true    answer written
+ */
+bool broker_write_answer(int fd, telegram_approval answer)
+{
+        uint8_t byte = answer;
+        return write_all(fd, &byte, sizeof(byte));
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _TELEGRAM_AUTHENTICATOR_BROKER_H_
+#define _TELEGRAM_AUTHENTICATOR_BROKER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "telegram.h"
+
+/* Default unix socket telegram-authenticatord listen on */
+#define BROKER_SOCKET "/run/telegram-authenticator/broker.sock"
+
+#define BROKER_MAX_TOKEN   128
+#define BROKER_MAX_CHAT_ID 64
+#define BROKER_MAX_MSG     512
+#define BROKER_MAX_NONCE   TELEGRAM_NONCE_MAX
+#define BROKER_MAX_CODE    16
+
+typedef enum {
+        BROKER_SEND = 0,        /* send text message */
+        BROKER_APPROVE,         /* send approval buttons and wait for the answer */
+        BROKER_CODE,            /* send login code and hold it until checked or expired */
+        BROKER_CHECK,           /* check the answer to a login code */
+} broker_type;
+
+typedef enum {
+        BROKER_OK = 0,          /* daemon delivered the message */
+        BROKER_FAILED,          /* daemon reachable but failed to deliver */
+        BROKER_UNAVAILABLE,     /* daemon not reachable, caller should send by itself */
+        BROKER_REJECTED,        /* bot api server refused the message, e.g. blocked bot,
+                                 * or wrong answer to a code */
+        BROKER_EXPIRED,         /* daemon holds no such code, it expired */
+} broker_status;
+
+typedef struct {
+        broker_type type;
+        char token[BROKER_MAX_TOKEN + 1];
+        char chat_id[BROKER_MAX_CHAT_ID + 1];
+        char msg[BROKER_MAX_MSG + 1];
+        char nonce[BROKER_MAX_NONCE + 1];       /* of the buttons, or key of the code */
+        char code[BROKER_MAX_CODE + 1];         /* code, or answer to check */
+        int timeout;                            /* seconds to wait for a button, or code lifetime */
+} broker_request;
+
+/**
+ * Ask telegram-authenticatord to send message to telegram channel, and wait for its ack.
+ *
+ * @param path      daemon's unix socket path
+ * @param token     telegram bot token
+ * @param chat_id   telegram chat channel id
+ * @param msg       message send to telegram
+ * @param timeout   milliseconds to wait for the ack, 0 for BROKER_ACK_TIMEOUT
+ *
+ * @return  BROKER_OK           message sent
+ *          BROKER_FAILED       daemon failed to send message
+ *          BROKER_REJECTED     bot api server refused the message
+ *          BROKER_UNAVAILABLE  can't talk to daemon, or no ack in time
+ */
+broker_status broker_send(const char *path, const char *token, const char *chat_id, const char *msg,
+                          int timeout);
+
+/**
+ * Ask telegram-authenticatord to send message with Approve and Deny buttons.
+ * The daemon only does it when it receives updates by webhook, the answer is
+ * then read with broker_approve_wait().
+ *
+ * @param path      daemon's unix socket path
+ * @param token     telegram bot token
+ * @param chat_id   telegram chat channel id
+ * @param msg       message send to telegram
+ * @param nonce     nonce of the buttons
+ * @param timeout   seconds the daemon waits for a button
+ * @param conn      set to the connection to wait on, for BROKER_OK
+ *
+ * @return  BROKER_OK           message sent
+ *          BROKER_FAILED       daemon failed to send message
+ *          BROKER_REJECTED     bot api server refused the message
+ *          BROKER_UNAVAILABLE  can't talk to daemon, or it has no webhook
+ */
+broker_status broker_approve(const char *path, const char *token, const char *chat_id,
+                             const char *msg, const char *nonce, int timeout, int *conn);
+
+/**
+ * Wait for the button of broker_approve(), and close the connection.
+ *
+ * @param conn      connection set by broker_approve()
+ *
+ * @return  TELEGRAM_APPROVAL_APPROVED  approve pressed
+ *          TELEGRAM_APPROVAL_DENIED    deny pressed
+ *          TELEGRAM_APPROVAL_TIMEOUT   nothing pressed before timeout
+ *          TELEGRAM_APPROVAL_ERROR     lost the daemon
+ */
+telegram_approval broker_approve_wait(int conn);
+
+/**
+ * Ask telegram-authenticatord to send login code and hold it, and wait for
+ * its ack. The daemon drops the code after its lifetime, the answer is
+ * checked with broker_check_code().
+ *
+ * @param path      daemon's unix socket path
+ * @param token     telegram bot token
+ * @param chat_id   telegram chat channel id
+ * @param msg       message send to telegram, with the code
+ * @param key       user name and tag of the login
+ * @param code      login code
+ * @param lifetime  seconds the code is valid, 0 for no limit of our own
+ * @param timeout   milliseconds to wait for the ack, 0 for BROKER_ACK_TIMEOUT
+ *
+ * @return  BROKER_OK           message sent and code held
+ *          BROKER_FAILED       daemon failed to send message
+ *          BROKER_REJECTED     bot api server refused the message
+ *          BROKER_UNAVAILABLE  can't talk to daemon, no ack in time, or it
+ *                              can't hold the code
+ */
+broker_status broker_send_code(const char *path, const char *token, const char *chat_id,
+                               const char *msg, const char *key, const char *code,
+                               int lifetime, int timeout);
+
+/**
+ * Ask telegram-authenticatord to check answer to a code of broker_send_code().
+ * The code is dropped whatever the answer, an empty answer just drops it.
+ *
+ * @param path      daemon's unix socket path
+ * @param chat_id   telegram chat channel id
+ * @param key       user name and tag of the login
+ * @param answer    typed by the user
+ *
+ * @return  BROKER_OK           answer is the code
+ *          BROKER_REJECTED     wrong answer
+ *          BROKER_EXPIRED      code expired
+ *          BROKER_UNAVAILABLE  can't talk to daemon
+ */
+broker_status broker_check_code(const char *path, const char *chat_id, const char *key,
+                                const char *answer);
+
+/**
+ * Create the listening unix socket for daemon.
+ *
+ * @param path  unix socket path, removed first if it already exists
+ *
+ * @return  listening socket fd, -1 on failure
+ */
+int broker_listen(const char *path);
+
+/**
+ * Read one request sent by broker_send() and the like.
+ *
+ * @param fd    connected client socket
+ * @param req   request to fill
+ *
+ * @return  false   malformed request or connection error
+ *          true    request read
+ */
+bool broker_read_request(int fd, broker_request *req);
+
+/**
+ * Reply to a request with the delivery status, or the result of a check.
+ *
+ * @param fd        connected client socket
+ * @param status    BROKER_OK, BROKER_FAILED, BROKER_REJECTED, or BROKER_EXPIRED
+ *                  and BROKER_UNAVAILABLE for codes
+ *
+ * @return  false   failed to write ack
+ *          true    ack written
+ */
+bool broker_write_ack(int fd, broker_status status);
+
+/**
+ * Tell broker_approve_wait() which button was pressed, after the ack.
+ *
+ * @param fd        connected client socket
+ * @param answer    button pressed, or TELEGRAM_APPROVAL_TIMEOUT
+ *
+ * @return  false   failed to write answer
+ *          true    answer written
+ */
+bool broker_write_answer(int fd, telegram_approval answer);
+
+#endif /* _TELEGRAM_AUTHENTICATOR_BROKER_H_ */
@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "challenge.h"
+
+/*
+ * Timing wheel: WHEEL_LEVELS levels of WHEEL_SIZE slots each. Level 0 slot i
+ * holds entries expiring at tick i of the current 64 ticks, level 1 those
+ * expiring in a later 64 tick block of the current 4096 ticks, and so on.
+ * When a level wraps, the next slot of the level above is cascaded down.
+ */
+#define WHEEL_BITS   6
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+
+/* Empty index slot or list end, entries are referred to by index + 1 */
+#define NIL 0
+
+typedef struct {
+        uint64_t expires;               /* tick */
+        void *data;
+        uint32_t hash;
+        uint32_t prev, next;            /* wheel slot list, next is also the free list */
+        uint16_t slot;                  /* level * WHEEL_SIZE + slot */
+        char chat_id[CHALLENGE_MAX_CHAT_ID + 1];
+        char nonce[CHALLENGE_MAX_NONCE + 1];
+} challenge_entry;
+
+typedef struct {
+        uint32_t hash;
+        uint32_t entry;
+} challenge_index;
+
+struct challenge_table {
+        challenge_entry *entries;
+        challenge_index *index;
+        size_t capacity;
+        size_t count;
+        uint32_t index_mask;
+        uint32_t free;
+        unsigned int tick_ms;
+        uint64_t now;                   /* tick, everything up to it expired */
+        uint32_t wheel[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+/* FNV-1a over chat_id, a separator and nonce */
+static
+uint32_t key_hash(const char *chat_id, const char *nonce)
+{
+        uint32_t h = 2166136261u;
+
+        for (; *chat_id; chat_id++)
+                h = (h ^ (unsigned char)*chat_id) * 16777619u;
+        h = (h ^ ':') * 16777619u;
+        for (; *nonce; nonce++)
+                h = (h ^ (unsigned char)*nonce) * 16777619u;
+
+        return h;
+}
+
+challenge_table *challenge_create(size_t capacity, unsigned int tick_ms, uint64_t now_ms)
+{
+        challenge_table *t;
+        size_t index_size = 1;
+
+        if (capacity == 0 || capacity >= UINT32_MAX / 2 || tick_ms == 0)
+                return NULL;
+
+        /* Keep the index at most half full so probes stay short */
+        while (index_size < capacity * 2)
+                index_size <<= 1;
+
+        t = calloc(1, sizeof(*t));
+        if (!t)
+                return NULL;
+
+        t->entries = calloc(capacity, sizeof(*t->entries));
+        t->index = calloc(index_size, sizeof(*t->index));
+        if (!t->entries || !t->index) {
+                challenge_destroy(t);
+                return NULL;
+        }
+
+        for (size_t i = 0; i < capacity; i++)
+                t->entries[i].next = i + 1 < capacity ? i + 2 : NIL;
+        t->free = 1;
+        t->capacity = capacity;
+        t->index_mask = index_size - 1;
+        t->tick_ms = tick_ms;
+        t->now = now_ms / tick_ms;
+
+        return t;
+}
+
+void challenge_destroy(challenge_table *t)
+{
+        if (!t)
+                return;
+
+        free(t->entries);
+        free(t->index);
+        free(t);
+}
+
+static
+challenge_entry *entry_at(const challenge_table *t, uint32_t id)
+{
+        return &t->entries[id - 1];
+}
+
+/** Index slot of key, or of the empty slot ending its probe sequence */
+static
+uint32_t index_find(const challenge_table *t, uint32_t hash,
+                    const char *chat_id, const char *nonce)
+{
+        uint32_t i = hash & t->index_mask;
+
+        for (;; i = (i + 1) & t->index_mask) {
+                const challenge_index *slot = &t->index[i];
+                const challenge_entry *e;
+
+                if (slot->entry == NIL)
+                        return i;
+                if (slot->hash != hash)
+                        continue;
+
+                e = entry_at(t, slot->entry);
+                if (!strcmp(e->chat_id, chat_id) && !strcmp(e->nonce, nonce))
+                        return i;
+        }
+}
+
+/** Empty index slot i, shifting later entries of the cluster back so lookups need no tombstones */
+static
+void index_delete(challenge_table *t, uint32_t i)
+{
+        uint32_t j = i;
+
+        for (;;) {
+                uint32_t home;
+
+                j = (j + 1) & t->index_mask;
+                if (t->index[j].entry == NIL)
+                        break;
+
+                /* Entry at j may move to i only if its home isn't cyclically in (i, j] */
+                home = t->index[j].hash & t->index_mask;
+                if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+                        continue;
+
+                t->index[i] = t->index[j];
+                i = j;
+        }
+
+        t->index[i].entry = NIL;
+        t->index[i].hash = 0;
+}
+
+static
+void wheel_link(challenge_table *t, uint32_t id)
+{
+        challenge_entry *e = entry_at(t, id);
+        int level;
+        uint32_t *head;
+
+        /* Lowest level whose next level block holds both now and expiry */
+        for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+                int shift = WHEEL_BITS * (level + 1);
+
+                if ((e->expires >> shift) == (t->now >> shift))
+                        break;
+        }
+
+        e->slot = level * WHEEL_SIZE + ((e->expires >> (WHEEL_BITS * level)) & WHEEL_MASK);
+        head = &t->wheel[0][0] + e->slot;
+
+        e->prev = NIL;
+        e->next = *head;
+        if (*head != NIL)
+                entry_at(t, *head)->prev = id;
+        *head = id;
+}
+
+static
+void wheel_unlink(challenge_table *t, uint32_t id)
+{
+        challenge_entry *e = entry_at(t, id);
+
+        if (e->prev != NIL)
+                entry_at(t, e->prev)->next = e->next;
+        else
+                (&t->wheel[0][0])[e->slot] = e->next;
+        if (e->next != NIL)
+                entry_at(t, e->next)->prev = e->prev;
+}
+
+bool challenge_insert(challenge_table *t, const char *chat_id, const char *nonce,
+                      void *data, uint64_t ttl_ms)
+{
+        uint64_t ticks = (ttl_ms + t->tick_ms - 1) / t->tick_ms;
+        uint64_t horizon = ((t->now >> (WHEEL_BITS * WHEEL_LEVELS)) + 1) << (WHEEL_BITS * WHEEL_LEVELS);
+        uint32_t hash, i, id;
+        challenge_entry *e;
+
+        if (strlen(chat_id) > CHALLENGE_MAX_CHAT_ID || strlen(nonce) > CHALLENGE_MAX_NONCE)
+                return false;
+        if (t->free == NIL)
+                return false;
+
+        hash = key_hash(chat_id, nonce);
+        i = index_find(t, hash, chat_id, nonce);
+        if (t->index[i].entry != NIL)
+                return false;
+
+        id = t->free;
+        e = entry_at(t, id);
+        t->free = e->next;
+
+        strcpy(e->chat_id, chat_id);
+        strcpy(e->nonce, nonce);
+        e->data = data;
+        e->hash = hash;
+
+        /* Expire no earlier than next tick, and no later than the wheel reaches */
+        e->expires = t->now + (ticks ? ticks : 1);
+        if (e->expires >= horizon)
+                e->expires = horizon - 1;
+        wheel_link(t, id);
+
+        t->index[i].hash = hash;
+        t->index[i].entry = id;
+        t->count++;
+
+        return true;
+}
+
+void *challenge_lookup(const challenge_table *t, const char *chat_id, const char *nonce)
+{
+        uint32_t i = index_find(t, key_hash(chat_id, nonce), chat_id, nonce);
+
+        if (t->index[i].entry == NIL)
+                return NULL;
+
+        return entry_at(t, t->index[i].entry)->data;
+}
+
+/** Drop entry id found at index slot i, return its data */
+static
+void *remove_at(challenge_table *t, uint32_t i, uint32_t id)
+{
+        challenge_entry *e = entry_at(t, id);
+        void *data = e->data;
+
+        index_delete(t, i);
+        wheel_unlink(t, id);
+
+        e->data = NULL;
+        e->next = t->free;
+        t->free = id;
+        t->count--;
+
+        return data;
+}
+
+void *challenge_remove(challenge_table *t, const char *chat_id, const char *nonce)
+{
+        uint32_t i = index_find(t, key_hash(chat_id, nonce), chat_id, nonce);
+
+        if (t->index[i].entry == NIL)
+                return NULL;
+
+        return remove_at(t, i, t->index[i].entry);
+}
+
+/** Move every entry of a higher level slot to where it belongs now */
+static
+void cascade(challenge_table *t, int level)
+{
+        uint32_t *head = &t->wheel[level][(t->now >> (WHEEL_BITS * level)) & WHEEL_MASK];
+        uint32_t id = *head;
+
+        *head = NIL;
+        while (id != NIL) {
+                uint32_t next = entry_at(t, id)->next;
+
+                wheel_link(t, id);
+                id = next;
+        }
+}
+
+size_t challenge_expire(challenge_table *t, uint64_t now_ms, challenge_expire_cb cb, void *userdata)
+{
+        uint64_t target = now_ms / t->tick_ms;
+        size_t expired = 0;
+
+        while (t->now < target) {
+                uint32_t *head;
+
+                /* Nothing pending, just catch up */
+                if (t->count == 0) {
+                        t->now = target;
+                        break;
+                }
+
+                t->now++;
+                for (int level = WHEEL_LEVELS - 1; level > 0; level--)
+                        if ((t->now & (((uint64_t)1 << (WHEEL_BITS * level)) - 1)) == 0)
+                                cascade(t, level);
+
+                head = &t->wheel[0][t->now & WHEEL_MASK];
+                while (*head != NIL) {
+                        uint32_t id = *head;
+                        challenge_entry *e = entry_at(t, id);
+                        void *data = remove_at(t, index_find(t, e->hash, e->chat_id, e->nonce), id);
+
+                        expired++;
+                        if (cb)
+                                cb(data, userdata);
+                }
+        }
+
+        return expired;
+}
+
+size_t challenge_count(const challenge_table *t)
+{
+        return t->count;
+}
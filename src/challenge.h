@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _TELEGRAM_AUTHENTICATOR_CHALLENGE_H_
+#define _TELEGRAM_AUTHENTICATOR_CHALLENGE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Table of outstanding challenges, e.g. approval messages waiting for their
+ * button, keyed by chat_id and nonce.
+ *
+ * Entries live in a fixed array allocated up front, found through an open
+ * addressing index, and expire through a hierarchical timing wheel: insert,
+ * lookup, remove are O(1), expiring is O(1) amortized per entry, and memory
+ * doesn't grow with the number of pending challenges.
+ *
+ * Not thread safe, callers hold their own lock.
+ */
+
+#define CHALLENGE_MAX_CHAT_ID 31
+#define CHALLENGE_MAX_NONCE   48
+
+typedef struct challenge_table challenge_table;
+
+/* Called for every entry expired by challenge_expire() */
+typedef void (*challenge_expire_cb)(void *data, void *userdata);
+
+/**
+ * Create table.
+ *
+ * @param capacity  most entries held at once
+ * @param tick_ms   resolution of expiry
+ * @param now_ms    current time, from a monotonic clock
+ *
+ * @return table, NULL if out of memory
+ */
+challenge_table *challenge_create(size_t capacity, unsigned int tick_ms, uint64_t now_ms);
+
+/**
+ * Free table, entries left are dropped.
+ *
+ * @param t     table
+ */
+void challenge_destroy(challenge_table *t);
+
+/**
+ * Add entry which expires after ttl_ms.
+ *
+ * @param t         table
+ * @param chat_id   key, at most CHALLENGE_MAX_CHAT_ID chars
+ * @param nonce     key, at most CHALLENGE_MAX_NONCE chars
+ * @param data      returned by lookup and given to the expire callback
+ * @param ttl_ms    lifetime, from the last time given to the table
+ *
+ * @return  false   table full, key too long or already in table
+ *          true    entry added
+ */
+bool challenge_insert(challenge_table *t, const char *chat_id, const char *nonce,
+                      void *data, uint64_t ttl_ms);
+
+/**
+ * Find entry.
+ *
+ * @param t         table
+ * @param chat_id   key
+ * @param nonce     key
+ *
+ * @return data of the entry, NULL if not in table
+ */
+void *challenge_lookup(const challenge_table *t, const char *chat_id, const char *nonce);
+
+/**
+ * Remove entry.
+ *
+ * @param t         table
+ * @param chat_id   key
+ * @param nonce     key
+ *
+ * @return data of the entry removed, NULL if not in table
+ */
+void *challenge_remove(challenge_table *t, const char *chat_id, const char *nonce);
+
+/**
+ * Advance time, remove every entry which expired and call cb for it.
+ *
+ * @param t         table
+ * @param now_ms    current time, from the same clock as challenge_create()
+ * @param cb        called for each expired entry, after it was removed
+ * @param userdata  passed to cb
+ *
+ * @return number of entries expired
+ */
+size_t challenge_expire(challenge_table *t, uint64_t now_ms, challenge_expire_cb cb, void *userdata);
+
+/**
+ * Number of entries in table.
+ *
+ * @param t     table
+ */
+size_t challenge_count(const challenge_table *t);
+
+#endif /* _TELEGRAM_AUTHENTICATOR_CHALLENGE_H_ */
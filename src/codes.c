@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Login codes held by telegram-authenticatord.
+ *
+ * Codes live in a challenge table like the approvals of the webhook, its
+ * timing wheel is advanced by one thread every tick, so a pending login costs
+ * one entry and no timer of its own. A code is wiped when it leaves the table.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "challenge.h"
+#include "codes.h"
+
+/* Most codes held at once, and resolution of their lifetime */
+#define CODES_PENDING_MAX 65536
+#define CODES_TICK_MS     1000
+
+/* Seconds a code without a lifetime of its own is held, the prompt of such
+ * a login is long closed by then */
+#define CODES_LIFETIME_MAX (24 * 3600)
+
+typedef struct {
+        char code[BROKER_MAX_CODE + 1];
+} held_code;
+
+static struct {
+        pthread_mutex_t lock;
+        challenge_table *table;
+        codes_stats stats;
+} codes = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static
+uint64_t monotonic_ms(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static
+void code_free(held_code *held)
+{
+        explicit_bzero(held, sizeof(*held));
+        free(held);
+}
+
+static
+void on_expire(void *data, void *userdata)
+{
+        (void)userdata;
+
+        codes.stats.expired++;
+        code_free(data);
+}
+
+/**
+ * Advance the timing wheel of the codes every tick.
+ */
+static
+void *expire_thread(void *arg)
+{
+        const struct timespec tick = {
+                .tv_sec = CODES_TICK_MS / 1000,
+                .tv_nsec = CODES_TICK_MS % 1000 * 1000000,
+        };
+        (void)arg;
+
+        for (;;) {
+                nanosleep(&tick, NULL);
+
+                pthread_mutex_lock(&codes.lock);
+                challenge_expire(codes.table, monotonic_ms(), on_expire, NULL);
+                pthread_mutex_unlock(&codes.lock);
+        }
+        return NULL;
+}
+
+/**
+ * Create the table and start expiring codes on a background thread.
+ *
+ * @return  false   out of memory or no thread, error printed
+ *          true    started
+ */
+bool codes_start(void)
+{
+        codes.table = challenge_create(CODES_PENDING_MAX, CODES_TICK_MS, monotonic_ms());
+        if (!codes.table) {
+                fprintf(stderr, "ERROR: Out of memory.\n");
+                return false;
+        }
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+        pthread_t tid;
+        bool ok = !pthread_create(&tid, &attr, expire_thread, NULL);
+        pthread_attr_destroy(&attr);
+
+        if (!ok) {
+                fprintf(stderr, "ERROR: Failed on pthread_create().\n");
+                challenge_destroy(codes.table);
+                codes.table = NULL;
+        }
+        return ok;
+}
+
+/**
+ * Hold code until it's checked or expires.
+ *
+ * @param chat_id   chat the code is sent to
+ * @param key       user name and tag of the login
+ * @param code      login code
+ * @param lifetime  seconds the code is valid, 0 for a day
+ *
+ * @return  false   table full, key too long or already held
+ *          true    code held
+ */
+bool codes_add(const char *chat_id, const char *key, const char *code, int lifetime)
+{
+        if (!codes.table || strlen(code) > BROKER_MAX_CODE)
+                return false;
+
+        held_code *held = calloc(1, sizeof(*held));
+        if (!held)
+                return false;
+        strcpy(held->code, code);
+
+        if (lifetime <= 0 || lifetime > CODES_LIFETIME_MAX)
+                lifetime = CODES_LIFETIME_MAX;
+
+        pthread_mutex_lock(&codes.lock);
+        bool ok = challenge_insert(codes.table, chat_id, key, held, (uint64_t)lifetime * 1000);
+        if (ok)
+                codes.stats.issued++;
+        pthread_mutex_unlock(&codes.lock);
+
+        if (!ok)
+                code_free(held);
+        return ok;
+}
+
+/**
+ * Drop code, e.g. when it couldn't be sent.
+ *
+ * @param chat_id   chat the code is sent to
+ * @param key       user name and tag of the login
+ */
+void codes_drop(const char *chat_id, const char *key)
+{
+        pthread_mutex_lock(&codes.lock);
+        held_code *held = codes.table ? challenge_remove(codes.table, chat_id, key) : NULL;
+        pthread_mutex_unlock(&codes.lock);
+
+        if (held)
+                code_free(held);
+}
+
+/**
+ * Check answer and drop the code, whatever the answer: a code takes one try.
+ *
+ * @param chat_id   chat the code is sent to
+ * @param key       user name and tag of the login
+ * @param answer    typed by the user
+ *
+ * @return  BROKER_OK           answer is the code
+ *          BROKER_REJECTED     wrong answer
+ *          BROKER_EXPIRED      no such code, it expired or was never held
+ */
+broker_status codes_check(const char *chat_id, const char *key, const char *answer)
+{
+        pthread_mutex_lock(&codes.lock);
+        held_code *held = codes.table ? challenge_remove(codes.table, chat_id, key) : NULL;
+        if (held)
+                codes.stats.checked++;
+        pthread_mutex_unlock(&codes.lock);
+
+        if (!held)
+                return BROKER_EXPIRED;
+
+        bool match = !strcmp(held->code, answer);
+        code_free(held);
+        return match ? BROKER_OK : BROKER_REJECTED;
+}
+
+/**
+ * Get code statistics.
+ *
+ * @param stats     filled with current values
+ */
+void codes_get_stats(codes_stats *stats)
+{
+        pthread_mutex_lock(&codes.lock);
+        *stats = codes.stats;
+        stats->pending = codes.table ? challenge_count(codes.table) : 0;
+        pthread_mutex_unlock(&codes.lock);
+}
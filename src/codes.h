@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _TELEGRAM_AUTHENTICATOR_CODES_H_
+#define _TELEGRAM_AUTHENTICATOR_CODES_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "broker.h"
+
+/*
+ * Login codes held by telegram-authenticatord.
+ *
+ * A code sent through the daemon is kept in a challenge table, keyed by
+ * chat_id and a key made of the user name and a tag of the login, until the
+ * answer is checked or its lifetime runs out. Expiry doesn't depend on the
+ * module: the timing wheel drops the code even while the prompt is open, and
+ * an answer coming later finds nothing.
+ */
+
+typedef struct {
+        size_t issued;          /* codes added */
+        size_t checked;         /* answers checked, right or wrong */
+        size_t expired;         /* dropped before an answer came */
+        size_t pending;         /* codes held now */
+} codes_stats;
+
+/**
+ * Create the table and start expiring codes on a background thread.
+ *
+ * @return  false   out of memory or no thread, error printed
+ *          true    started
+ */
+bool codes_start(void);
+
+/**
+ * Hold code until it's checked or expires.
+ *
+ * @param chat_id   chat the code is sent to
+ * @param key       user name and tag of the login
+ * @param code      login code
+ * @param lifetime  seconds the code is valid, 0 for a day
+ *
+ * @return  false   table full, key too long or already held
+ *          true    code held
+ */
+bool codes_add(const char *chat_id, const char *key, const char *code, int lifetime);
+
+/**
+ * Drop code, e.g. when it couldn't be sent.
+ *
+ * @param chat_id   chat the code is sent to
+ * @param key       user name and tag of the login
+ */
+void codes_drop(const char *chat_id, const char *key);
+
+/**
+ * Check answer and drop the code, whatever the answer: a code takes one try.
+ *
+ * @param chat_id   chat the code is sent to
+ * @param key       user name and tag of the login
+ * @param answer    typed by the user
+ *
+ * @return  BROKER_OK           answer is the code
+ *          BROKER_REJECTED     wrong answer
+ *          BROKER_EXPIRED      no such code, it expired or was never held
+ */
+broker_status codes_check(const char *chat_id, const char *key, const char *answer);
+
+/**
+ * Get code statistics.
+ *
+ * @param stats     filled with current values
+ */
+void codes_get_stats(codes_stats *stats);
+
+#endif /* _TELEGRAM_AUTHENTICATOR_CODES_H_ */
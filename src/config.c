@@ -24,29 +24,55 @@
 #include <stdarg.h>
 #include <sys/stat.h>
 #include <pwd.h>
+#include <errno.h>
+#include <unistd.h>
 
+#include "arena.h"
 #include "config.h"
-#include <json-c/json.h>
+#include "config_cache.h"
+#include "json_scan.h"
+#include "store.h"
 
-#define CONFIG_FILE "/.telegram_authenticator"
+/* System-wide store consulted before user's config file, NULL to disable.
+ * Per thread, so concurrent PAM transactions can use different stores. */
+static __thread const char *store_path = STORE_FILE;
+
+/* Arena the configs read by this thread are allocated from, NULL for the heap */
+static __thread arena_t *config_arena;
 
 /**
- * Remove double quote
+ * Look up passwd entry of uid, reentrant.
  *
- * json_object_to_json_string() will return value with double quote, we need to strip it.
+ * @param uid   user uid
+ * @param pwd   filled with the entry, its strings point into *buf
+ * @param buf   allocated storage of the entry, free when no longer needed
  *
- * @param str
+ * @return  false   no such user or out of memory
+ *          true    pwd filled
  */
 static
-char *remove_double_quote(char *str)
+bool lookup_user(uid_t uid, struct passwd *pwd, char **buf)
 {
-        char *pr = str, *pw = str;
-        while (*pr) {
-                *pw = *pr++;
-                pw += (*pw != '"');
+        long size = sysconf(_SC_GETPW_R_SIZE_MAX);
+        size_t bufsize = (size > 0) ? (size_t) size : 1024;
+        struct passwd *result = NULL;
+
+        *buf = NULL;
+
+        /* getpwuid() is not reentrant, PAM module runs in threaded services */
+        for (;;) {
+                char *tmp = realloc(*buf, bufsize);
+                if (!tmp)
+                        break;
+                *buf = tmp;
+
+                int s = getpwuid_r(uid, pwd, *buf, bufsize, &result);
+                if (ERANGE != s || bufsize >= 1024 * 1024)
+                        break;
+                bufsize *= 2;
         }
-        *pw = '\0';
-        return str;
+
+        return result != NULL;
 }
 
 /**
@@ -56,26 +82,33 @@ char *remove_double_quote(char *str)
  * @param uid   user uid to find user home dir
  *
  * @return config file path
+ *         NULL     user's home directory not found
  */
 const char *config_file(uid_t uid)
 {
+        char *buf;
+        struct passwd pwd;
+        bool found = lookup_user(uid, &pwd, &buf);
+
         /* Find config file at user's home dir */
-        const char *home = getpwuid(uid)->pw_dir;
+        const char *home = found ? pwd.pw_dir : NULL;
         if (!home || '/' != *home) {
                 home = getenv("HOME");
                 if (!home || '/' != *home) {
                         fprintf(stderr, "Cannot determine user's home directory\n");
-                        exit(EXIT_FAILURE);
+                        free(buf);
+                        return NULL;
                 }
         }
 
         char *config = malloc(strlen(home) + strlen(CONFIG_FILE) + 1);
-        if (!config) {
+        if (config)
+                strcat(strcpy(config, home), CONFIG_FILE);
+        else
                 perror("malloc()");
-                exit(EXIT_FAILURE);
-        }
 
-        return strcat(strcpy(config, home), CONFIG_FILE);
+        free(buf);
+        return config;
 }
 
 
@@ -92,6 +125,9 @@ bool config_exists(uid_t uid)
         const char *config = config_file(uid);
         struct stat st;
 
+        if (!config)
+                return false;
+
         bool ret = false;
         if (0 == stat(config, &st))
                 ret = true;
@@ -101,6 +137,81 @@ bool config_exists(uid_t uid)
 }
 
 
+/**
+ * Replace file at path with content, owned by uid.
+ *
+ * Written to a temporary file renamed over path, so readers never see it half
+ * written, and chown()ed when running as root for somebody else, so the
+ * user keeps owning the config root wrote.
+ *
+ * @return  false   failed, error printed
+ *          true    file replaced
+ */
+static
+bool write_file(const char *path, uid_t uid, const char *content)
+{
+        char *tmp = malloc(strlen(path) + sizeof(".XXXXXX"));
+        if (!tmp) {
+                perror("malloc()");
+                return false;
+        }
+        strcat(strcpy(tmp, path), ".XXXXXX");
+
+        /* mkstemp() creates it 0600, the token is a secret */
+        int fd = mkstemp(tmp);
+        if (fd < 0) {
+                fprintf(stderr, "Cannot create %s: %s\n", tmp, strerror(errno));
+                free(tmp);
+                return false;
+        }
+
+        bool ok = true;
+        if (0 == geteuid() && 0 != uid) {
+                char *buf;
+                struct passwd pwd;
+                ok = lookup_user(uid, &pwd, &buf) && 0 == fchown(fd, uid, pwd.pw_gid);
+                free(buf);
+                if (!ok)
+                        fprintf(stderr, "Cannot chown %s to uid %d\n", tmp, (int) uid);
+        }
+
+        size_t len = strlen(content);
+        if (ok && write(fd, content, len) != (ssize_t) len) {
+                fprintf(stderr, "Cannot write %s: %s\n", tmp, strerror(errno));
+                ok = false;
+        }
+        if (0 != close(fd))
+                ok = false;
+
+        if (ok && 0 != rename(tmp, path)) {
+                fprintf(stderr, "Cannot rename %s to %s: %s\n", tmp, path, strerror(errno));
+                ok = false;
+        }
+        if (!ok)
+                unlink(tmp);
+
+        free(tmp);
+        return ok;
+}
+
+/* Write s as a JSON string, NULL as "" */
+static
+void write_json_string(FILE *f, const char *s)
+{
+        fputc('"', f);
+        for (; s && *s; s++) {
+                unsigned char c = *s;
+
+                if ('"' == c || '\\' == c)
+                        fprintf(f, "\\%c", c);
+                else if (c < 0x20)
+                        fprintf(f, "\\u%04x", c);
+                else
+                        fputc(c, f);
+        }
+        fputc('"', f);
+}
+
 /**
  * Update user's config file.
  * This function will write config in json format to ~/.telegram_authenticator.
@@ -108,90 +219,457 @@ bool config_exists(uid_t uid)
  * @param uid   user uid to find user home dir
  * @param token     telegram bot's token
  * @param chat_id   telegram room chat_id
+ * @param api_url   bot api server, NULL to keep current one
+ * @param mode      "code" or "approve", NULL to keep current one
  *
  */
-void config_write(uid_t uid, const char *token, const char *chat_id)
+bool config_write(uid_t uid, const char *token, const char *chat_id, const char *api_url,
+                  const char *mode)
 {
         config_t config = config_read(uid);
 
-        json_object *jobj = json_object_new_object();
-        json_object *jval;
+        if (!token)
+                token = config.token;
+
+        if(!chat_id)
+                chat_id = config.chat_id;
 
-        if (token)
-                config.token = (char *) token;
+        if (!api_url)
+                api_url = config.api_url;
 
-        if(chat_id)
-                config.chat_id = (char *) chat_id;
+        if (!mode)
+                mode = config_mode_name(config.mode);
 
-        jval = json_object_new_string(config.token);
-        json_object_object_add(jobj, "token", jval);
+        char *content = NULL;
+        size_t size = 0;
+        FILE *f = open_memstream(&content, &size);
+        if (!f) {
+                perror("open_memstream()");
+                config_free(config);
+                return false;
+        }
 
-        jval = json_object_new_string(config.chat_id);
-        json_object_object_add(jobj, "chat_id", jval);
+        fputs("{ \"token\": ", f);
+        write_json_string(f, token);
+        fputs(", \"chat_id\": ", f);
+        write_json_string(f, chat_id);
 
-        const char *filename = config_file(uid);
-        FILE *f = fopen(filename, "w");
-        if (NULL != f)
-                fputs(json_object_to_json_string(jobj), f);
+        if (api_url && *api_url) {
+                fputs(", \"api_url\": ", f);
+                write_json_string(f, api_url);
+        }
+
+        /* code is the default, keep files of code users as they were */
+        if (strcmp(mode, config_mode_name(CONFIG_MODE_CODE))) {
+                fputs(", \"mode\": ", f);
+                write_json_string(f, mode);
+        }
 
+        /* more chats are only set by editing the file, keep them */
+        if (config.nchats > 0) {
+                fputs(", \"chats\": [", f);
+                for (int i = 0; i < config.nchats; i++) {
+                        fputs(i ? ", { \"chat_id\": " : " { \"chat_id\": ", f);
+                        write_json_string(f, config.chats[i].chat_id);
+                        if (config.chats[i].token) {
+                                fputs(", \"token\": ", f);
+                                write_json_string(f, config.chats[i].token);
+                        }
+                        fputs(" }", f);
+                }
+                fputs(" ]", f);
+        }
+        if (config.quorum > 0)
+                fprintf(f, ", \"quorum\": %d", config.quorum);
+        fputs(" }", f);
         fclose(f);
+
+        const char *filename = config_file(uid);
+        bool ok = content && filename && write_file(filename, uid, content);
+
         free((char *)filename);
-        json_object_put(jobj);  /* free json object */
+        free(content);
+        config_free(config);
+        return ok;
+}
+
+/**
+ * Parse name of a login mode.
+ *
+ * @param name  "code" or "approve"
+ * @param mode  filled with the mode
+ *
+ * @return  false   unknown mode
+ *          true    mode filled
+ */
+bool config_mode_parse(const char *name, config_mode *mode)
+{
+        if (!strcmp(name, "code"))
+                *mode = CONFIG_MODE_CODE;
+        else if (!strcmp(name, "approve"))
+                *mode = CONFIG_MODE_APPROVE;
+        else
+                return false;
+
+        return true;
+}
+
+/**
+ * Name of a login mode, as written in config file.
+ *
+ * @param mode  login mode
+ *
+ * @return name of mode
+ */
+const char *config_mode_name(config_mode mode)
+{
+        return CONFIG_MODE_APPROVE == mode ? "approve" : "code";
+}
+
+/**
+ * Pack the extra chats of config as "chat_id\0token\0" pairs, an empty token
+ * for the config token, to keep them in the cache or the store.
+ *
+ * @param chats     chats of config
+ * @param nchats    number of chats
+ * @param buf       filled with the pairs
+ * @param size      size of buf
+ *
+ * @return bytes used, 0 for no chats, -1 if they don't fit
+ */
+int config_chats_pack(const config_chat *chats, int nchats, char *buf, size_t size)
+{
+        size_t len = 0;
+
+        for (int i = 0; i < nchats; i++) {
+                const char *token = chats[i].token ? chats[i].token : "";
+                size_t chat_id_len = strlen(chats[i].chat_id) + 1;
+                size_t token_len = strlen(token) + 1;
+
+                if (len + chat_id_len + token_len > size)
+                        return -1;
+                memcpy(buf + len, chats[i].chat_id, chat_id_len);
+                memcpy(buf + len + chat_id_len, token, token_len);
+                len += chat_id_len + token_len;
+        }
+
+        return len;
+}
+
+/**
+ * Fill the extra chats of config from config_chats_pack() output.
+ *
+ * @param cfg       config, its chats are replaced
+ * @param buf       packed chats
+ * @param len       bytes in buf
+ * @param nchats    number of chats in buf
+ *
+ * @return  false   buf malformed or out of memory, cfg has no chats
+ *          true    chats filled
+ */
+bool config_chats_unpack(config_t *cfg, const char *buf, size_t len, int nchats)
+{
+        const char *p = buf, *end = buf + len;
+        bool ok = nchats >= 0 && nchats <= CONFIG_MAX_CHATS;
+
+        cfg->nchats = 0;
+        while (ok && cfg->nchats < nchats) {
+                const char *chat_id = p;
+                const char *chat_id_end = memchr(chat_id, '\0', end - chat_id);
+                const char *token = chat_id_end ? chat_id_end + 1 : end;
+                const char *token_end = token < end ? memchr(token, '\0', end - token) : NULL;
+                if (!token_end || chat_id == chat_id_end) {
+                        ok = false;
+                        break;
+                }
+
+                config_chat *chat = &cfg->chats[cfg->nchats++];
+                chat->chat_id = config_strdup(cfg, chat_id);
+                chat->token = *token ? config_strdup(cfg, token) : NULL;
+                ok = chat->chat_id && (!*token || chat->token);
+                p = token_end + 1;
+        }
+
+        if (!ok) {
+                for (int i = 0; i < cfg->nchats; i++) {
+                        config_strfree(cfg, cfg->chats[i].chat_id);
+                        config_strfree(cfg, cfg->chats[i].token);
+                }
+                cfg->nchats = 0;
+        }
+        return ok;
+}
+
+/**
+ * Use system-wide credential store at path before looking into user's home.
+ * The setting only applies to the calling thread.
+ *
+ * @param path  store file, NULL to disable the store
+ */
+void config_set_store(const char *path)
+{
+        store_path = path;
+}
+
+/**
+ * Allocate the configs read by the calling thread from arena, until called
+ * again with NULL. config_free() then leaves their strings to the arena.
+ *
+ * @param arena     arena, NULL to allocate from the heap
+ */
+void config_set_arena(arena_t *arena)
+{
+        config_arena = arena;
+}
+
+/**
+ * Copy string for a config being filled, from the arena of the calling
+ * thread if it has one, see config_set_arena().
+ *
+ * @param cfg   config the string is for
+ * @param s     string to copy
+ *
+ * @return copy, NULL when out of memory
+ */
+char *config_strdup(config_t *cfg, const char *s)
+{
+        if (config_arena) {
+                cfg->arena = true;
+                return arena_strdup(config_arena, s);
+        }
+        return strdup(s);
+}
+
+/**
+ * Free string of a config, unless it belongs to an arena.
+ *
+ * @param cfg   config the string is of
+ * @param s     string from config_strdup(), may be NULL
+ */
+void config_strfree(const config_t *cfg, char *s)
+{
+        if (!cfg->arena)
+                free(s);
+}
+
+/* Config file being scanned */
+typedef struct {
+        config_t conf;
+        const char *path;
+        config_chat chat;               /* object in chats[] being scanned */
+        bool truncated;                 /* a value was longer than JSON_SCAN_MAX_VALUE */
+} config_reader;
+
+/* Add one more chat the code goes to, takes ownership of its strings */
+static
+void config_add_chat(config_reader *reader, char *chat_id, char *token)
+{
+        config_t *conf = &reader->conf;
+
+        if (!chat_id || conf->nchats >= CONFIG_MAX_CHATS) {
+                if (chat_id)
+                        fprintf(stderr, "ERROR: more than %d chats in %s, ignore %s.\n",
+                                CONFIG_MAX_CHATS, reader->path, chat_id);
+                config_strfree(conf, chat_id);
+                config_strfree(conf, token);
+                return;
+        }
+
+        conf->chats[conf->nchats].chat_id = chat_id;
+        conf->chats[conf->nchats].token = token;
+        conf->nchats++;
+}
+
+/* End of an object in chats[] */
+static
+void config_on_end(json_scanner *s, void *userdata)
+{
+        config_reader *reader = userdata;
+
+        if (strcmp(json_scan_path(s), "chats[]"))
+                return;
+
+        config_add_chat(reader, reader->chat.chat_id, reader->chat.token);
+        reader->chat.chat_id = reader->chat.token = NULL;
+}
+
+/* Top-level members of config file while it is scanned */
+static
+void config_on_value(json_scanner *s, json_scan_type type,
+                     const char *value, size_t len, void *userdata)
+{
+        config_reader *reader = userdata;
+        config_t *conf = &reader->conf;
+        const char *key = json_scan_path(s);
+        char **field = NULL;
+
+        /* cut to JSON_SCAN_MAX_VALUE, no token, url or chat_id that long is valid */
+        if (json_scan_truncated(s)) {
+                if (!reader->truncated)
+                        fprintf(stderr, "ERROR: value of %s in %s is longer than %d bytes.\n",
+                                key, reader->path, JSON_SCAN_MAX_VALUE);
+                reader->truncated = true;
+                return;
+        }
+
+        if (!strcmp(key, "token"))
+                field = &conf->token;
+        else if (!strcmp(key, "chat_id"))
+                field = &conf->chat_id;
+        else if (!strcmp(key, "api_url"))
+                field = &conf->api_url;
+        else if (!strcmp(key, "mode") && !config_mode_parse(value, &conf->mode))
+                fprintf(stderr, "ERROR: unknown mode \"%s\" in %s, use code.\n", value, reader->path);
+        else if (!strcmp(key, "quorum") && JSON_SCAN_NUMBER == type)
+                conf->quorum = atoi(value);
+        /* chats is a list of chat_ids, or of objects with a chat_id and a token */
+        else if (!strcmp(key, "chats[]") && JSON_SCAN_NULL != type)
+                config_add_chat(reader, config_strdup(conf, value), NULL);
+        else if (!strcmp(key, "chats[].chat_id"))
+                field = &reader->chat.chat_id;
+        else if (!strcmp(key, "chats[].token"))
+                field = &reader->chat.token;
+
+        /* null is as good as missing, optional api_url and token of a chat may be empty too */
+        if (!field || JSON_SCAN_NULL == type ||
+            ((field == &conf->api_url || field == &reader->chat.token) && 0 == len))
+                return;
+
+        config_strfree(conf, *field);
+        *field = config_strdup(conf, value);
+}
+
+/**
+ * Parse config file at path, return in config_t struct.
+ * The returned value should use config_free() when no longer needed.
+ *
+ * @param path  config file
+ * @param st    if not NULL, filled with stat of the file parsed
+ *
+ * @return config_t  file exist and config can parse
+ *         config_t  with NULL token and chat_id if file not exist or invalid
+ */
+config_t config_read_file(const char *path, struct stat *st)
+{
+        config_reader reader = { { NULL, NULL }, path, { NULL, NULL }, false };
+        config_t *conf = &reader.conf;
+        struct stat fst;
+
+        FILE *f = fopen(path, "r");
+        if (NULL == f)
+                return *conf;
+
+        /* scan as it is read, nothing but the values we keep is allocated */
+        json_scanner scanner;
+        json_scan_init(&scanner, config_on_value, config_on_end, &reader);
+
+        bool ok = 0 == fstat(fileno(f), &fst);
+        while (ok) {
+                char buf[1024];
+                size_t len = fread(buf, 1, sizeof(buf), f);
+                if (0 == len)
+                        break;
+                ok = json_scan_feed(&scanner, buf, len);
+        }
+        ok = ok && !ferror(f) && json_scan_finish(&scanner);
+        fclose(f);
+
+        /* left by an unfinished chats[] object */
+        config_strfree(conf, reader.chat.chat_id);
+        config_strfree(conf, reader.chat.token);
+
+        if (conf->quorum < 0 || conf->quorum > conf->nchats + 1) {
+                fprintf(stderr, "ERROR: quorum %d of %s is not between 0 and %d chats, use 0.\n",
+                        conf->quorum, path, conf->nchats + 1);
+                conf->quorum = 0;
+        }
+
+        if (!ok || reader.truncated || !conf->token || !conf->chat_id) {
+                config_free(*conf);
+                memset(conf, 0, sizeof(*conf));
+        } else if (st) {
+                *st = fst;
+        }
+
+        return *conf;
 }
 
 /**
  * Read usre's config file, return in config_t struct.
  * The returned value should use config_free() when no longer needed.
  *
+ * The system-wide store is checked first. Parsed configs are kept in
+ * CONFIG_CACHE_FILE, as long as the config file is not changed next read is
+ * served from the cache without parsing it again.
+ *
  * @param uid   user uid to find user home dir
  *
  * @return config_t  file exist and config can parse
- *         NULL      file not exist
+ *         config_t  with NULL token and chat_id if file not exist or invalid
  */
 config_t config_read(uid_t uid)
 {
-        config_t conf;
-        char *buf;
+        config_t conf = { NULL, NULL };
+
+        if (store_path && store_lookup_uid(store_path, uid, &conf))
+                return conf;
 
-        if (!config_exists(uid)) return conf;
+        /* fast path, already parsed and config file not changed */
+        if (config_cache_lookup(uid, &conf))
+                return conf;
 
         const char *config = config_file(uid);
-        FILE *f = fopen(config, "r");
-        if (NULL != f) {
-                /* get file size */
-                fseek(f, 0, SEEK_END);
-                long fsize = ftell(f);
-                rewind(f);
+        struct stat st;
 
-                buf = malloc(fsize + 1);
-                fread(buf, fsize, 1, f);
-        }
-        fclose(f);
-        free((char *)config);
+        if (!config)
+                return conf;
+
+        conf = config_read_file(config, &st);
+        if (conf.token)
+                config_cache_store(uid, config, &st, &conf);
 
-        /* parse json value */
-        struct json_object *root = json_tokener_parse(buf);
-        struct json_object *jobj;
+        free((char *)config);
+        return conf;
+}
 
-        json_object_object_get_ex(root, "token", &jobj);
-        conf.token = remove_double_quote((char *) json_object_to_json_string(jobj));
+/**
+ * Read user's config from the system-wide store by user name, without any
+ * passwd lookup.
+ * The returned value should use config_free() when no longer needed.
+ *
+ * @param name  user name
+ *
+ * @return config_t  user found in store
+ *         config_t  with NULL token and chat_id if not found
+ */
+config_t config_read_name(const char *name)
+{
+        config_t conf = { NULL, NULL };
 
-        json_object_object_get_ex(root, "chat_id", &jobj);
-        conf.chat_id = remove_double_quote((char *) json_object_to_json_string(jobj));
+        if (store_path)
+                store_lookup_name(store_path, name, &conf);
 
-        free(buf);
         return conf;
 }
 
 /**
- * Free the config_t structure.
+ * Free the config_t structure, strings allocated from an arena are left to it.
  *
  * @param cfg
  */
 void config_free(config_t cfg)
 {
+        if (cfg.arena)
+                return;
+
         if (cfg.token)   free(cfg.token);
         if (cfg.chat_id) free(cfg.chat_id);
+        if (cfg.api_url) free(cfg.api_url);
+
+        for (int i = 0; i < cfg.nchats; i++) {
+                free(cfg.chats[i].chat_id);
+                free(cfg.chats[i].token);
+        }
 }
 
 /**
@@ -207,7 +685,17 @@ void config_print(uid_t uid)
         printf("\n"
                "\t Bot Token: %s\n"
                "\t chat_id:   %s\n"
-               "\n", cfg.token, cfg.chat_id);
+               "\t API url:   %s\n"
+               "\t Mode:      %s\n", cfg.token, cfg.chat_id, cfg.api_url ? cfg.api_url : "default",
+               config_mode_name(cfg.mode));
+
+        for (int i = 0; i < cfg.nchats; i++)
+                printf("\t Also to:   %s%s%s\n", cfg.chats[i].chat_id,
+                       cfg.chats[i].token ? " with bot " : "",
+                       cfg.chats[i].token ? cfg.chats[i].token : "");
+        if (cfg.nchats > 0)
+                printf("\t Quorum:    %d of %d chats\n", cfg.quorum ? cfg.quorum : 1, cfg.nchats + 1);
+        printf("\n");
 
         config_free(cfg);
 }
\ No newline at end of file
@@ -23,10 +23,38 @@
 
 #include <stdbool.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+
+#include "arena.h"
+
+/* User's config file, relative to home dir */
+#define CONFIG_FILE "/.telegram_authenticator"
+
+/* How user confirms a login */
+typedef enum {
+        CONFIG_MODE_CODE = 0,   /* type the code sent to telegram */
+        CONFIG_MODE_APPROVE,    /* press Approve in telegram, code as fallback */
+} config_mode;
+
+/* Chats the code goes to besides chat_id, and the most bytes they take
+ * packed by config_chats_pack() */
+#define CONFIG_MAX_CHATS 8
+#define CONFIG_MAX_CHATS_PACKED 512
+
+typedef struct {
+        char *chat_id;
+        char *token;            /* bot sending to this chat, NULL for config token */
+} config_chat;
 
 typedef struct {
         char *token;            /* telegram bot token */
         char *chat_id;          /* telegram chat_id */
+        char *api_url;          /* user's own bot api server, NULL for host default */
+        config_mode mode;
+        config_chat chats[CONFIG_MAX_CHATS];    /* more chats the code goes to */
+        int nchats;
+        int quorum;             /* chats that must get the code, 0 for any one */
+        bool arena;             /* strings belong to an arena, see config_set_arena() */
 } config_t;
 
 
@@ -47,6 +75,7 @@ bool config_exists(uid_t uid);
  * @param uid   user uid to find user home dir
  *
  * @return config file path
+ *         NULL     user's home directory not found
  */
 const char *config_file(uid_t uid);
 
@@ -58,23 +87,137 @@ const char *config_file(uid_t uid);
  *
  * @param token     telegram bot's token
  * @param chat_id   telegram room chat_id
+ * @param api_url   bot api server, NULL to keep current one
+ * @param mode      "code" or "approve", NULL to keep current one
  *
+ * The file is replaced atomically, readable by the user only and owned by
+ * the user even when written by root.
+ *
+ * @return  false   failed to write, error printed
+ *          true    config written
  */
-void config_write(uid_t uid, const char *token, const char *chat_id);
+bool config_write(uid_t uid, const char *token, const char *chat_id, const char *api_url,
+                  const char *mode);
+
+/**
+ * Parse name of a login mode.
+ *
+ * @param name  "code" or "approve"
+ * @param mode  filled with the mode
+ *
+ * @return  false   unknown mode
+ *          true    mode filled
+ */
+bool config_mode_parse(const char *name, config_mode *mode);
+
+/**
+ * Name of a login mode, as written in config file.
+ *
+ * @param mode  login mode
+ *
+ * @return name of mode
+ */
+const char *config_mode_name(config_mode mode);
+
+/**
+ * Pack the extra chats of config as "chat_id\0token\0" pairs, an empty token
+ * for the config token, to keep them in the cache or the store.
+ *
+ * @param chats     chats of config
+ * @param nchats    number of chats
+ * @param buf       filled with the pairs
+ * @param size      size of buf
+ *
+ * @return bytes used, 0 for no chats, -1 if they don't fit
+ */
+int config_chats_pack(const config_chat *chats, int nchats, char *buf, size_t size);
+
+/**
+ * Fill the extra chats of config from config_chats_pack() output.
+ *
+ * @param cfg       config, its chats are replaced
+ * @param buf       packed chats
+ * @param len       bytes in buf
+ * @param nchats    number of chats in buf
+ *
+ * @return  false   buf malformed or out of memory, cfg has no chats
+ *          true    chats filled
+ */
+bool config_chats_unpack(config_t *cfg, const char *buf, size_t len, int nchats);
+
+/**
+ * Use system-wide credential store at path before looking into user's home.
+ * The setting only applies to the calling thread.
+ *
+ * @param path  store file, NULL to disable the store
+ */
+void config_set_store(const char *path);
+
+/**
+ * Allocate the configs read by the calling thread from arena, until called
+ * again with NULL. config_free() then leaves their strings to the arena.
+ *
+ * @param arena     arena, NULL to allocate from the heap
+ */
+void config_set_arena(arena_t *arena);
+
+/**
+ * Copy string for a config being filled, from the arena of the calling
+ * thread if it has one, see config_set_arena().
+ *
+ * @param cfg   config the string is for
+ * @param s     string to copy
+ *
+ * @return copy, NULL when out of memory
+ */
+char *config_strdup(config_t *cfg, const char *s);
+
+/**
+ * Free string of a config, unless it belongs to an arena.
+ *
+ * @param cfg   config the string is of
+ * @param s     string from config_strdup(), may be NULL
+ */
+void config_strfree(const config_t *cfg, char *s);
+
+/**
+ * Parse config file at path, return in config_t struct.
+ * The returned value should use config_free() when no longer needed.
+ *
+ * @param path  config file
+ * @param st    if not NULL, filled with stat of the file parsed
+ *
+ * @return config_t  file exist and config can parse
+ *         config_t  with NULL token and chat_id if file not exist or invalid
+ */
+config_t config_read_file(const char *path, struct stat *st);
 
 /**
  * Read usre's config file, return in config_t struct.
  * The returned value should use config_free() when no longer needed.
+ * The system-wide store is checked first, then user's home.
  *
  * @param uid   user uid to find user home dir
  *
  * @return config_t  file exist and config can parse
- *         NULL      file not exist
+ *         config_t  with NULL token and chat_id if file not exist or invalid
  */
 config_t config_read(uid_t uid);
 
 /**
- * Free the config_t structure.
+ * Read user's config from the system-wide store by user name, without any
+ * passwd lookup.
+ * The returned value should use config_free() when no longer needed.
+ *
+ * @param name  user name
+ *
+ * @return config_t  user found in store
+ *         config_t  with NULL token and chat_id if not found
+ */
+config_t config_read_name(const char *name);
+
+/**
+ * Free the config_t structure, strings allocated from an arena are left to it.
  *
  * @param cfg
  */
@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Compiled config cache.
+ *
+ * The cache file is a fixed size table of slots keyed by uid with linear
+ * probing. Each slot holds the already parsed config values, plus the path
+ * and stat identity of the config file they came from. A hit only costs one
+ * stat() on the config file: no passwd lookup, no read and no json parsing.
+ *
+ * Readers never lock, each slot carries a sequence number which is odd while
+ * a writer is updating it (seqlock). Writers serialize with flock().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "config_cache.h"
+#include "mapfile.h"
+
+#define CACHE_MAGIC   0x43414754        /* "TGAC" */
+#define CACHE_VERSION 4
+#define CACHE_SLOTS   4096              /* must be power of 2 */
+#define CACHE_PROBE   8                 /* max slots we look at for one uid */
+
+#define CACHE_MAX_PATH    256
+#define CACHE_MAX_TOKEN   128
+#define CACHE_MAX_CHAT_ID 64
+#define CACHE_MAX_API_URL 255
+
+typedef struct {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t nslots;
+        uint32_t reserved;
+} cache_header;
+
+typedef struct {
+        uint32_t seq;                   /* odd while being written */
+        uint32_t used;
+        uint32_t uid;
+        uint32_t mode;                  /* config_mode */
+        uint16_t nchats;
+        uint16_t quorum;
+        uint32_t chats_len;             /* bytes used in chats */
+        /* identity of the config file */
+        uint64_t dev;
+        uint64_t ino;
+        int64_t  size;
+        int64_t  mtime_sec;
+        int64_t  mtime_nsec;
+        int64_t  ctime_sec;             /* unlike mtime, can't be set by the owner */
+        int64_t  ctime_nsec;
+        char path[CACHE_MAX_PATH];
+        char token[CACHE_MAX_TOKEN + 1];
+        char chat_id[CACHE_MAX_CHAT_ID + 1];
+        char api_url[CACHE_MAX_API_URL + 1];    /* empty for host default */
+        char chats[CONFIG_MAX_CHATS_PACKED];    /* config_chats_pack() */
+} cache_slot;
+
+typedef struct {
+        cache_header header;
+        cache_slot slots[CACHE_SLOTS];
+} cache_file;
+
+static struct {
+        pthread_mutex_t lock;
+        bool tried;                     /* don't retry opening on every call */
+        const char *path;               /* NULL: cache disabled */
+        mapfile_t map;
+} cache = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .path = CONFIG_CACHE_FILE,
+        .map  = { .fd = -1 },
+};
+
+/**
+ * Use another cache file, e.g. for benchmarks. Set it once at startup,
+ * before the cache is used.
+ *
+ * @param path  cache file, NULL to disable the cache
+ */
+void config_cache_set_file(const char *path)
+{
+        pthread_mutex_lock(&cache.lock);
+        cache.path = path;
+        pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ * Map the cache file once per process.
+ *
+ * @return cache file, NULL if we can't use the cache
+ */
+static
+cache_file *cache_open(void)
+{
+        pthread_mutex_lock(&cache.lock);
+        if (!cache.tried && cache.path) {
+                cache.tried = true;
+
+                /* only root may create the cache, it holds everyone's token */
+                if (mapfile_open(&cache.map, cache.path, sizeof(cache_file), 0 == geteuid())) {
+                        cache_file *file = cache.map.addr;
+
+                        mapfile_lock(&cache.map);
+                        if (CACHE_MAGIC != file->header.magic ||
+                            CACHE_VERSION != file->header.version ||
+                            CACHE_SLOTS != file->header.nslots) {
+                                memset(file, 0, sizeof(*file));
+                                file->header.magic = CACHE_MAGIC;
+                                file->header.version = CACHE_VERSION;
+                                file->header.nslots = CACHE_SLOTS;
+                        }
+                        mapfile_unlock(&cache.map);
+                }
+        }
+        pthread_mutex_unlock(&cache.lock);
+
+        return cache.map.addr;
+}
+
+static inline
+uint32_t slot_index(uid_t uid, uint32_t probe)
+{
+        /* Knuth multiplicative hash */
+        return ((uint32_t) uid * 2654435761u + probe) & (CACHE_SLOTS - 1);
+}
+
+/**
+ * Take a consistent copy of slot, retry while a writer is updating it.
+ *
+ * @return  false   slot kept changing (or its writer died), treat as a miss
+ *          true    copy is consistent
+ */
+static
+bool slot_read(const cache_slot *slot, cache_slot *copy)
+{
+        for (int retry = 0; retry < 1000; retry++) {
+                uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+                if (seq & 1)
+                        continue;
+
+                memcpy(copy, slot, sizeof(*copy));
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+                if (seq == __atomic_load_n(&slot->seq, __ATOMIC_RELAXED))
+                        return true;
+        }
+        return false;
+}
+
+static
+bool same_file(const cache_slot *slot, const struct stat *st)
+{
+        return slot->dev == (uint64_t) st->st_dev &&
+                slot->ino == (uint64_t) st->st_ino &&
+                slot->size == (int64_t) st->st_size &&
+                slot->mtime_sec == (int64_t) st->st_mtim.tv_sec &&
+                slot->mtime_nsec == (int64_t) st->st_mtim.tv_nsec &&
+                slot->ctime_sec == (int64_t) st->st_ctim.tv_sec &&
+                slot->ctime_nsec == (int64_t) st->st_ctim.tv_nsec;
+}
+
+/**
+ * Find user's parsed config in cache. The entry is only used when the config
+ * file it was parsed from still has the same inode, size, mtime and ctime.
+ * The returned value should use config_free() when no longer needed.
+ *
+ * @param uid   user uid
+ * @param cfg   config to fill when found
+ *
+ * @return  false   not cached, or config file changed
+ *          true    cfg filled from cache
+ */
+bool config_cache_lookup(uid_t uid, config_t *cfg)
+{
+        cache_file *file = cache_open();
+        if (!file)
+                return false;
+
+        cache_slot slot;
+        for (uint32_t probe = 0; probe < CACHE_PROBE; probe++) {
+                if (!slot_read(&file->slots[slot_index(uid, probe)], &slot))
+                        return false;
+                if (!slot.used)
+                        return false;
+                if (slot.uid == uid)
+                        break;
+        }
+
+        if (!slot.used || slot.uid != uid)
+                return false;
+
+        /* config file changed or removed since it was cached */
+        struct stat st;
+        slot.path[CACHE_MAX_PATH - 1] = '\0';
+        if (stat(slot.path, &st) < 0 || !same_file(&slot, &st))
+                return false;
+
+        slot.token[CACHE_MAX_TOKEN] = '\0';
+        slot.chat_id[CACHE_MAX_CHAT_ID] = '\0';
+        slot.api_url[CACHE_MAX_API_URL] = '\0';
+
+        cfg->token = config_strdup(cfg, slot.token);
+        cfg->chat_id = config_strdup(cfg, slot.chat_id);
+        cfg->api_url = slot.api_url[0] ? config_strdup(cfg, slot.api_url) : NULL;
+        cfg->mode = CONFIG_MODE_APPROVE == slot.mode ? CONFIG_MODE_APPROVE : CONFIG_MODE_CODE;
+        cfg->quorum = slot.quorum;
+        if (!cfg->token || !cfg->chat_id || (slot.api_url[0] && !cfg->api_url) ||
+            slot.chats_len > sizeof(slot.chats) ||
+            !config_chats_unpack(cfg, slot.chats, slot.chats_len, slot.nchats)) {
+                config_free(*cfg);
+                memset(cfg, 0, sizeof(*cfg));
+                return false;
+        }
+
+        return true;
+}
+
+/**
+ * Store user's parsed config in cache. Only root can update the cache.
+ *
+ * @param uid   user uid
+ * @param path  config file the config parsed from
+ * @param st    stat of config file when it was read
+ * @param cfg   parsed config
+ */
+void config_cache_store(uid_t uid, const char *path, const struct stat *st, const config_t *cfg)
+{
+        char chats[CONFIG_MAX_CHATS_PACKED];
+        int chats_len = config_chats_pack(cfg->chats, cfg->nchats, chats, sizeof(chats));
+
+        if (chats_len < 0 ||
+            strlen(path) >= CACHE_MAX_PATH ||
+            strlen(cfg->token) > CACHE_MAX_TOKEN ||
+            strlen(cfg->chat_id) > CACHE_MAX_CHAT_ID ||
+            (cfg->api_url && strlen(cfg->api_url) > CACHE_MAX_API_URL))
+                return;
+
+        cache_file *file = cache_open();
+        if (!file)
+                return;
+
+        mapfile_lock(&cache.map);
+
+        /* reuse user's slot or take a free one, evict the first slot if all taken */
+        cache_slot *slot = &file->slots[slot_index(uid, 0)];
+        for (uint32_t probe = 0; probe < CACHE_PROBE; probe++) {
+                cache_slot *s = &file->slots[slot_index(uid, probe)];
+                if (!s->used || s->uid == uid) {
+                        slot = s;
+                        break;
+                }
+        }
+
+        /* a writer died in the middle of update, the slot is garbage anyway */
+        if (slot->seq & 1)
+                slot->seq++;
+
+        __atomic_add_fetch(&slot->seq, 1, __ATOMIC_ACQ_REL);   /* odd: writing */
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        slot->used = 1;
+        slot->uid = uid;
+        slot->mode = cfg->mode;
+        slot->nchats = cfg->nchats;
+        slot->quorum = cfg->quorum;
+        slot->chats_len = chats_len;
+        slot->dev = st->st_dev;
+        slot->ino = st->st_ino;
+        slot->size = st->st_size;
+        slot->mtime_sec = st->st_mtim.tv_sec;
+        slot->mtime_nsec = st->st_mtim.tv_nsec;
+        slot->ctime_sec = st->st_ctim.tv_sec;
+        slot->ctime_nsec = st->st_ctim.tv_nsec;
+        strncpy(slot->path, path, sizeof(slot->path));
+        strncpy(slot->token, cfg->token, sizeof(slot->token));
+        strncpy(slot->chat_id, cfg->chat_id, sizeof(slot->chat_id));
+        strncpy(slot->api_url, cfg->api_url ? cfg->api_url : "", sizeof(slot->api_url));
+        memcpy(slot->chats, chats, chats_len);
+
+        __atomic_add_fetch(&slot->seq, 1, __ATOMIC_RELEASE);   /* even: done */
+
+        mapfile_unlock(&cache.map);
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _TELEGRAM_AUTHENTICATOR_CONFIG_CACHE_H_
+#define _TELEGRAM_AUTHENTICATOR_CONFIG_CACHE_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "config.h"
+
+/* Parsed configs of all users, shared by every process loading the PAM module */
+#define CONFIG_CACHE_FILE "/var/cache/telegram-authenticator/config.cache"
+
+/**
+ * Use another cache file, e.g. for benchmarks. Set it once at startup,
+ * before the cache is used.
+ *
+ * @param path  cache file, NULL to disable the cache
+ */
+void config_cache_set_file(const char *path);
+
+/**
+ * Find user's parsed config in cache. The entry is only used when the config
+ * file it was parsed from still has the same inode, size, mtime and ctime.
+ * The returned value should use config_free() when no longer needed.
+ *
+ * @param uid   user uid
+ * @param cfg   config to fill when found
+ *
+ * @return  false   not cached, or config file changed
+ *          true    cfg filled from cache
+ */
+bool config_cache_lookup(uid_t uid, config_t *cfg);
+
+/**
+ * Store user's parsed config in cache. Only root can update the cache.
+ *
+ * @param uid   user uid
+ * @param path  config file the config parsed from
+ * @param st    stat of config file when it was read
+ * @param cfg   parsed config
+ */
+void config_cache_store(uid_t uid, const char *path, const struct stat *st, const config_t *cfg);
+
+#endif /* _TELEGRAM_AUTHENTICATOR_CONFIG_CACHE_H_ */
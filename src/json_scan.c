@@ -0,0 +1,431 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+
+#include "json_scan.h"
+
+enum {
+        S_VALUE,                /* expect a value */
+        S_VALUE_OR_END,         /* just after '[' */
+        S_KEY_OR_END,           /* just after '{' */
+        S_KEY,                  /* after ',' in object */
+        S_COLON,
+        S_AFTER_VALUE,          /* expect ',' or end of container */
+        S_STRING,
+        S_ESCAPE,
+        S_UNICODE,
+        S_NUMBER,
+        S_LITERAL,
+        S_DONE,                 /* root value complete */
+        S_ERROR,
+};
+
+static inline
+bool is_space(char c)
+{
+        return ' ' == c || '\t' == c || '\n' == c || '\r' == c;
+}
+
+static inline
+bool is_digit(char c)
+{
+        return c >= '0' && c <= '9';
+}
+
+static inline
+int hex_value(char c)
+{
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+}
+
+static
+void path_append(json_scanner *s, const char *str, size_t len)
+{
+        /* too deep for us, make sure nobody matches this path */
+        if (s->path_len + len > JSON_SCAN_MAX_PATH) {
+                str = "#";
+                len = 1;
+                if (s->path_len + len > JSON_SCAN_MAX_PATH + 1)
+                        return;
+        }
+
+        memcpy(s->path + s->path_len, str, len);
+        s->path_len += len;
+        s->path[s->path_len] = '\0';
+}
+
+static
+void path_truncate(json_scanner *s, size_t len)
+{
+        s->path_len = len;
+        s->path[len] = '\0';
+}
+
+static inline
+void value_append(json_scanner *s, char c)
+{
+        if (s->value_len < JSON_SCAN_MAX_VALUE)
+                s->value[s->value_len++] = c;
+        else
+                s->truncated = true;
+}
+
+static
+void value_append_utf8(json_scanner *s, unsigned int cp)
+{
+        if (cp < 0x80) {
+                value_append(s, cp);
+        } else if (cp < 0x800) {
+                value_append(s, 0xC0 | (cp >> 6));
+                value_append(s, 0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+                value_append(s, 0xE0 | (cp >> 12));
+                value_append(s, 0x80 | ((cp >> 6) & 0x3F));
+                value_append(s, 0x80 | (cp & 0x3F));
+        } else {
+                value_append(s, 0xF0 | (cp >> 18));
+                value_append(s, 0x80 | ((cp >> 12) & 0x3F));
+                value_append(s, 0x80 | ((cp >> 6) & 0x3F));
+                value_append(s, 0x80 | (cp & 0x3F));
+        }
+}
+
+static
+void value_start(json_scanner *s, bool in_key)
+{
+        s->in_key = in_key;
+        s->truncated = false;
+        s->value_len = 0;
+        s->high_surrogate = 0;
+}
+
+static
+void value_emit(json_scanner *s, json_scan_type type)
+{
+        s->value[s->value_len] = '\0';
+        if (s->on_value)
+                s->on_value(s, type, s->value, s->value_len, s->userdata);
+}
+
+static inline
+void value_done(json_scanner *s)
+{
+        s->state = (0 == s->depth) ? S_DONE : S_AFTER_VALUE;
+}
+
+static
+bool push(json_scanner *s, bool is_array)
+{
+        if (s->depth >= JSON_SCAN_MAX_DEPTH)
+                return false;
+
+        s->stack[s->depth].is_array = is_array;
+        s->stack[s->depth].path_len = s->path_len;
+        s->depth++;
+
+        if (is_array) {
+                path_append(s, "[]", 2);
+                s->state = S_VALUE_OR_END;
+        } else {
+                s->state = S_KEY_OR_END;
+        }
+
+        return true;
+}
+
+static
+void pop(json_scanner *s)
+{
+        s->depth--;
+        path_truncate(s, s->stack[s->depth].path_len);
+
+        if (s->on_end)
+                s->on_end(s, s->userdata);
+
+        value_done(s);
+}
+
+/* Key string complete, path becomes container path + key */
+static
+void set_key(json_scanner *s)
+{
+        path_truncate(s, s->stack[s->depth - 1].path_len);
+        if (s->path_len)
+                path_append(s, ".", 1);
+
+        if (s->truncated)
+                path_append(s, "#", 1);
+        else
+                path_append(s, s->value, s->value_len);
+}
+
+static
+bool literal_emit(json_scanner *s)
+{
+        s->value[s->value_len] = '\0';
+
+        if (!strcmp(s->value, "true"))
+                value_emit(s, JSON_SCAN_TRUE);
+        else if (!strcmp(s->value, "false"))
+                value_emit(s, JSON_SCAN_FALSE);
+        else if (!strcmp(s->value, "null"))
+                value_emit(s, JSON_SCAN_NULL);
+        else
+                return false;
+
+        return true;
+}
+
+/**
+ * Start a value beginning with c.
+ */
+static
+bool value_begin(json_scanner *s, char c)
+{
+        switch (c) {
+        case '{':
+                return push(s, false);
+        case '[':
+                return push(s, true);
+        case '"':
+                value_start(s, false);
+                s->state = S_STRING;
+                return true;
+        case 't':
+        case 'f':
+        case 'n':
+                value_start(s, false);
+                value_append(s, c);
+                s->state = S_LITERAL;
+                return true;
+        default:
+                if ('-' == c || is_digit(c)) {
+                        value_start(s, false);
+                        value_append(s, c);
+                        s->state = S_NUMBER;
+                        return true;
+                }
+                return false;
+        }
+}
+
+/**
+ * Prepare scanner for a new document.
+ *
+ * @param s         scanner
+ * @param on_value  called for every scalar value
+ * @param on_end    called when object or array closed, can be NULL
+ * @param userdata  passed to callbacks
+ */
+void json_scan_init(json_scanner *s, json_scan_value_cb on_value,
+                    json_scan_end_cb on_end, void *userdata)
+{
+        s->state = S_VALUE;
+        s->depth = 0;
+        s->path_len = 0;
+        s->path[0] = '\0';
+        s->on_value = on_value;
+        s->on_end = on_end;
+        s->userdata = userdata;
+        value_start(s, false);
+}
+
+/**
+ * Feed next chunk of document.
+ *
+ * @param s     scanner
+ * @param buf   chunk
+ * @param len   chunk length
+ *
+ * @return  false   syntax error, the rest of document is ignored
+ *          true    chunk scanned
+ */
+bool json_scan_feed(json_scanner *s, const char *buf, size_t len)
+{
+        for (size_t i = 0; i < len && S_ERROR != s->state; i++) {
+                char c = buf[i];
+        again:
+                switch (s->state) {
+                case S_VALUE:
+                case S_VALUE_OR_END:
+                        if (is_space(c))
+                                break;
+                        if (']' == c && S_VALUE_OR_END == s->state) {
+                                pop(s);
+                                break;
+                        }
+                        if (!value_begin(s, c))
+                                s->state = S_ERROR;
+                        break;
+
+                case S_KEY_OR_END:
+                case S_KEY:
+                        if (is_space(c))
+                                break;
+                        if ('}' == c && S_KEY_OR_END == s->state) {
+                                pop(s);
+                        } else if ('"' == c) {
+                                value_start(s, true);
+                                s->state = S_STRING;
+                        } else {
+                                s->state = S_ERROR;
+                        }
+                        break;
+
+                case S_COLON:
+                        if (is_space(c))
+                                break;
+                        s->state = (':' == c) ? S_VALUE : S_ERROR;
+                        break;
+
+                case S_AFTER_VALUE:
+                        if (is_space(c))
+                                break;
+                        if (',' == c)
+                                s->state = s->stack[s->depth - 1].is_array ? S_VALUE : S_KEY;
+                        else if ((s->stack[s->depth - 1].is_array ? ']' : '}') == c)
+                                pop(s);
+                        else
+                                s->state = S_ERROR;
+                        break;
+
+                case S_STRING:
+                        if ('"' == c) {
+                                if (s->in_key) {
+                                        set_key(s);
+                                        s->state = S_COLON;
+                                } else {
+                                        value_emit(s, JSON_SCAN_STRING);
+                                        value_done(s);
+                                }
+                        } else if ('\\' == c) {
+                                s->state = S_ESCAPE;
+                        } else if ((unsigned char) c < 0x20) {
+                                s->state = S_ERROR;
+                        } else {
+                                value_append(s, c);
+                        }
+                        break;
+
+                case S_ESCAPE:
+                        s->state = S_STRING;
+                        switch (c) {
+                        case '"':  value_append(s, '"');  break;
+                        case '\\': value_append(s, '\\'); break;
+                        case '/':  value_append(s, '/');  break;
+                        case 'b':  value_append(s, '\b'); break;
+                        case 'f':  value_append(s, '\f'); break;
+                        case 'n':  value_append(s, '\n'); break;
+                        case 'r':  value_append(s, '\r'); break;
+                        case 't':  value_append(s, '\t'); break;
+                        case 'u':
+                                s->unicode = 0;
+                                s->unicode_digits = 0;
+                                s->state = S_UNICODE;
+                                break;
+                        default:
+                                s->state = S_ERROR;
+                                break;
+                        }
+                        break;
+
+                case S_UNICODE: {
+                        int h = hex_value(c);
+                        if (h < 0) {
+                                s->state = S_ERROR;
+                                break;
+                        }
+
+                        s->unicode = (s->unicode << 4) | h;
+                        if (++s->unicode_digits < 4)
+                                break;
+
+                        unsigned int cp = s->unicode;
+                        if (cp >= 0xD800 && cp <= 0xDBFF) {
+                                /* wait for low surrogate in next \uXXXX */
+                                s->high_surrogate = cp;
+                        } else if (cp >= 0xDC00 && cp <= 0xDFFF) {
+                                if (s->high_surrogate)
+                                        value_append_utf8(s, 0x10000 + ((s->high_surrogate - 0xD800) << 10) + (cp - 0xDC00));
+                                s->high_surrogate = 0;
+                        } else {
+                                value_append_utf8(s, cp);
+                        }
+                        s->state = S_STRING;
+                        break;
+                }
+
+                case S_NUMBER:
+                        if (is_digit(c) || '+' == c || '-' == c || '.' == c || 'e' == c || 'E' == c) {
+                                value_append(s, c);
+                                break;
+                        }
+                        value_emit(s, JSON_SCAN_NUMBER);
+                        value_done(s);
+                        goto again;
+
+                case S_LITERAL:
+                        if (c >= 'a' && c <= 'z') {
+                                value_append(s, c);
+                                break;
+                        }
+                        if (!literal_emit(s)) {
+                                s->state = S_ERROR;
+                                break;
+                        }
+                        value_done(s);
+                        goto again;
+
+                case S_DONE:
+                        if (!is_space(c))
+                                s->state = S_ERROR;
+                        break;
+                }
+        }
+
+        return S_ERROR != s->state;
+}
+
+/**
+ * End of input.
+ *
+ * @param s     scanner
+ *
+ * @return  false   document incomplete or has syntax error
+ *          true    one complete document scanned
+ */
+bool json_scan_finish(json_scanner *s)
+{
+        /* a number or literal at root is only terminated by end of input */
+        if (0 == s->depth) {
+                if (S_NUMBER == s->state) {
+                        value_emit(s, JSON_SCAN_NUMBER);
+                        s->state = S_DONE;
+                } else if (S_LITERAL == s->state) {
+                        s->state = literal_emit(s) ? S_DONE : S_ERROR;
+                }
+        }
+
+        return S_DONE == s->state;
+}
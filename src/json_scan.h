@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _TELEGRAM_AUTHENTICATOR_JSON_SCAN_H_
+#define _TELEGRAM_AUTHENTICATOR_JSON_SCAN_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Incremental JSON scanner.
+ *
+ * Input can be fed in chunks of any size, every scalar value is reported to a
+ * callback together with its path from the root, e.g. "result[].message.chat.id".
+ * Array elements are written as "[]". Nothing is allocated, memory used is the
+ * size of json_scanner no matter how large the document is; longer strings are
+ * truncated to JSON_SCAN_MAX_VALUE bytes.
+ */
+
+#define JSON_SCAN_MAX_DEPTH 32
+#define JSON_SCAN_MAX_PATH  128
+#define JSON_SCAN_MAX_VALUE 1024
+
+typedef enum {
+        JSON_SCAN_STRING,
+        JSON_SCAN_NUMBER,
+        JSON_SCAN_TRUE,
+        JSON_SCAN_FALSE,
+        JSON_SCAN_NULL,
+} json_scan_type;
+
+typedef struct json_scanner json_scanner;
+
+/**
+ * Called for every scalar value, json_scan_path() is the path of the value.
+ *
+ * @param s         scanner
+ * @param type      value type
+ * @param value     unescaped string, or number/literal text. NUL terminated.
+ * @param len       length of value
+ * @param userdata  userdata passed to json_scan_init()
+ */
+typedef void (*json_scan_value_cb)(json_scanner *s, json_scan_type type,
+                                   const char *value, size_t len, void *userdata);
+
+/**
+ * Called when an object or array is closed, json_scan_path() is the path of the
+ * container itself. Can be NULL.
+ */
+typedef void (*json_scan_end_cb)(json_scanner *s, void *userdata);
+
+struct json_scanner {
+        int state;
+        int depth;
+        bool in_key;
+        bool truncated;                         /* current value was truncated */
+        unsigned int unicode;                   /* \uXXXX being decoded */
+        int unicode_digits;
+        unsigned int high_surrogate;
+        struct {
+                bool is_array;
+                size_t path_len;                /* path length of the container */
+        } stack[JSON_SCAN_MAX_DEPTH];
+        char path[JSON_SCAN_MAX_PATH + 2];
+        size_t path_len;
+        char value[JSON_SCAN_MAX_VALUE + 1];
+        size_t value_len;
+        json_scan_value_cb on_value;
+        json_scan_end_cb on_end;
+        void *userdata;
+};
+
+/**
+ * Prepare scanner for a new document.
+ *
+ * @param s         scanner
+ * @param on_value  called for every scalar value
+ * @param on_end    called when object or array closed, can be NULL
+ * @param userdata  passed to callbacks
+ */
+void json_scan_init(json_scanner *s, json_scan_value_cb on_value,
+                    json_scan_end_cb on_end, void *userdata);
+
+/**
+ * Feed next chunk of document.
+ *
+ * @param s     scanner
+ * @param buf   chunk
+ * @param len   chunk length
+ *
+ * @return  false   syntax error, the rest of document is ignored
+ *          true    chunk scanned
+ */
+bool json_scan_feed(json_scanner *s, const char *buf, size_t len);
+
+/**
+ * End of input.
+ *
+ * @param s     scanner
+ *
+ * @return  false   document incomplete or has syntax error
+ *          true    one complete document scanned
+ */
+bool json_scan_finish(json_scanner *s);
+
+/**
+ * Path of current value, valid inside callbacks.
+ *
+ * @param s     scanner
+ *
+ * @return path like "result[].message.chat.id", "" for root value
+ */
+static inline
+const char *json_scan_path(const json_scanner *s)
+{
+        return s->path;
+}
+
+/**
+ * Whether current string value was longer than JSON_SCAN_MAX_VALUE and truncated.
+ *
+ * @param s     scanner
+ */
+static inline
+bool json_scan_truncated(const json_scanner *s)
+{
+        return s->truncated;
+}
+
+#endif /* _TELEGRAM_AUTHENTICATOR_JSON_SCAN_H_ */
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mapfile.h"
+
+/**
+ * Create parent directory of path, only root can access it.
+ */
+static
+void make_parent_dir(const char *path)
+{
+        char *dup = strdup(path);
+        if (!dup)
+                return;
+
+        mkdir(dirname(dup), 0700);
+        free(dup);
+}
+
+/**
+ * Map a root-owned file shared between processes.
+ * New file is created with mode 0600 and zero filled.
+ *
+ * @param m         mapping to fill
+ * @param path      file path, parent directory is created if needed
+ * @param size      size of mapping
+ * @param create    create the file if not exists
+ *
+ * @return  false   failed to open or map the file
+ *          true    file mapped
+ */
+bool mapfile_open(mapfile_t *m, const char *path, size_t size, bool create)
+{
+        int flags = O_RDWR | O_CLOEXEC | O_NOFOLLOW;
+
+        if (create) {
+                make_parent_dir(path);
+                flags |= O_CREAT;
+        }
+
+        int fd = open(path, flags, 0600);
+        if (fd < 0)
+                return false;
+
+        /* never trust a file other users can write */
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_uid != geteuid() || (st.st_mode & 022)) {
+                close(fd);
+                return false;
+        }
+
+        /* new or truncated file, extend it. New space reads back as zero */
+        if ((size_t) st.st_size < size) {
+                flock(fd, LOCK_EX);
+                if (fstat(fd, &st) < 0 ||
+                    ((size_t) st.st_size < size && ftruncate(fd, size) < 0)) {
+                        flock(fd, LOCK_UN);
+                        close(fd);
+                        return false;
+                }
+                flock(fd, LOCK_UN);
+        }
+
+        void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (MAP_FAILED == addr) {
+                close(fd);
+                return false;
+        }
+
+        m->addr = addr;
+        m->size = size;
+        m->fd = fd;
+        pthread_mutex_init(&m->lock, NULL);
+
+        return true;
+}
+
+/**
+ * Take exclusive lock of the file, used by writers. Excludes other processes
+ * and other threads of this process.
+ *
+ * @param m     mapping returned by mapfile_open()
+ */
+void mapfile_lock(mapfile_t *m)
+{
+        pthread_mutex_lock(&m->lock);
+        while (flock(m->fd, LOCK_EX) < 0 && EINTR == errno)
+                ;
+}
+
+/**
+ * Release lock taken by mapfile_lock().
+ *
+ * @param m     mapping returned by mapfile_open()
+ */
+void mapfile_unlock(mapfile_t *m)
+{
+        flock(m->fd, LOCK_UN);
+        pthread_mutex_unlock(&m->lock);
+}
+
+/**
+ * Unmap and close the file.
+ *
+ * @param m     mapping returned by mapfile_open()
+ */
+void mapfile_close(mapfile_t *m)
+{
+        if (m->addr)
+                munmap(m->addr, m->size);
+        if (m->fd >= 0) {
+                close(m->fd);
+                pthread_mutex_destroy(&m->lock);
+        }
+
+        m->addr = NULL;
+        m->size = 0;
+        m->fd = -1;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _TELEGRAM_AUTHENTICATOR_MAPFILE_H_
+#define _TELEGRAM_AUTHENTICATOR_MAPFILE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+typedef struct {
+        void *addr;             /* mapped memory, shared with other processes */
+        size_t size;
+        int fd;
+        pthread_mutex_t lock;   /* flock() doesn't exclude threads sharing fd */
+} mapfile_t;
+
+/**
+ * Map a root-owned file shared between processes.
+ * New file is created with mode 0600 and zero filled.
+ *
+ * @param m         mapping to fill
+ * @param path      file path, parent directory is created if needed
+ * @param size      size of mapping
+ * @param create    create the file if not exists
+ *
+ * @return  false   failed to open or map the file
+ *          true    file mapped
+ */
+bool mapfile_open(mapfile_t *m, const char *path, size_t size, bool create);
+
+/**
+ * Take exclusive lock of the file, used by writers. Excludes other processes
+ * and other threads of this process.
+ *
+ * @param m     mapping returned by mapfile_open()
+ */
+void mapfile_lock(mapfile_t *m);
+
+/**
+ * Release lock taken by mapfile_lock().
+ *
+ * @param m     mapping returned by mapfile_open()
+ */
+void mapfile_unlock(mapfile_t *m);
+
+/**
+ * Unmap and close the file.
+ *
+ * @param m     mapping returned by mapfile_open()
+ */
+void mapfile_close(mapfile_t *m);
+
+#endif /* _TELEGRAM_AUTHENTICATOR_MAPFILE_H_ */
@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Timing histograms and counters.
+ *
+ * Everything lives in one small file mapped by every process, updated with
+ * atomic adds so no process ever waits for another. Processes which can't map
+ * the file (not root) count into memory of their own instead.
+ *
+ * Buckets are not cumulative in the file, they are summed up on export.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "mapfile.h"
+#include "metrics.h"
+
+#define METRICS_MAGIC   0x4d414754      /* "TGAM" */
+#define METRICS_VERSION 1
+
+/* Upper bounds of histogram buckets in seconds, the last one is +Inf */
+static const double bucket_bounds[] = {
+        0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+        0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60,
+};
+
+#define METRICS_BUCKETS (sizeof(bucket_bounds) / sizeof(bucket_bounds[0]) + 1)
+
+typedef struct {
+        uint64_t buckets[METRICS_BUCKETS];
+        uint64_t count;
+        uint64_t sum_us;
+} metrics_histogram;
+
+typedef struct {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t nmetrics;
+        uint32_t nbuckets;
+        uint32_t ncounters;
+        uint32_t reserved;
+        metrics_histogram histograms[METRIC_LAST];
+        uint64_t counters[COUNTER_LAST];
+} metrics_file;
+
+static const struct {
+        const char *name;
+        const char *help;
+} metric_info[METRIC_LAST] = {
+        [METRIC_DNS]        = { "request_dns_seconds", "Name lookup of new Bot API connections" },
+        [METRIC_CONNECT]    = { "request_connect_seconds", "TCP connect of new Bot API connections" },
+        [METRIC_TLS]        = { "request_tls_seconds", "TLS handshake of new Bot API connections" },
+        [METRIC_FIRST_BYTE] = { "request_first_byte_seconds", "Bot API request start to first response byte" },
+        [METRIC_REQUEST]    = { "request_seconds", "Whole Bot API requests" },
+        [METRIC_CONFIG]     = { "config_lookup_seconds", "Finding user's config" },
+        [METRIC_PASSWD]     = { "passwd_lookup_seconds", "Passwd lookup of user" },
+        [METRIC_PROMPT]     = { "prompt_wait_seconds", "User answering the code prompt" },
+        [METRIC_AUTH]       = { "auth_seconds", "Whole authentications" },
+};
+
+static const struct {
+        const char *name;
+        const char *label;
+        const char *help;
+} counter_info[COUNTER_LAST] = {
+        [COUNTER_REQUEST_OK]      = { "requests_total", "result=\"ok\"", "Number of Bot API requests" },
+        [COUNTER_REQUEST_ERROR]   = { "requests_total", "result=\"error\"", "Number of Bot API requests" },
+        [COUNTER_AUTH_SUCCESS]    = { "auth_total", "result=\"success\"", "Number of authentications" },
+        [COUNTER_AUTH_FAILURE]    = { "auth_total", "result=\"failure\"", "Number of authentications" },
+        [COUNTER_AUTH_ERROR]      = { "auth_total", "result=\"error\"", "Number of authentications" },
+        [COUNTER_AUTH_IGNORED]    = { "auth_total", "result=\"ignored\"", "Number of authentications" },
+        [COUNTER_AUTH_FAIL_OPEN]  = { "auth_total", "result=\"fail_open\"", "Number of authentications" },
+        [COUNTER_ARENA_ALLOCATED] = { "auth_arena_bytes_total", "kind=\"allocated\"", "Bytes of the per authentication arenas" },
+        [COUNTER_ARENA_HEAP]      = { "auth_arena_bytes_total", "kind=\"heap\"", "Bytes of the per authentication arenas" },
+};
+
+static struct {
+        pthread_mutex_t lock;
+        bool tried;
+        mapfile_t map;
+        metrics_file *file;             /* shared file, or local below */
+        metrics_file local;
+} metrics = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .map  = { .fd = -1 },
+};
+
+/**
+ * Map the metrics file once per process, fallback to local memory.
+ */
+static
+metrics_file *metrics_open(void)
+{
+        metrics_file *file = __atomic_load_n(&metrics.file, __ATOMIC_ACQUIRE);
+        if (file)
+                return file;
+
+        pthread_mutex_lock(&metrics.lock);
+        if (!metrics.tried) {
+                metrics.tried = true;
+                file = &metrics.local;
+
+                /* only root may create the file, same as the config cache */
+                if (mapfile_open(&metrics.map, METRICS_FILE, sizeof(metrics_file), 0 == geteuid())) {
+                        file = metrics.map.addr;
+
+                        mapfile_lock(&metrics.map);
+                        if (METRICS_MAGIC != file->magic ||
+                            METRICS_VERSION != file->version ||
+                            METRIC_LAST != file->nmetrics ||
+                            METRICS_BUCKETS != file->nbuckets ||
+                            COUNTER_LAST != file->ncounters) {
+                                memset(file, 0, sizeof(*file));
+                                file->magic = METRICS_MAGIC;
+                                file->version = METRICS_VERSION;
+                                file->nmetrics = METRIC_LAST;
+                                file->nbuckets = METRICS_BUCKETS;
+                                file->ncounters = COUNTER_LAST;
+                        }
+                        mapfile_unlock(&metrics.map);
+                }
+
+                __atomic_store_n(&metrics.file, file, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&metrics.lock);
+
+        return metrics.file;
+}
+
+/**
+ * Monotonic clock for timing phases.
+ *
+ * @return seconds since some point in the past
+ */
+double metrics_now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Add one duration to histogram.
+ *
+ * @param id        histogram
+ * @param seconds   duration
+ */
+void metrics_observe(metric_id id, double seconds)
+{
+        metrics_histogram *h = &metrics_open()->histograms[id];
+        size_t i = 0;
+
+        if (seconds < 0)
+                seconds = 0;
+        while (i < METRICS_BUCKETS - 1 && seconds > bucket_bounds[i])
+                i++;
+
+        __atomic_add_fetch(&h->buckets[i], 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&h->sum_us, (uint64_t) (seconds * 1e6), __ATOMIC_RELAXED);
+        __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Increase counter by one.
+ *
+ * @param id    counter
+ */
+void metrics_count(metrics_counter id)
+{
+        __atomic_add_fetch(&metrics_open()->counters[id], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Increase counter by n.
+ *
+ * @param id    counter
+ * @param n     amount to add
+ */
+void metrics_add(metrics_counter id, unsigned long n)
+{
+        __atomic_add_fetch(&metrics_open()->counters[id], n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Check the metrics are shared with other processes, rather than only
+ * counting what this process did.
+ *
+ * @return  false   only process local metrics
+ *          true    METRICS_FILE mapped
+ */
+bool metrics_shared(void)
+{
+        return metrics_open() != &metrics.local;
+}
+
+/**
+ * Write all metrics in Prometheus text format.
+ *
+ * @param f     output stream
+ *
+ * @return  false   failed to write
+ *          true    metrics written
+ */
+bool metrics_write(FILE *f)
+{
+        const metrics_file *file = metrics_open();
+
+        for (int id = 0; id < METRIC_LAST; id++) {
+                const metrics_histogram *h = &file->histograms[id];
+                const char *name = metric_info[id].name;
+                uint64_t cumulative = 0;
+
+                fprintf(f, "# HELP telegram_authenticator_%s %s.\n", name, metric_info[id].help);
+                fprintf(f, "# TYPE telegram_authenticator_%s histogram\n", name);
+
+                for (size_t i = 0; i < METRICS_BUCKETS; i++) {
+                        cumulative += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+                        if (i < METRICS_BUCKETS - 1)
+                                fprintf(f, "telegram_authenticator_%s_bucket{le=\"%g\"} %llu\n",
+                                        name, bucket_bounds[i], (unsigned long long) cumulative);
+                        else
+                                fprintf(f, "telegram_authenticator_%s_bucket{le=\"+Inf\"} %llu\n",
+                                        name, (unsigned long long) cumulative);
+                }
+
+                /* count must match +Inf bucket even while others keep adding */
+                fprintf(f, "telegram_authenticator_%s_sum %.6f\n", name,
+                        __atomic_load_n(&h->sum_us, __ATOMIC_RELAXED) / 1e6);
+                fprintf(f, "telegram_authenticator_%s_count %llu\n", name,
+                        (unsigned long long) cumulative);
+        }
+
+        for (int id = 0; id < COUNTER_LAST; id++) {
+                const char *name = counter_info[id].name;
+
+                /* HELP and TYPE once per family, counters of a family are adjacent */
+                if (0 == id || strcmp(name, counter_info[id - 1].name)) {
+                        fprintf(f, "# HELP telegram_authenticator_%s %s.\n", name, counter_info[id].help);
+                        fprintf(f, "# TYPE telegram_authenticator_%s counter\n", name);
+                }
+
+                fprintf(f, "telegram_authenticator_%s{%s} %llu\n", name, counter_info[id].label,
+                        (unsigned long long) __atomic_load_n(&file->counters[id], __ATOMIC_RELAXED));
+        }
+
+        return !ferror(f);
+}
+
+/**
+ * Write all metrics in Prometheus text format to path, for node_exporter's
+ * textfile collector. The file is written aside and renamed over path.
+ *
+ * @param path  output file
+ *
+ * @return  false   failed to write
+ *          true    path replaced
+ */
+bool metrics_write_file(const char *path)
+{
+        char tmp[512];
+        if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int) sizeof(tmp))
+                return false;
+
+        int fd = mkstemp(tmp);
+        if (fd < 0)
+                return false;
+
+        FILE *f = fdopen(fd, "w");
+        if (!f) {
+                close(fd);
+                unlink(tmp);
+                return false;
+        }
+
+        /* textfile collector runs as another user, the file holds no secret */
+        bool ok = 0 == fchmod(fd, 0644) && metrics_write(f);
+        if (fclose(f) || !ok || rename(tmp, path) < 0) {
+                unlink(tmp);
+                return false;
+        }
+
+        return true;
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _TELEGRAM_AUTHENTICATOR_METRICS_H_
+#define _TELEGRAM_AUTHENTICATOR_METRICS_H_
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/* Histograms shared by every process loading the PAM module and the daemon */
+#define METRICS_FILE "/var/cache/telegram-authenticator/metrics"
+
+/* Durations we keep a histogram of */
+typedef enum {
+        METRIC_DNS,             /* name lookup of a new connection */
+        METRIC_CONNECT,         /* tcp connect of a new connection */
+        METRIC_TLS,             /* tls handshake of a new connection */
+        METRIC_FIRST_BYTE,      /* request start to first response byte */
+        METRIC_REQUEST,         /* whole bot api request */
+        METRIC_CONFIG,          /* finding user's config */
+        METRIC_PASSWD,          /* passwd lookup of user */
+        METRIC_PROMPT,          /* user typing the code */
+        METRIC_AUTH,            /* whole pam_sm_authenticate() */
+        METRIC_LAST
+} metric_id;
+
+/* Things we count */
+typedef enum {
+        COUNTER_REQUEST_OK,
+        COUNTER_REQUEST_ERROR,
+        COUNTER_AUTH_SUCCESS,
+        COUNTER_AUTH_FAILURE,   /* wrong code */
+        COUNTER_AUTH_ERROR,     /* code not delivered, no answer */
+        COUNTER_AUTH_IGNORED,   /* user has no config */
+        COUNTER_AUTH_FAIL_OPEN, /* telegram unreachable in time, left to other modules */
+        COUNTER_ARENA_ALLOCATED, /* bytes authentications allocated from their arena */
+        COUNTER_ARENA_HEAP,     /* bytes the arenas took from the heap beyond their stack block */
+        COUNTER_LAST
+} metrics_counter;
+
+/**
+ * Monotonic clock for timing phases.
+ *
+ * @return seconds since some point in the past
+ */
+double metrics_now(void);
+
+/**
+ * Add one duration to histogram.
+ *
+ * @param id        histogram
+ * @param seconds   duration
+ */
+void metrics_observe(metric_id id, double seconds);
+
+/**
+ * Increase counter by one.
+ *
+ * @param id    counter
+ */
+void metrics_count(metrics_counter id);
+
+/**
+ * Increase counter by n.
+ *
+ * @param id    counter
+ * @param n     amount to add
+ */
+void metrics_add(metrics_counter id, unsigned long n);
+
+/**
+ * Check the metrics are shared with other processes, rather than only
+ * counting what this process did.
+ *
+ * @return  false   only process local metrics
+ *          true    METRICS_FILE mapped
+ */
+bool metrics_shared(void);
+
+/**
+ * Write all metrics in Prometheus text format.
+ *
+ * @param f     output stream
+ *
+ * @return  false   failed to write
+ *          true    metrics written
+ */
+bool metrics_write(FILE *f);
+
+/**
+ * Write all metrics in Prometheus text format to path, for node_exporter's
+ * textfile collector. The file is written aside and renamed over path.
+ *
+ * @param path  output file
+ *
+ * @return  false   failed to write
+ *          true    path replaced
+ */
+bool metrics_write_file(const char *path);
+
+#endif /* _TELEGRAM_AUTHENTICATOR_METRICS_H_ */
@@ -18,6 +18,8 @@
  *
  */
 
+#define _GNU_SOURCE             /* dladdr(), pthread_timedjoin_np() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -27,104 +29,851 @@
 #include <sys/types.h>
 #include <pwd.h>
 #include <unistd.h>
+#include <errno.h>
+#include <limits.h>
 #include <time.h>
+#include <pthread.h>
+#include <dlfcn.h>
 
+#include "arena.h"
+#include "breaker.h"
+#include "broker.h"
 #include "config.h"
-#include "telegram.h"
+#include "metrics.h"
+#include "random.h"
+#include "store.h"
+#include "telegram_ops.h"
+#include "tls_cache.h"
 
 #include <security/pam_modules.h>
 #include <security/pam_ext.h>
 
+/* Length of the login code sent to telegram, and seconds it is valid */
+#define CODE_DIGITS  5
+#define CODE_TIMEOUT 120
+
+/* Random bytes of the tag telling logins of one user apart, in the key of a
+ * code held by telegram-authenticatord */
+#define CODE_TAG_BYTES 4
+
+/* Milliseconds the prompt waits for the code to be sent, so a send failing
+ * right away is told before the user is asked for a code that won't come */
+#define SEND_SETTLE_MS 1000
+
+/* Seconds user has to press Approve, and random bytes in the nonce of it */
+#define APPROVE_TIMEOUT 60
+#define NONCE_BYTES     16
+
+/* Stack block of the arena of one authentication, enough for a config and
+ * the passwd entry of a usual user */
+#define AUTH_ARENA_STACK 4096
+
+struct module_options {
+    const char *broker;         /* telegram-authenticatord socket, NULL to disable */
+    const char *store;          /* system-wide credential store, NULL to disable */
+    const char *api_url;        /* bot api server for this host, NULL for default */
+    double global_rate;         /* messages per second, -1 to keep default */
+    double chat_rate;
+    int approve_timeout;        /* seconds to wait for Approve button */
+    int code_timeout;           /* seconds a code is valid, 0 for no limit */
+    int budget;                 /* milliseconds for whole authentication, 0 for no limit */
+    bool fail_open;             /* leave user to other modules when telegram can't make it */
+    int breaker_failures;       /* failed sends in a row that stop sending, 0 to disable */
+    int breaker_cooldown;       /* seconds before trying again */
+    bool tls_cache;             /* resume TLS sessions of earlier processes */
+};
+
+/**
+ * Parse module arguments in /etc/pam.d/ config:
+ *
+ *   broker=PATH   talk to telegram-authenticatord listen on PATH
+ *   nobroker      always send message by ourself
+ *   store=PATH    system-wide credential store
+ *   nostore       only use config file in user's home
+ *   api_url=URL   bot api server, default https://api.telegram.org/bot,
+ *                 or unix:PATH for a local server on a unix socket
+ *   ratelimit=G:C messages per second for all chats and for one chat sent by
+ *                 this process, 0 for unlimited
+ *   approve_timeout=SECONDS
+ *                 time users in approve mode have to press the button
+ *   code_timeout=SECONDS
+ *                 time a code is valid, 0 for as long as the prompt is open
+ *   budget=MS     time one authentication may take from start to the answer,
+ *                 0 for no limit
+ *   fail=open|closed
+ *                 when the code can't be sent within the budget, return
+ *                 PAM_IGNORE (open) or PAM_AUTHINFO_UNAVAIL (closed, default)
+ *   breaker=N:S   after N failed sends in a row to a bot api server, don't
+ *                 try it for S seconds, 0:0 to always try
+ *   tls_cache     resume TLS sessions saved by earlier logins in TLS_CACHE_FILE
+ */
 static
-uid_t get_user_uid(pam_handle_t* pamh)
+void parse_options(pam_handle_t *pamh, int argc, const char **argv,
+                   struct module_options *opts)
 {
-    /* first we try to get username */
-    const char *username;
-    pam_get_user(pamh, &username, NULL);
+    opts->broker = BROKER_SOCKET;
+    opts->store = STORE_FILE;
+    opts->api_url = NULL;
+    opts->global_rate = opts->chat_rate = -1;
+    opts->approve_timeout = APPROVE_TIMEOUT;
+    opts->code_timeout = CODE_TIMEOUT;
+    opts->budget = 0;
+    opts->fail_open = false;
+    opts->breaker_failures = BREAKER_FAILURES;
+    opts->breaker_cooldown = BREAKER_COOLDOWN;
+    opts->tls_cache = false;
+
+    for (int i = 0; i < argc; i++) {
+        if (!strncmp(argv[i], "broker=", 7))
+            opts->broker = argv[i] + 7;
+        else if (!strcmp(argv[i], "nobroker"))
+            opts->broker = NULL;
+        else if (!strncmp(argv[i], "store=", 6))
+            opts->store = argv[i] + 6;
+        else if (!strcmp(argv[i], "nostore"))
+            opts->store = NULL;
+        else if (!strncmp(argv[i], "api_url=", 8))
+            opts->api_url = argv[i] + 8;    /* checked once telegram is loaded */
+        else if (!strncmp(argv[i], "ratelimit=", 10)) {
+            if (2 != sscanf(argv[i] + 10, "%lf:%lf", &opts->global_rate, &opts->chat_rate) ||
+                opts->global_rate < 0 || opts->chat_rate < 0) {
+                pam_syslog(pamh, LOG_ERR, "Invalid ratelimit: %s", argv[i] + 10);
+                opts->global_rate = opts->chat_rate = -1;
+            }
+        } else if (!strncmp(argv[i], "approve_timeout=", 16)) {
+            if (1 != sscanf(argv[i] + 16, "%d", &opts->approve_timeout) ||
+                opts->approve_timeout <= 0) {
+                pam_syslog(pamh, LOG_ERR, "Invalid approve_timeout: %s", argv[i] + 16);
+                opts->approve_timeout = APPROVE_TIMEOUT;
+            }
+        } else if (!strncmp(argv[i], "code_timeout=", 13)) {
+            if (1 != sscanf(argv[i] + 13, "%d", &opts->code_timeout) ||
+                opts->code_timeout < 0) {
+                pam_syslog(pamh, LOG_ERR, "Invalid code_timeout: %s", argv[i] + 13);
+                opts->code_timeout = CODE_TIMEOUT;
+            }
+        } else if (!strncmp(argv[i], "budget=", 7)) {
+            if (1 != sscanf(argv[i] + 7, "%d", &opts->budget) || opts->budget < 0) {
+                pam_syslog(pamh, LOG_ERR, "Invalid budget: %s", argv[i] + 7);
+                opts->budget = 0;
+            }
+        } else if (!strcmp(argv[i], "fail=open"))
+            opts->fail_open = true;
+        else if (!strcmp(argv[i], "fail=closed"))
+            opts->fail_open = false;
+        else if (!strncmp(argv[i], "breaker=", 8)) {
+            if (2 != sscanf(argv[i] + 8, "%d:%d", &opts->breaker_failures, &opts->breaker_cooldown) ||
+                opts->breaker_failures < 0 || opts->breaker_cooldown < 0) {
+                pam_syslog(pamh, LOG_ERR, "Invalid breaker: %s", argv[i] + 8);
+                opts->breaker_failures = BREAKER_FAILURES;
+                opts->breaker_cooldown = BREAKER_COOLDOWN;
+            }
+        } else if (!strcmp(argv[i], "tls_cache"))
+            opts->tls_cache = true;
+        else
+            pam_syslog(pamh, LOG_ERR, "Unknown option: %s", argv[i]);
+    }
+}
+
+/* telegram.c and libcurl, loaded by load_telegram() */
+static pthread_mutex_t telegram_lock = PTHREAD_MUTEX_INITIALIZER;
+static const telegram_ops *telegram;
 
-    /*  FIXME: error handling */
+/**
+ * Load the library talking to telegram, from the directory of this module,
+ * the first time a user with a config logs in. It's never unloaded, libcurl
+ * and TLS libraries don't support that.
+ *
+ * @return functions of telegram.c, NULL if library can't be loaded
+ */
+static
+const telegram_ops *load_telegram(pam_handle_t *pamh)
+{
+    pthread_mutex_lock(&telegram_lock);
+    if (!telegram) {
+        char path[PATH_MAX];
+        Dl_info info;
+        const char *slash = NULL;
 
-    /* get user uid by getpwname_r() */
-    size_t bufsize = sysconf(_SC_GETPW_R_SIZE_MAX);
-    if (bufsize == -1)
-        bufsize = 4096;
+        if (dladdr((void *) load_telegram, &info) && info.dli_fname)
+            slash = strrchr(info.dli_fname, '/');
+        if (slash)
+            snprintf(path, sizeof(path), "%.*s/%s", (int) (slash - info.dli_fname),
+                     info.dli_fname, TELEGRAM_OPS_LIBRARY);
+        else
+            snprintf(path, sizeof(path), "%s", TELEGRAM_OPS_LIBRARY);
 
-    char *buf = malloc(bufsize);
-    if (buf == NULL) {
-        perror("malloc");
-        exit(EXIT_FAILURE);
+        void *lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+        const telegram_ops *ops = lib ? dlsym(lib, TELEGRAM_OPS_SYMBOL) : NULL;
+        if (!lib) {
+            pam_syslog(pamh, LOG_ERR, "Cannot load %s: %s", path, dlerror());
+        } else if (!ops || TELEGRAM_OPS_VERSION != ops->version) {
+            pam_syslog(pamh, LOG_ERR, "Incompatible %s, reinstall the module.", path);
+            dlclose(lib);
+            ops = NULL;
+        }
+        telegram = ops;
     }
+    const telegram_ops *ops = telegram;
+    pthread_mutex_unlock(&telegram_lock);
 
-    struct passwd pwd, *result;
-    int s = getpwnam_r(username, &pwd, buf, bufsize, &result);
+    return ops;
+}
 
-    if (result == NULL) {
-        if (s == 0)
-            printf("Not found\n");
-        else {
-            perror("getpwnam_r");
-            exit(EXIT_FAILURE);
+/**
+ * Milliseconds left of the budget of one authentication.
+ *
+ * @param deadline  metrics_now() the budget runs out, 0 for no budget
+ *
+ * @return milliseconds left, 0 once the budget ran out, -1 for no budget
+ */
+static
+long budget_left(double deadline)
+{
+    if (deadline <= 0)
+        return -1;
+
+    double left = (deadline - metrics_now()) * 1e3;
+    return left > 0 ? (long) left : 0;
+}
+
+/**
+ * Give up on an authentication telegram can't take part in, the fail= option
+ * decides if other modules get the last word.
+ *
+ * @param why   logged reason, without trailing period
+ *
+ * @return PAM_IGNORE for fail=open, PAM_AUTHINFO_UNAVAIL otherwise
+ */
+static
+int fail_unavailable(pam_handle_t *pamh, const struct module_options *opts,
+                     const char *username, const char *why)
+{
+    if (opts->fail_open) {
+        pam_syslog(pamh, LOG_WARNING, "%s, leave %s to other modules.", why, username);
+        return PAM_IGNORE;
+    }
+
+    pam_syslog(pamh, LOG_ERR, "%s.", why);
+    return PAM_AUTHINFO_UNAVAIL;
+}
+
+/**
+ * Send message through telegram-authenticatord, fallback to send by ourself when
+ * the daemon is not reachable. The daemon holds the code until its answer is
+ * checked with broker_check_code(), or code_timeout expires it. Users with
+ * their own bot api server are never sent through the daemon, it only talks
+ * to the host's server. Users with more chats get the message in all of them
+ * at once, delivered once their quorum of chats got it.
+ *
+ * @param key       of the code in the daemon
+ * @param code      login code in msg
+ *
+ * @return TELEGRAM_SEND_OK when delivered, otherwise why not
+ */
+static
+telegram_send_result send_message(pam_handle_t *pamh, const struct module_options *opts,
+                                  const config_t *cfg, const telegram_endpoint *ep, const char *msg,
+                                  const char *key, const char *code, double deadline, bool *via_broker)
+{
+    *via_broker = false;
+    long left = budget_left(deadline);
+    if (0 == left)
+        return TELEGRAM_SEND_NOT_SENT;
+
+    /* the daemon sends to one chat, more of them all go out at once from here */
+    if (cfg->nchats > 0) {
+        telegram_target targets[CONFIG_MAX_CHATS + 1] = { { cfg->token, cfg->chat_id } };
+        for (int i = 0; i < cfg->nchats; i++) {
+            targets[i + 1].token = cfg->chats[i].token ? cfg->chats[i].token : cfg->token;
+            targets[i + 1].chat_id = cfg->chats[i].chat_id;
         }
+
+        size_t quorum = cfg->quorum > 0 ? cfg->quorum : 1;
+        telegram->set_budget(left);
+        telegram->send_fanout(ep, targets, cfg->nchats + 1, msg, quorum);
+        return telegram->get_last_send_result();
     }
 
-    free(buf);
-    return pwd.pw_uid;
+    if (opts->broker && !cfg->api_url) {
+        *via_broker = true;
+        switch (broker_send_code(opts->broker, cfg->token, cfg->chat_id, msg, key, code,
+                                 opts->code_timeout, left > 0 ? left : 0)) {
+        case BROKER_OK:
+            return TELEGRAM_SEND_OK;
+        case BROKER_REJECTED:
+            pam_syslog(pamh, LOG_ERR, "Bot API server refused message of telegram-authenticatord.");
+            return TELEGRAM_SEND_REJECTED;
+        case BROKER_FAILED:
+            pam_syslog(pamh, LOG_ERR, "telegram-authenticatord failed to send message.");
+            return TELEGRAM_SEND_UNREACHABLE;
+        default:
+            *via_broker = false;
+            break;
+        }
+    }
+
+    telegram->set_budget(budget_left(deadline));
+    telegram->send_to(ep, cfg->token, cfg->chat_id, msg);
+    return telegram->get_last_send_result();
+}
+
+/* Message delivery running on a helper thread while user sees the prompt */
+struct send_job {
+    pthread_t thread;
+    bool started;
+    pam_handle_t *pamh;
+    const struct module_options *opts;
+    const config_t *cfg;
+    const telegram_endpoint *ep;
+    char msg[128];
+    const char *code;           /* in msg */
+    char code_key[BROKER_MAX_NONCE + 1];    /* user name and tag of the login */
+    double deadline;            /* of the budget, 0 for none */
+    const char *endpoint;       /* url the breaker is kept for */
+    breaker_verdict verdict;    /* of the breaker, to report the result */
+    bool reported;              /* to the breaker, once per authentication */
+    bool ok;                    /* valid after send_job_wait() */
+    bool via_broker;            /* sent by telegram-authenticatord, which holds the code */
+    bool approval_sent;         /* approval request reached the user */
+    double seconds;             /* time taken to send */
+    telegram_timing timing;     /* of our own request, if not via broker */
+};
+
+/**
+ * Tell the breaker if the bot api server answered. Done as soon as it's
+ * known, not after the prompt, so a probe can't hold back others while the
+ * user types. Only the first send of an authentication counts, the code
+ * after a failed approval request says nothing new about the server.
+ *
+ * A refused message, e.g. of a revoked token or a blocked bot, shows the
+ * server is up: one user's broken config must not open the breaker shared
+ * by every user. A send given up before reaching the server isn't reported,
+ * a probe among them is taken as lost after BREAKER_PROBE_TIMEOUT.
+ */
+static
+void breaker_delivered(struct send_job *job, telegram_send_result result)
+{
+    if (job->opts->breaker_failures <= 0 || job->reported || TELEGRAM_SEND_NOT_SENT == result)
+        return;
+
+    job->reported = true;
+    breaker_report(job->endpoint, job->verdict, TELEGRAM_SEND_UNREACHABLE != result,
+                   job->opts->breaker_failures);
+}
+
+static
+void *send_job_thread(void *arg)
+{
+    struct send_job *job = arg;
+    double start = metrics_now();
+    telegram_send_result result = send_message(job->pamh, job->opts, job->cfg, job->ep, job->msg,
+                                               job->code_key, job->code, job->deadline,
+                                               &job->via_broker);
+    job->ok = TELEGRAM_SEND_OK == result;
+    job->seconds = metrics_now() - start;
+    breaker_delivered(job, result);
+    telegram->get_last_timing(&job->timing);
+    return NULL;
+}
+
+/**
+ * Start sending message in background, fallback to send it right now if we
+ * can't create the helper thread.
+ */
+static
+void send_job_start(struct send_job *job)
+{
+    job->started = !pthread_create(&job->thread, NULL, send_job_thread, job);
+    if (!job->started) {
+        pam_syslog(job->pamh, LOG_WARNING, "Failed to create send thread, send synchronously.");
+        send_job_thread(job);
+    }
+}
+
+/**
+ * Wait a while for background send to finish.
+ *
+ * @param ms    milliseconds to wait at most
+ *
+ * @return  false   still sending
+ *          true    finished, job->ok is valid
+ */
+static
+bool send_job_settle(struct send_job *job, long ms)
+{
+    if (!job->started)
+        return true;
+
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += ms / 1000;
+    until.tv_nsec += (ms % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+
+    if (pthread_timedjoin_np(job->thread, NULL, &until))
+        return false;
+    job->started = false;
+    return true;
 }
 
+/**
+ * Wait for background send to finish.
+ *
+ * @return  false   failed to deliver message
+ *          true    message delivered
+ */
 static
-void passwdgen(char *str)
+bool send_job_wait(struct send_job *job)
 {
-    size_t size = 6;
-    const char charset[] = "0123456789";
-    srand(time(NULL));
+    if (job->started) {
+        pthread_join(job->thread, NULL);
+        job->started = false;
+    }
+    return job->ok;
+}
 
-    if (size) {
-        --size;
-        for (size_t n = 0; n < size; n++) {
-            int key = rand() % (int) (sizeof charset - 1);
-            str[n] = charset[key];
+/**
+ * Find uid of user, safe to call from many threads at once.
+ *
+ * @param arena     where the passwd entry is read into
+ *
+ * @return  false   user not found or lookup failed
+ *          true    uid filled
+ */
+static
+bool get_user_uid(arena_t *arena, const char *username, uid_t *uid)
+{
+    long size = sysconf(_SC_GETPW_R_SIZE_MAX);
+    size_t bufsize = (size > 0) ? (size_t) size : 1024;
+
+    for (;;) {
+        char *buf = arena_alloc(arena, bufsize);
+        if (!buf)
+            return false;
+
+        struct passwd pwd, *result = NULL;
+        int s = getpwnam_r(username, &pwd, buf, bufsize, &result);
+        if (result)
+            *uid = pwd.pw_uid;
+
+        /* entry larger than our buffer, e.g. a huge gecos from LDAP */
+        if (ERANGE == s && bufsize < 1024 * 1024) {
+            bufsize *= 2;
+            continue;
         }
-        str[size] = '\0';
+
+        return NULL != result;
     }
 }
 
-PAM_EXTERN int pam_sm_authenticate(pam_handle_t* pamh, int flags, int argc,
-                                   char const** argv) {
+/**
+ * Generate one time login code of CODE_DIGITS digits.
+ *
+ * @param str   buffer of at least CODE_DIGITS + 1 bytes
+ *
+ * @return  false   no random bytes available
+ *          true    code generated
+ */
+static
+bool passwdgen(char *str)
+{
+    return random_digits(str, CODE_DIGITS);
+}
+
+/**
+ * Generate nonce tying the buttons of an approval message, or a code held by
+ * telegram-authenticatord, to this login.
+ *
+ * @param nonce     buffer of at least 2 * bytes + 1 bytes, filled with hex
+ * @param bytes     random bytes, at most NONCE_BYTES
+ *
+ * @return  false   no random bytes available
+ *          true    nonce generated
+ */
+static
+bool make_nonce(char *nonce, size_t bytes)
+{
+    unsigned char raw[NONCE_BYTES];
+    if (!random_bytes(raw, bytes))
+        return false;
+
+    for (size_t i = 0; i < bytes; i++)
+        sprintf(nonce + 2 * i, "%02x", raw[i]);
+    return true;
+}
+
+/* How long each step of one authentication took */
+struct auth_timing {
+    double start;
+    double deadline;            /* start + budget, 0 for no budget */
+    double config;              /* finding user's config */
+    double passwd;              /* passwd lookup, 0 if not needed */
+    double prompt;              /* user typing the code */
+    const arena_t *arena;       /* everything allocated for this authentication */
+};
+
+/**
+ * Log where the time of one authentication went, and count it in metrics.
+ */
+static
+void log_timing(pam_handle_t *pamh, const char *username, int rc,
+                const struct auth_timing *t, const struct send_job *job)
+{
+    double total = metrics_now() - t->start;
+    char send[160];
 
-    /* step 1: get user home */
-    uid_t uid = get_user_uid(pamh);
-    bool has_config = config_exists(uid);
-    if (!has_config) {
+    metrics_observe(METRIC_AUTH, total);
+    metrics_count(PAM_SUCCESS == rc ? COUNTER_AUTH_SUCCESS :
+                  PAM_AUTH_ERR == rc ? COUNTER_AUTH_FAILURE :
+                  PAM_IGNORE == rc ? COUNTER_AUTH_FAIL_OPEN : COUNTER_AUTH_ERROR);
+
+    if (job->via_broker)
+        snprintf(send, sizeof(send), "%.1fms via telegram-authenticatord", job->seconds * 1e3);
+    else if (job->timing.new_connection)
+        snprintf(send, sizeof(send), "%.1fms (dns %.1fms, connect %.1fms, tls %.1fms, first byte %.1fms)",
+                 job->seconds * 1e3, job->timing.dns * 1e3, job->timing.connect * 1e3,
+                 job->timing.tls * 1e3, job->timing.first_byte * 1e3);
+    else
+        snprintf(send, sizeof(send), "%.1fms (reused connection, first byte %.1fms)",
+                 job->seconds * 1e3, job->timing.first_byte * 1e3);
+
+    pam_syslog(pamh, LOG_INFO, "%s for %s in %.1fms: config %.1fms, passwd %.1fms, send %s, prompt %.1fms, "
+               "memory %zu bytes (%zu from heap)",
+               pam_strerror(pamh, rc), username, total * 1e3, t->config * 1e3,
+               t->passwd * 1e3, send, t->prompt * 1e3, t->arena->allocated, t->arena->heap);
+}
+
+/**
+ * Ask user to press Approve in telegram instead of typing a code, through
+ * telegram-authenticatord when it receives updates by webhook, otherwise by
+ * sending the message and polling for the answer ourself.
+ *
+ * @param rc    filled with the result when the user answered or time ran out
+ *
+ * @return  false   approval request not possible, ask for the code instead
+ *          true    rc filled
+ */
+static
+bool approve_login(pam_handle_t *pamh, const struct module_options *opts, const char *username,
+                   const config_t *cfg, const telegram_endpoint *ep,
+                   struct auth_timing *t, struct send_job *job, int *rc)
+{
+    /* no point asking when the budget is gone before the user could react */
+    int timeout = opts->approve_timeout;
+    long left = budget_left(t->deadline);
+    if (left >= 0 && left / 1000 < timeout)
+        timeout = left / 1000;
+    if (timeout <= 0)
+        return false;
+
+    /* a button pressed in a group can't be told from one pressed by the user */
+    if ('-' == cfg->chat_id[0]) {
+        pam_syslog(pamh, LOG_NOTICE, "Chat of %s is a group, ask for code instead of approval.", username);
+        return false;
+    }
+
+    char nonce[2 * NONCE_BYTES + 1];
+    if (!make_nonce(nonce, NONCE_BYTES))
+        return false;
+
+    const void *rhost = NULL;
+    if (pam_get_item(pamh, PAM_RHOST, &rhost) != PAM_SUCCESS || !rhost)
+        rhost = "localhost";
+    snprintf(job->msg, sizeof(job->msg), "Approve ssh login of %s from %s?",
+             username, (const char *) rhost);
+
+    /* telegram-authenticatord with a webhook gets the answer pushed */
+    broker_status status = BROKER_UNAVAILABLE;
+    int conn = -1;
+    double start = metrics_now();
+    if (opts->broker && !cfg->api_url) {
+        status = broker_approve(opts->broker, cfg->token, cfg->chat_id, job->msg, nonce,
+                                timeout, &conn);
+        if (BROKER_FAILED == status || BROKER_REJECTED == status) {
+            breaker_delivered(job, BROKER_REJECTED == status ? TELEGRAM_SEND_REJECTED :
+                              TELEGRAM_SEND_UNREACHABLE);
+            pam_syslog(pamh, LOG_WARNING, "telegram-authenticatord failed to send approval request, ask for code.");
+            return false;
+        }
+        job->via_broker = BROKER_OK == status;
+    }
+
+    /* polling getUpdates of a bot other users share would take their button
+     * presses, or fail while they poll */
+    if (BROKER_OK != status && store_bot_shared(STORE_SHARED_BOTS_FILE, cfg->token)) {
+        pam_syslog(pamh, LOG_NOTICE, "Bot of %s is shared, ask for code instead of approval.", username);
+        return false;
+    }
+
+    telegram_send_result result = TELEGRAM_SEND_OK;
+    if (BROKER_OK != status) {
+        telegram->set_budget(budget_left(t->deadline));
+        telegram->send_approval(ep, cfg->token, cfg->chat_id, job->msg, nonce);
+        result = telegram->get_last_send_result();
+        telegram->get_last_timing(&job->timing);
+    }
+    job->ok = TELEGRAM_SEND_OK == result;
+    job->seconds = metrics_now() - start;
+
+    breaker_delivered(job, result);
+    if (!job->ok) {
+        pam_syslog(pamh, LOG_WARNING, "Failed to send approval request, ask for code.");
+        return false;
+    }
+    job->approval_sent = true;
+
+    pam_info(pamh, "Approve the login in Telegram.");
+    start = metrics_now();
+    telegram_approval answer = (BROKER_OK == status) ? broker_approve_wait(conn) :
+        telegram->wait_approval(ep, cfg->token, cfg->chat_id, nonce, timeout);
+    t->prompt = metrics_now() - start;
+    metrics_observe(METRIC_PROMPT, t->prompt);
+
+    switch (answer) {
+    case TELEGRAM_APPROVAL_APPROVED:
+        *rc = PAM_SUCCESS;
+        return true;
+    case TELEGRAM_APPROVAL_DENIED:
+        pam_syslog(pamh, LOG_NOTICE, "Login of %s denied in telegram.", username);
+        *rc = PAM_AUTH_ERR;
+        return true;
+    case TELEGRAM_APPROVAL_TIMEOUT:
+        pam_syslog(pamh, LOG_NOTICE, "Login of %s not approved in %d seconds.",
+                   username, timeout);
+        *rc = PAM_AUTH_ERR;
+        return true;
+    default:
+        pam_syslog(pamh, LOG_WARNING, "Cannot receive approval from telegram, ask for code.");
+        return false;
+    }
+}
+
+/**
+ * Authenticate user, everything allocated on the way comes from arena.
+ */
+static
+int authenticate(pam_handle_t *pamh, int argc, char const **argv, arena_t *arena)
+{
+    struct auth_timing timing = { .start = metrics_now(), .arena = arena };
+    struct module_options opts;
+    parse_options(pamh, argc, argv, &opts);
+    if (opts.budget > 0)
+        timing.deadline = timing.start + opts.budget / 1e3;
+
+    const char *username;
+    if (pam_get_user(pamh, &username, NULL) != PAM_SUCCESS || !username) {
+        pam_syslog(pamh, LOG_ERR, "Cannot determine user name.");
+        return PAM_USER_UNKNOWN;
+    }
+
+    /* step 1: get user's config, system-wide store first then user's home */
+    config_set_store(opts.store);
+    double start = metrics_now();
+    config_t cfg = config_read_name(username);
+    if (!cfg.token) {
+        uid_t uid;
+        double passwd_start = metrics_now();
+        bool found = get_user_uid(arena, username, &uid);
+        timing.passwd = metrics_now() - passwd_start;
+        metrics_observe(METRIC_PASSWD, timing.passwd);
+
+        if (!found) {
+            pam_syslog(pamh, LOG_NOTICE, "Unknown user %s.", username);
+            return PAM_USER_UNKNOWN;
+        }
+        cfg = config_read(uid);
+    }
+    timing.config = metrics_now() - start - timing.passwd;
+    metrics_observe(METRIC_CONFIG, timing.config);
+
+    if (!cfg.token) {
+        metrics_count(COUNTER_AUTH_IGNORED);
         pam_syslog(pamh, LOG_NOTICE, "No telegram-authenticator config find, skipped.");
         return PAM_IGNORE;
     }
 
-    /* generate password */
-    char passwd[6];
-    passwdgen(passwd);
+    /* one breaker per bot api server, the user's own one or the host's */
+    struct send_job job = { .pamh = pamh, .opts = &opts, .cfg = &cfg,
+                            .deadline = timing.deadline, .verdict = BREAKER_ALLOW };
+    job.endpoint = cfg.api_url ? cfg.api_url : opts.api_url ? opts.api_url : "";
 
-    /* Send password to telegram */
-    char msg[128];
-    sprintf(msg, "Your ssh login code: %s", passwd);
+    /* passwd and config lookups can't be interrupted, see what they left us */
+    int rc = PAM_SUCCESS;
+    if (0 == budget_left(timing.deadline))
+        rc = fail_unavailable(pamh, &opts, username, "Budget ran out before sending to telegram");
+
+    /* don't make the user wait for a server known to be down */
+    if (PAM_SUCCESS == rc && opts.breaker_failures > 0) {
+        job.verdict = breaker_check(job.endpoint, opts.breaker_cooldown);
+        if (BREAKER_DENY == job.verdict)
+            rc = fail_unavailable(pamh, &opts, username, "Bot API server is down, not trying");
+    }
+
+    /* only now we need curl */
+    if (PAM_SUCCESS == rc && !load_telegram(pamh))
+        rc = fail_unavailable(pamh, &opts, username, "Cannot talk to telegram");
+
+    if (PAM_SUCCESS != rc) {
+        metrics_count(PAM_IGNORE == rc ? COUNTER_AUTH_FAIL_OPEN : COUNTER_AUTH_ERROR);
+        config_free(cfg);
+        return rc;
+    }
+
+    if (opts.tls_cache)
+        telegram->set_tls_cache_file(TLS_CACHE_FILE);
+
+    if (opts.global_rate >= 0) {
+        telegram_send_limits limits;
+        telegram->get_send_limits(&limits);
+        limits.global_rate = limits.global_burst = opts.global_rate;
+        limits.chat_rate = opts.chat_rate;
+        telegram->set_send_limits(&limits);
+    }
+
+    /* user's own bot api server wins over the host's one */
+    telegram_endpoint host_endpoint, user_endpoint;
+    const telegram_endpoint *ep = NULL;
+    if (opts.api_url) {
+        if (telegram->endpoint_parse(&host_endpoint, opts.api_url, true))
+            ep = &host_endpoint;
+        else
+            pam_syslog(pamh, LOG_ERR, "Invalid api_url: %s", opts.api_url);
+    }
+    if (cfg.api_url) {
+        if (telegram->endpoint_parse(&user_endpoint, cfg.api_url, false))
+            ep = &user_endpoint;
+        else
+            pam_syslog(pamh, LOG_WARNING, "Ignore invalid api_url in config of %s.", username);
+    }
+
+    /* one tap login, falls through to the code when that's not possible */
+    job.ep = ep;
+    if (CONFIG_MODE_APPROVE == cfg.mode &&
+        approve_login(pamh, &opts, username, &cfg, ep, &timing, &job, &rc)) {
+        log_timing(pamh, username, rc, &timing, &job);
+        config_free(cfg);
+        return rc;
+    }
+
+    /* approval may have used it all up. Once the user got the request, telegram
+     * took part in this login, so like an expired code it never fails open */
+    if (0 == budget_left(timing.deadline)) {
+        if (job.approval_sent) {
+            pam_syslog(pamh, LOG_WARNING, "Budget ran out waiting for approval of %s.", username);
+            rc = PAM_AUTH_ERR;
+        } else {
+            rc = fail_unavailable(pamh, &opts, username, "Budget ran out before sending the code");
+        }
+        log_timing(pamh, username, rc, &timing, &job);
+        config_free(cfg);
+        return rc;
+    }
 
-    config_t cfg = config_read(uid);
-    telegram_send(cfg.token, cfg.chat_id, msg);
+    /* generate password, and the key telegram-authenticatord holds it by */
+    char passwd[CODE_DIGITS + 1];
+    char tag[2 * CODE_TAG_BYTES + 1];
+    if (!passwdgen(passwd) || !make_nonce(tag, CODE_TAG_BYTES)) {
+        explicit_bzero(passwd, sizeof(passwd));
+        pam_syslog(pamh, LOG_ERR, "Failed to generate verification code.");
+        metrics_count(COUNTER_AUTH_ERROR);
+        config_free(cfg);
+        return PAM_AUTHINFO_UNAVAIL;
+    }
+    double issued = metrics_now();
+    snprintf(job.code_key, sizeof(job.code_key), "%.*s:%s",
+             (int) (sizeof(job.code_key) - sizeof(tag) - 1), username, tag);
+    job.code = passwd;
+
+    /* Send password to telegram, the prompt is shown while message is in flight.
+     * A send failing right away, e.g. no DNS, a refused connection or a revoked
+     * token, is told first instead of after the user typed something */
+    snprintf(job.msg, sizeof(job.msg), "Your ssh login code: %s", passwd);
+    send_job_start(&job);
+
+    long settle = budget_left(timing.deadline);
+    if (settle < 0 || settle > SEND_SETTLE_MS)
+        settle = SEND_SETTLE_MS;
 
-    char *response;
-    int rc = pam_prompt(pamh, PAM_PROMPT_ECHO_OFF, &response, "Telegram Verification: ");
+    char *response = NULL;
+    bool prompted = !send_job_settle(&job, settle) || job.ok;
+    if (prompted) {
+        start = metrics_now();
+        rc = pam_prompt(pamh, PAM_PROMPT_ECHO_OFF, &response, "Telegram Verification: ");
+        timing.prompt = metrics_now() - start;
+        metrics_observe(METRIC_PROMPT, timing.prompt);
+    }
+
+    bool delivered = send_job_wait(&job);
 
-    if (response == NULL)
+    if (prompted && response == NULL && rc == PAM_SUCCESS)
         rc = PAM_CONV_ERR;
 
-    if (rc != PAM_SUCCESS) {
+    if (!delivered) {
+        /* right away instead of the prompt, or once the user answered it */
+        if (!prompted || rc == PAM_SUCCESS)
+            pam_error(pamh, "Failed to deliver telegram verification code.");
+        rc = fail_unavailable(pamh, &opts, username, "Failed to deliver telegram verification code");
+    } else if (rc != PAM_SUCCESS) {
         pam_syslog(pamh, LOG_WARNING, "No response to query telegram verification code.");
-        return rc;
+        /* no answer, the daemon can drop the code now */
+        if (job.via_broker)
+            broker_check_code(opts.broker, cfg.chat_id, job.code_key, "");
+    } else {
+        /* telegram-authenticatord expired its code on time, the prompt can't be
+         * interrupted so it's refused once answered. Ours is checked too, for a
+         * daemon restarted meanwhile which lost the code */
+        broker_status held = job.via_broker ?
+            broker_check_code(opts.broker, cfg.chat_id, job.code_key, response) : BROKER_UNAVAILABLE;
+
+        if (BROKER_EXPIRED == held ||
+            (opts.code_timeout > 0 && metrics_now() - issued > opts.code_timeout) ||
+            0 == budget_left(timing.deadline)) {
+            /* it was sent, so running out of budget here never fails open */
+            pam_syslog(pamh, LOG_WARNING, "Telegram verification code of %s expired.", username);
+            pam_error(pamh, "Telegram verification code expired.");
+            rc = PAM_AUTH_ERR;
+        } else if (BROKER_UNAVAILABLE != held) {
+            rc = BROKER_OK == held ? PAM_SUCCESS : PAM_AUTH_ERR;
+        } else {
+            rc = strcmp(response, passwd) ? PAM_AUTH_ERR : PAM_SUCCESS;
+        }
+    }
+
+    log_timing(pamh, username, rc, &timing, &job);
+
+    /* the sender is joined, no copy of the code is left in use */
+    explicit_bzero(passwd, sizeof(passwd));
+    explicit_bzero(job.msg, sizeof(job.msg));
+    if (response) {
+        explicit_bzero(response, strlen(response));
+        free(response);
     }
+    config_free(cfg);
+    return rc;
+}
+
+PAM_EXTERN int pam_sm_authenticate(pam_handle_t* pamh, int flags, int argc,
+                                   char const** argv) {
+
+    /* configs and passwd entries of this login go to the arena, all given
+     * back at once when the login is done, whichever way it ends */
+    char stack[AUTH_ARENA_STACK];
+    arena_t arena;
+    arena_init(&arena, stack, sizeof(stack));
+    config_set_arena(&arena);
+
+    int rc = authenticate(pamh, argc, argv, &arena);
 
-    if (!strcmp(response, passwd))
-        return PAM_SUCCESS;
+    config_set_arena(NULL);
+    metrics_add(COUNTER_ARENA_ALLOCATED, arena.allocated);
+    metrics_add(COUNTER_ARENA_HEAP, arena.heap);
+    arena_release(&arena);
 
-    return PAM_AUTH_ERR;
+    return rc;
 }
 
 PAM_EXTERN int pam_sm_setcred(pam_handle_t* pamh, int flags, int argc,
@@ -0,0 +1,597 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <json-c/json.h>
+
+#include "challenge.h"
+#include "config.h"
+#include "provision.h"
+#include "store.h"
+#include "telegram.h"
+
+#define POLLING_TIMEOUT 30      /* seconds, server side long polling */
+#define POLL_RETRY_MS   1000    /* pause after a failed getUpdates */
+#define EXPIRE_TICK_MS  100
+
+#define START_COMMAND   "/start "
+
+typedef struct {
+        char *name;
+        uid_t uid;
+        char nonce[CHALLENGE_MAX_NONCE + 1];
+        int bot;                        /* index in bots */
+        char *mode;                     /* NULL for default */
+        char chat_id[32];
+        const char *error;              /* why it failed, NULL if it didn't */
+} provision_user;
+
+/* One getUpdates stream, shared by every user of the bot */
+typedef struct {
+        char *token;
+        char key[16];                   /* bot index, the chat_id part of challenge keys */
+        size_t users;                   /* users of the list given this bot */
+        size_t pending;                 /* users who didn't send /start yet */
+        long long offset;
+        pthread_t thread;
+} provision_bot;
+
+static struct {
+        const provision_options *opts;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;            /* queue got a user, or nobody pending any more */
+        challenge_table *pending;       /* users waiting for their /start */
+        provision_user *users;
+        size_t user_count;
+        provision_bot *bots;
+        size_t bot_count;
+        size_t *queue;                  /* users matched, configs to write */
+        size_t queue_head, queue_tail;
+        size_t waiting;                 /* users pending of every bot */
+        uint64_t deadline;
+        size_t written, failed;
+        size_t welcomed;                /* welcome messages delivered */
+        size_t updates, unmatched, poll_errors;
+} prov = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static
+uint64_t monotonic_ms(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static
+void sleep_ms(unsigned int ms)
+{
+        struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+        nanosleep(&ts, NULL);
+}
+
+/* Read the whole list, from stdin with "-" */
+static
+char *read_list(const char *path)
+{
+        FILE *f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+        if (!f) {
+                fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+                return NULL;
+        }
+
+        size_t len = 0, size = 4096;
+        char *buf = malloc(size);
+        while (buf) {
+                len += fread(buf + len, 1, size - len - 1, f);
+                if (len < size - 1)
+                        break;
+
+                char *tmp = realloc(buf, size *= 2);
+                if (!tmp)
+                        free(buf);
+                buf = tmp;
+        }
+        if (buf)
+                buf[len] = '\0';
+        else
+                perror("malloc()");
+
+        if (f != stdin)
+                fclose(f);
+        return buf;
+}
+
+static
+bool resolve_user(const char *name, uid_t *uid)
+{
+        char buf[16384];
+        struct passwd pwd, *result = NULL;
+        char *end;
+
+        errno = 0;
+        unsigned long id = strtoul(name, &end, 10);
+        if (*name && !*end && !errno)
+                getpwuid_r((uid_t) id, &pwd, buf, sizeof(buf), &result);
+        else
+                getpwnam_r(name, &pwd, buf, sizeof(buf), &result);
+
+        if (result)
+                *uid = pwd.pw_uid;
+        return result != NULL;
+}
+
+/* Deep link payloads telegram passes on: A-Z, a-z, 0-9, _ and - */
+static
+bool valid_nonce(const char *nonce)
+{
+        size_t len = strlen(nonce);
+
+        if (len == 0 || len > CHALLENGE_MAX_NONCE)
+                return false;
+        for (; *nonce; nonce++)
+                if (!isalnum((unsigned char) *nonce) && *nonce != '_' && *nonce != '-')
+                        return false;
+        return true;
+}
+
+static
+int bot_index(const char *token)
+{
+        for (size_t i = 0; i < prov.bot_count; i++)
+                if (!strcmp(prov.bots[i].token, token))
+                        return i;
+
+        provision_bot *tmp = realloc(prov.bots, (prov.bot_count + 1) * sizeof(*tmp));
+        if (!tmp)
+                return -1;
+        prov.bots = tmp;
+
+        provision_bot *bot = &prov.bots[prov.bot_count];
+        memset(bot, 0, sizeof(*bot));
+        bot->token = strdup(token);
+        if (!bot->token)
+                return -1;
+        snprintf(bot->key, sizeof(bot->key), "%zu", prov.bot_count);
+
+        return prov.bot_count++;
+}
+
+/**
+ * Add a user of the list, users failing a check are kept with their error so
+ * they show up in the report.
+ */
+static
+bool add_user(const char *name, const char *nonce, const char *token, const char *mode)
+{
+        provision_user *tmp = realloc(prov.users, (prov.user_count + 1) * sizeof(*tmp));
+        if (!tmp)
+                return false;
+        prov.users = tmp;
+
+        provision_user *u = &prov.users[prov.user_count++];
+        memset(u, 0, sizeof(*u));
+        u->bot = -1;
+        u->name = strdup(name);
+        if (!u->name)
+                return false;
+
+        config_mode m;
+        if (!token || !*token)
+                token = prov.opts->token;
+        if (!mode || !*mode)
+                mode = prov.opts->mode;
+
+        if (!resolve_user(name, &u->uid))
+                u->error = "no such user";
+        else if (!valid_nonce(nonce))
+                u->error = "invalid nonce";
+        else if (!token)
+                u->error = "no bot token";
+        else if (mode && !config_mode_parse(mode, &m))
+                u->error = "unknown mode";
+        else if (mode && !(u->mode = strdup(mode)))
+                return false;
+
+        if (!u->error) {
+                strcpy(u->nonce, nonce);
+                u->bot = bot_index(token);
+                if (u->bot < 0)
+                        return false;
+                prov.bots[u->bot].users++;
+        }
+        return true;
+}
+
+/**
+ * List the bots given to more than one user, and refuse approve mode on
+ * them: without telegram-authenticatord the logins of their users would
+ * poll getUpdates at once, which telegram allows once per bot.
+ *
+ * @return  false   failed to write the list of shared bots
+ *          true    shared bots listed
+ */
+static
+bool check_shared_bots(void)
+{
+        const char **shared = calloc(prov.bot_count + 1, sizeof(*shared));
+        size_t nshared = 0;
+        if (!shared)
+                return false;
+
+        for (size_t i = 0; i < prov.bot_count; i++) {
+                if (prov.bots[i].users > 1 || store_bot_shared(STORE_SHARED_BOTS_FILE, prov.bots[i].token))
+                        shared[nshared++] = prov.bots[i].token;
+        }
+
+        for (size_t i = 0; i < prov.user_count; i++) {
+                provision_user *u = &prov.users[i];
+                config_mode mode;
+                if (u->error || !u->mode || !config_mode_parse(u->mode, &mode) || CONFIG_MODE_APPROVE != mode)
+                        continue;
+
+                for (size_t j = 0; j < nshared; j++)
+                        if (shared[j] == prov.bots[u->bot].token)
+                                u->error = "approve mode needs a bot of its own";
+        }
+
+        bool ok = store_add_shared_bots(STORE_SHARED_BOTS_FILE, shared, nshared);
+        if (!ok)
+                fprintf(stderr, "Cannot write %s\n", STORE_SHARED_BOTS_FILE);
+        free(shared);
+        return ok;
+}
+
+static
+char *trim_field(char *s)
+{
+        while (isspace((unsigned char) *s))
+                s++;
+
+        char *end = s + strlen(s);
+        while (end > s && isspace((unsigned char) end[-1]))
+                *--end = '\0';
+        return s;
+}
+
+/* user,nonce[,token[,mode]] per line, # comments and a "user,..." header skipped */
+static
+bool parse_csv(char *list)
+{
+        char *saveptr = NULL;
+        bool first = true;
+
+        for (char *line = strtok_r(list, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+                char *fields[4] = { NULL };
+                int n = 0;
+
+                line = trim_field(line);
+                if (!*line || '#' == *line)
+                        continue;
+
+                for (char *p = line; p && n < 4; n++) {
+                        fields[n] = p;
+                        p = strchr(p, ',');
+                        if (p)
+                                *p++ = '\0';
+                        fields[n] = trim_field(fields[n]);
+                }
+
+                if (first && !strcmp(fields[0], "user")) {
+                        first = false;
+                        continue;
+                }
+                first = false;
+
+                if (!add_user(fields[0], fields[1] ? fields[1] : "", fields[2], fields[3]))
+                        return false;
+        }
+        return true;
+}
+
+static
+const char *json_field(json_object *obj, const char *key)
+{
+        json_object *val;
+
+        if (!json_object_object_get_ex(obj, key, &val) || !json_object_is_type(val, json_type_string))
+                return NULL;
+        return json_object_get_string(val);
+}
+
+/* [{"user": ..., "nonce": ..., "token": ..., "mode": ...}, ...] */
+static
+bool parse_json(const char *list)
+{
+        json_object *root = json_tokener_parse(list);
+
+        if (!root || !json_object_is_type(root, json_type_array)) {
+                fprintf(stderr, "Invalid JSON list of users\n");
+                json_object_put(root);
+                return false;
+        }
+
+        bool ok = true;
+        for (size_t i = 0; ok && i < json_object_array_length(root); i++) {
+                json_object *obj = json_object_array_get_idx(root, i);
+                const char *name = json_field(obj, "user");
+                const char *nonce = json_field(obj, "nonce");
+
+                ok = add_user(name ? name : "", nonce ? nonce : "",
+                              json_field(obj, "token"), json_field(obj, "mode"));
+        }
+
+        json_object_put(root);
+        return ok;
+}
+
+/* Called with lock held */
+static
+void user_done(provision_user *u)
+{
+        prov.bots[u->bot].pending--;
+        if (0 == --prov.waiting)
+                pthread_cond_broadcast(&prov.cond);
+}
+
+static
+void on_expire(void *data, void *userdata)
+{
+        provision_user *u = data;
+
+        u->error = "no /start before timeout";
+        prov.failed++;
+        user_done(u);
+}
+
+static
+void on_update(const telegram_update *update, void *userdata)
+{
+        provision_bot *bot = userdata;
+
+        pthread_mutex_lock(&prov.lock);
+        prov.updates++;
+
+        provision_user *u = NULL;
+        if (update->chat_id[0] && !strncmp(update->text, START_COMMAND, strlen(START_COMMAND)))
+                u = challenge_remove(prov.pending, bot->key, update->text + strlen(START_COMMAND));
+
+        if (u) {
+                snprintf(u->chat_id, sizeof(u->chat_id), "%s", update->chat_id);
+                prov.queue[prov.queue_tail++] = u - prov.users;
+                user_done(u);
+                pthread_cond_broadcast(&prov.cond);
+        } else {
+                prov.unmatched++;
+        }
+        pthread_mutex_unlock(&prov.lock);
+}
+
+/* Follow the bot's updates until each of its users sent /start or expired */
+static
+void *poll_thread(void *arg)
+{
+        provision_bot *bot = arg;
+
+        for (;;) {
+                pthread_mutex_lock(&prov.lock);
+                uint64_t now = monotonic_ms();
+                challenge_expire(prov.pending, now, on_expire, NULL);
+                size_t pending = bot->pending;
+                pthread_mutex_unlock(&prov.lock);
+
+                if (0 == pending)
+                        break;
+
+                /* past the deadline, the wheel expires the rest within a tick */
+                if (now >= prov.deadline) {
+                        sleep_ms(EXPIRE_TICK_MS);
+                        continue;
+                }
+
+                int timeout = (prov.deadline - now + 999) / 1000;
+                if (timeout > POLLING_TIMEOUT)
+                        timeout = POLLING_TIMEOUT;
+
+                if (!telegram_poll_updates(bot->token, &bot->offset, timeout, on_update, bot)) {
+                        pthread_mutex_lock(&prov.lock);
+                        prov.poll_errors++;
+                        pthread_mutex_unlock(&prov.lock);
+                        sleep_ms(POLL_RETRY_MS);
+                }
+        }
+
+        /* remove what we have read from server's pending updates */
+        if (bot->offset > 0)
+                telegram_confirm_updates(bot->token, bot->offset);
+        return NULL;
+}
+
+/* Write config of each user matched, then welcome them */
+static
+void *write_thread(void *arg)
+{
+        const provision_options *opts = prov.opts;
+
+        for (;;) {
+                pthread_mutex_lock(&prov.lock);
+                while (prov.queue_head == prov.queue_tail && prov.waiting > 0)
+                        pthread_cond_wait(&prov.cond, &prov.lock);
+
+                if (prov.queue_head == prov.queue_tail) {
+                        pthread_mutex_unlock(&prov.lock);
+                        break;
+                }
+                provision_user *u = &prov.users[prov.queue[prov.queue_head++]];
+                pthread_mutex_unlock(&prov.lock);
+
+                const char *token = prov.bots[u->bot].token;
+                bool ok = config_write(u->uid, token, u->chat_id, opts->api_url, u->mode);
+                bool welcomed = false;
+                if (ok) {
+                        char message[512];
+                        snprintf(message, sizeof(message),
+                                 "Welcome to use telegram-authenticator, your setup for user %s is done.",
+                                 u->name);
+                        /* paced by the send scheduler like any message to telegram */
+                        welcomed = telegram_send(token, u->chat_id, message);
+                }
+
+                pthread_mutex_lock(&prov.lock);
+                if (ok) {
+                        prov.written++;
+                        prov.welcomed += welcomed;
+                } else {
+                        u->error = "cannot write config";
+                        prov.failed++;
+                }
+                pthread_mutex_unlock(&prov.lock);
+        }
+        return NULL;
+}
+
+static
+void report(double seconds)
+{
+        printf("Provisioned %zu of %zu users in %.1f seconds (%.1f users/s), %zu failed\n",
+               prov.written, prov.user_count, seconds,
+               seconds > 0 ? prov.written / seconds : 0.0, prov.failed);
+        printf("bots=%zu updates=%zu unmatched=%zu poll_errors=%zu welcomed=%zu\n",
+               prov.bot_count, prov.updates, prov.unmatched, prov.poll_errors, prov.welcomed);
+        fflush(stdout);
+
+        for (size_t i = 0; i < prov.user_count; i++)
+                if (prov.users[i].error)
+                        fprintf(stderr, "FAILED %s: %s\n", prov.users[i].name, prov.users[i].error);
+}
+
+static
+void cleanup(void)
+{
+        for (size_t i = 0; i < prov.user_count; i++) {
+                free(prov.users[i].name);
+                free(prov.users[i].mode);
+        }
+        for (size_t i = 0; i < prov.bot_count; i++)
+                free(prov.bots[i].token);
+
+        free(prov.users);
+        free(prov.bots);
+        free(prov.queue);
+        challenge_destroy(prov.pending);
+}
+
+int provision_run(const provision_options *opts)
+{
+        prov.opts = opts;
+
+        char *list = read_list(opts->path);
+        if (!list)
+                return EXIT_FAILURE;
+
+        const char *p = list;
+        while (isspace((unsigned char) *p))
+                p++;
+        bool ok = ('[' == *p) ? parse_json(list) : parse_csv(list);
+        free(list);
+
+        if (!ok || 0 == prov.user_count) {
+                fprintf(stderr, ok ? "No users in %s\n" : "Failed to read list of users in %s\n",
+                        opts->path);
+                cleanup();
+                return EXIT_FAILURE;
+        }
+
+        if (!check_shared_bots()) {
+                cleanup();
+                return EXIT_FAILURE;
+        }
+
+        uint64_t start = monotonic_ms();
+        prov.deadline = start + (uint64_t) opts->timeout * 1000;
+        prov.queue = calloc(prov.user_count, sizeof(*prov.queue));
+        prov.pending = challenge_create(prov.user_count, EXPIRE_TICK_MS, start);
+        if (!prov.queue || !prov.pending) {
+                perror("malloc()");
+                cleanup();
+                return EXIT_FAILURE;
+        }
+
+        /* a nonce names one user of a bot */
+        for (size_t i = 0; i < prov.user_count; i++) {
+                provision_user *u = &prov.users[i];
+
+                if (u->error) {
+                        prov.failed++;
+                } else if (!challenge_insert(prov.pending, prov.bots[u->bot].key, u->nonce, u,
+                                             (uint64_t) opts->timeout * 1000)) {
+                        u->error = "duplicate nonce";
+                        prov.failed++;
+                } else {
+                        prov.bots[u->bot].pending++;
+                        prov.waiting++;
+                }
+        }
+
+        printf("Waiting up to %d seconds for %zu users to send /start <nonce> to their bot\n",
+               opts->timeout, prov.waiting);
+        fflush(stdout);
+
+        int jobs = opts->jobs > 0 ? opts->jobs : 1;
+        pthread_t *writers = calloc(jobs, sizeof(*writers));
+        int started = 0;
+
+        for (; writers && started < jobs; started++)
+                if (pthread_create(&writers[started], NULL, write_thread, NULL))
+                        break;
+
+        size_t polling = 0;
+        for (; started > 0 && polling < prov.bot_count; polling++)
+                if (pthread_create(&prov.bots[polling].thread, NULL, poll_thread, &prov.bots[polling]))
+                        break;
+
+        if (started == 0 || polling < prov.bot_count) {
+                fprintf(stderr, "ERROR: Failed on pthread_create().\n");
+                exit(EXIT_FAILURE);
+        }
+
+        for (size_t i = 0; i < prov.bot_count; i++)
+                pthread_join(prov.bots[i].thread, NULL);
+        for (int i = 0; i < started; i++)
+                pthread_join(writers[i], NULL);
+        free(writers);
+
+        report((monotonic_ms() - start) / 1e3);
+
+        int rc = prov.failed ? EXIT_FAILURE : 0;
+        cleanup();
+        return rc;
+}
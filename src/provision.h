@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _TELEGRAM_AUTHENTICATOR_PROVISION_H_
+#define _TELEGRAM_AUTHENTICATOR_PROVISION_H_
+
+/*
+ * Batch setup of many users by `telegram-authenticator --provision`.
+ *
+ * Each user is given a start nonce, opens the bot with the deep link
+ * https://t.me/<bot>?start=<nonce> and telegram sends "/start <nonce>". One
+ * getUpdates stream per bot matches those to the users, and their configs
+ * are written by a pool of threads while the stream goes on.
+ */
+
+typedef struct {
+        const char *path;       /* CSV or JSON list of users, "-" for stdin */
+        const char *token;      /* bot of users without their own, may be NULL */
+        const char *api_url;    /* saved in every config, NULL for none */
+        const char *mode;       /* mode of users without their own, NULL for code */
+        int jobs;               /* threads writing configs */
+        int timeout;            /* seconds users have to send /start */
+} provision_options;
+
+/**
+ * Provision every user in the list and print a report.
+ *
+ * The list is CSV with one user per line, `user,nonce[,token[,mode]]`, or a
+ * JSON array of objects with the same keys. user is a login name or uid,
+ * nonce 1 to 48 characters of A-Z, a-z, 0-9, _ and -.
+ *
+ * @param opts      options
+ *
+ * @return 0 if every user was provisioned, EXIT_FAILURE otherwise
+ */
+int provision_run(const provision_options *opts);
+
+#endif /* _TELEGRAM_AUTHENTICATOR_PROVISION_H_ */
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/random.h>
+
+#include "random.h"
+
+/*
+ * Each thread keeps its own pool, a busy multithreaded service generating
+ * codes in parallel never contends on a lock. Bytes are wiped once handed out.
+ */
+static __thread struct {
+        unsigned char buf[RANDOM_POOL_SIZE];
+        size_t pos;                     /* next unused byte, RANDOM_POOL_SIZE if empty */
+} pool = { .pos = RANDOM_POOL_SIZE };
+
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+/* A child of fork() got a copy of the pool of the forking thread, drawing from
+ * it would hand out the same bytes as the parent */
+static
+void pool_drop(void)
+{
+        explicit_bzero(pool.buf, sizeof(pool.buf));
+        pool.pos = sizeof(pool.buf);
+}
+
+static
+void atfork_register(void)
+{
+        pthread_atfork(NULL, NULL, pool_drop);
+}
+
+static
+bool pool_refill(void)
+{
+        size_t got = 0;
+
+        /* before the first refill no pool has bytes a child could share */
+        pthread_once(&atfork_once, atfork_register);
+
+        while (got < sizeof(pool.buf)) {
+                ssize_t n = getrandom(pool.buf + got, sizeof(pool.buf) - got, 0);
+                if (n < 0) {
+                        if (EINTR == errno)
+                                continue;
+                        return false;
+                }
+                got += n;
+        }
+
+        pool.pos = 0;
+        return true;
+}
+
+/**
+ * Fill buf with cryptographically secure random bytes.
+ * Bytes come from a per-thread pool refilled from getrandom(), so no locking
+ * and only one syscall every RANDOM_POOL_SIZE bytes.
+ *
+ * @param buf   buffer to fill
+ * @param len   bytes wanted
+ *
+ * @return  false   kernel failed to give us random bytes
+ *          true    buf filled
+ */
+bool random_bytes(void *buf, size_t len)
+{
+        unsigned char *out = buf;
+
+        while (len) {
+                if (pool.pos >= sizeof(pool.buf) && !pool_refill())
+                        return false;
+
+                size_t n = sizeof(pool.buf) - pool.pos;
+                if (n > len)
+                        n = len;
+
+                memcpy(out, pool.buf + pool.pos, n);
+                explicit_bzero(pool.buf + pool.pos, n);
+                pool.pos += n;
+                out += n;
+                len -= n;
+        }
+
+        return true;
+}
+
+/**
+ * Generate a string of uniformly distributed decimal digits.
+ *
+ * @param str       buffer of at least digits + 1 bytes
+ * @param digits    number of digits
+ *
+ * @return  false   failed to get random bytes, str is empty
+ *          true    str filled and '\0' terminated
+ */
+bool random_digits(char *str, size_t digits)
+{
+        for (size_t n = 0; n < digits; ) {
+                unsigned char b;
+                if (!random_bytes(&b, 1)) {
+                        explicit_bzero(str, n);
+                        str[0] = '\0';
+                        return false;
+                }
+
+                /* 250 is the largest multiple of 10 below 256, reject the rest
+                 * so every digit is equally likely */
+                if (b < 250)
+                        str[n++] = '0' + b % 10;
+        }
+
+        str[digits] = '\0';
+        return true;
+}
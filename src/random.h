@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _TELEGRAM_AUTHENTICATOR_RANDOM_H_
+#define _TELEGRAM_AUTHENTICATOR_RANDOM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Bytes fetched from the kernel at once into each thread's pool */
+#define RANDOM_POOL_SIZE 256
+
+/**
+ * Fill buf with cryptographically secure random bytes.
+ * Bytes come from a per-thread pool refilled from getrandom(), so no locking
+ * and only one syscall every RANDOM_POOL_SIZE bytes.
+ *
+ * @param buf   buffer to fill
+ * @param len   bytes wanted
+ *
+ * @return  false   kernel failed to give us random bytes
+ *          true    buf filled
+ */
+bool random_bytes(void *buf, size_t len);
+
+/**
+ * Generate a string of uniformly distributed decimal digits.
+ *
+ * @param str       buffer of at least digits + 1 bytes
+ * @param digits    number of digits
+ *
+ * @return  false   failed to get random bytes, str is empty
+ *          true    str filled and '\0' terminated
+ */
+bool random_digits(char *str, size_t digits);
+
+#endif /* _TELEGRAM_AUTHENTICATOR_RANDOM_H_ */
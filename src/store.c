@@ -0,0 +1,736 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * System-wide credential store.
+ *
+ * A constant database built in one go and never modified in place:
+ *
+ *   header
+ *   uid index     nbuckets x store_bucket, open addressing with linear probing
+ *   name index    nbuckets x store_bucket
+ *   records       store_record + "name\0token\0chat_id\0[api_url\0][chats]", 4 bytes aligned
+ *
+ * chats are the extra chats of the config, packed by config_chats_pack().
+ *
+ * A bucket with offset 0 is empty. Indexes are at most half full, a lookup
+ * usually touches one bucket and one record.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "store.h"
+
+#define STORE_MAGIC   0x53414754        /* "TGAS" */
+#define STORE_VERSION 3
+
+typedef struct {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t nbuckets;              /* power of 2 */
+        uint32_t nrecords;
+        uint32_t uid_index;             /* offsets from start of file */
+        uint32_t name_index;
+        uint32_t records;
+        uint32_t size;                  /* total file size */
+} store_header;
+
+typedef struct {
+        uint32_t hash;
+        uint32_t offset;                /* record offset, 0 if empty */
+} store_bucket;
+
+typedef struct {
+        uint32_t uid;
+        uint16_t name_len;
+        uint16_t token_len;
+        uint16_t chat_id_len;
+        uint16_t api_url_len;           /* 0: no api_url string, host default */
+        uint8_t mode;                   /* config_mode */
+        uint8_t nchats;
+        uint8_t quorum;
+        uint8_t reserved;
+        uint16_t chats_len;             /* bytes of chats after api_url */
+        uint16_t reserved2;
+        char data[];                    /* name\0token\0chat_id\0[api_url\0][chats] */
+} store_record;
+
+/* Mapping of the store, kept per process and remapped when file replaced */
+static struct {
+        pthread_mutex_t lock;
+        char path[256];
+        dev_t dev;
+        ino_t ino;
+        const char *addr;
+        size_t size;
+} store = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static inline
+uint32_t hash_uid(uid_t uid)
+{
+        uint32_t h = (uint32_t) uid * 2654435761u;
+        return h ? h : 1;
+}
+
+/* FNV-1a */
+static inline
+uint32_t hash_name(const char *name)
+{
+        uint32_t h = 2166136261u;
+        while (*name) {
+                h ^= (unsigned char) *name++;
+                h *= 16777619u;
+        }
+        return h ? h : 1;
+}
+
+/**
+ * Check the whole store is sane, so lookups can trust every offset.
+ */
+static
+bool store_valid(const char *addr, size_t size)
+{
+        const store_header *hdr = (const store_header *) addr;
+
+        if (size < sizeof(*hdr) ||
+            STORE_MAGIC != hdr->magic ||
+            STORE_VERSION != hdr->version ||
+            hdr->size != size ||
+            0 == hdr->nbuckets ||
+            (hdr->nbuckets & (hdr->nbuckets - 1)) ||
+            hdr->uid_index != sizeof(*hdr))
+                return false;
+
+        size_t index_size = (size_t) hdr->nbuckets * sizeof(store_bucket);
+        if (hdr->name_index != hdr->uid_index + index_size ||
+            hdr->records != hdr->name_index + index_size ||
+            hdr->records > size)
+                return false;
+
+        /* every bucket must point to a complete record */
+        const store_bucket *buckets = (const store_bucket *) (addr + hdr->uid_index);
+        for (size_t i = 0; i < 2 * (size_t) hdr->nbuckets; i++) {
+                uint32_t off = buckets[i].offset;
+                if (!off)
+                        continue;
+                if (off < hdr->records || off + sizeof(store_record) > size)
+                        return false;
+
+                const store_record *rec = (const store_record *) (addr + off);
+                size_t api_url = rec->api_url_len ? rec->api_url_len + 1 : 0;
+                if (off + sizeof(*rec) + rec->name_len + rec->token_len + rec->chat_id_len + 3 +
+                    api_url + rec->chats_len > size)
+                        return false;
+
+                const char *data = rec->data;
+                size_t chat_id_end = rec->name_len + 1 + rec->token_len + 1 + rec->chat_id_len;
+                if (data[rec->name_len] ||
+                    data[rec->name_len + 1 + rec->token_len] ||
+                    data[chat_id_end] ||
+                    (api_url && data[chat_id_end + api_url]) ||
+                    (rec->chats_len && data[chat_id_end + api_url + rec->chats_len]) ||
+                    rec->nchats > CONFIG_MAX_CHATS ||
+                    rec->mode > CONFIG_MODE_APPROVE)
+                        return false;
+        }
+
+        return true;
+}
+
+/**
+ * Map store file, reuse current mapping unless the file was replaced.
+ * Must be called with store.lock held.
+ */
+static
+bool store_map(const char *path)
+{
+        struct stat st;
+        if (stat(path, &st) < 0)
+                return false;
+
+        if (store.addr && !strcmp(store.path, path) &&
+            store.dev == st.st_dev && store.ino == st.st_ino)
+                return true;
+
+        if (store.addr) {
+                munmap((void *) store.addr, store.size);
+                store.addr = NULL;
+        }
+
+        if (strlen(path) >= sizeof(store.path))
+                return false;
+
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                return false;
+
+        /* store holds everyone's token, refuse one others can write */
+        if (fstat(fd, &st) < 0 || (0 != st.st_uid && geteuid() != st.st_uid) ||
+            (st.st_mode & 022) ||
+            (size_t) st.st_size < sizeof(store_header)) {
+                close(fd);
+                return false;
+        }
+
+        void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (MAP_FAILED == addr)
+                return false;
+
+        if (!store_valid(addr, st.st_size)) {
+                fprintf(stderr, "ERROR: invalid telegram-authenticator store: %s\n", path);
+                munmap(addr, st.st_size);
+                return false;
+        }
+
+        strcpy(store.path, path);
+        store.dev = st.st_dev;
+        store.ino = st.st_ino;
+        store.addr = addr;
+        store.size = st.st_size;
+
+        return true;
+}
+
+/**
+ * Copy record to config_t.
+ */
+static
+bool record_to_config(const store_record *rec, config_t *cfg)
+{
+        const char *token = rec->data + rec->name_len + 1;
+        const char *chat_id = token + rec->token_len + 1;
+
+        const char *api_url = chat_id + rec->chat_id_len + 1;
+        const char *chats = api_url + (rec->api_url_len ? rec->api_url_len + 1 : 0);
+
+        cfg->token = config_strdup(cfg, token);
+        cfg->chat_id = config_strdup(cfg, chat_id);
+        cfg->api_url = rec->api_url_len ? config_strdup(cfg, api_url) : NULL;
+        cfg->mode = rec->mode;
+        cfg->quorum = rec->quorum;
+        if (!cfg->token || !cfg->chat_id || (rec->api_url_len && !cfg->api_url) ||
+            !config_chats_unpack(cfg, chats, rec->chats_len, rec->nchats)) {
+                config_free(*cfg);
+                memset(cfg, 0, sizeof(*cfg));
+                return false;
+        }
+
+        return true;
+}
+
+/**
+ * Probe one of the index for a record.
+ *
+ * @param index     offset of index to search
+ * @param hash      key hash
+ * @param uid       uid to match, ignored when name is not NULL
+ * @param name      name to match
+ */
+static
+bool store_lookup(const char *path, uint32_t index, uint32_t hash,
+                  uid_t uid, const char *name, config_t *cfg)
+{
+        bool found = false;
+
+        pthread_mutex_lock(&store.lock);
+        if (store_map(path)) {
+                const store_header *hdr = (const store_header *) store.addr;
+                uint32_t off = (index == 0) ? hdr->uid_index : hdr->name_index;
+                const store_bucket *buckets = (const store_bucket *) (store.addr + off);
+                uint32_t mask = hdr->nbuckets - 1;
+
+                for (uint32_t i = 0; i <= mask; i++) {
+                        const store_bucket *b = &buckets[(hash + i) & mask];
+                        if (!b->offset)
+                                break;
+                        if (b->hash != hash)
+                                continue;
+
+                        const store_record *rec = (const store_record *) (store.addr + b->offset);
+                        if (name ? !strcmp(rec->data, name) : rec->uid == uid) {
+                                found = record_to_config(rec, cfg);
+                                break;
+                        }
+                }
+        }
+        pthread_mutex_unlock(&store.lock);
+
+        return found;
+}
+
+/**
+ * Find user's config in the store by uid.
+ * The returned value should use config_free() when no longer needed.
+ *
+ * @param path  store file
+ * @param uid   user uid
+ * @param cfg   config to fill when found
+ *
+ * @return  false   store not exist or user not in store
+ *          true    cfg filled
+ */
+bool store_lookup_uid(const char *path, uid_t uid, config_t *cfg)
+{
+        return store_lookup(path, 0, hash_uid(uid), uid, NULL, cfg);
+}
+
+/**
+ * Find user's config in the store by user name.
+ * The returned value should use config_free() when no longer needed.
+ *
+ * @param path  store file
+ * @param name  user name
+ * @param cfg   config to fill when found
+ *
+ * @return  false   store not exist or user not in store
+ *          true    cfg filled
+ */
+bool store_lookup_name(const char *path, const char *name, config_t *cfg)
+{
+        return store_lookup(path, 1, hash_name(name), 0, name, cfg);
+}
+
+typedef struct {
+        uid_t uid;
+        char *name;
+        char *home;
+} store_user;
+
+/**
+ * Insert record offset into index.
+ */
+static
+void index_insert(store_bucket *buckets, uint32_t nbuckets, uint32_t hash, uint32_t offset)
+{
+        uint32_t mask = nbuckets - 1;
+        for (uint32_t i = 0; ; i++) {
+                store_bucket *b = &buckets[(hash + i) & mask];
+                if (!b->offset) {
+                        b->hash = hash;
+                        b->offset = offset;
+                        return;
+                }
+        }
+}
+
+/**
+ * Collect every user in passwd database.
+ */
+static
+store_user *collect_users(size_t *count)
+{
+        store_user *users = NULL;
+        size_t n = 0, cap = 0;
+        struct passwd *pw;
+
+        setpwent();
+        while ((pw = getpwent())) {
+                if (!pw->pw_dir || '/' != *pw->pw_dir)
+                        continue;
+
+                if (n == cap) {
+                        cap = cap ? cap * 2 : 256;
+                        store_user *p = realloc(users, cap * sizeof(*users));
+                        if (!p) {
+                                perror("realloc()");
+                                exit(EXIT_FAILURE);
+                        }
+                        users = p;
+                }
+
+                users[n].uid = pw->pw_uid;
+                users[n].name = strdup(pw->pw_name);
+                users[n].home = strdup(pw->pw_dir);
+                if (!users[n].name || !users[n].home) {
+                        perror("strdup()");
+                        exit(EXIT_FAILURE);
+                }
+                n++;
+        }
+        endpwent();
+
+        *count = n;
+        return users;
+}
+
+/**
+ * Write buffer to a temp file next to path, then rename it over path.
+ *
+ * @param mode  permissions of the file
+ */
+static
+bool write_atomic(const char *path, const void *buf, size_t size, mode_t mode)
+{
+        char tmp[512];
+        if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int) sizeof(tmp))
+                return false;
+
+        char *dir = strdup(path);
+        if (dir) {
+                mkdir(dirname(dir), 0755);
+                free(dir);
+        }
+
+        int fd = mkstemp(tmp);
+        if (fd < 0) {
+                perror("mkstemp()");
+                return false;
+        }
+
+        const char *p = buf;
+        size_t left = size;
+        while (left > 0) {
+                ssize_t n = write(fd, p, left);
+                if (n < 0 && EINTR == errno)
+                        continue;
+                if (n <= 0) {
+                        perror("write()");
+                        close(fd);
+                        unlink(tmp);
+                        return false;
+                }
+                p += n;
+                left -= n;
+        }
+
+        if (fchmod(fd, mode) < 0 || fsync(fd) < 0 || close(fd) < 0 || rename(tmp, path) < 0) {
+                perror("rename()");
+                unlink(tmp);
+                return false;
+        }
+
+        return true;
+}
+
+/**
+ * Write a store holding exactly the given entries.
+ * The new store is written aside and renamed over the old one.
+ *
+ * @param path      store file
+ * @param entries   users to put in store
+ * @param count     number of entries
+ *
+ * @return  false   failed to write the store
+ *          true    store replaced
+ */
+bool store_build(const char *path, const store_entry *entries, size_t count)
+{
+        /* records area, grown as we go */
+        char *records = NULL;
+        size_t records_size = 0, records_cap = 0;
+        uint32_t *offsets = calloc(count ? count : 1, sizeof(uint32_t));
+        uint32_t nrecords = 0;
+
+        if (!offsets) {
+                perror("calloc()");
+                return false;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+                const store_entry *e = &entries[i];
+                size_t name_len = strlen(e->name);
+                size_t token_len = strlen(e->token);
+                size_t chat_id_len = strlen(e->chat_id);
+                size_t api_url_len = e->api_url ? strlen(e->api_url) : 0;
+                char chats[CONFIG_MAX_CHATS_PACKED];
+                int chats_len = config_chats_pack(e->chats, e->nchats, chats, sizeof(chats));
+                size_t rec_size = (sizeof(store_record) + name_len + token_len + chat_id_len + 3 +
+                                   (api_url_len ? api_url_len + 1 : 0) + (chats_len > 0 ? chats_len : 0) +
+                                   3) & ~(size_t) 3;
+
+                if (name_len > UINT16_MAX || token_len > UINT16_MAX ||
+                    chat_id_len > UINT16_MAX || api_url_len > UINT16_MAX)
+                        continue;
+
+                if (chats_len < 0 || e->nchats > CONFIG_MAX_CHATS || e->quorum > UINT8_MAX) {
+                        fprintf(stderr, "ERROR: too many chats for %s, left out of the store\n", e->name);
+                        continue;
+                }
+
+                if (records_size + rec_size > records_cap) {
+                        records_cap = (records_cap + rec_size) * 2;
+                        char *p = realloc(records, records_cap);
+                        if (!p) {
+                                perror("realloc()");
+                                free(records);
+                                free(offsets);
+                                return false;
+                        }
+                        records = p;
+                }
+
+                store_record *rec = (store_record *) (records + records_size);
+                memset(rec, 0, rec_size);
+                rec->uid = e->uid;
+                rec->name_len = name_len;
+                rec->token_len = token_len;
+                rec->chat_id_len = chat_id_len;
+                rec->api_url_len = api_url_len;
+                rec->mode = e->mode;
+                rec->nchats = e->nchats;
+                rec->quorum = e->quorum;
+                rec->chats_len = chats_len;
+                strcpy(rec->data, e->name);
+                strcpy(rec->data + name_len + 1, e->token);
+                strcpy(rec->data + name_len + 1 + token_len + 1, e->chat_id);
+                char *p = rec->data + name_len + 1 + token_len + 1 + chat_id_len + 1;
+                if (api_url_len) {
+                        strcpy(p, e->api_url);
+                        p += api_url_len + 1;
+                }
+                memcpy(p, chats, chats_len);
+
+                offsets[nrecords++] = records_size;
+                records_size += rec_size;
+        }
+
+        /* keep indexes at most half full */
+        uint32_t nbuckets = 16;
+        while (nbuckets < 2 * nrecords)
+                nbuckets <<= 1;
+
+        size_t index_size = (size_t) nbuckets * sizeof(store_bucket);
+        size_t size = sizeof(store_header) + 2 * index_size + records_size;
+        char *buf = (size <= UINT32_MAX) ? calloc(1, size) : NULL;
+        if (!buf) {
+                fprintf(stderr, "ERROR: too many users for the store\n");
+                free(records);
+                free(offsets);
+                return false;
+        }
+
+        store_header *hdr = (store_header *) buf;
+        hdr->magic = STORE_MAGIC;
+        hdr->version = STORE_VERSION;
+        hdr->nbuckets = nbuckets;
+        hdr->nrecords = nrecords;
+        hdr->uid_index = sizeof(store_header);
+        hdr->name_index = hdr->uid_index + index_size;
+        hdr->records = hdr->name_index + index_size;
+        hdr->size = size;
+
+        if (records_size)
+                memcpy(buf + hdr->records, records, records_size);
+
+        store_bucket *uid_index = (store_bucket *) (buf + hdr->uid_index);
+        store_bucket *name_index = (store_bucket *) (buf + hdr->name_index);
+        for (uint32_t i = 0; i < nrecords; i++) {
+                uint32_t off = hdr->records + offsets[i];
+                const store_record *rec = (const store_record *) (buf + off);
+
+                index_insert(uid_index, nbuckets, hash_uid(rec->uid), off);
+                index_insert(name_index, nbuckets, hash_name(rec->data), off);
+        }
+
+        bool ok = write_atomic(path, buf, size, 0600);
+
+        free(offsets);
+        free(records);
+        free(buf);
+
+        return ok;
+}
+
+/**
+ * Build the store from every user's ~/.telegram_authenticator.
+ * The new store is written aside and renamed over the old one, readers always
+ * see either the old or the new store.
+ *
+ * @param path  store file
+ *
+ * @return number of users in the new store, -1 on failure
+ */
+int store_compile(const char *path)
+{
+        size_t nusers;
+        store_user *users = collect_users(&nusers);
+
+        store_entry *entries = calloc(nusers ? nusers : 1, sizeof(store_entry));
+        config_t *configs = calloc(nusers ? nusers : 1, sizeof(config_t));
+        size_t count = 0;
+
+        if (!entries || !configs) {
+                perror("calloc()");
+                exit(EXIT_FAILURE);
+        }
+
+        for (size_t i = 0; i < nusers; i++) {
+                char file[512];
+                snprintf(file, sizeof(file), "%s%s", users[i].home, CONFIG_FILE);
+
+                configs[count] = config_read_file(file, NULL);
+                if (!configs[count].token)
+                        continue;
+
+                entries[count].uid = users[i].uid;
+                entries[count].name = users[i].name;
+                entries[count].token = configs[count].token;
+                entries[count].chat_id = configs[count].chat_id;
+                entries[count].api_url = configs[count].api_url;
+                entries[count].mode = configs[count].mode;
+                entries[count].chats = configs[count].chats;
+                entries[count].nchats = configs[count].nchats;
+                entries[count].quorum = configs[count].quorum;
+                count++;
+        }
+
+        bool ok = store_build(path, entries, count);
+
+        for (size_t i = 0; i < count; i++)
+                config_free(configs[i]);
+        for (size_t i = 0; i < nusers; i++) {
+                free(users[i].name);
+                free(users[i].home);
+        }
+        free(users);
+        free(entries);
+        free(configs);
+
+        return ok ? (int) count : -1;
+}
+
+/* Bot id, the part of the token before ':', not a secret */
+static
+size_t bot_id_len(const char *token)
+{
+        return strcspn(token, ":");
+}
+
+/* Check if the bot of token is a line of list */
+static
+bool bot_listed(const char *list, size_t len, const char *token)
+{
+        size_t n = bot_id_len(token);
+
+        for (const char *line = list; line < list + len; ) {
+                const char *end = memchr(line, '\n', list + len - line);
+                if (!end)
+                        end = list + len;
+                if ((size_t) (end - line) == n && !strncmp(line, token, n))
+                        return true;
+                line = end + 1;
+        }
+        return false;
+}
+
+/**
+ * Check if a bot is in the list of shared bots.
+ *
+ * @param path  list of shared bots
+ * @param token bot token
+ *
+ * @return  false   not listed, or no list
+ *          true    more users share the bot
+ */
+bool store_bot_shared(const char *path, const char *token)
+{
+        FILE *f = fopen(path, "re");
+        if (!f)
+                return false;
+
+        size_t len = bot_id_len(token);
+        char line[64];
+        bool found = false;
+        while (!found && fgets(line, sizeof(line), f))
+                found = strcspn(line, "\n") == len && !strncmp(line, token, len);
+        fclose(f);
+
+        return found;
+}
+
+/**
+ * Add bots to the list of shared bots, keeping those listed already.
+ * The new list is written aside and renamed over the old one.
+ *
+ * @param path      list of shared bots
+ * @param tokens    bot tokens, only their bot id is written
+ * @param count     number of tokens
+ *
+ * @return  false   failed to write the list
+ *          true    every bot listed
+ */
+bool store_add_shared_bots(const char *path, const char *const *tokens, size_t count)
+{
+        size_t len = 0, size = 4096;
+        char *buf = malloc(size);
+        if (!buf)
+                return false;
+
+        FILE *f = fopen(path, "re");
+        if (f) {
+                char line[64];
+                while (fgets(line, sizeof(line), f)) {
+                        size_t n = strcspn(line, "\n");
+                        if (n + 2 > size - len) {
+                                char *tmp = realloc(buf, size *= 2);
+                                if (!tmp) {
+                                        fclose(f);
+                                        free(buf);
+                                        return false;
+                                }
+                                buf = tmp;
+                        }
+                        memcpy(buf + len, line, n);
+                        len += n;
+                        buf[len++] = '\n';
+                }
+                fclose(f);
+        }
+
+        bool changed = false;
+        for (size_t i = 0; i < count; i++) {
+                if (bot_listed(buf, len, tokens[i]))
+                        continue;
+
+                size_t n = bot_id_len(tokens[i]);
+                if (n + 2 > size - len) {
+                        size = size * 2 + n;
+                        char *tmp = realloc(buf, size);
+                        if (!tmp) {
+                                free(buf);
+                                return false;
+                        }
+                        buf = tmp;
+                }
+                memcpy(buf + len, tokens[i], n);
+                len += n;
+                buf[len++] = '\n';
+                changed = true;
+        }
+
+        /* users read it to tell whether they may use approve mode */
+        bool ok = !changed || write_atomic(path, buf, len, 0644);
+        free(buf);
+        return ok;
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _TELEGRAM_AUTHENTICATOR_STORE_H_
+#define _TELEGRAM_AUTHENTICATOR_STORE_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "config.h"
+
+/* System-wide credential store, compiled by `telegram-authenticator --compile-store` */
+#define STORE_FILE "/etc/telegram-authenticator/users.db"
+
+/* Bots `telegram-authenticator --provision` gave to more than one user, one
+ * bot id per line. Without telegram-authenticatord their users can't wait for
+ * a button: only one getUpdates of a bot may run at a time */
+#define STORE_SHARED_BOTS_FILE "/etc/telegram-authenticator/shared_bots"
+
+typedef struct {
+        uid_t uid;
+        const char *name;
+        const char *token;
+        const char *chat_id;
+        const char *api_url;    /* NULL for host default */
+        config_mode mode;
+        const config_chat *chats;
+        int nchats;
+        int quorum;
+} store_entry;
+
+/**
+ * Find user's config in the store by uid.
+ * The returned value should use config_free() when no longer needed.
+ *
+ * @param path  store file
+ * @param uid   user uid
+ * @param cfg   config to fill when found
+ *
+ * @return  false   store not exist or user not in store
+ *          true    cfg filled
+ */
+bool store_lookup_uid(const char *path, uid_t uid, config_t *cfg);
+
+/**
+ * Find user's config in the store by user name.
+ * The returned value should use config_free() when no longer needed.
+ *
+ * @param path  store file
+ * @param name  user name
+ * @param cfg   config to fill when found
+ *
+ * @return  false   store not exist or user not in store
+ *          true    cfg filled
+ */
+bool store_lookup_name(const char *path, const char *name, config_t *cfg);
+
+/**
+ * Write a store holding exactly the given entries.
+ * The new store is written aside and renamed over the old one.
+ *
+ * @param path      store file
+ * @param entries   users to put in store
+ * @param count     number of entries
+ *
+ * @return  false   failed to write the store
+ *          true    store replaced
+ */
+bool store_build(const char *path, const store_entry *entries, size_t count);
+
+/**
+ * Build the store from every user's ~/.telegram_authenticator.
+ * The new store is written aside and renamed over the old one, readers always
+ * see either the old or the new store.
+ *
+ * @param path  store file
+ *
+ * @return number of users in the new store, -1 on failure
+ */
+int store_compile(const char *path);
+
+/**
+ * Check if a bot is in the list of shared bots.
+ *
+ * @param path  list of shared bots
+ * @param token bot token
+ *
+ * @return  false   not listed, or no list
+ *          true    more users share the bot
+ */
+bool store_bot_shared(const char *path, const char *token);
+
+/**
+ * Add bots to the list of shared bots, keeping those listed already.
+ * The new list is written aside and renamed over the old one.
+ *
+ * @param path      list of shared bots
+ * @param tokens    bot tokens, only their bot id is written
+ * @param count     number of tokens
+ *
+ * @return  false   failed to write the list
+ *          true    every bot listed
+ */
+bool store_add_shared_bots(const char *path, const char *const *tokens, size_t count);
+
+#endif /* _TELEGRAM_AUTHENTICATOR_STORE_H_ */
@@ -23,12 +23,21 @@
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <pwd.h>
 
 #include "config.h"
+#include "metrics.h"
+#include "provision.h"
+#include "store.h"
 #include "telegram.h"
 
-#define POLLING_INTERVAL 10000 // 10 ms
+#define POLLING_TIMEOUT 30 // seconds, server side long polling
+#define POLLING_RETRIES 5  // getUpdates failed in a row before giving up
+
+/* Defaults of --provision */
+#define PROVISION_JOBS    8
+#define PROVISION_TIMEOUT 3600
 
 static void trim (char *s) {
         int i = strlen(s) - 1;
@@ -70,13 +79,170 @@ static bool maybe(const char *question)
 }
 
 
+static void usage(const char *prog)
+{
+        printf("Usage: %s [options]\n"
+               "\n"
+               "Without options, interactively setup telegram-authenticator for current user.\n"
+               "Once set up, --api-url and --mode only change that setting of your config.\n"
+               "\n"
+               "  --api-url=URL            use your own bot api server, saved in your config\n"
+               "  --mode=MODE              how to confirm a login, saved in your config:\n"
+               "                           code     type the code sent to telegram (default)\n"
+               "                           approve  press Approve in telegram\n"
+               "  --compile-store[=PATH]   build system-wide store from every user's config\n"
+               "                           (default: %s)\n"
+               "  --provision=FILE         set up every user listed in FILE (CSV or JSON, - for\n"
+               "                           stdin) without asking, matching the /start <nonce>\n"
+               "                           each user sends to the bot; run as root\n"
+               "  --token=TOKEN            bot of users listed without a token\n"
+               "  --jobs=N                 configs written at once (default: %d)\n"
+               "  --timeout=SECONDS        time users have to send /start (default: %d)\n"
+               "  --metrics                print timing histograms in Prometheus text format\n"
+               "  -h, --help               show this help\n",
+               prog, STORE_FILE, PROVISION_JOBS, PROVISION_TIMEOUT);
+}
+
+/* Build system-wide credential store from users' ~/.telegram_authenticator */
+static int compile_store(const char *path)
+{
+        int count = store_compile(path);
+        if (count < 0) {
+                fprintf(stderr, "Failed to write store: %s\n", path);
+                return EXIT_FAILURE;
+        }
+
+        printf("Compiled %d users into %s\n", count, path);
+        return 0;
+}
+
+/* Dump metrics collected by the PAM module and telegram-authenticatord */
+static int print_metrics(void)
+{
+        if (!metrics_shared()) {
+                fprintf(stderr, "Cannot read %s, are you root?\n", METRICS_FILE);
+                return EXIT_FAILURE;
+        }
+
+        return metrics_write(stdout) ? 0 : EXIT_FAILURE;
+}
+
+/* Approve mode polls getUpdates, which a bot shared with other users can't */
+static bool approve_allowed(const char *mode, const char *token)
+{
+        config_mode m;
+        if (!mode || !config_mode_parse(mode, &m) || CONFIG_MODE_APPROVE != m ||
+            !store_bot_shared(STORE_SHARED_BOTS_FILE, token))
+                return true;
+
+        fprintf(stderr, "Your bot is shared with other users, approve mode needs a bot of its own\n");
+        return false;
+}
+
 int main(int argc, char *argv[])
 {
+        static const struct option long_options[] = {
+                { "api-url",       required_argument, NULL, 'a' },
+                { "mode",          required_argument, NULL, 'o' },
+                { "compile-store", optional_argument, NULL, 'c' },
+                { "metrics",       no_argument,       NULL, 'm' },
+                { "provision",     required_argument, NULL, 'p' },
+                { "token",         required_argument, NULL, 't' },
+                { "jobs",          required_argument, NULL, 'j' },
+                { "timeout",       required_argument, NULL, 'T' },
+                { "help",          no_argument,       NULL, 'h' },
+                { NULL, 0, NULL, 0 }
+        };
+
+        const char *api_url = NULL;
+        const char *mode = NULL;
+        provision_options prov = {
+                .jobs = PROVISION_JOBS,
+                .timeout = PROVISION_TIMEOUT,
+        };
+        telegram_endpoint ep;
+        config_mode m;
+
+        int opt;
+        while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+                switch (opt) {
+                case 'a':
+                        /* unix sockets are for the admin, see telegram_endpoint_parse() */
+                        if (!telegram_endpoint_parse(&ep, optarg, false) || !telegram_set_api_url(optarg))
+                                return EXIT_FAILURE;
+                        api_url = optarg;
+                        break;
+                case 'o':
+                        if (!config_mode_parse(optarg, &m)) {
+                                fprintf(stderr, "Unknown mode: %s\n", optarg);
+                                return EXIT_FAILURE;
+                        }
+                        mode = optarg;
+                        break;
+                case 'c':
+                        return compile_store(optarg ? optarg : STORE_FILE);
+                case 'm':
+                        return print_metrics();
+                case 'p':
+                        prov.path = optarg;
+                        break;
+                case 't':
+                        prov.token = optarg;
+                        break;
+                case 'j':
+                        prov.jobs = atoi(optarg);
+                        break;
+                case 'T':
+                        prov.timeout = atoi(optarg);
+                        break;
+                case 'h':
+                        usage(argv[0]);
+                        return 0;
+                default:
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        if (prov.path) {
+                if (prov.jobs <= 0 || prov.timeout <= 0) {
+                        fprintf(stderr, "--jobs and --timeout must be positive\n");
+                        return EXIT_FAILURE;
+                }
+                prov.api_url = api_url;
+                prov.mode = mode;
+                return provision_run(&prov);
+        }
+
         /* get uid */
         uid_t uid = getuid();
 
         /* Check if config file already exists or not */
         bool has_config = config_exists(uid);
+
+        /* --mode or --api-url on their own only change that field */
+        if (has_config && (mode || api_url)) {
+                config_t cfg = config_read(uid);
+                bool valid = cfg.token && cfg.chat_id;
+                bool allowed = !valid || approve_allowed(mode, cfg.token);
+                config_free(cfg);
+                if (!valid) {
+                        fprintf(stderr, "Cannot read your config, run %s without options to set it up again\n",
+                                argv[0]);
+                        return EXIT_FAILURE;
+                }
+                if (!allowed)
+                        return EXIT_FAILURE;
+
+                if (!config_write(uid, NULL, NULL, api_url, mode)) {
+                        fprintf(stderr, "Failed to write config\n");
+                        return EXIT_FAILURE;
+                }
+                printf("Your config is updated:\n");
+                config_print(uid);
+                return 0;
+        }
+
         if (has_config) {
                 printf("You already has previously configs with folloing settings:\n");
                 config_print(uid);
@@ -92,6 +258,20 @@ int main(int argc, char *argv[])
         fgets(token, sizeof(token), stdin);
         trim(token);
 
+        if (!approve_allowed(mode, token))
+                return EXIT_FAILURE;
+
+        /* a /start sent before, e.g. in an earlier setup, must not count */
+        long long offset = 0;
+        if (!telegram_skip_updates(token, &offset)) {
+                if (telegram_updates_conflict())
+                        fprintf(stderr, "Your bot has a webhook set or is polled by another program, "
+                                "stop telegram-authenticatord or call deleteWebhook\n");
+                else
+                        fprintf(stderr, "Cannot get updates of your bot, check the token\n");
+                return EXIT_FAILURE;
+        }
+
         /* Send message to telegram  */
         printf("Please type '/start' to your telegram bot\n");
 
@@ -99,21 +279,35 @@ int main(int argc, char *argv[])
         printf("Waiting for user type '/start' in telegram bot channel\n");
 
         char *chat_id = NULL;
+        int failures = 0;
         while (1) {
-                chat_id = (char *) telegram_fetch_chat_id(token);
+                if (!telegram_fetch_chat_id(token, &offset, POLLING_TIMEOUT, &chat_id)) {
+                        /* network trouble, or another getUpdates of this bot running */
+                        if (telegram_updates_conflict() || ++failures >= POLLING_RETRIES) {
+                                fprintf(stderr, "Cannot get updates of your bot, giving up\n");
+                                return EXIT_FAILURE;
+                        }
+                        sleep(failures);
+                        continue;
+                }
+                failures = 0;
 
                 if (chat_id) {
                         printf("\nFind chat_id: %s\n", chat_id);
                         break;
                 }
-
-                usleep(POLLING_INTERVAL);
-                free(chat_id);
         }
 
+        /* remove what we have read from server's pending updates */
+        telegram_confirm_updates(token, offset);
+
         /* write to config file */
         if (maybe("Do you want to write setting to your config?")) {
-                config_write(uid, token, chat_id);
+                if (!config_write(uid, token, chat_id, api_url, mode)) {
+                        fprintf(stderr, "Failed to write config\n");
+                        free(chat_id);
+                        return EXIT_FAILURE;
+                }
 
                 /* send something to notify user */
                 char message[512];
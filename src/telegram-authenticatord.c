@@ -0,0 +1,326 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * telegram-authenticatord keeps connections to telegram bot api warm, and send
+ * messages on behalf of pam_telegram_authenticator.so over a unix socket. Login
+ * codes it sends are held until the module checks the answer, or they expire.
+ */
+
+#define _GNU_SOURCE             /* accept4() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "broker.h"
+#include "codes.h"
+#include "metrics.h"
+#include "telegram.h"
+#include "webhook.h"
+
+/* How often the metrics textfile is rewritten */
+#define METRICS_INTERVAL 15
+
+static const char *socket_path = BROKER_SOCKET;
+static const char *metrics_path = NULL;
+static bool use_webhook = false;
+static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t dump_stats = 0;
+
+static void usage(const char *prog)
+{
+        fprintf(stderr,
+                "Usage: %s [-s socket] [-a api_url] [-r rate] [-c rate] [-q size] [-m file]\n"
+                "       [-w [host:]port -u url]\n"
+                "\n"
+                "  -s socket   unix socket to listen on (default: %s)\n"
+                "  -a api_url  bot api server, http(s)://host[:port] or unix:PATH\n"
+                "              (default: https://api.telegram.org)\n"
+                "  -r rate     messages per second for all chats (default: 30)\n"
+                "  -c rate     messages per second to one chat (default: 1)\n"
+                "  -q size     messages allowed to wait for sending (default: 256)\n"
+                "  -m file     write metrics in Prometheus text format to file every %ds\n"
+                "  -w listen   receive updates by webhook on [host:]port (host: 127.0.0.1)\n"
+                "  -u url      public https url forwarded to the webhook listener\n"
+                "\n"
+                "Send SIGUSR1 to print send queue statistics.\n",
+                prog, BROKER_SOCKET, METRICS_INTERVAL);
+}
+
+static void on_signal(int sig)
+{
+        if (SIGUSR1 == sig)
+                dump_stats = 1;
+        else
+                running = 0;
+}
+
+static void print_stats(void)
+{
+        telegram_send_stats stats;
+        telegram_get_send_stats(&stats);
+
+        fprintf(stderr, "send queue: depth=%zu peak=%zu sent=%zu failed=%zu rejected=%zu "
+                "retries=%zu throttled=%zu wait_mean=%.1fms wait_max=%.1fms\n",
+                stats.depth, stats.peak_depth, stats.sent, stats.failed, stats.rejected,
+                stats.retries, stats.throttled,
+                stats.sent ? stats.wait_total_ms / stats.sent : 0, stats.wait_max_ms);
+
+        if (use_webhook) {
+                webhook_stats ws;
+                webhook_get_stats(&ws);
+                fprintf(stderr, "webhook: received=%zu dispatched=%zu unmatched=%zu rejected=%zu refused=%zu "
+                        "waiting=%zu\n",
+                        ws.received, ws.dispatched, ws.unmatched, ws.rejected, ws.refused, ws.waiting);
+        }
+
+        codes_stats cs;
+        codes_get_stats(&cs);
+        fprintf(stderr, "codes: issued=%zu checked=%zu expired=%zu pending=%zu\n",
+                cs.issued, cs.checked, cs.expired, cs.pending);
+}
+
+/* Keep the textfile for node_exporter up to date */
+static void *metrics_thread(void *arg)
+{
+        for (;;) {
+                if (!metrics_write_file(metrics_path))
+                        fprintf(stderr, "ERROR: Failed to write metrics to %s\n", metrics_path);
+                sleep(METRICS_INTERVAL);
+        }
+        return NULL;
+}
+
+/* Ack of a send, telling the module if the server refused it or is in trouble */
+static broker_status send_status(bool ok)
+{
+        if (ok)
+                return BROKER_OK;
+        return TELEGRAM_SEND_REJECTED == telegram_get_last_send_result() ? BROKER_REJECTED : BROKER_FAILED;
+}
+
+/* Send approval buttons and wait for the webhook to bring the answer */
+static void approve(int fd, const broker_request *req)
+{
+        /* without webhook the module polls getUpdates by itself */
+        if (!use_webhook || !webhook_register(req->token)) {
+                broker_write_ack(fd, BROKER_UNAVAILABLE);
+                return;
+        }
+
+        webhook_waiter *waiter = webhook_wait_begin(req->chat_id, req->nonce, req->timeout);
+        if (!waiter) {
+                broker_write_ack(fd, BROKER_FAILED);
+                return;
+        }
+
+        if (!telegram_send_approval(NULL, req->token, req->chat_id, req->msg, req->nonce)) {
+                webhook_wait_cancel(waiter);
+                broker_write_ack(fd, send_status(false));
+                return;
+        }
+
+        broker_write_ack(fd, BROKER_OK);
+
+        char callback_id[64];
+        telegram_approval answer = webhook_wait_end(waiter, callback_id, sizeof(callback_id));
+        broker_write_answer(fd, answer);
+
+        if (TELEGRAM_APPROVAL_TIMEOUT != answer)
+                telegram_answer_callback(NULL, req->token, callback_id,
+                                         TELEGRAM_APPROVAL_APPROVED == answer ? "Login approved" : "Login denied");
+}
+
+/* Hold login code before sending it, so an answer can't come before it's known */
+static void send_code(int fd, const broker_request *req)
+{
+        /* the module then sends and checks the code by itself */
+        if (!codes_add(req->chat_id, req->nonce, req->code, req->timeout)) {
+                broker_write_ack(fd, BROKER_UNAVAILABLE);
+                return;
+        }
+
+        bool ok = telegram_send(req->token, req->chat_id, req->msg);
+        if (!ok)
+                codes_drop(req->chat_id, req->nonce);
+        broker_write_ack(fd, send_status(ok));
+}
+
+/* Serve one client: read request, send it, ack with the result */
+static void *client_thread(void *arg)
+{
+        int fd = (int) (intptr_t) arg;
+        broker_request req;
+
+        if (broker_read_request(fd, &req)) {
+                switch (req.type) {
+                case BROKER_APPROVE:
+                        approve(fd, &req);
+                        break;
+                case BROKER_CODE:
+                        send_code(fd, &req);
+                        break;
+                case BROKER_CHECK:
+                        broker_write_ack(fd, codes_check(req.chat_id, req.nonce, req.code));
+                        break;
+                default:
+                        broker_write_ack(fd, send_status(telegram_send(req.token, req.chat_id, req.msg)));
+                        break;
+                }
+        }
+
+        /* codes and answers are in the request and the message */
+        explicit_bzero(&req, sizeof(req));
+        close(fd);
+        return NULL;
+}
+
+/* Create socket's parent directory if it doesn't exist */
+static void make_socket_dir(const char *path)
+{
+        char *dup = strdup(path);
+        if (!dup) {
+                perror("strdup()");
+                exit(EXIT_FAILURE);
+        }
+
+        mkdir(dirname(dup), 0755);
+        free(dup);
+}
+
+int main(int argc, char *argv[])
+{
+        telegram_send_limits limits = {
+                .global_rate = 30, .global_burst = 30,
+                .chat_rate = 1, .chat_burst = 3,
+                .queue_max = 256, .deadline_ms = 20000,
+        };
+
+        const char *webhook_listen = NULL, *webhook_url = NULL;
+
+        int opt;
+        while ((opt = getopt(argc, argv, "s:a:r:c:q:m:w:u:h")) != -1) {
+                switch (opt) {
+                case 's':
+                        socket_path = optarg;
+                        break;
+                case 'a':
+                        if (!telegram_set_api_url(optarg))
+                                return EXIT_FAILURE;
+                        break;
+                case 'r':
+                        limits.global_rate = limits.global_burst = atof(optarg);
+                        break;
+                case 'c':
+                        limits.chat_rate = atof(optarg);
+                        break;
+                case 'q':
+                        limits.queue_max = atoi(optarg);
+                        break;
+                case 'm':
+                        metrics_path = optarg;
+                        break;
+                case 'w':
+                        webhook_listen = optarg;
+                        break;
+                case 'u':
+                        webhook_url = optarg;
+                        break;
+                default:
+                        usage(argv[0]);
+                        return (opt == 'h') ? 0 : EXIT_FAILURE;
+                }
+        }
+
+        if (limits.global_rate <= 0 || limits.chat_rate <= 0 || !webhook_listen != !webhook_url) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+        telegram_set_send_limits(&limits);
+
+        /* do not use SA_RESTART, we want accept() to be interrupted */
+        struct sigaction sa = { .sa_handler = on_signal };
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        sigaction(SIGUSR1, &sa, NULL);
+        signal(SIGPIPE, SIG_IGN);
+
+        if (webhook_listen) {
+                if (!webhook_start(webhook_listen, webhook_url))
+                        return EXIT_FAILURE;
+                use_webhook = true;
+        }
+
+        if (!codes_start())
+                return EXIT_FAILURE;
+
+        make_socket_dir(socket_path);
+
+        int lfd = broker_listen(socket_path);
+        if (lfd < 0)
+                return EXIT_FAILURE;
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+        pthread_t tid;
+        if (metrics_path && pthread_create(&tid, &attr, metrics_thread, NULL))
+                fprintf(stderr, "ERROR: Failed on pthread_create().\n");
+
+        while (running) {
+                if (dump_stats) {
+                        dump_stats = 0;
+                        print_stats();
+                }
+
+                int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+                if (fd < 0) {
+                        if (EINTR != errno)
+                                perror("accept()");
+                        continue;
+                }
+
+                if (pthread_create(&tid, &attr, client_thread, (void *) (intptr_t) fd)) {
+                        fprintf(stderr, "ERROR: Failed on pthread_create().\n");
+                        broker_write_ack(fd, BROKER_FAILED);
+                        close(fd);
+                }
+        }
+
+        pthread_attr_destroy(&attr);
+        close(lfd);
+        unlink(socket_path);
+        webhook_unregister_all();
+        print_stats();
+        if (metrics_path)
+                metrics_write_file(metrics_path);
+
+        return 0;
+}
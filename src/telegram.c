@@ -22,245 +22,2189 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
+#include "json_scan.h"
+#include "metrics.h"
+#include "random.h"
 #include "telegram.h"
+#include "tls_cache.h"
 
 #include <curl/curl.h>
-#include <json-c/json.h>
 
 #define BOT_API_URL "https://api.telegram.org/bot"
 
+/* Max idle curl handles we keep warm for reuse */
+#define TRANSPORT_POOL_SIZE 4
+
+/* Response buffers kept for reuse, and the largest one worth keeping */
+#define BUFFER_POOL_SIZE 8
+#define BUFFER_INITIAL   1024
+#define BUFFER_KEEP_MAX  (64 * 1024)
+
+/* We only look at small json replies, never hold more than this */
+#define BUFFER_MAX       (1024 * 1024)
+
+/* Default send limits. Telegram allows about 30 messages per second per bot,
+ * and about one per second to a chat with short bursts. The global ones are
+ * per bot token */
+#define SEND_GLOBAL_RATE        30
+#define SEND_GLOBAL_BURST       30
+#define SEND_CHAT_RATE          1
+#define SEND_CHAT_BURST         3
+#define SEND_QUEUE_MAX          256
+#define SEND_DEADLINE_MS        20000   /* below BROKER_ACK_TIMEOUT */
+#define SEND_BACKOFF_BASE_MS    250
+#define SEND_BACKOFF_MAX_MS     8000
+#define SEND_REFUSED_RETRIES    1       /* server not resolved or refusing connections */
+
+/* Longest a request waits for its connection, so a dead server leaves time
+ * for a retry within the send deadline */
+#define CONNECT_TIMEOUT_MS      5000
+
+/* Requests made once without the send scheduler, e.g. setWebhook */
+#define API_TIMEOUT_MS          10000
+
+/* Bots and chats we keep a token bucket for, power of 2 */
+#define SEND_BUCKET_SLOTS 256
+#define SEND_BUCKET_PROBE 8
+
+/* callback_data of the approval buttons, followed by the nonce */
+#define APPROVAL_APPROVE        "approve:"
+#define APPROVAL_DENY           "deny:"
+
+/* Long polling of one getUpdates while waiting for a button, and the pause
+ * after a failed one */
+#define APPROVAL_POLL_S         25
+#define APPROVAL_RETRY_MS       1000
+
+/* Parse getUpdates response while curl receives it */
+typedef struct {
+        json_scanner scanner;
+        bool ok;                        /* response has "ok": true */
+        char description[256];          /* why not ok */
+        telegram_update update;         /* update being scanned */
+        telegram_update_cb on_update;
+        void *userdata;
+} updates_reader;
+
+/* Endpoint used when caller doesn't give one, see telegram_set_api_url() */
+static telegram_endpoint default_endpoint = {
+        .url = BOT_API_URL,
+        .url_len = sizeof(BOT_API_URL) - 1,
+};
+
+/* CA certificates to verify servers with, NULL for the system ones */
+static const char *ca_file;
+
+static
+bool is_loopback_url(const char *url)
+{
+        static const char *const hosts[] = { "localhost", "127.0.0.1", "[::1]" };
+        const char *host = strstr(url, "://") + 3;
+
+        for (size_t i = 0; i < sizeof(hosts) / sizeof(hosts[0]); i++) {
+                size_t len = strlen(hosts[i]);
+                if (!strncmp(host, hosts[i], len) &&
+                    ('\0' == host[len] || ':' == host[len] || '/' == host[len]))
+                        return true;
+        }
+        return false;
+}
+
+/**
+ * Parse endpoint spec into ep. The spec is one of
+ *
+ *   https://host[:port][/path]     any server
+ *   http://host[:port][/path]      plain http, meant for a local server
+ *   unix:/path/to/socket           local server listening on a unix socket
+ *
+ * "/bot" is appended to the url unless it already ends with it.
+ *
+ * @param ep            endpoint to fill
+ * @param spec          endpoint spec
+ * @param allow_unix    accept unix sockets, only for specs from the admin
+ *
+ * @return  false   invalid spec, error printed
+ *          true    ep filled
+ */
+bool telegram_endpoint_parse(telegram_endpoint *ep, const char *spec, bool allow_unix)
+{
+        const char *url = spec;
+
+        ep->unix_socket[0] = '\0';
+
+        if (!strncmp(spec, "unix:", 5)) {
+                const char *path = spec + 5;
+                if (!allow_unix || '/' != *path || strlen(path) >= sizeof(ep->unix_socket)) {
+                        fprintf(stderr, "ERROR: invalid bot api endpoint: %s\n", spec);
+                        return false;
+                }
+                strcpy(ep->unix_socket, path);
+                url = "http://localhost";
+        } else if (strncmp(spec, "https://", 8) && strncmp(spec, "http://", 7)) {
+                fprintf(stderr, "ERROR: invalid bot api endpoint: %s\n", spec);
+                return false;
+        } else if (!strncmp(spec, "http://", 7) && !is_loopback_url(spec)) {
+                fprintf(stderr, "WARNING: bot token sent in clear text to %s\n", spec);
+        }
+
+        size_t len = strlen(url);
+        while (len > 0 && '/' == url[len - 1])
+                len--;
+
+        bool has_bot = len >= 4 && !strncmp(url + len - 4, "/bot", 4);
+        if (len + (has_bot ? 0 : 4) >= sizeof(ep->url)) {
+                fprintf(stderr, "ERROR: bot api endpoint too long: %s\n", spec);
+                return false;
+        }
+
+        memcpy(ep->url, url, len);
+        if (!has_bot) {
+                memcpy(ep->url + len, "/bot", 4);
+                len += 4;
+        }
+        ep->url[len] = '\0';
+        ep->url_len = len;
+
+        return true;
+}
+
+/**
+ * Use another Bot API server, e.g. a self-hosted one or a local test server.
+ * Set it once at startup, it's not synchronized with requests in flight.
+ *
+ * @param spec  endpoint as accepted by telegram_endpoint_parse(), NULL for default
+ *
+ * @return  false   invalid spec, endpoint not changed
+ *          true    endpoint changed
+ */
+bool telegram_set_api_url(const char *spec)
+{
+        telegram_endpoint ep;
+
+        if (!spec)
+                spec = BOT_API_URL;
+        if (!telegram_endpoint_parse(&ep, spec, true))
+                return false;
+
+        default_endpoint = ep;
+        return true;
+}
+
+/**
+ * Verify bot api servers against these CA certificates instead of the system
+ * ones, e.g. for a self-hosted server with a private CA. Set it once at
+ * startup, it's not synchronized with requests in flight.
+ *
+ * @param path  PEM file, kept by reference, NULL for the system CAs
+ */
+void telegram_set_ca_file(const char *path)
+{
+        ca_file = path;
+}
+
+/**
+ * Build url of bot api method into url, no allocation involved.
+ *
+ * @param ep      endpoint, NULL for the default one
+ * @param token   telegarm bot token
+ * @param method  telegram bot method, e.g. "/sendMessage"
+ * @param url     buffer to fill
+ * @param size    size of url, TELEGRAM_URL_MAX is always enough for a sane token
+ *
+ * @return  false   url doesn't fit, error printed
+ *          true    url filled
+ */
+bool telegram_api_url(const telegram_endpoint *ep, const char *token, const char *method,
+                      char *url, size_t size)
+{
+        if (!ep)
+                ep = &default_endpoint;
+
+        size_t token_len = strlen(token);
+        size_t method_len = strlen(method);
+        if (ep->url_len + token_len + method_len >= size) {
+                fprintf(stderr, "ERROR: bot token too long\n");
+                return false;
+        }
+
+        char *p = url;
+        memcpy(p, ep->url, ep->url_len);
+        p += ep->url_len;
+        memcpy(p, token, token_len);
+        p += token_len;
+        memcpy(p, method, method_len + 1);
+
+        return true;
+}
+
+/* Make curl reach the endpoint through its unix socket, if any */
+static inline
+void endpoint_setopt(CURL *curl, const telegram_endpoint *ep)
+{
+        if (!ep)
+                ep = &default_endpoint;
+        if (ep->unix_socket[0])
+                curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, ep->unix_socket);
+}
+
+/*
+ * Long-lived transport shared by every request we make.
+ *
+ * Idle easy handles are kept in a small pool so they stay warm, and all of them
+ * are attached to one CURLSH which shares the DNS cache, the connection cache and
+ * the SSL session cache. Subsequent requests to api.telegram.org can then skip
+ * the DNS lookup, the TCP connect and the TLS handshake entirely.
+ *
+ * The first request of a process still needs a new connection. Its TLS
+ * handshake is resumed from sessions other processes left in the tls cache,
+ * where the sessions of every new connection are saved in turn. That needs
+ * the session import/export of curl 8.12, which is optional at its build time.
+ */
+static struct {
+        pthread_mutex_t lock;           /* protects everything below */
+        bool initialized;
+        CURLSH *share;
+        struct curl_slist *json_headers;
+        CURL *pool[TRANSPORT_POOL_SIZE];
+        size_t npool;
+        bool tls_cache;                 /* libcurl can import and export sessions */
+} transport = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* One lock per curl_lock_data, used by the share interface */
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+static
+void share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+        pthread_mutex_lock(&share_locks[data]);
+}
+
+static
+void share_unlock(CURL *handle, curl_lock_data data, void *userptr)
+{
+        pthread_mutex_unlock(&share_locks[data]);
+}
+
+#if CURL_AT_LEAST_VERSION(8, 12, 0)
+static
+bool has_ssls_export(void)
+{
+        const curl_version_info_data *info = curl_version_info(CURLVERSION_NOW);
+
+        for (const char *const *name = info->feature_names; name && *name; name++) {
+                if (!strcmp(*name, "SSLS-EXPORT"))
+                        return true;
+        }
+        return false;
+}
+
+static
+void session_import(const tls_session *session, void *userdata)
+{
+        curl_easy_ssls_import(userdata, session->key[0] ? session->key : NULL,
+                              session->shmac_len ? session->shmac : NULL, session->shmac_len,
+                              session->data, session->data_len);
+}
+
+static
+CURLcode session_export(CURL *curl, void *userptr, const char *session_key,
+                        const unsigned char *shmac, size_t shmac_len,
+                        const unsigned char *sdata, size_t sdata_len,
+                        curl_off_t valid_until, int ietf_tls_id,
+                        const char *alpn, size_t earlydata_max)
+{
+        tls_cache_save(session_key, shmac, shmac_len, sdata, sdata_len, valid_until);
+        return CURLE_OK;
+}
+#endif
+
+static pthread_once_t global_once = PTHREAD_ONCE_INIT;
+static bool global_ok;
+
+static
+void global_init_once(void)
+{
+        global_ok = CURLE_OK == curl_global_init(CURL_GLOBAL_DEFAULT);
+        if (!global_ok)
+                fprintf(stderr, "ERROR: Failed on curl_global_init().");
+}
+
+/**
+ * Initialize libcurl once per process, never cleaned up: the module can't
+ * know whether the service uses curl as well.
+ *
+ * @return  false   failed to initialize curl
+ *          true    curl ready to use
+ */
+bool telegram_global_init(void)
+{
+        pthread_once(&global_once, global_init_once);
+        return global_ok;
+}
+
+/**
+ * Initialize the shared transport, must be called with transport.lock held.
+ *
+ * @return  false   failed to initialize curl
+ *          true    transport ready to use
+ */
+static
+bool transport_init(void)
+{
+        if (transport.initialized)
+                return true;
+
+        if (!telegram_global_init())
+                return false;
+
+        for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+                pthread_mutex_init(&share_locks[i], NULL);
+
+        transport.share = curl_share_init();
+        if (!transport.share) {
+                fprintf(stderr, "ERROR: Failed on curl_share_init().");
+                return false;
+        }
+
+        curl_share_setopt(transport.share, CURLSHOPT_LOCKFUNC, share_lock);
+        curl_share_setopt(transport.share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+        curl_share_setopt(transport.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(transport.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        curl_share_setopt(transport.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+        /* headers to make curl send with json request, built only once */
+        transport.json_headers = curl_slist_append(transport.json_headers, "Accept: application/json");
+        transport.json_headers = curl_slist_append(transport.json_headers, "Content-Type: application/json");
+
+#if CURL_AT_LEAST_VERSION(8, 12, 0)
+        /* sessions saved by other processes go into the share through the
+         * first handle of the pool */
+        transport.tls_cache = tls_cache_enabled() && has_ssls_export();
+        CURL *curl = transport.tls_cache ? curl_easy_init() : NULL;
+        if (curl) {
+                curl_easy_setopt(curl, CURLOPT_SHARE, transport.share);
+                tls_cache_load(session_import, curl);
+                transport.pool[transport.npool++] = curl;
+        }
+#endif
+
+        transport.initialized = true;
+        return true;
+}
+
+/**
+ * Take a warm curl handle from the pool, or create a new one if the pool is empty.
+ * The handle must be given back by transport_release().
+ *
+ * @return curl handler, NULL on failure
+ */
+static
+CURL *transport_acquire(void)
+{
+        CURL *curl = NULL;
+
+        pthread_mutex_lock(&transport.lock);
+        if (transport_init()) {
+                if (transport.npool > 0)
+                        curl = transport.pool[--transport.npool];
+                else
+                        curl = curl_easy_init();
+        }
+        pthread_mutex_unlock(&transport.lock);
+
+        if (!curl) {
+                fprintf(stderr, "ERROR: Failed on curl_easy_init().");
+                return NULL;
+        }
+
+        curl_easy_setopt(curl, CURLOPT_SHARE, transport.share);
+        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+        if (ca_file)
+                curl_easy_setopt(curl, CURLOPT_CAINFO, ca_file);
+
+        return curl;
+}
+
+/**
+ * Give the curl handle back to the pool, the connection it holds stays open
+ * in the shared connection cache.
+ *
+ * @param curl curl handler
+ */
+static
+void transport_release(CURL *curl)
+{
+        if (!curl)
+                return;
+
+        /* drop per-request options but keep connections and caches alive */
+        curl_easy_reset(curl);
+
+        pthread_mutex_lock(&transport.lock);
+        if (transport.initialized && transport.npool < TRANSPORT_POOL_SIZE) {
+                transport.pool[transport.npool++] = curl;
+                curl = NULL;
+        }
+        pthread_mutex_unlock(&transport.lock);
+
+        if (curl)
+                curl_easy_cleanup(curl);
+}
+
+/* Timing of the last request made by this thread */
+static __thread telegram_timing last_timing;
+
+/* How the last send of this thread ended */
+static __thread telegram_send_result last_send = TELEGRAM_SEND_NOT_SENT;
+
+/* Last getUpdates of this thread was refused with 409 */
+static __thread bool last_conflict;
+
+/**
+ * Record how long each phase of the request took, into the histograms and
+ * into last_timing. Must be called before curl is released.
+ */
+static
+void transport_timing(CURL *curl, CURLcode res)
+{
+        curl_off_t dns = 0, connect = 0, tls = 0, first_byte = 0, total = 0;
+        long connects = 0;
+
+        curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+        curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+        curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+        curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &first_byte);
+        curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+        curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+
+        /* curl gives us times from request start in us, we want each phase */
+        telegram_timing *t = &last_timing;
+        t->new_connection = connects > 0;
+        t->dns = dns / 1e6;
+        t->connect = connect > dns ? (connect - dns) / 1e6 : 0;
+        t->tls = tls > connect ? (tls - connect) / 1e6 : 0;
+        t->first_byte = first_byte / 1e6;
+        t->total = total / 1e6;
+
+        /* a reused connection has nothing to say about dns, connect and tls */
+        if (t->new_connection) {
+                metrics_observe(METRIC_DNS, t->dns);
+                metrics_observe(METRIC_CONNECT, t->connect);
+                if (tls > 0)
+                        metrics_observe(METRIC_TLS, t->tls);
+        }
+
+#if CURL_AT_LEAST_VERSION(8, 12, 0)
+        /* leave the sessions of a new TLS connection to the next process,
+         * even a resumed one brings fresh tickets */
+        if (transport.tls_cache && t->new_connection && tls > 0 && CURLE_OK == res)
+                curl_easy_ssls_export(curl, session_export, NULL);
+#endif
+
+        if (CURLE_OK == res)
+                metrics_observe(METRIC_FIRST_BYTE, t->first_byte);
+        metrics_observe(METRIC_REQUEST, t->total);
+        metrics_count(CURLE_OK == res ? COUNTER_REQUEST_OK : COUNTER_REQUEST_ERROR);
+}
+
+/**
+ * Get timing of the last bot api request made by the calling thread.
+ *
+ * @param timing    filled with timing of each phase
+ */
+void telegram_get_last_timing(telegram_timing *timing)
+{
+        *timing = last_timing;
+}
+
+/**
+ * Get how the last telegram_send_to(), telegram_send_approval() or
+ * telegram_send_fanout() of the calling thread ended.
+ *
+ * @return result of the send, TELEGRAM_SEND_NOT_SENT before any
+ */
+telegram_send_result telegram_get_last_send_result(void)
+{
+        return last_send;
+}
+
+/**
+ * Tell a server in trouble from one refusing this message.
+ *
+ * @param res       result of curl_easy_perform()
+ * @param status    http status, 0 if none
+ * @param ok        telegram took the message
+ */
+static
+telegram_send_result send_result(CURLcode res, long status, bool ok)
+{
+        if (ok)
+                return TELEGRAM_SEND_OK;
+        if (CURLE_OK != res || status >= 500)
+                return TELEGRAM_SEND_UNREACHABLE;
+        return TELEGRAM_SEND_REJECTED;
+}
+
+/*
+ * Response buffers.
+ *
+ * Buffers grow geometrically, so a response costs O(log n) reallocations
+ * instead of one per chunk curl delivers. Released buffers go back to a free
+ * list and are reused by the next request, so the steady state does no
+ * allocation at all.
+ */
+typedef struct telegram_buffer {
+        char *data;
+        size_t size;                    /* bytes used, data[size] is always '\0' */
+        size_t cap;
+        struct telegram_buffer *next;   /* free list link */
+} telegram_buffer;
+
+static struct {
+        pthread_mutex_t lock;
+        telegram_buffer *free;
+        size_t nfree;
+        size_t held;                    /* bytes held by all buffers */
+        telegram_buffer_stats stats;
+} buffers = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+ * Take an empty buffer, from the free list if possible.
+ *
+ * @return buffer, NULL on failure
+ */
+static
+telegram_buffer *buffer_get(void)
+{
+        pthread_mutex_lock(&buffers.lock);
+        telegram_buffer *buf = buffers.free;
+        if (buf) {
+                buffers.free = buf->next;
+                buffers.nfree--;
+                buffers.stats.reused++;
+        }
+        pthread_mutex_unlock(&buffers.lock);
+
+        if (!buf)
+                buf = calloc(1, sizeof(*buf));
+
+        if (buf) {
+                buf->size = 0;
+                buf->next = NULL;
+                if (buf->data)
+                        buf->data[0] = '\0';
+        }
+
+        return buf;
+}
+
+/**
+ * Give buffer back to free list, free it when the list is full or the buffer
+ * grew too large to be worth keeping.
+ */
+static
+void buffer_put(telegram_buffer *buf)
+{
+        if (!buf)
+                return;
+
+        pthread_mutex_lock(&buffers.lock);
+        if (buffers.nfree < BUFFER_POOL_SIZE && buf->cap <= BUFFER_KEEP_MAX) {
+                buf->next = buffers.free;
+                buffers.free = buf;
+                buffers.nfree++;
+                buf = NULL;
+        } else {
+                buffers.held -= buf->cap;
+        }
+        pthread_mutex_unlock(&buffers.lock);
+
+        if (buf) {
+                free(buf->data);
+                free(buf);
+        }
+}
+
+/**
+ * Make room for need bytes in buffer, at least doubling its capacity.
+ *
+ * @return  false   out of memory or more than BUFFER_MAX
+ *          true    buffer holds cap bytes
+ */
+static
+bool buffer_reserve(telegram_buffer *buf, size_t need)
+{
+        if (need <= buf->cap)
+                return true;
+
+        size_t cap = buf->cap ? buf->cap : BUFFER_INITIAL;
+        while (cap < need)
+                cap *= 2;
+
+        if (cap > BUFFER_MAX)
+                return false;
+
+        char *p = realloc(buf->data, cap);
+        if (!p)
+                return false;
+
+        pthread_mutex_lock(&buffers.lock);
+        buffers.held += cap - buf->cap;
+        if (buffers.held > buffers.stats.peak_bytes)
+                buffers.stats.peak_bytes = buffers.held;
+        buffers.stats.allocations++;
+        pthread_mutex_unlock(&buffers.lock);
+
+        buf->data = p;
+        buf->cap = cap;
+        return true;
+}
+
+/**
+ * Append data to buffer, double its capacity when needed.
+ *
+ * @return  false   out of memory or response too large
+ *          true    data appended
+ */
+static
+bool buffer_append(telegram_buffer *buf, const void *data, size_t len)
+{
+        if (!buffer_reserve(buf, buf->size + len + 1))
+                return false;
+
+        memcpy(buf->data + buf->size, data, len);
+        buf->size += len;
+        buf->data[buf->size] = '\0';
+
+        __atomic_add_fetch(&buffers.stats.total_bytes, len, __ATOMIC_RELAXED);
+
+        return true;
+}
+
+/**
+ * Free every buffer in free list.
+ */
+static
+void buffer_pool_cleanup(void)
+{
+        pthread_mutex_lock(&buffers.lock);
+        while (buffers.free) {
+                telegram_buffer *buf = buffers.free;
+                buffers.free = buf->next;
+                buffers.held -= buf->cap;
+                free(buf->data);
+                free(buf);
+        }
+        buffers.nfree = 0;
+        pthread_mutex_unlock(&buffers.lock);
+}
+
+/**
+ * Get statistics of response buffers.
+ *
+ * @param stats     filled with current statistics
+ */
+void telegram_get_buffer_stats(telegram_buffer_stats *stats)
+{
+        pthread_mutex_lock(&buffers.lock);
+        *stats = buffers.stats;
+        stats->total_bytes = __atomic_load_n(&buffers.stats.total_bytes, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&buffers.lock);
+}
+
+/**
+ * Release all warm connections, cached sessions and pooled buffers.
+ */
+void telegram_cleanup(void)
+{
+        pthread_mutex_lock(&transport.lock);
+        if (transport.initialized) {
+                while (transport.npool > 0)
+                        curl_easy_cleanup(transport.pool[--transport.npool]);
+
+                curl_share_cleanup(transport.share);
+                transport.share = NULL;
+
+                curl_slist_free_all(transport.json_headers);
+                transport.json_headers = NULL;
+
+                transport.initialized = false;
+        }
+        pthread_mutex_unlock(&transport.lock);
+
+        buffer_pool_cleanup();
+}
+
+/* Callback for curl read func, collect response into buffer */
+static
+size_t buffer_write_callback(void *ptr, size_t size, size_t nmemb, void *dest)
+{
+        size_t rsize = size * nmemb;
+
+        if (!buffer_append((telegram_buffer *) dest, ptr, rsize)) {
+                fprintf(stderr, "ERROR: no message readed from telegram channel!!!");
+                return 0;
+        }
+
+        return rsize;
+}
+
+static
+void copy_value(char *dest, size_t size, const char *value, size_t len)
+{
+        if (len >= size)
+                len = size - 1;
+        memcpy(dest, value, len);
+        dest[len] = '\0';
+}
+
+/* What we care about in a bot api reply */
+typedef struct {
+        bool ok;
+        char description[256];
+        long retry_after;               /* seconds to wait when flood limit hit */
+} api_reply;
+
+static
+void reply_on_value(json_scanner *s, json_scan_type type,
+                    const char *value, size_t len, void *userdata)
+{
+        api_reply *reply = userdata;
+        const char *path = json_scan_path(s);
+
+        if (!strcmp(path, "ok"))
+                reply->ok = (JSON_SCAN_TRUE == type);
+        else if (!strcmp(path, "description"))
+                copy_value(reply->description, sizeof(reply->description), value, len);
+        else if (!strcmp(path, "parameters.retry_after") && JSON_SCAN_NUMBER == type)
+                reply->retry_after = strtol(value, NULL, 10);
+}
+
+/**
+ * Parse bot api reply stored in buffer.
+ *
+ * @param buf       response body
+ * @param reply     filled with what the server said
+ */
+static
+void reply_parse(const telegram_buffer *buf, api_reply *reply)
+{
+        json_scanner scanner;
+
+        reply->ok = false;
+        reply->retry_after = 0;
+        snprintf(reply->description, sizeof(reply->description), "invalid response");
+
+        json_scan_init(&scanner, reply_on_value, NULL, reply);
+        if (!json_scan_feed(&scanner, buf->data ? buf->data : "", buf->size) ||
+            !json_scan_finish(&scanner))
+                reply->ok = false;
+}
+
+/*
+ * Send scheduler.
+ *
+ * Telegram limits how fast each bot may send, in total and to each chat, and
+ * answers 429 with retry_after when one goes faster. Every message first takes
+ * a token from its bot's bucket and from its chat's bucket, waiting until both
+ * have one. A 429 stops sending of that bot until retry_after passed, other
+ * bots of the daemon carry on. Other transient failures are retried with
+ * jittered exponential backoff. A server that can't be resolved or refuses
+ * connections is retried only SEND_REFUSED_RETRIES times, so the PAM module
+ * hears of it before showing the prompt. A message not delivered before its
+ * deadline, or arriving when too many are already waiting, fails right away so
+ * the user isn't left at the prompt forever.
+ */
+typedef struct {
+        double tokens;
+        double updated;                 /* ms, last refill */
+} token_bucket;
+
+typedef struct {
+        char key[64];                   /* chat_id, or bot id; empty if slot unused */
+        bool bot;
+        token_bucket bucket;
+        double blocked_until;           /* ms, bot only: set by 429 retry_after */
+} send_bucket;
+
+static struct {
+        pthread_mutex_t lock;
+        telegram_send_limits limits;
+        send_bucket buckets[SEND_BUCKET_SLOTS];
+        telegram_send_stats stats;
+} scheduler = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .limits = {
+                .global_rate = SEND_GLOBAL_RATE,
+                .global_burst = SEND_GLOBAL_BURST,
+                .chat_rate = SEND_CHAT_RATE,
+                .chat_burst = SEND_CHAT_BURST,
+                .queue_max = SEND_QUEUE_MAX,
+                .deadline_ms = SEND_DEADLINE_MS,
+        },
+};
+
+static
+double now_ms(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static
+void sleep_ms(double ms)
+{
+        long long ns = (long long) (ms * 1e6);
+        struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+        while (clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts) == EINTR)
+                ;
+}
+
+/* now_ms() every request of this thread must be done by, 0 for no limit */
+static __thread double budget_deadline;
+
+/**
+ * Limit the time all following bot api requests of the calling thread may
+ * take together, including rate limit waits and retries.
+ *
+ * @param ms    milliseconds from now, 0 to fail every request right away,
+ *              negative for no limit
+ */
+void telegram_set_budget(long ms)
+{
+        budget_deadline = ms < 0 ? 0 : now_ms() + ms;
+}
+
+/**
+ * Bring deadline of one request within the budget of the calling thread.
+ */
+static
+double budget_clamp(double deadline)
+{
+        if (budget_deadline > 0 && budget_deadline < deadline)
+                return budget_deadline;
+        return deadline;
+}
+
+/**
+ * Set curl timeouts so the request is over by deadline, and its connect
+ * leaves time for another attempt.
+ */
+static
+void transport_deadline(CURL *curl, double deadline)
+{
+        long left = (long) (deadline - now_ms()) + 1;
+        if (left < 1)
+                left = 1;       /* 0 would be no timeout at all */
+
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, left);
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS,
+                         left < CONNECT_TIMEOUT_MS ? left : (long) CONNECT_TIMEOUT_MS);
+}
+
+/* rate 0 means unlimited */
+static
+void bucket_refill(token_bucket *b, double rate, double burst, double now)
+{
+        if (rate <= 0) {
+                b->tokens = 1;
+                b->updated = now;
+                return;
+        }
+
+        b->tokens += (now - b->updated) * rate / 1e3;
+        if (b->tokens > burst)
+                b->tokens = burst;
+        b->updated = now;
+}
+
+/* ms until bucket has a whole token */
+static
+double bucket_wait(const token_bucket *b, double rate)
+{
+        return (b->tokens >= 1) ? 0 : (1 - b->tokens) * 1e3 / rate;
+}
+
+/* FNV-1a */
+static
+uint32_t key_hash(const char *key, size_t len, bool bot)
+{
+        uint32_t h = bot ? 16777619u : 2166136261u;
+        while (len--) {
+                h ^= (unsigned char) *key++;
+                h *= 16777619u;
+        }
+        return h;
+}
+
+/**
+ * Find bucket of a chat or bot, must be called with scheduler.lock held.
+ * When all probed slots are taken the least recently used one is recycled,
+ * a bucket idle long enough is full again anyway. A blocked bot counts as
+ * used until its block ends, so it's never recycled before.
+ *
+ * @param key   chat_id, or bot id
+ * @param len   length of key
+ * @param bot   key is a bot id
+ */
+static
+send_bucket *bucket_find(const char *key, size_t len, bool bot, double now)
+{
+        uint32_t h = key_hash(key, len, bot);
+        send_bucket *victim = NULL;
+
+        if (len > sizeof(victim->key) - 1)
+                len = sizeof(victim->key) - 1;
+
+        for (uint32_t probe = 0; probe < SEND_BUCKET_PROBE; probe++) {
+                send_bucket *b = &scheduler.buckets[(h + probe) & (SEND_BUCKET_SLOTS - 1)];
+
+                if (b->bot == bot && !strncmp(b->key, key, len) && !b->key[len])
+                        return b;
+
+                if (!victim || !b->key[0] ||
+                    (victim->key[0] && b->bucket.updated < victim->bucket.updated))
+                        victim = b;
+        }
+
+        copy_value(victim->key, sizeof(victim->key), key, len);
+        victim->bot = bot;
+        victim->bucket.tokens = bot ? scheduler.limits.global_burst : scheduler.limits.chat_burst;
+        victim->bucket.updated = now;
+        victim->blocked_until = 0;
+
+        return victim;
+}
+
+/* Flood limits are per bot, the bot id is the part of the token before ':' */
+static
+send_bucket *bot_bucket_find(const char *token, double now)
+{
+        const char *colon = strchr(token, ':');
+        return bucket_find(token, colon ? (size_t) (colon - token) : strlen(token), true, now);
+}
+
+/**
+ * Wait until message of bot token to chat_id may be sent.
+ *
+ * @param token     bot sending the message
+ * @param chat_id   chat the message goes to
+ * @param deadline  ms, give up if we can't send before it
+ *
+ * @return  false   queue full or deadline passed
+ *          true    tokens taken, send now
+ */
+static
+bool scheduler_acquire(const char *token, const char *chat_id, double deadline)
+{
+        const telegram_send_limits *limits = &scheduler.limits;
+        double start = now_ms();
+        bool ok = false;
+
+        pthread_mutex_lock(&scheduler.lock);
+
+        if (scheduler.stats.depth >= limits->queue_max) {
+                size_t depth = scheduler.stats.depth;
+                scheduler.stats.rejected++;
+                pthread_mutex_unlock(&scheduler.lock);
+                fprintf(stderr, "ERROR: telegram send queue full (%zu waiting)\n", depth);
+                return false;
+        }
+
+        if (++scheduler.stats.depth > scheduler.stats.peak_depth)
+                scheduler.stats.peak_depth = scheduler.stats.depth;
+
+        for (;;) {
+                double now = now_ms();
+
+                /* buckets looked up again every round, they may be recycled while we sleep */
+                send_bucket *bot = bot_bucket_find(token, now);
+                token_bucket *chat = &bucket_find(chat_id, strlen(chat_id), false, now)->bucket;
+                if (now >= bot->blocked_until)
+                        bucket_refill(&bot->bucket, limits->global_rate, limits->global_burst, now);
+                bucket_refill(chat, limits->chat_rate, limits->chat_burst, now);
+
+                double wait = bot->blocked_until - now;
+                double w = bucket_wait(&bot->bucket, limits->global_rate);
+                if (w > wait)
+                        wait = w;
+                w = bucket_wait(chat, limits->chat_rate);
+                if (w > wait)
+                        wait = w;
+
+                if (wait <= 0) {
+                        bot->bucket.tokens -= 1;
+                        chat->tokens -= 1;
+                        ok = true;
+                        break;
+                }
+
+                if (now + wait > deadline)
+                        break;
+
+                pthread_mutex_unlock(&scheduler.lock);
+                sleep_ms(wait);
+                pthread_mutex_lock(&scheduler.lock);
+        }
+
+        scheduler.stats.depth--;
+        if (ok) {
+                double waited = now_ms() - start;
+                scheduler.stats.wait_total_ms += waited;
+                if (waited > scheduler.stats.wait_max_ms)
+                        scheduler.stats.wait_max_ms = waited;
+        }
+        pthread_mutex_unlock(&scheduler.lock);
+
+        if (!ok)
+                fprintf(stderr, "ERROR: telegram send deadline passed while queued\n");
+
+        return ok;
+}
+
+/*
+ * Server told a bot to slow down, it sends nothing until retry_after passed.
+ * Its bucket restarts empty at that time, so waiters resume at the steady
+ * rate instead of bursting into another 429.
+ */
+static
+void scheduler_block(const char *token, long retry_after)
+{
+        double now = now_ms();
+        double until = now + retry_after * 1e3;
+
+        pthread_mutex_lock(&scheduler.lock);
+        scheduler.stats.throttled++;
+        send_bucket *bot = bot_bucket_find(token, now);
+        if (until > bot->blocked_until) {
+                bot->blocked_until = until;
+                bot->bucket.tokens = 0;
+                bot->bucket.updated = until;
+        }
+        pthread_mutex_unlock(&scheduler.lock);
+}
+
+/* Backoff before retry number attempt (from 0): half fixed, half random */
+static
+double backoff_ms(unsigned int attempt)
+{
+        double cap = SEND_BACKOFF_MAX_MS;
+        if (attempt < 16 && (SEND_BACKOFF_BASE_MS << attempt) < SEND_BACKOFF_MAX_MS)
+                cap = SEND_BACKOFF_BASE_MS << attempt;
+
+        uint16_t r = 0;
+        random_bytes(&r, sizeof(r));
+
+        return cap / 2 + (cap / 2) * r / UINT16_MAX;
+}
+
+/**
+ * Set rate limits and queueing of telegram_send(), takes effect for messages
+ * sent afterwards.
+ *
+ * @param limits    new limits
+ */
+void telegram_set_send_limits(const telegram_send_limits *limits)
+{
+        pthread_mutex_lock(&scheduler.lock);
+        scheduler.limits = *limits;
+        pthread_mutex_unlock(&scheduler.lock);
+}
+
+/**
+ * Get current rate limits and queueing of telegram_send().
+ *
+ * @param limits    filled with current limits
+ */
+void telegram_get_send_limits(telegram_send_limits *limits)
+{
+        pthread_mutex_lock(&scheduler.lock);
+        *limits = scheduler.limits;
+        pthread_mutex_unlock(&scheduler.lock);
+}
+
+/**
+ * Get statistics of the send scheduler.
+ *
+ * @param stats     filled with current statistics
+ */
+void telegram_get_send_stats(telegram_send_stats *stats)
+{
+        pthread_mutex_lock(&scheduler.lock);
+        *stats = scheduler.stats;
+        pthread_mutex_unlock(&scheduler.lock);
+}
+
+/**
+ * Post sendMessage request body, rate limited and retried until the send
+ * deadline.
+ *
+ * @param ep        bot api server, NULL for default
+ * @param token     telegram bot token
+ * @param chat_id   chat the message goes to, for the per chat limit
+ * @param body      json request body
+ *
+ * @return  false   failed to send message
+ *          true    send message success
+ */
+static
+bool send_message_body(const telegram_endpoint *ep, const char *token, const char *chat_id,
+                       const char *body)
+{
+        last_send = TELEGRAM_SEND_NOT_SENT;
+
+        char url[TELEGRAM_URL_MAX];
+        if (!telegram_api_url(ep, token, "/sendMessage", url, sizeof(url)))
+                return false;
+
+        pthread_mutex_lock(&scheduler.lock);
+        double deadline = budget_clamp(now_ms() + scheduler.limits.deadline_ms);
+        pthread_mutex_unlock(&scheduler.lock);
+
+        telegram_buffer *rdata = buffer_get();  /* data we read */
+        if (!rdata)
+                return false;
+
+        bool ok = false;
+        for (unsigned int attempt = 0; ; attempt++) {
+                if (now_ms() >= deadline || !scheduler_acquire(token, chat_id, deadline))
+                        break;
+
+                CURL *curl = transport_acquire();
+                if (!curl)
+                        break;
+
+                rdata->size = 0;
+
+                curl_easy_setopt(curl, CURLOPT_URL, url);
+                endpoint_setopt(curl, ep);
+                curl_easy_setopt(curl, CURLOPT_HTTPHEADER, transport.json_headers);
+                curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, buffer_write_callback);
+                curl_easy_setopt(curl, CURLOPT_WRITEDATA, rdata);
+                curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
+                transport_deadline(curl, deadline);
+
+                CURLcode res = curl_easy_perform(curl);
+
+                long status = 0;
+                curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+                transport_timing(curl, res);
+                transport_release(curl);
+
+                /* check return code, then what telegram replied */
+                api_reply reply = { false, "", 0 };
+                if (CURLE_OK != res) {
+                        fprintf(stderr, "ERROR: Failed to send to %s - curl said: %s\n",
+                                (ep ? ep : &default_endpoint)->url, curl_easy_strerror(res));
+                } else {
+                        reply_parse(rdata, &reply);
+                        if (reply.ok) {
+                                ok = true;
+                                last_send = TELEGRAM_SEND_OK;
+                                break;
+                        }
+                        fprintf(stderr, "ERROR: telegram sendMessage failed: %s\n", reply.description);
+                }
+                last_send = send_result(res, status, false);
+
+                /* only network errors, server errors and flood limit are worth a retry */
+                double wait = 0;
+                if (429 == status || reply.retry_after > 0)
+                        scheduler_block(token, reply.retry_after > 0 ? reply.retry_after : 1);
+                else if ((CURLE_COULDNT_RESOLVE_HOST == res || CURLE_COULDNT_CONNECT == res) &&
+                         attempt >= SEND_REFUSED_RETRIES)
+                        break;
+                else if (CURLE_OK != res || status >= 500)
+                        wait = backoff_ms(attempt);
+                else
+                        break;
+
+                if (now_ms() + wait >= deadline)
+                        break;
+
+                pthread_mutex_lock(&scheduler.lock);
+                scheduler.stats.retries++;
+                pthread_mutex_unlock(&scheduler.lock);
+
+                sleep_ms(wait);
+        }
+
+        pthread_mutex_lock(&scheduler.lock);
+        if (ok)
+                scheduler.stats.sent++;
+        else
+                scheduler.stats.failed++;
+        pthread_mutex_unlock(&scheduler.lock);
+
+        buffer_put(rdata);
+
+        return ok;
+}
+
+/*
+ * Request bodies.
+ *
+ * The few bodies we send have a fixed shape, they are written straight into a
+ * buffer with their strings escaped on the way, nothing else is allocated.
+ */
+typedef struct {
+        char *buf;
+        size_t size;
+        size_t len;                     /* bytes needed so far, may exceed size */
+} json_out;
+
+static
+void out_raw(json_out *o, const char *s, size_t len)
+{
+        if (o->len < o->size)
+                memcpy(o->buf + o->len, s, o->len + len < o->size ? len : o->size - o->len);
+        o->len += len;
+}
+
+#define out_literal(o, s) out_raw(o, s, sizeof(s) - 1)
+
+/* Escape s as the inside of a JSON string */
+static
+void out_escaped(json_out *o, const char *s)
+{
+        static const char hex[] = "0123456789abcdef";
+
+        while (*s) {
+                /* copy the run which needs no escaping in one go */
+                size_t run = 0;
+                while (s[run] && '"' != s[run] && '\\' != s[run] && (unsigned char) s[run] >= 0x20)
+                        run++;
+                out_raw(o, s, run);
+                s += run;
+                if (!*s)
+                        break;
+
+                unsigned char c = *s++;
+                char esc[6] = { '\\', (char) c };
+                size_t len = 2;
+                switch (c) {
+                case '"': case '\\': break;
+                case '\n': esc[1] = 'n'; break;
+                case '\r': esc[1] = 'r'; break;
+                case '\t': esc[1] = 't'; break;
+                case '\b': esc[1] = 'b'; break;
+                case '\f': esc[1] = 'f'; break;
+                default:
+                        memcpy(esc + 1, "u00", 3);
+                        esc[4] = hex[c >> 4];
+                        esc[5] = hex[c & 0xf];
+                        len = 6;
+                }
+                out_raw(o, esc, len);
+        }
+}
+
+static
+void out_string(json_out *o, const char *s)
+{
+        out_literal(o, "\"");
+        out_escaped(o, s);
+        out_literal(o, "\"");
+}
+
+/* NUL terminate, truncated if it didn't fit, and return length needed */
+static
+size_t out_finish(json_out *o)
+{
+        if (o->size > 0)
+                o->buf[o->len < o->size ? o->len : o->size - 1] = '\0';
+        return o->len;
+}
+
+/**
+ * Write JSON body of a sendMessage request into buf, {"chat_id":..,"text":..}
+ * plus the Approve and Deny buttons when nonce is given.
+ *
+ * @param buf       where the body is written, NUL terminated if size > 0
+ * @param size      size of buf
+ * @param chat_id   telegram chat channel id
+ * @param text      message
+ * @param nonce     NULL for a plain message, else nonce of the buttons
+ *
+ * @return length of body without the NUL, buf was too small if >= size
+ */
+size_t telegram_message_body(char *buf, size_t size, const char *chat_id, const char *text,
+                             const char *nonce)
+{
+        json_out o = { buf, size, 0 };
+
+        out_literal(&o, "{\"chat_id\":");
+        out_string(&o, chat_id);
+        out_literal(&o, ",\"text\":");
+        out_string(&o, text);
+
+        /* "reply_markup":{"inline_keyboard":[[approve, deny]]} */
+        if (nonce) {
+                out_literal(&o, ",\"reply_markup\":{\"inline_keyboard\":[["
+                            "{\"text\":\"Approve\",\"callback_data\":\"" APPROVAL_APPROVE);
+                out_escaped(&o, nonce);
+                out_literal(&o, "\"},{\"text\":\"Deny\",\"callback_data\":\"" APPROVAL_DENY);
+                out_escaped(&o, nonce);
+                out_literal(&o, "\"}]]}");
+        }
+        out_literal(&o, "}");
+
+        return out_finish(&o);
+}
+
+/**
+ * Build sendMessage body in a pooled buffer, which is large enough after the
+ * first messages so no allocation is needed.
+ *
+ * @return buffer with body, give back with buffer_put(). NULL on failure
+ */
+static
+telegram_buffer *message_body(const char *chat_id, const char *text, const char *nonce)
+{
+        telegram_buffer *body = buffer_get();
+        if (!body)
+                return NULL;
+
+        size_t len = telegram_message_body(body->data, body->cap, chat_id, text, nonce);
+        if (len >= body->cap) {
+                if (!buffer_reserve(body, len + 1)) {
+                        buffer_put(body);
+                        return NULL;
+                }
+                telegram_message_body(body->data, body->cap, chat_id, text, nonce);
+        }
+        body->size = len;
+
+        return body;
+}
+
+/**
+ * Send message to telegram channel.
+ *
+ * @param token     telegram bot token
+ * @param chat_id   telegram chat channel id
+ * @param msg       message send to telegram
+ *
+ * @return  false   failed to send message
+ *          true    send message success
+ */
+bool telegram_send(const char *token, const char *chat_id, const char *msg)
+{
+        return telegram_send_to(NULL, token, chat_id, msg);
+}
+
+/**
+ * Send message to telegram channel through the given Bot API server.
+ * Unlike telegram_set_api_url(), nothing global is changed, so threads may
+ * use different servers at once.
+ *
+ * @param ep        bot api server, NULL for default
+ * @param token     telegram bot token
+ * @param chat_id   telegram chat channel id
+ * @param msg       message send to telegram
+ *
+ * @return  false   failed to send message
+ *          true    send message success
+ */
+bool telegram_send_to(const telegram_endpoint *ep, const char *token, const char *chat_id, const char *msg)
+{
+        last_send = TELEGRAM_SEND_NOT_SENT;
+        telegram_buffer *body = message_body(chat_id, msg, NULL);
+        if (!body)
+                return false;
+
+        bool ok = send_message_body(ep, token, chat_id, body->data);
+
+        buffer_put(body);
+        return ok;
+}
+
+/* One request of telegram_send_fanout() */
 typedef struct {
-        char *text;
-        size_t size;
-} json_message;
+        const telegram_target *target;
+        CURL *curl;
+        telegram_buffer *body;
+        telegram_buffer *rdata;
+} fanout_request;
+
+/**
+ * Check what telegram replied to one request of telegram_send_fanout().
+ *
+ * @return how the request ended, error printed unless delivered
+ */
+static
+telegram_send_result fanout_done(const telegram_endpoint *ep, fanout_request *req, CURLcode res)
+{
+        long status = 0;
+        curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &status);
+        transport_timing(req->curl, res);
 
+        api_reply reply = { false, "", 0 };
+        if (CURLE_OK != res) {
+                fprintf(stderr, "ERROR: Failed to send to %s - curl said: %s\n",
+                        (ep ? ep : &default_endpoint)->url, curl_easy_strerror(res));
+        } else {
+                reply_parse(req->rdata, &reply);
+                if (!reply.ok)
+                        fprintf(stderr, "ERROR: telegram sendMessage to %s failed: %s\n",
+                                req->target->chat_id, reply.description);
+        }
+
+        /* the flood limit still holds for everyone else */
+        if (reply.retry_after > 0)
+                scheduler_block(req->target->token, reply.retry_after);
+
+        pthread_mutex_lock(&scheduler.lock);
+        if (reply.ok)
+                scheduler.stats.sent++;
+        else
+                scheduler.stats.failed++;
+        pthread_mutex_unlock(&scheduler.lock);
+
+        return send_result(res, status, reply.ok);
+}
 
 /**
- * Return telegram's bot api url according to key.
- * The returned value should be freed when no longer needed.
+ * Send message to several chats at once. All requests go out together over
+ * one curl multi handle, so it takes as long as the slowest chat needed for
+ * the quorum instead of the sum of them.
  *
- * @param token   telegarm bot token
- * @param method  telegram bot method
+ * Returns as soon as quorum chats got the message, requests still running
+ * then are dropped. Every chat is rate limited like telegram_send_to(), but
+ * tried only once: a retry of one chat would hold back all of them.
+ *
+ * @param ep        bot api server, NULL for default
+ * @param targets   chats, with the bot to reach each of them
+ * @param n         number of targets, at most TELEGRAM_FANOUT_MAX
+ * @param msg       message send to telegram
+ * @param quorum    chats that must get the message, 0 for any one
+ *
+ * @return number of chats the message was delivered to
+ */
+size_t telegram_send_fanout(const telegram_endpoint *ep, const telegram_target *targets, size_t n,
+                            const char *msg, size_t quorum)
+{
+        fanout_request reqs[TELEGRAM_FANOUT_MAX];
+        size_t delivered = 0, running = 0;
+        bool answered = false, unreachable = false;
+
+        last_send = TELEGRAM_SEND_NOT_SENT;
+
+        if (n > TELEGRAM_FANOUT_MAX)
+                n = TELEGRAM_FANOUT_MAX;
+        if (0 == quorum)
+                quorum = 1;
+        if (quorum > n)
+                quorum = n;
+        memset(reqs, 0, sizeof(reqs));
+
+        pthread_mutex_lock(&scheduler.lock);
+        double deadline = budget_clamp(now_ms() + scheduler.limits.deadline_ms);
+        pthread_mutex_unlock(&scheduler.lock);
+
+        CURLM *multi = curl_multi_init();
+        if (!multi) {
+                fprintf(stderr, "ERROR: Failed on curl_multi_init().\n");
+                return 0;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+                fanout_request *req = &reqs[i];
+                char url[TELEGRAM_URL_MAX];
+
+                req->target = &targets[i];
+                if (!telegram_api_url(ep, targets[i].token, "/sendMessage", url, sizeof(url)) ||
+                    now_ms() >= deadline || !scheduler_acquire(targets[i].token, targets[i].chat_id, deadline))
+                        continue;
+
+                req->body = message_body(targets[i].chat_id, msg, NULL);
+                req->rdata = buffer_get();
+                req->curl = (req->body && req->rdata) ? transport_acquire() : NULL;
+                if (!req->curl)
+                        continue;
+
+                curl_easy_setopt(req->curl, CURLOPT_URL, url);
+                endpoint_setopt(req->curl, ep);
+                curl_easy_setopt(req->curl, CURLOPT_HTTPHEADER, transport.json_headers);
+                curl_easy_setopt(req->curl, CURLOPT_WRITEFUNCTION, buffer_write_callback);
+                curl_easy_setopt(req->curl, CURLOPT_WRITEDATA, req->rdata);
+                curl_easy_setopt(req->curl, CURLOPT_POSTFIELDS, req->body->data);
+                curl_easy_setopt(req->curl, CURLOPT_PRIVATE, req);
+                transport_deadline(req->curl, deadline);
+
+                if (CURLM_OK == curl_multi_add_handle(multi, req->curl))
+                        running++;
+        }
+
+        /* curl timeouts end every request by the deadline */
+        while (running > 0 && delivered < quorum) {
+                int still, left;
+                if (CURLM_OK != curl_multi_perform(multi, &still))
+                        break;
+
+                CURLMsg *m;
+                while ((m = curl_multi_info_read(multi, &left))) {
+                        fanout_request *req = NULL;
+                        if (CURLMSG_DONE != m->msg)
+                                continue;
+
+                        curl_easy_getinfo(m->easy_handle, CURLINFO_PRIVATE, (char **) &req);
+                        switch (fanout_done(ep, req, m->data.result)) {
+                        case TELEGRAM_SEND_OK:
+                                delivered++;
+                                break;
+                        case TELEGRAM_SEND_REJECTED:
+                                answered = true;
+                                break;
+                        default:
+                                unreachable = true;
+                                break;
+                        }
+                        running--;
+                }
+
+                if (running > 0 && delivered < quorum)
+                        curl_multi_wait(multi, NULL, 0, 100, NULL);
+        }
+
+        for (size_t i = 0; i < n; i++) {
+                if (reqs[i].curl) {
+                        curl_multi_remove_handle(multi, reqs[i].curl);
+                        transport_release(reqs[i].curl);
+                }
+                if (reqs[i].body)
+                        buffer_put(reqs[i].body);
+                if (reqs[i].rdata)
+                        buffer_put(reqs[i].rdata);
+        }
+        curl_multi_cleanup(multi);
+
+        /* any answer shows the server is up, even if the quorum wasn't met */
+        if (delivered >= quorum)
+                last_send = TELEGRAM_SEND_OK;
+        else if (answered || delivered > 0)
+                last_send = TELEGRAM_SEND_REJECTED;
+        else if (unreachable)
+                last_send = TELEGRAM_SEND_UNREACHABLE;
+
+        return delivered;
+}
+
+/**
+ * Send message with Approve and Deny buttons to telegram channel, the button
+ * pressed is reported by telegram_wait_approval().
+ *
+ * @param ep        bot api server, NULL for default
+ * @param token     telegram bot token
+ * @param chat_id   telegram chat channel id
+ * @param msg       message send to telegram
+ * @param nonce     unique to this request, at most TELEGRAM_NONCE_MAX chars
+ *
+ * @return  false   failed to send message
+ *          true    send message success
+ */
+bool telegram_send_approval(const telegram_endpoint *ep, const char *token, const char *chat_id,
+                            const char *msg, const char *nonce)
+{
+        last_send = TELEGRAM_SEND_NOT_SENT;
+        if (strlen(nonce) > TELEGRAM_NONCE_MAX)
+                return false;
+
+        telegram_buffer *body = message_body(chat_id, msg, nonce);
+        if (!body)
+                return false;
+
+        bool ok = send_message_body(ep, token, chat_id, body->data);
+
+        buffer_put(body);
+        return ok;
+}
+
+/**
+ * Call a bot api method with json body once, without rate limits nor retries.
+ *
+ * @param ep        bot api server, NULL for default
+ * @param token     telegram bot token
+ * @param method    method with leading slash, e.g. "/setWebhook"
+ * @param body      json request body
  *
- * @return telegram bot api url
+ * @return  false   request failed or server said no, error printed
+ *          true    server replied ok
  */
 static
-const char *telegram_api_url(const char *token, const char *method)
+bool api_post(const telegram_endpoint *ep, const char *token, const char *method, const char *body)
 {
-        if ((!token) || (!method)) {
-                fprintf(stderr, "ERROR: bot token should not be NULL\n");
-                exit(EXIT_FAILURE);
+        char url[TELEGRAM_URL_MAX];
+        if (!telegram_api_url(ep, token, method, url, sizeof(url)))
+                return false;
+
+        double deadline = budget_clamp(now_ms() + API_TIMEOUT_MS);
+        if (now_ms() >= deadline)
+                return false;
+
+        telegram_buffer *rdata = buffer_get();
+        if (!rdata)
+                return false;
+
+        CURL *curl = transport_acquire();
+        if (!curl) {
+                buffer_put(rdata);
+                return false;
         }
 
-        char *url = malloc(strlen(BOT_API_URL) + strlen(token) + strlen(method) + 1);
-        if (!url) {
-                perror("malloc()");
-                exit(EXIT_FAILURE);
+        curl_easy_setopt(curl, CURLOPT_URL, url);
+        endpoint_setopt(curl, ep);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, transport.json_headers);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, buffer_write_callback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, rdata);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
+        transport_deadline(curl, deadline);
+
+        CURLcode res = curl_easy_perform(curl);
+        transport_release(curl);
+
+        api_reply reply = { false, "", 0 };
+        if (CURLE_OK != res) {
+                fprintf(stderr, "ERROR: Failed to send to %s - curl said: %s\n",
+                        (ep ? ep : &default_endpoint)->url, curl_easy_strerror(res));
+        } else {
+                reply_parse(rdata, &reply);
+                if (!reply.ok)
+                        fprintf(stderr, "ERROR: telegram %s failed: %s\n", method + 1, reply.description);
         }
 
-        return strcat(strcat(strcpy(url, BOT_API_URL), token), method);
+        buffer_put(rdata);
+        return reply.ok;
 }
 
 /**
- * Return telegram's bot getUpdates api rul
- * The returned value should be freed when no longer needed.
+ * Tell telegram the button press was handled, so the client stops showing
+ * progress and pops up text. One try only, nothing depends on it.
  *
- * @param token   telegarm bot token
+ * @param ep            bot api server, NULL for default
+ * @param token         telegram bot token
+ * @param callback_id   id of the callback_query
+ * @param text          shown to the user
+ */
+void telegram_answer_callback(const telegram_endpoint *ep, const char *token,
+                              const char *callback_id, const char *text)
+{
+        char body[512];
+        json_out o = { body, sizeof(body), 0 };
+
+        out_literal(&o, "{\"callback_query_id\":");
+        out_string(&o, callback_id);
+        out_literal(&o, ",\"text\":");
+        out_string(&o, text);
+        out_literal(&o, "}");
+
+        if (out_finish(&o) < sizeof(body))
+                api_post(ep, token, "/answerCallbackQuery", body);
+}
+
+/**
+ * Have telegram push updates of the bot to url instead of keeping them for
+ * getUpdates.
+ *
+ * @param ep        bot api server, NULL for default
+ * @param token     telegram bot token
+ * @param url       https url telegram posts updates to
+ * @param secret    sent back in X-Telegram-Bot-Api-Secret-Token header
  *
- * @return telegram bot getUpdates api url
+ * @return  false   failed to set webhook
+ *          true    webhook set
  */
-static inline
-const char *telegram_api_getUpdates(const char *token)
+bool telegram_set_webhook(const telegram_endpoint *ep, const char *token,
+                          const char *url, const char *secret)
 {
-        return telegram_api_url(token, "/getUpdates");
+        char body[TELEGRAM_URL_MAX + 512];
+        json_out o = { body, sizeof(body), 0 };
+
+        out_literal(&o, "{\"url\":");
+        out_string(&o, url);
+        out_literal(&o, ",\"secret_token\":");
+        out_string(&o, secret);
+
+        /* we only wait for buttons and /start */
+        out_literal(&o, ",\"allowed_updates\":[\"message\",\"callback_query\"]}");
+
+        if (out_finish(&o) >= sizeof(body)) {
+                fprintf(stderr, "ERROR: webhook url too long: %s\n", url);
+                return false;
+        }
+
+        return api_post(ep, token, "/setWebhook", body);
 }
 
 /**
- * Return telegram's bot sendMessage api rul
- * The returned value should be freed when no longer needed.
+ * Remove webhook of the bot, so updates can be fetched with getUpdates again.
  *
- * @param token   telegarm bot token
+ * @param ep        bot api server, NULL for default
+ * @param token     telegram bot token
  *
- * @return telegram bot sendMessage api url
+ * @return  false   failed to delete webhook
+ *          true    webhook deleted
  */
-static inline
-const char *telegram_api_sendMessage(const char *token)
+bool telegram_delete_webhook(const telegram_endpoint *ep, const char *token)
 {
-        return telegram_api_url(token, "/sendMessage");
+        return api_post(ep, token, "/deleteWebhook", "{}");
 }
 
 /**
- * Setup curl's headers to make it send with json request.
+ * Store one value of an update scanned by json_scan.
  *
- * @param curl curl handler
+ * @param update    update being scanned
+ * @param path      json_scan_path() relative to the update object
+ * @param value     scanned value
+ * @param len       length of value
  */
-static inline
-void curl_set_json_headers(CURL *curl)
+void telegram_update_field(telegram_update *update, const char *path, const char *value, size_t len)
+{
+        if (!strcmp(path, "update_id"))
+                update->update_id = strtoll(value, NULL, 10);
+        else if (!strcmp(path, "message.chat.id"))
+                copy_value(update->chat_id, sizeof(update->chat_id), value, len);
+        else if (!strcmp(path, "message.from.id"))
+                copy_value(update->from_id, sizeof(update->from_id), value, len);
+        else if (!strcmp(path, "message.text"))
+                copy_value(update->text, sizeof(update->text), value, len);
+        else if (!strcmp(path, "callback_query.id"))
+                copy_value(update->callback_id, sizeof(update->callback_id), value, len);
+        else if (!strcmp(path, "callback_query.data"))
+                copy_value(update->data, sizeof(update->data), value, len);
+        else if (!strcmp(path, "callback_query.message.chat.id"))
+                copy_value(update->chat_id, sizeof(update->chat_id), value, len);
+        else if (!strcmp(path, "callback_query.from.id"))
+                copy_value(update->from_id, sizeof(update->from_id), value, len);
+}
+
+static
+void updates_on_value(json_scanner *s, json_scan_type type,
+                      const char *value, size_t len, void *userdata)
+{
+        updates_reader *reader = userdata;
+        const char *path = json_scan_path(s);
+
+        /* all paths we want start with "ok", "description" or "result[]." */
+        if (!strcmp(path, "ok"))
+                reader->ok = (JSON_SCAN_TRUE == type);
+        else if (!strcmp(path, "description"))
+                copy_value(reader->description, sizeof(reader->description), value, len);
+        if (strncmp(path, "result[].", 9))
+                return;
+
+        telegram_update_field(&reader->update, path + 9, value, len);
+}
+
+static
+void updates_on_end(json_scanner *s, void *userdata)
 {
-        struct curl_slist *headers = NULL;
+        updates_reader *reader = userdata;
 
-        headers = curl_slist_append(headers, "Accept: application/json");
-        headers = curl_slist_append(headers, "Content-Type: application/json");
+        /* one update complete */
+        if (strcmp(json_scan_path(s), "result[]"))
+                return;
 
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        reader->on_update(&reader->update, reader->userdata);
+        memset(&reader->update, 0, sizeof(reader->update));
 }
 
-/* Callback for make curl not show response */
+/* Callback for curl read func, scan response as it arrives */
 static
-size_t dummy_callback(void *ptr, size_t size, size_t nmemb, void *stream)
+size_t updates_write_callback(void *buffer, size_t size, size_t nmemb, void *dest)
 {
-        return size * nmemb;
+        size_t rsize = size * nmemb;
+        updates_reader *reader = (updates_reader *) dest;
+
+        if (!json_scan_feed(&reader->scanner, buffer, rsize)) {
+                fprintf(stderr, "ERROR: invalid response from telegram getUpdates.\n");
+                return 0;
+        }
+
+        return rsize;
 }
 
 /**
- * Send message to telegram channel.
+ * Call getUpdates with offset, the updates before offset are confirmed and
+ * removed from server. When timeout > 0, server holds the request until an
+ * update arrives or timeout seconds passed.
  *
+ * The response is never stored, on_update is called for every update while
+ * it streams in. A 409, a webhook set or another getUpdates of the bot
+ * running, is told by telegram_updates_conflict().
+ *
+ * @param ep        bot api server, NULL for default
  * @param token     telegram bot token
- * @param chat_id   telegram chat channel id
- * @param msg       message send to telegram
+ * @param offset    first update_id to return
+ * @param timeout   long polling timeout in seconds
+ * @param limit     max number of updates to return, 0 for server default
+ * @param on_update called for every update received
+ * @param userdata  passed to on_update
  *
- * @return  false   failed to send message
- *          true    send message success
+ * @return  false   failed to get updates
+ *          true    all updates received
  */
-bool telegram_send(const char *token, const char *chat_id, const char *msg)
+static
+bool telegram_get_updates(const telegram_endpoint *ep, const char *token, long long offset,
+                          int timeout, int limit, telegram_update_cb on_update, void *userdata)
 {
-        const char *url = telegram_api_sendMessage(token);
+        char url[TELEGRAM_URL_MAX + 64];
         CURLcode res;
 
-        CURL *curl = curl_easy_init();
-        if (!curl) {
-                fprintf(stderr, "ERROR: Failed on curl_easy_init().");
+        if (!telegram_api_url(ep, token, "/getUpdates", url, TELEGRAM_URL_MAX))
                 return false;
-        }
 
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_set_json_headers(curl);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, dummy_callback); /* ignore response callback */
+        size_t len = strlen(url);
+        snprintf(url + len, sizeof(url) - len, "?offset=%lld&timeout=%d", offset, timeout);
+        if (limit > 0)
+                snprintf(url + strlen(url), sizeof(url) - strlen(url), "&limit=%d", limit);
 
-        /* build request data */
-        json_object *jobj = json_object_new_object();
-        json_object *jval;
+        updates_reader reader = {
+                .ok = false,
+                .on_update = on_update,
+                .userdata = userdata,
+        };
+        json_scan_init(&reader.scanner, updates_on_value, updates_on_end, &reader);
+        last_conflict = false;
 
-        jval = json_object_new_string(chat_id);
-        json_object_object_add(jobj, "chat_id", jval);
+        /* leave enough time for server side long polling */
+        double deadline = budget_clamp(now_ms() + (timeout + 10) * 1000.0);
+        if (now_ms() >= deadline)
+                return false;
 
-        jval = json_object_new_string(msg);
-        json_object_object_add(jobj, "text", jval);
+        /* setup curl handler */
+        CURL *curl = transport_acquire();
+        if (!curl)
+                return false;
 
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_object_to_json_string(jobj));
+        curl_easy_setopt(curl, CURLOPT_URL, url);
+        endpoint_setopt(curl, ep);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, updates_write_callback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &reader);
+        transport_deadline(curl, deadline);
 
         res = curl_easy_perform(curl);
+        long status = 0;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+        transport_release(curl);
 
-        /* check return code */
         if (CURLE_OK != res) {
-                fprintf(stderr, "ERROR: Failed to send to url (%s) - curl said: %s", url, curl_easy_strerror(res));
+                fprintf(stderr, "ERROR: Failed to send to %s - curl said: %s\n",
+                        (ep ? ep : &default_endpoint)->url, curl_easy_strerror(res));
                 return false;
         }
 
-        curl_easy_cleanup(curl);
-        json_object_put(jobj);  /* free json object */
+        if (!json_scan_finish(&reader.scanner))
+                return false;
 
-        free((char *) url);
+        if (!reader.ok) {
+                last_conflict = (409 == status);
+                fprintf(stderr, "ERROR: telegram getUpdates: %s\n",
+                        reader.description[0] ? reader.description : "failed");
+                return false;
+        }
 
         return true;
 }
 
+/**
+ * Tell whether the last getUpdates of the calling thread was refused with
+ * 409: the bot has a webhook set, which only deleteWebhook removes, or
+ * another getUpdates of the bot is running. Retrying right away won't help.
+ *
+ * @return  true    refused with 409
+ *          false   succeeded, or failed otherwise
+ */
+bool telegram_updates_conflict(void)
+{
+        return last_conflict;
+}
+
+/* State of telegram_fetch_chat_id() while scanning updates */
+typedef struct {
+        long long *offset;
+        char *chat_id;
+} fetch_chat_id_state;
 
-/* Callback for curl read func */
 static
-size_t write_callback(void *buffer, size_t size, size_t nmemb, void *dest) {
-        size_t rsize = size * nmemb;
-        json_message *message = (json_message *) dest;
+void fetch_chat_id_on_update(const telegram_update *update, void *userdata)
+{
+        fetch_chat_id_state *state = userdata;
 
-        message->text = realloc(message->text, message->size + rsize + 1);
+        /* skip this update next time */
+        if (update->update_id >= *state->offset)
+                *state->offset = update->update_id + 1;
 
-        if (!message->text) {
-                fprintf(stderr, "ERROR: no message readed from telegram channel!!!");
-                return 0;
+        /* We need to make sure the text user type is match to our keyword,
+         * we only keep the latest match value */
+        if (update->chat_id[0] && !strcmp(update->text, "/start")) {
+                free(state->chat_id);
+                state->chat_id = strdup(update->chat_id);
+        }
+}
+
+/**
+ * Long polling wait for user input specific keyword, after input match, return channel's chat_id.
+ * The chat_id should be freed when no longer needed.
+ *
+ * Every update fetched is skipped next time by advancing offset to the last
+ * update_id + 1, so each update is only downloaded and parsed once.
+ *
+ * @param token     telegram bot token
+ * @param offset    next update_id to fetch, updated on return. Start with
+ *                  telegram_skip_updates().
+ * @param timeout   long polling timeout in seconds
+ * @param chat_id   set to the chat of the latest /start, NULL if none came
+ *
+ * @return  false   failed to get updates, error printed
+ *          true    updates received, maybe none
+ */
+bool telegram_fetch_chat_id(const char *token, long long *offset, int timeout, char **chat_id)
+{
+        fetch_chat_id_state state = { offset, NULL };
+
+        if (!telegram_get_updates(NULL, token, *offset, timeout, 0, fetch_chat_id_on_update, &state)) {
+                free(state.chat_id);
+                *chat_id = NULL;
+                return false;
         }
 
-        memcpy(&(message->text[message->size]), buffer, rsize);
-        message->size += rsize;
-        message->text[message->size] = '\0';
+        *chat_id = state.chat_id;
+        return true;
+}
 
-        return rsize;
+/* State of telegram_poll_updates() while scanning updates */
+typedef struct {
+        long long *offset;
+        telegram_update_cb on_update;
+        void *userdata;
+} poll_updates_state;
+
+static
+void poll_updates_on_update(const telegram_update *update, void *userdata)
+{
+        poll_updates_state *state = userdata;
+
+        if (update->update_id >= *state->offset)
+                *state->offset = update->update_id + 1;
+
+        state->on_update(update, state->userdata);
+}
+
+/**
+ * Long polling getUpdates once, calling on_update for every update received.
+ * Updates fetched are skipped next time by advancing offset, like
+ * telegram_fetch_chat_id() does.
+ *
+ * @param token     telegram bot token
+ * @param offset    next update_id to fetch, updated on return. Start with 0.
+ * @param timeout   long polling timeout in seconds
+ * @param on_update called for every update received
+ * @param userdata  passed to on_update
+ *
+ * @return  false   failed to get updates
+ *          true    all updates received, maybe none
+ */
+bool telegram_poll_updates(const char *token, long long *offset, int timeout,
+                           telegram_update_cb on_update, void *userdata)
+{
+        poll_updates_state state = { offset, on_update, userdata };
+
+        return telegram_get_updates(NULL, token, *offset, timeout, 0, poll_updates_on_update, &state);
+}
+
+static
+void ignore_update(const telegram_update *update, void *userdata)
+{
+}
+
+/**
+ * Confirm all updates before offset, so server won't send them again.
+ *
+ * @param token     telegram bot token
+ * @param offset    offset returned by telegram_fetch_chat_id()
+ */
+void telegram_confirm_updates(const char *token, long long offset)
+{
+        telegram_get_updates(NULL, token, offset, 0, 1, ignore_update, NULL);
 }
 
 /**
- * Start a long polling loop wait for user input specific keyword, after input match, return channel's chat_id.
- * The returned value should be freed when no longer needed.
+ * Skip every update pending now, e.g. a /start left from an earlier setup,
+ * by fetching them without waiting until none is left.
  *
- * @param token telegram bot token
+ * @param token     telegram bot token
+ * @param offset    set to the offset after the last pending update
  *
- * @return chat_id  telegram bot chat_id
- *         NULL     failed to fetch chat_id (user not input ?)
+ * @return  false   failed to get updates
+ *          true    offset set
  */
-const char *telegram_fetch_chat_id(const char *token)
+bool telegram_skip_updates(const char *token, long long *offset)
 {
-        char *chat_id = NULL;
+        poll_updates_state state = { offset, ignore_update, NULL };
+        long long before;
 
-        const char *url = telegram_api_getUpdates(token);
+        do {
+                before = *offset;
+                if (!telegram_get_updates(NULL, token, *offset, 0, 0, poll_updates_on_update, &state))
+                        return false;
+        } while (*offset != before);
 
-        json_message rdata = {0, 0}; /* data we read */
-        rdata.text = (char*) malloc(1 * sizeof(char));
-        rdata.text[0] = '\0';
+        return true;
+}
 
-        /* setup curl handler */
-        CURLcode res;
-        CURL *curl = curl_easy_init();
-        if (!curl) {
-                fprintf(stderr, "ERROR: Failed on curl_easy_init().");
-                return false;
-        }
+/* State of telegram_wait_approval() while scanning updates */
+typedef struct {
+        const char *chat_id;
+        const char *nonce;
+        long long offset;               /* next update to fetch */
+        telegram_approval result;
+        char callback_id[64];           /* the button press we answer */
+} approval_state;
 
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &rdata);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10);
+/**
+ * Compare nonces without leaking how much of them matched.
+ *
+ * @return  false   different
+ *          true    same
+ */
+bool telegram_nonce_equal(const char *a, const char *b)
+{
+        size_t len = strlen(b);
+        unsigned char diff = strlen(a) != len;
 
-        res = curl_easy_perform(curl);
-        if (CURLE_OK != res) {
-                fprintf(stderr, "ERROR: Failed to send to url (%s) - curl said: %s", url, curl_easy_strerror(res));
-                exit(EXIT_FAILURE);
-        }
+        for (size_t i = 0; i < len && a[i]; i++)
+                diff |= (unsigned char) a[i] ^ (unsigned char) b[i];
 
-        json_object *root = json_tokener_parse(rdata.text);
-        if (is_error(root)) {
-                //fprintf(stderr, "parse failed.\n");
-                return NULL;
+        return !diff;
+}
+
+/**
+ * Check if update is a press of a button sent by telegram_send_approval().
+ *
+ * @param update    update received
+ * @param answer    filled with TELEGRAM_APPROVAL_APPROVED or TELEGRAM_APPROVAL_DENIED
+ * @param nonce     set to the nonce in the button, points into update
+ *
+ * @return  false   not an approval button
+ *          true    answer and nonce filled
+ */
+bool telegram_update_approval(const telegram_update *update, telegram_approval *answer,
+                              const char **nonce)
+{
+        const char *data = update->data;
+
+        if (!update->callback_id[0] || !update->chat_id[0] || !update->from_id[0])
+                return false;
+
+        if (!strncmp(data, APPROVAL_APPROVE, sizeof(APPROVAL_APPROVE) - 1)) {
+                *nonce = data + sizeof(APPROVAL_APPROVE) - 1;
+                *answer = TELEGRAM_APPROVAL_APPROVED;
+        } else if (!strncmp(data, APPROVAL_DENY, sizeof(APPROVAL_DENY) - 1)) {
+                *nonce = data + sizeof(APPROVAL_DENY) - 1;
+                *answer = TELEGRAM_APPROVAL_DENIED;
+        } else {
+                return false;
         }
 
-        json_object *body;
-        json_object_object_get_ex(root, "result", &body);
+        return true;
+}
 
-        int arraylen = json_object_array_length(body);
+static
+void approval_on_update(const telegram_update *update, void *userdata)
+{
+        approval_state *state = userdata;
 
-        json_object *jvalue;
-        for (int i = 0; i < arraylen; i++) {
-                jvalue = json_object_array_get_idx(body, i);
+        if (update->update_id >= state->offset)
+                state->offset = update->update_id + 1;
 
-                /* we only find the latest match value */
-                struct json_object *jmessage;
-                json_object_object_get_ex(jvalue, "message", &jmessage);
+        /* only buttons of our message count, pressed by the user in their own
+         * chat. In a group, chat.id is the group and anyone could press */
+        telegram_approval answer;
+        const char *nonce;
+        if (TELEGRAM_APPROVAL_TIMEOUT != state->result ||
+            !telegram_update_approval(update, &answer, &nonce) ||
+            strcmp(update->chat_id, state->chat_id) ||
+            strcmp(update->from_id, state->chat_id) ||
+            !telegram_nonce_equal(nonce, state->nonce))
+                return;
 
-                struct json_object *jchat;
-                json_object_object_get_ex(jmessage, "chat", &jchat);
+        state->result = answer;
+        snprintf(state->callback_id, sizeof(state->callback_id), "%s", update->callback_id);
+}
 
-                struct json_object *jchat_id;
-                json_object_object_get_ex(jchat, "id", &jchat_id);
+/**
+ * Wait for the Approve or Deny button of the message sent by
+ * telegram_send_approval() with the same nonce, by long polling getUpdates.
+ *
+ * Telegram lets only one getUpdates run at a time for a bot, so a bot can
+ * wait for one approval at a time, and not while it has a webhook set. Such
+ * a 409 gives up at once, the user gets asked for the code instead.
+ * Other updates fetched meanwhile are confirmed and lost.
+ *
+ * @param ep        bot api server, NULL for default
+ * @param token     telegram bot token
+ * @param chat_id   chat the message was sent to
+ * @param nonce     nonce given to telegram_send_approval()
+ * @param timeout   seconds to wait for the button
+ *
+ * @return  TELEGRAM_APPROVAL_APPROVED  approve pressed
+ *          TELEGRAM_APPROVAL_DENIED    deny pressed
+ *          TELEGRAM_APPROVAL_TIMEOUT   nothing pressed before timeout
+ *          TELEGRAM_APPROVAL_ERROR     getUpdates never succeeded, or refused with 409
+ */
+telegram_approval telegram_wait_approval(const telegram_endpoint *ep, const char *token,
+                                         const char *chat_id, const char *nonce, int timeout)
+{
+        approval_state state = {
+                .chat_id = chat_id,
+                .nonce = nonce,
+                .offset = 0,
+                .result = TELEGRAM_APPROVAL_TIMEOUT,
+        };
+        double deadline = budget_clamp(now_ms() + timeout * 1000.0);
+        bool polled = false;
 
-                struct json_object *jtext;
-                json_object_object_get_ex(jmessage, "text", &jtext);
+        while (TELEGRAM_APPROVAL_TIMEOUT == state.result) {
+                int poll = (int) ((deadline - now_ms()) / 1000);
+                if (poll <= 0)
+                        break;
+                if (poll > APPROVAL_POLL_S)
+                        poll = APPROVAL_POLL_S;
 
-                /* We need to make sure the text user type is match to our keyword */
-                if (!strcmp(json_object_to_json_string(jtext), "\"\\/start\"")) {
-                        chat_id = (char *) json_object_to_json_string(jchat_id);
+                if (telegram_get_updates(ep, token, state.offset, poll, 0, approval_on_update, &state)) {
+                        polled = true;
+                        continue;
                 }
+
+                /* webhook set, e.g. left by a daemon that was killed, or
+                 * another getUpdates of this bot running */
+                if (last_conflict)
+                        return TELEGRAM_APPROVAL_ERROR;
+
+                /* network error */
+                double wait = deadline - now_ms();
+                sleep_ms(wait < APPROVAL_RETRY_MS ? wait : APPROVAL_RETRY_MS);
         }
 
-        curl_easy_cleanup(curl);
-        free((char *) url);
+        if (TELEGRAM_APPROVAL_TIMEOUT == state.result)
+                return polled ? TELEGRAM_APPROVAL_TIMEOUT : TELEGRAM_APPROVAL_ERROR;
 
-        return chat_id;
-}
\ No newline at end of file
+        /* confirm the button press, so it isn't delivered again */
+        telegram_get_updates(ep, token, state.offset, 0, 1, ignore_update, NULL);
+        telegram_answer_callback(ep, token, state.callback_id,
+                                 TELEGRAM_APPROVAL_APPROVED == state.result ? "Login approved" : "Login denied");
+
+        return state.result;
+}
@@ -22,9 +22,139 @@
 #define _TELEGRAM_AUTHENTICATOR_TELEGRAM_H_
 
 #include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+        size_t total_bytes;     /* bytes received into response buffers */
+        size_t peak_bytes;      /* most memory held by response buffers at once */
+        size_t allocations;     /* buffer allocations and growths */
+        size_t reused;          /* buffers served from the free list */
+} telegram_buffer_stats;
+
+/* Longest bot api url we build, prefix + token + method */
+#define TELEGRAM_URL_MAX 512
+
+/* Bot API server to talk to, see telegram_endpoint_parse() */
+typedef struct {
+        char url[256];          /* prefix, the token and method are appended */
+        size_t url_len;
+        char unix_socket[108];  /* connect through this unix socket if not empty */
+} telegram_endpoint;
+
+/* One chat of telegram_send_fanout(), and the most chats it sends to */
+typedef struct {
+        const char *token;      /* bot sending to the chat */
+        const char *chat_id;
+} telegram_target;
+
+#define TELEGRAM_FANOUT_MAX 16
+
+/* Longest nonce of an approval request, callback_data is limited to 64 bytes */
+#define TELEGRAM_NONCE_MAX 48
+
+/* Answer to telegram_send_approval() */
+typedef enum {
+        TELEGRAM_APPROVAL_APPROVED,
+        TELEGRAM_APPROVAL_DENIED,
+        TELEGRAM_APPROVAL_TIMEOUT,      /* no button pressed in time */
+        TELEGRAM_APPROVAL_ERROR,        /* can't get updates from server */
+} telegram_approval;
+
+/* The fields we need from one update, from getUpdates or a webhook */
+typedef struct {
+        long long update_id;
+        char chat_id[32];               /* of the message, or the message with the button */
+        char from_id[32];               /* user who sent the message or pressed the button */
+        char text[256];
+        char callback_id[64];           /* button pressed, empty for a message */
+        char data[65];                  /* callback_data of the button */
+} telegram_update;
+
+/* Called for every update of a getUpdates response */
+typedef void (*telegram_update_cb)(const telegram_update *update, void *userdata);
+
+/* How the last send of a thread ended, the circuit breaker only counts
+ * TELEGRAM_SEND_UNREACHABLE against the server */
+typedef enum {
+        TELEGRAM_SEND_OK = 0,           /* delivered */
+        TELEGRAM_SEND_REJECTED,         /* server answered with an error, e.g. blocked bot, flood limit */
+        TELEGRAM_SEND_UNREACHABLE,      /* network error, timeout or 5xx */
+        TELEGRAM_SEND_NOT_SENT,         /* gave up before asking the server */
+} telegram_send_result;
+
+/* How long each phase of a bot api request took, in seconds */
+typedef struct {
+        bool new_connection;    /* false: connection reused, no dns/connect/tls */
+        double dns;
+        double connect;
+        double tls;
+        double first_byte;      /* from request start */
+        double total;
+} telegram_timing;
+
+typedef struct {
+        double global_rate;     /* messages per second of one bot to all chats, 0 unlimited */
+        double global_burst;
+        double chat_rate;       /* messages per second to one chat, 0 unlimited */
+        double chat_burst;
+        size_t queue_max;       /* messages allowed to wait, more fail at once */
+        unsigned int deadline_ms; /* give up message not delivered by then */
+} telegram_send_limits;
+
+typedef struct {
+        size_t depth;           /* messages waiting for their turn now */
+        size_t peak_depth;
+        size_t sent;
+        size_t failed;          /* not delivered: error, deadline or queue full */
+        size_t rejected;        /* queue was full */
+        size_t retries;
+        size_t throttled;       /* 429 replies from server */
+        double wait_total_ms;   /* time spent queued by messages sent on */
+        double wait_max_ms;
+} telegram_send_stats;
+
+/**
+ * Parse endpoint spec into ep. The spec is one of
+ *
+ *   https://host[:port][/path]     any server
+ *   http://host[:port][/path]      plain http, meant for a local server
+ *   unix:/path/to/socket           local server listening on a unix socket
+ *
+ * "/bot" is appended to the url unless it already ends with it.
+ *
+ * @param ep            endpoint to fill
+ * @param spec          endpoint spec
+ * @param allow_unix    accept unix sockets, only for specs from the admin
+ *
+ * @return  false   invalid spec, error printed
+ *          true    ep filled
+ */
+bool telegram_endpoint_parse(telegram_endpoint *ep, const char *spec, bool allow_unix);
+
+/**
+ * Use another Bot API server, e.g. a self-hosted one or a local test server.
+ * Set it once at startup, it's not synchronized with requests in flight.
+ *
+ * @param spec  endpoint as accepted by telegram_endpoint_parse(), NULL for default
+ *
+ * @return  false   invalid spec, endpoint not changed
+ *          true    endpoint changed
+ */
+bool telegram_set_api_url(const char *spec);
+
+/**
+ * Verify bot api servers against these CA certificates instead of the system
+ * ones, e.g. for a self-hosted server with a private CA. Set it once at
+ * startup, it's not synchronized with requests in flight.
+ *
+ * @param path  PEM file, kept by reference, NULL for the system CAs
+ */
+void telegram_set_ca_file(const char *path);
 
 /**
  * Send message to telegram channel.
+ * Messages are rate limited globally and per chat, queued while over the
+ * limits and retried on transient failures until the send deadline.
  *
  * @param token     telegram bot token
  * @param chat_id   telegram chat channel id
@@ -34,17 +164,303 @@
  */
 bool telegram_send(const char *token, const char *chat_id, const char *msg);
 
+/**
+ * Send message to telegram channel through the given Bot API server.
+ * Unlike telegram_set_api_url(), nothing global is changed, so threads may
+ * use different servers at once.
+ *
+ * @param ep        bot api server, NULL for default
+ * @param token     telegram bot token
+ * @param chat_id   telegram chat channel id
+ * @param msg       message send to telegram
+ * @return  false   failed to send message
+ *          true    send message success
+ */
+bool telegram_send_to(const telegram_endpoint *ep, const char *token, const char *chat_id, const char *msg);
+
+/**
+ * Send message to several chats at once. All requests go out together over
+ * one curl multi handle, so it takes as long as the slowest chat needed for
+ * the quorum instead of the sum of them.
+ *
+ * Returns as soon as quorum chats got the message, requests still running
+ * then are dropped. Every chat is rate limited like telegram_send_to(), but
+ * tried only once: a retry of one chat would hold back all of them.
+ *
+ * @param ep        bot api server, NULL for default
+ * @param targets   chats, with the bot to reach each of them
+ * @param n         number of targets, at most TELEGRAM_FANOUT_MAX
+ * @param msg       message send to telegram
+ * @param quorum    chats that must get the message, 0 for any one
+ *
+ * @return number of chats the message was delivered to
+ */
+size_t telegram_send_fanout(const telegram_endpoint *ep, const telegram_target *targets, size_t n,
+                            const char *msg, size_t quorum);
+
+/**
+ * Build url of bot api method into url, no allocation involved.
+ *
+ * @param ep      endpoint, NULL for the default one
+ * @param token   telegarm bot token
+ * @param method  telegram bot method, e.g. "/sendMessage"
+ * @param url     buffer to fill
+ * @param size    size of url, TELEGRAM_URL_MAX is always enough for a sane token
+ *
+ * @return  false   url doesn't fit, error printed
+ *          true    url filled
+ */
+bool telegram_api_url(const telegram_endpoint *ep, const char *token, const char *method,
+                      char *url, size_t size);
+
+/**
+ * Write JSON body of a sendMessage request into buf, with strings escaped.
+ * Nothing is allocated, like snprintf() the result is truncated to fit and
+ * the length needed is returned.
+ *
+ * @param buf       where the body is written, NUL terminated if size > 0
+ * @param size      size of buf
+ * @param chat_id   telegram chat channel id
+ * @param text      message
+ * @param nonce     NULL for a plain message, else nonce of Approve and Deny buttons
+ *
+ * @return length of body without the NUL, buf was too small if >= size
+ */
+size_t telegram_message_body(char *buf, size_t size, const char *chat_id, const char *text,
+                             const char *nonce);
+
+/**
+ * Send message with Approve and Deny buttons to telegram channel, the button
+ * pressed is reported by telegram_wait_approval().
+ *
+ * @param ep        bot api server, NULL for default
+ * @param token     telegram bot token
+ * @param chat_id   telegram chat channel id
+ * @param msg       message send to telegram
+ * @param nonce     unique to this request, at most TELEGRAM_NONCE_MAX chars
+ * @return  false   failed to send message
+ *          true    send message success
+ */
+bool telegram_send_approval(const telegram_endpoint *ep, const char *token, const char *chat_id,
+                            const char *msg, const char *nonce);
+
+/**
+ * Wait for the Approve or Deny button of the message sent by
+ * telegram_send_approval() with the same nonce.
+ * A bot can only wait for one approval at a time, see telegram.c.
+ *
+ * @param ep        bot api server, NULL for default
+ * @param token     telegram bot token
+ * @param chat_id   chat the message was sent to
+ * @param nonce     nonce given to telegram_send_approval()
+ * @param timeout   seconds to wait for the button
+ * @return  TELEGRAM_APPROVAL_APPROVED  approve pressed
+ *          TELEGRAM_APPROVAL_DENIED    deny pressed
+ *          TELEGRAM_APPROVAL_TIMEOUT   nothing pressed before timeout
+ *          TELEGRAM_APPROVAL_ERROR     getUpdates never succeeded, or refused with 409
+ */
+telegram_approval telegram_wait_approval(const telegram_endpoint *ep, const char *token,
+                                         const char *chat_id, const char *nonce, int timeout);
+
+/**
+ * Tell telegram the button press was handled, so the client stops showing
+ * progress and pops up text.
+ *
+ * @param ep            bot api server, NULL for default
+ * @param token         telegram bot token
+ * @param callback_id   id of the callback_query
+ * @param text          shown to the user
+ */
+void telegram_answer_callback(const telegram_endpoint *ep, const char *token,
+                              const char *callback_id, const char *text);
+
+/**
+ * Check if update is a press of a button sent by telegram_send_approval().
+ *
+ * @param update    update received
+ * @param answer    filled with TELEGRAM_APPROVAL_APPROVED or TELEGRAM_APPROVAL_DENIED
+ * @param nonce     set to the nonce in the button, points into update
+ * @return  false   not an approval button
+ *          true    answer and nonce filled
+ */
+bool telegram_update_approval(const telegram_update *update, telegram_approval *answer,
+                              const char **nonce);
+
+/**
+ * Compare nonces without leaking how much of them matched.
+ *
+ * @return  false   different
+ *          true    same
+ */
+bool telegram_nonce_equal(const char *a, const char *b);
+
+/**
+ * Store one value of an update scanned by json_scan, for updates not coming
+ * from getUpdates.
+ *
+ * @param update    update being scanned
+ * @param path      json_scan_path() relative to the update object
+ * @param value     scanned value
+ * @param len       length of value
+ */
+void telegram_update_field(telegram_update *update, const char *path, const char *value, size_t len);
+
+/**
+ * Have telegram push updates of the bot to url instead of keeping them for
+ * getUpdates.
+ *
+ * @param ep        bot api server, NULL for default
+ * @param token     telegram bot token
+ * @param url       https url telegram posts updates to
+ * @param secret    sent back in X-Telegram-Bot-Api-Secret-Token header
+ * @return  false   failed to set webhook
+ *          true    webhook set
+ */
+bool telegram_set_webhook(const telegram_endpoint *ep, const char *token,
+                          const char *url, const char *secret);
+
+/**
+ * Remove webhook of the bot, so updates can be fetched with getUpdates again.
+ *
+ * @param ep        bot api server, NULL for default
+ * @param token     telegram bot token
+ * @return  false   failed to delete webhook
+ *          true    webhook deleted
+ */
+bool telegram_delete_webhook(const telegram_endpoint *ep, const char *token);
+
 /**
  * Wait for user input specific keyword, after input match, return channel's chat_id.
- * You need to use this function inside a loop.
+ * You need to use this function inside a loop, the server holds each request up to
+ * timeout seconds until new updates arrive.
+ *
+ * The chat_id should be freed when no longer needed.
+ *
+ * @param token     telegram bot token
+ * @param offset    next update_id to fetch, updated on return. Start with
+ *                  telegram_skip_updates().
+ * @param timeout   long polling timeout in seconds
+ * @param chat_id   set to the chat of the latest /start, NULL if none came
+ *
+ * @return  false   failed to get updates, error printed
+ *          true    updates received, maybe none
+ */
+bool telegram_fetch_chat_id(const char *token, long long *offset, int timeout, char **chat_id);
+
+/**
+ * Long polling getUpdates once, calling on_update for every update received.
+ * Updates fetched are skipped next time by advancing offset.
+ *
+ * @param token     telegram bot token
+ * @param offset    next update_id to fetch, updated on return. Start with 0.
+ * @param timeout   long polling timeout in seconds
+ * @param on_update called for every update received
+ * @param userdata  passed to on_update
+ *
+ * @return  false   failed to get updates
+ *          true    all updates received, maybe none
+ */
+bool telegram_poll_updates(const char *token, long long *offset, int timeout,
+                           telegram_update_cb on_update, void *userdata);
+
+/**
+ * Confirm all updates before offset, so server won't send them again.
+ *
+ * @param token     telegram bot token
+ * @param offset    offset returned by telegram_fetch_chat_id()
+ */
+void telegram_confirm_updates(const char *token, long long offset);
+
+/**
+ * Skip every update pending now, e.g. a /start left from an earlier setup,
+ * by fetching them without waiting until none is left.
+ *
+ * @param token     telegram bot token
+ * @param offset    set to the offset after the last pending update
+ *
+ * @return  false   failed to get updates
+ *          true    offset set
+ */
+bool telegram_skip_updates(const char *token, long long *offset);
+
+/**
+ * Tell whether the last getUpdates of the calling thread was refused with
+ * 409: the bot has a webhook set, which only deleteWebhook removes, or
+ * another getUpdates of the bot is running. Retrying right away won't help.
+ *
+ * @return  true    refused with 409
+ *          false   succeeded, or failed otherwise
+ */
+bool telegram_updates_conflict(void);
+
+/**
+ * Set rate limits and queueing of telegram_send(), takes effect for messages
+ * sent afterwards.
+ *
+ * @param limits    new limits
+ */
+void telegram_set_send_limits(const telegram_send_limits *limits);
+
+/**
+ * Get current rate limits and queueing of telegram_send().
+ *
+ * @param limits    filled with current limits
+ */
+void telegram_get_send_limits(telegram_send_limits *limits);
+
+/**
+ * Get statistics of the send scheduler.
+ *
+ * @param stats     filled with current statistics
+ */
+void telegram_get_send_stats(telegram_send_stats *stats);
+
+/**
+ * Limit the time all following bot api requests of the calling thread may
+ * take together, including rate limit waits and retries.
+ *
+ * @param ms    milliseconds from now, 0 to fail every request right away,
+ *              negative for no limit
+ */
+void telegram_set_budget(long ms);
+
+/**
+ * Get timing of the last bot api request made by the calling thread.
  *
- * The returned value should be freed when no longer needed.
+ * @param timing    filled with timing of each phase
+ */
+void telegram_get_last_timing(telegram_timing *timing);
+
+/**
+ * Get how the last telegram_send_to(), telegram_send_approval() or
+ * telegram_send_fanout() of the calling thread ended.
  *
- * @param token telegram bot token
+ * @return result of the send, TELEGRAM_SEND_NOT_SENT before any
+ */
+telegram_send_result telegram_get_last_send_result(void);
+
+/**
+ * Get statistics of response buffers.
+ *
+ * @param stats     filled with current statistics
+ */
+void telegram_get_buffer_stats(telegram_buffer_stats *stats);
+
+/**
+ * Release the warm connections, DNS cache, TLS sessions and response buffers kept
+ * between requests.
+ * Next request will start from a cold connection again.
+ */
+void telegram_cleanup(void);
+
+/**
+ * Initialize libcurl, once per process no matter how often it is called.
+ * Called before first request anyway, call it early while the process is
+ * still single threaded where curl_global_init() isn't thread safe.
  *
-  * @return chat_id  telegram bot chat_id
- *          NULL     failed to fetch chat_id (user not input ?)
+ * @return  false   failed to initialize curl
+ *          true    curl ready to use
  */
-const char *telegram_fetch_chat_id(const char *token);
+bool telegram_global_init(void);
 
 #endif /* _TELEGRAM_AUTHENTICATOR_TELEGRAM_H_ */
\ No newline at end of file
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "telegram_ops.h"
+#include "tls_cache.h"
+
+/* curl_global_init() isn't thread safe before curl 7.84, run it while the
+ * library is being loaded, before any thread of the module can use curl. */
+__attribute__((constructor))
+static void telegram_ops_load(void)
+{
+        telegram_global_init();
+}
+
+const telegram_ops telegram_ops_table = {
+        .version = TELEGRAM_OPS_VERSION,
+        .endpoint_parse = telegram_endpoint_parse,
+        .get_send_limits = telegram_get_send_limits,
+        .set_send_limits = telegram_set_send_limits,
+        .send_to = telegram_send_to,
+        .send_approval = telegram_send_approval,
+        .wait_approval = telegram_wait_approval,
+        .get_last_timing = telegram_get_last_timing,
+        .set_budget = telegram_set_budget,
+        .send_fanout = telegram_send_fanout,
+        .get_last_send_result = telegram_get_last_send_result,
+        .set_tls_cache_file = tls_cache_set_file,
+};
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _TELEGRAM_AUTHENTICATOR_TELEGRAM_OPS_H_
+#define _TELEGRAM_AUTHENTICATOR_TELEGRAM_OPS_H_
+
+#include "telegram.h"
+
+/*
+ * Functions of telegram.c the PAM module calls, reached through a table.
+ *
+ * Most users of a host have no config, and the module answers PAM_IGNORE for
+ * them. So that sshd children don't pay for linking libcurl and TLS libraries
+ * they never use, telegram.c is built into its own library next to the module,
+ * dlopen()ed the first time a user with a config logs in.
+ */
+
+/* Library with the table, looked up in the directory of the module */
+#define TELEGRAM_OPS_LIBRARY "pam_telegram_authenticator_curl.so"
+#define TELEGRAM_OPS_SYMBOL  "telegram_ops_table"
+
+/* Bumped whenever the table changes */
+#define TELEGRAM_OPS_VERSION 5
+
+typedef struct {
+        int version;
+        bool (*endpoint_parse)(telegram_endpoint *ep, const char *spec, bool allow_unix);
+        void (*get_send_limits)(telegram_send_limits *limits);
+        void (*set_send_limits)(const telegram_send_limits *limits);
+        bool (*send_to)(const telegram_endpoint *ep, const char *token, const char *chat_id,
+                        const char *msg);
+        bool (*send_approval)(const telegram_endpoint *ep, const char *token, const char *chat_id,
+                              const char *msg, const char *nonce);
+        telegram_approval (*wait_approval)(const telegram_endpoint *ep, const char *token,
+                                           const char *chat_id, const char *nonce, int timeout);
+        void (*get_last_timing)(telegram_timing *timing);
+        void (*set_budget)(long ms);
+        size_t (*send_fanout)(const telegram_endpoint *ep, const telegram_target *targets, size_t n,
+                              const char *msg, size_t quorum);
+        telegram_send_result (*get_last_send_result)(void);
+        void (*set_tls_cache_file)(const char *path);
+} telegram_ops;
+
+#endif /* _TELEGRAM_AUTHENTICATOR_TELEGRAM_OPS_H_ */
@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Cross-process TLS session cache.
+ *
+ * Every sshd child is a new process, so the in-process SSL session cache of
+ * curl starts empty and the first request of every login pays for a full TLS
+ * handshake. Sessions are saved here after a handshake and handed to the next
+ * process, which resumes them instead.
+ *
+ * The file is a small table of slots. Readers never lock, each slot carries a
+ * sequence number which is odd while a writer is updating it (seqlock).
+ * Writers serialize with flock(), same as the config cache.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "mapfile.h"
+#include "tls_cache.h"
+
+#define TLS_CACHE_MAGIC   0x53544754    /* "TGTS" */
+#define TLS_CACHE_VERSION 1
+#define TLS_CACHE_SLOTS   16
+
+typedef struct {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t nslots;
+        uint32_t reserved;
+} cache_header;
+
+typedef struct {
+        uint32_t seq;                   /* odd while being written */
+        uint32_t used;
+        int64_t stored;                 /* unix time */
+        int64_t valid_until;            /* unix time, 0 for unknown */
+        uint32_t shmac_len;
+        uint32_t data_len;
+        char key[TLS_CACHE_MAX_KEY];
+        unsigned char shmac[TLS_CACHE_MAX_SHMAC];
+        unsigned char data[TLS_CACHE_MAX_DATA];
+} cache_slot;
+
+typedef struct {
+        cache_header header;
+        cache_slot slots[TLS_CACHE_SLOTS];
+} cache_file;
+
+static struct {
+        pthread_mutex_t lock;
+        bool tried;                     /* don't retry opening on every call */
+        const char *path;               /* NULL: cache disabled */
+        mapfile_t map;
+} cache = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .path = NULL,
+        .map  = { .fd = -1 },
+};
+
+/**
+ * Enable the cache on a file, e.g. TLS_CACHE_FILE. The cache is disabled until
+ * then. Set it once at startup, before the cache is used.
+ *
+ * @param path  cache file, NULL to disable the cache
+ */
+void tls_cache_set_file(const char *path)
+{
+        pthread_mutex_lock(&cache.lock);
+        cache.path = path;
+        pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ * Tell whether a cache file was set.
+ *
+ * @return  true    sessions are loaded and saved
+ *          false   cache disabled
+ */
+bool tls_cache_enabled(void)
+{
+        pthread_mutex_lock(&cache.lock);
+        bool enabled = NULL != cache.path;
+        pthread_mutex_unlock(&cache.lock);
+
+        return enabled;
+}
+
+/**
+ * Map the cache file once per process.
+ *
+ * @return cache file, NULL if we can't use the cache
+ */
+static
+cache_file *cache_open(void)
+{
+        pthread_mutex_lock(&cache.lock);
+        if (!cache.tried && cache.path) {
+                cache.tried = true;
+
+                /* only root may create the cache, it holds session secrets */
+                if (mapfile_open(&cache.map, cache.path, sizeof(cache_file), 0 == geteuid())) {
+                        cache_file *file = cache.map.addr;
+
+                        mapfile_lock(&cache.map);
+                        if (TLS_CACHE_MAGIC != file->header.magic ||
+                            TLS_CACHE_VERSION != file->header.version ||
+                            TLS_CACHE_SLOTS != file->header.nslots) {
+                                memset(file, 0, sizeof(*file));
+                                file->header.magic = TLS_CACHE_MAGIC;
+                                file->header.version = TLS_CACHE_VERSION;
+                                file->header.nslots = TLS_CACHE_SLOTS;
+                        }
+                        mapfile_unlock(&cache.map);
+                }
+        }
+        pthread_mutex_unlock(&cache.lock);
+
+        return cache.map.addr;
+}
+
+static inline
+bool slot_expired(const cache_slot *slot, int64_t now)
+{
+        return (slot->valid_until && slot->valid_until <= now) ||
+                slot->stored + TLS_CACHE_TTL <= now || slot->stored > now;
+}
+
+/**
+ * Take a consistent copy of slot into session, retry while a writer is
+ * updating it.
+ *
+ * @return  false   slot unused, expired, or kept changing
+ *          true    session filled
+ */
+static
+bool slot_read(const cache_slot *slot, tls_session *session, int64_t now)
+{
+        for (int retry = 0; retry < 1000; retry++) {
+                uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+                if (seq & 1)
+                        continue;
+
+                if (!slot->used || slot_expired(slot, now))
+                        return false;
+
+                size_t shmac_len = slot->shmac_len;
+                size_t data_len = slot->data_len;
+                if (shmac_len > sizeof(session->shmac) || data_len > sizeof(session->data))
+                        return false;
+
+                memcpy(session->key, slot->key, sizeof(session->key));
+                memcpy(session->shmac, slot->shmac, shmac_len);
+                memcpy(session->data, slot->data, data_len);
+                session->shmac_len = shmac_len;
+                session->data_len = data_len;
+                session->valid_until = slot->valid_until;
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+                if (seq == __atomic_load_n(&slot->seq, __ATOMIC_RELAXED)) {
+                        session->key[sizeof(session->key) - 1] = '\0';
+                        return true;
+                }
+        }
+        return false;
+}
+
+/**
+ * Hand every session still valid to cb. Sessions which expired are skipped,
+ * and so are slots a writer is updating right now.
+ *
+ * @param cb        called for each session
+ * @param userdata  passed to cb
+ *
+ * @return number of sessions given to cb
+ */
+size_t tls_cache_load(tls_cache_cb cb, void *userdata)
+{
+        cache_file *file = cache_open();
+        if (!file)
+                return 0;
+
+        tls_session *session = malloc(sizeof(*session));
+        if (!session)
+                return 0;
+
+        int64_t now = time(NULL);
+        size_t n = 0;
+        for (int i = 0; i < TLS_CACHE_SLOTS; i++) {
+                if (slot_read(&file->slots[i], session, now)) {
+                        cb(session, userdata);
+                        n++;
+                }
+        }
+
+        free(session);
+        return n;
+}
+
+static
+bool same_key(const cache_slot *slot, const char *key, const unsigned char *shmac, size_t shmac_len)
+{
+        if (key)
+                return !strcmp(slot->key, key);
+        return !slot->key[0] && slot->shmac_len == shmac_len && !memcmp(slot->shmac, shmac, shmac_len);
+}
+
+/**
+ * Store a session, replacing the one with the same key. Without a free slot
+ * an expired session is evicted, or the oldest one. Only root can update the
+ * cache.
+ *
+ * @param key           peer the session is for, NULL if only shmac is given
+ * @param shmac         salted hash of the key, NULL if none
+ * @param shmac_len     length of shmac
+ * @param data          session data
+ * @param data_len      length of data
+ * @param valid_until   unix time the server stops accepting it, 0 for unknown
+ *
+ * @return  false   session too large, or no cache
+ *          true    session stored
+ */
+bool tls_cache_save(const char *key, const unsigned char *shmac, size_t shmac_len,
+                    const unsigned char *data, size_t data_len, int64_t valid_until)
+{
+        if (!shmac)
+                shmac_len = 0;
+        if ((!key && !shmac_len) || (key && strlen(key) >= TLS_CACHE_MAX_KEY) ||
+            shmac_len > TLS_CACHE_MAX_SHMAC || !data_len || data_len > TLS_CACHE_MAX_DATA)
+                return false;
+
+        cache_file *file = cache_open();
+        if (!file)
+                return false;
+
+        int64_t now = time(NULL);
+
+        mapfile_lock(&cache.map);
+
+        /* same peer, else a free or expired slot, else the oldest one */
+        cache_slot *slot = NULL, *free_slot = NULL, *oldest = &file->slots[0];
+        for (int i = 0; i < TLS_CACHE_SLOTS; i++) {
+                cache_slot *s = &file->slots[i];
+                if (s->used && same_key(s, key, shmac, shmac_len)) {
+                        slot = s;
+                        break;
+                }
+                if (!free_slot && (!s->used || slot_expired(s, now)))
+                        free_slot = s;
+                if (s->stored < oldest->stored)
+                        oldest = s;
+        }
+        if (!slot)
+                slot = free_slot ? free_slot : oldest;
+
+        /* a writer died in the middle of update, the slot is garbage anyway */
+        if (slot->seq & 1)
+                slot->seq++;
+
+        __atomic_add_fetch(&slot->seq, 1, __ATOMIC_ACQ_REL);   /* odd: writing */
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        slot->used = 1;
+        slot->stored = now;
+        slot->valid_until = valid_until;
+        slot->shmac_len = shmac_len;
+        slot->data_len = data_len;
+        strncpy(slot->key, key ? key : "", sizeof(slot->key));
+        if (shmac_len)
+                memcpy(slot->shmac, shmac, shmac_len);
+        memcpy(slot->data, data, data_len);
+
+        __atomic_add_fetch(&slot->seq, 1, __ATOMIC_RELEASE);   /* even: done */
+
+        mapfile_unlock(&cache.map);
+
+        return true;
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _TELEGRAM_AUTHENTICATOR_TLS_CACHE_H_
+#define _TELEGRAM_AUTHENTICATOR_TLS_CACHE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* TLS sessions of the bot api servers, shared by every process. Kept in
+ * tmpfs so the session secrets never reach a disk, gone after reboot */
+#define TLS_CACHE_FILE "/run/telegram-authenticator/tls.cache"
+
+/* Largest session we keep, and its key as given by curl */
+#define TLS_CACHE_MAX_KEY   256
+#define TLS_CACHE_MAX_SHMAC 64
+#define TLS_CACHE_MAX_DATA  4096
+
+/* Sessions are dropped this many seconds after they were stored, even when
+ * the server says they are valid for longer */
+#define TLS_CACHE_TTL 3600
+
+/* One TLS session, opaque to us */
+typedef struct {
+        char key[TLS_CACHE_MAX_KEY];    /* peer the session is for, "" if only shmac */
+        unsigned char shmac[TLS_CACHE_MAX_SHMAC]; /* salted hash of the key */
+        size_t shmac_len;
+        unsigned char data[TLS_CACHE_MAX_DATA];
+        size_t data_len;
+        int64_t valid_until;            /* unix time, 0 for unknown */
+} tls_session;
+
+/* Called by tls_cache_load() for every session still valid */
+typedef void (*tls_cache_cb)(const tls_session *session, void *userdata);
+
+/**
+ * Enable the cache on a file, e.g. TLS_CACHE_FILE. The cache is disabled until
+ * then. Set it once at startup, before the cache is used.
+ *
+ * @param path  cache file, NULL to disable the cache
+ */
+void tls_cache_set_file(const char *path);
+
+/**
+ * Tell whether a cache file was set.
+ *
+ * @return  true    sessions are loaded and saved
+ *          false   cache disabled
+ */
+bool tls_cache_enabled(void);
+
+/**
+ * Hand every session still valid to cb. Sessions which expired are skipped,
+ * and so are slots a writer is updating right now.
+ *
+ * @param cb        called for each session
+ * @param userdata  passed to cb
+ *
+ * @return number of sessions given to cb
+ */
+size_t tls_cache_load(tls_cache_cb cb, void *userdata);
+
+/**
+ * Store a session, replacing the one with the same key. Without a free slot
+ * an expired session is evicted, or the oldest one. Only root can update the
+ * cache.
+ *
+ * @param key           peer the session is for, NULL if only shmac is given
+ * @param shmac         salted hash of the key, NULL if none
+ * @param shmac_len     length of shmac
+ * @param data          session data
+ * @param data_len      length of data
+ * @param valid_until   unix time the server stops accepting it, 0 for unknown
+ *
+ * @return  false   session too large, or no cache
+ *          true    session stored
+ */
+bool tls_cache_save(const char *key, const unsigned char *shmac, size_t shmac_len,
+                    const unsigned char *data, size_t data_len, int64_t valid_until);
+
+#endif /* _TELEGRAM_AUTHENTICATOR_TLS_CACHE_H_ */
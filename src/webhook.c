@@ -0,0 +1,667 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Webhook receiver.
+ *
+ * One thread accepts connections from telegram (through the reverse proxy),
+ * each connection is served by its own thread. The request body is fed to
+ * json_scan as it arrives, so an update is parsed without being buffered and
+ * without any allocation. A button press is looked up among the waiters by
+ * chat_id and nonce, and the waiting thread is woken up.
+ *
+ * Waiters are kept in a challenge table, its timing wheel is advanced by one
+ * more thread every tick and wakes waiters whose message expired, so a
+ * pending approval costs no timer of its own.
+ */
+
+#define _GNU_SOURCE             /* accept4(), strncasecmp() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "challenge.h"
+#include "json_scan.h"
+#include "random.h"
+#include "webhook.h"
+
+/* Longest request headers we accept, and largest update */
+#define WEBHOOK_HEADER_MAX 4096
+#define WEBHOOK_BODY_MAX   (64 * 1024)
+
+/* Idle keep-alive connections are closed after this many seconds, and a
+ * request must be complete this many seconds after its first byte */
+#define WEBHOOK_IDLE_TIMEOUT    120
+#define WEBHOOK_REQUEST_TIMEOUT 10
+
+/* Connections served at once, more are closed right away. Telegram opens 40
+ * at most by default */
+#define WEBHOOK_CONNECTIONS_MAX 64
+
+/* Random bytes of the secret token, sent as hex */
+#define WEBHOOK_SECRET_BYTES 32
+
+/* Most approvals pending at once, and resolution of their timeout */
+#define WEBHOOK_PENDING_MAX 65536
+#define WEBHOOK_TICK_MS     100
+
+#define SECRET_HEADER "X-Telegram-Bot-Api-Secret-Token:"
+
+struct webhook_waiter {
+        char chat_id[CHALLENGE_MAX_CHAT_ID + 1];
+        char nonce[CHALLENGE_MAX_NONCE + 1];
+        bool done;                      /* pressed or expired, out of the table */
+        telegram_approval result;       /* TELEGRAM_APPROVAL_TIMEOUT until pressed */
+        char callback_id[64];
+        pthread_cond_t cond;
+};
+
+/* A bot pointing its webhook to us */
+typedef struct webhook_bot {
+        char *token;
+        struct webhook_bot *next;
+} webhook_bot;
+
+static struct {
+        pthread_mutex_t lock;
+        int listen_fd;
+        char url[256];
+        char secret[2 * WEBHOOK_SECRET_BYTES + 1];
+        challenge_table *waiters;
+        webhook_stats stats;
+        int connections;                /* served by a connection_thread */
+        pthread_mutex_t bots_lock;      /* held during setWebhook */
+        webhook_bot *bots;
+} webhook = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .listen_fd = -1,
+        .bots_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Parse one update while its body streams in */
+typedef struct {
+        json_scanner scanner;
+        telegram_update update;
+} update_reader;
+
+static
+void update_on_value(json_scanner *s, json_scan_type type,
+                     const char *value, size_t len, void *userdata)
+{
+        update_reader *reader = userdata;
+        telegram_update_field(&reader->update, json_scan_path(s), value, len);
+}
+
+/**
+ * Hand update to the thread waiting for it.
+ */
+static
+void dispatch(const telegram_update *update)
+{
+        telegram_approval answer;
+        const char *nonce;
+        bool approval = telegram_update_approval(update, &answer, &nonce);
+
+        pthread_mutex_lock(&webhook.lock);
+        webhook.stats.received++;
+
+        /* only the user may press, in their own chat: chat.id of a group
+         * is the group, whoever pressed */
+        webhook_waiter *w = NULL;
+        if (approval && !strcmp(update->from_id, update->chat_id))
+                w = challenge_remove(webhook.waiters, update->chat_id, nonce);
+
+        if (w) {
+                w->done = true;
+                w->result = answer;
+                snprintf(w->callback_id, sizeof(w->callback_id), "%s", update->callback_id);
+                pthread_cond_signal(&w->cond);
+                webhook.stats.dispatched++;
+        } else {
+                webhook.stats.unmatched++;
+        }
+        pthread_mutex_unlock(&webhook.lock);
+}
+
+static
+bool write_all(int fd, const char *buf, size_t len)
+{
+        while (len > 0) {
+                ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+                if (n < 0 && EINTR == errno)
+                        continue;
+                if (n <= 0)
+                        return false;
+                buf += n;
+                len -= n;
+        }
+        return true;
+}
+
+static
+bool reply(int fd, const char *status)
+{
+        char buf[128];
+        int len = snprintf(buf, sizeof(buf), "HTTP/1.1 %s\r\nContent-Length: 0\r\n\r\n", status);
+        return write_all(fd, buf, len);
+}
+
+static
+void reject(void)
+{
+        pthread_mutex_lock(&webhook.lock);
+        webhook.stats.rejected++;
+        pthread_mutex_unlock(&webhook.lock);
+}
+
+static
+double monotonic_now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * recv() what arrives before deadline, so a peer sending a byte now and then
+ * can't hold the connection longer.
+ *
+ * @param deadline  monotonic_now() to give up at
+ *
+ * @return bytes received, 0 on end of stream, -1 on error or timeout
+ */
+static
+ssize_t recv_before(int fd, char *buf, size_t len, double deadline)
+{
+        for (;;) {
+                double left = deadline - monotonic_now();
+                if (left <= 0)
+                        return -1;
+
+                struct pollfd pfd = { .fd = fd, .events = POLLIN };
+                int ready = poll(&pfd, 1, (int) (left * 1000) + 1);
+                if (ready < 0 && EINTR != errno)
+                        return -1;
+                if (ready <= 0)
+                        continue;
+
+                ssize_t n = recv(fd, buf, len, 0);
+                if (n >= 0 || EINTR != errno)
+                        return n;
+        }
+}
+
+/**
+ * Serve requests of one keep-alive connection. Pipelined requests are not
+ * expected from telegram, data after a body ends the connection.
+ */
+static
+void *connection_thread(void *arg)
+{
+        int fd = (int) (intptr_t) arg;
+        char buf[WEBHOOK_HEADER_MAX + 1];
+        update_reader reader;
+
+        for (;;) {
+                /* wait for complete headers, the request's time starts with
+                 * its first byte */
+                size_t used = 0;
+                char *end;
+                double deadline = monotonic_now() + WEBHOOK_IDLE_TIMEOUT;
+                buf[0] = '\0';
+                while (!(end = strstr(buf, "\r\n\r\n"))) {
+                        if (used >= WEBHOOK_HEADER_MAX)
+                                goto out;
+                        ssize_t n = recv_before(fd, buf + used, WEBHOOK_HEADER_MAX - used, deadline);
+                        if (n <= 0)
+                                goto out;
+                        if (0 == used)
+                                deadline = monotonic_now() + WEBHOOK_REQUEST_TIMEOUT;
+                        used += n;
+                        buf[used] = '\0';
+                }
+
+                char method[8];
+                if (sscanf(buf, "%7s", method) != 1)
+                        goto out;
+
+                size_t body_len = 0;
+                bool keep_alive = true, secret_ok = false;
+                for (char *line = strstr(buf, "\r\n") + 2; line < end; line = strstr(line, "\r\n") + 2) {
+                        if (!strncasecmp(line, "Content-Length:", 15)) {
+                                body_len = strtoul(line + 15, NULL, 10);
+                        } else if (!strncasecmp(line, "Connection:", 11)) {
+                                keep_alive = !strstr(line, "close");
+                        } else if (!strncasecmp(line, SECRET_HEADER, sizeof(SECRET_HEADER) - 1)) {
+                                char *value = line + sizeof(SECRET_HEADER) - 1;
+                                value += strspn(value, " \t");
+                                size_t len = strcspn(value, "\r");
+                                char saved = value[len];
+                                value[len] = '\0';
+                                secret_ok = telegram_nonce_equal(value, webhook.secret);
+                                value[len] = saved;
+                        }
+                }
+
+                /* body bytes which came with the headers */
+                char *body = end + 4;
+                size_t have = used - (body - buf);
+                if (have > body_len)
+                        goto out;
+
+                if (strcmp(method, "POST") || !secret_ok || body_len > WEBHOOK_BODY_MAX) {
+                        reject();
+                        reply(fd, strcmp(method, "POST") ? "405 Method Not Allowed" :
+                              !secret_ok ? "401 Unauthorized" : "413 Payload Too Large");
+                        goto out;
+                }
+
+                memset(&reader.update, 0, sizeof(reader.update));
+                json_scan_init(&reader.scanner, update_on_value, NULL, &reader);
+                bool valid = json_scan_feed(&reader.scanner, body, have);
+
+                /* rest of the body, scanned as it arrives */
+                for (size_t left = body_len - have; left > 0; ) {
+                        ssize_t n = recv_before(fd, buf, left < WEBHOOK_HEADER_MAX ? left : WEBHOOK_HEADER_MAX,
+                                                deadline);
+                        if (n <= 0)
+                                goto out;
+                        valid = valid && json_scan_feed(&reader.scanner, buf, n);
+                        left -= n;
+                }
+
+                if (!valid || !json_scan_finish(&reader.scanner)) {
+                        reject();
+                        reply(fd, "400 Bad Request");
+                        goto out;
+                }
+
+                dispatch(&reader.update);
+
+                if (!reply(fd, "200 OK") || !keep_alive)
+                        goto out;
+        }
+
+out:
+        close(fd);
+
+        pthread_mutex_lock(&webhook.lock);
+        webhook.connections--;
+        pthread_mutex_unlock(&webhook.lock);
+        return NULL;
+}
+
+static
+void *accept_thread(void *arg)
+{
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+        for (;;) {
+                int fd = accept4(webhook.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+                if (fd < 0) {
+                        if (EINTR != errno && ECONNABORTED != errno)
+                                perror("accept()");
+                        continue;
+                }
+
+                /* don't let anyone able to connect use up threads and fds */
+                pthread_mutex_lock(&webhook.lock);
+                bool full = webhook.connections >= WEBHOOK_CONNECTIONS_MAX;
+                if (full)
+                        webhook.stats.refused++;
+                else
+                        webhook.connections++;
+                pthread_mutex_unlock(&webhook.lock);
+                if (full) {
+                        close(fd);
+                        continue;
+                }
+
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+                pthread_t tid;
+                if (pthread_create(&tid, &attr, connection_thread, (void *) (intptr_t) fd)) {
+                        fprintf(stderr, "ERROR: Failed on pthread_create().\n");
+                        close(fd);
+                        pthread_mutex_lock(&webhook.lock);
+                        webhook.connections--;
+                        pthread_mutex_unlock(&webhook.lock);
+                }
+        }
+
+        return NULL;
+}
+
+/**
+ * Listen on [host:]port.
+ *
+ * @return  listening socket fd, -1 on failure
+ */
+static
+int listen_on(const char *spec)
+{
+        char host[256] = "127.0.0.1";
+        const char *port = spec;
+        const char *colon = strrchr(spec, ':');
+
+        if (colon) {
+                size_t len = colon - spec;
+                if (len >= sizeof(host)) {
+                        fprintf(stderr, "ERROR: invalid listen address: %s\n", spec);
+                        return -1;
+                }
+                if (len > 0) {
+                        memcpy(host, spec, len);
+                        host[len] = '\0';
+                }
+                port = colon + 1;
+        }
+
+        struct addrinfo hints = {
+                .ai_family = AF_UNSPEC,
+                .ai_socktype = SOCK_STREAM,
+                .ai_flags = AI_PASSIVE | AI_NUMERICSERV,
+        }, *res;
+
+        int err = getaddrinfo(host, port, &hints, &res);
+        if (err) {
+                fprintf(stderr, "ERROR: invalid listen address %s: %s\n", spec, gai_strerror(err));
+                return -1;
+        }
+
+        int fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol);
+        if (fd < 0) {
+                perror("socket()");
+                freeaddrinfo(res);
+                return -1;
+        }
+
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        if (bind(fd, res->ai_addr, res->ai_addrlen) < 0 || listen(fd, SOMAXCONN) < 0) {
+                fprintf(stderr, "ERROR: Failed to listen on %s: %s\n", spec, strerror(errno));
+                close(fd);
+                fd = -1;
+        }
+
+        freeaddrinfo(res);
+        return fd;
+}
+
+static
+uint64_t monotonic_ms(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static
+void on_expire(void *data, void *userdata)
+{
+        webhook_waiter *w = data;
+        (void)userdata;
+
+        w->done = true;
+        pthread_cond_signal(&w->cond);
+}
+
+/**
+ * Advance the timing wheel of the waiters every tick.
+ */
+static
+void *expire_thread(void *arg)
+{
+        const struct timespec tick = {
+                .tv_sec = WEBHOOK_TICK_MS / 1000,
+                .tv_nsec = WEBHOOK_TICK_MS % 1000 * 1000000,
+        };
+        (void)arg;
+
+        for (;;) {
+                nanosleep(&tick, NULL);
+
+                pthread_mutex_lock(&webhook.lock);
+                challenge_expire(webhook.waiters, monotonic_ms(), on_expire, NULL);
+                pthread_mutex_unlock(&webhook.lock);
+        }
+        return NULL;
+}
+
+/**
+ * Start listening for updates on background threads.
+ *
+ * @param listen    [host:]port to listen on, host defaults to 127.0.0.1
+ * @param url       public https url of the listener, given to setWebhook
+ *
+ * @return  false   invalid address or failed to listen, error printed
+ *          true    listening
+ */
+bool webhook_start(const char *listen, const char *url)
+{
+        unsigned char raw[WEBHOOK_SECRET_BYTES];
+
+        if (strlen(url) >= sizeof(webhook.url)) {
+                fprintf(stderr, "ERROR: webhook url too long: %s\n", url);
+                return false;
+        }
+
+        /* new secret on every start, bots are registered again anyway */
+        if (!random_bytes(raw, sizeof(raw))) {
+                fprintf(stderr, "ERROR: no random bytes for webhook secret.\n");
+                return false;
+        }
+        for (size_t i = 0; i < sizeof(raw); i++)
+                sprintf(webhook.secret + 2 * i, "%02x", raw[i]);
+
+        webhook.waiters = challenge_create(WEBHOOK_PENDING_MAX, WEBHOOK_TICK_MS, monotonic_ms());
+        if (!webhook.waiters) {
+                fprintf(stderr, "ERROR: Out of memory.\n");
+                return false;
+        }
+
+        webhook.listen_fd = listen_on(listen);
+        if (webhook.listen_fd < 0)
+                return false;
+
+        strcpy(webhook.url, url);
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+        pthread_t tid;
+        bool ok = !pthread_create(&tid, &attr, expire_thread, NULL) &&
+                  !pthread_create(&tid, &attr, accept_thread, NULL);
+        pthread_attr_destroy(&attr);
+
+        if (!ok) {
+                fprintf(stderr, "ERROR: Failed on pthread_create().\n");
+                close(webhook.listen_fd);
+                webhook.listen_fd = -1;
+        }
+        return ok;
+}
+
+/**
+ * Point the bot's webhook to us, once per bot.
+ *
+ * @param token     telegram bot token
+ *
+ * @return  false   webhook not started or setWebhook failed
+ *          true    updates of the bot come to us
+ */
+bool webhook_register(const char *token)
+{
+        if (webhook.listen_fd < 0)
+                return false;
+
+        pthread_mutex_lock(&webhook.bots_lock);
+
+        bool ok = false;
+        for (webhook_bot *b = webhook.bots; b && !ok; b = b->next)
+                ok = !strcmp(b->token, token);
+
+        if (!ok && telegram_set_webhook(NULL, token, webhook.url, webhook.secret)) {
+                webhook_bot *b = calloc(1, sizeof(*b));
+                if (b && (b->token = strdup(token))) {
+                        b->next = webhook.bots;
+                        webhook.bots = b;
+                } else {
+                        free(b);
+                }
+                ok = true;
+        }
+
+        pthread_mutex_unlock(&webhook.bots_lock);
+        return ok;
+}
+
+/**
+ * Delete the webhook of every bot registered, so they can be polled with
+ * getUpdates again.
+ */
+void webhook_unregister_all(void)
+{
+        pthread_mutex_lock(&webhook.bots_lock);
+        while (webhook.bots) {
+                webhook_bot *b = webhook.bots;
+                webhook.bots = b->next;
+                telegram_delete_webhook(NULL, b->token);
+                free(b->token);
+                free(b);
+        }
+        pthread_mutex_unlock(&webhook.bots_lock);
+}
+
+/**
+ * Start waiting for a button of telegram_send_approval(), call it before the
+ * message is sent so the press can't arrive before we wait for it.
+ *
+ * @param chat_id   chat the message goes to
+ * @param nonce     nonce of the message
+ * @param timeout   seconds the button is valid
+ *
+ * @return waiter, NULL if out of memory, too many pending or chat_id/nonce too long
+ */
+webhook_waiter *webhook_wait_begin(const char *chat_id, const char *nonce, int timeout)
+{
+        if (!webhook.waiters ||
+            strlen(chat_id) > CHALLENGE_MAX_CHAT_ID ||
+            strlen(nonce) > CHALLENGE_MAX_NONCE)
+                return NULL;
+
+        webhook_waiter *w = calloc(1, sizeof(*w));
+        if (!w)
+                return NULL;
+
+        strcpy(w->chat_id, chat_id);
+        strcpy(w->nonce, nonce);
+        w->result = TELEGRAM_APPROVAL_TIMEOUT;
+        pthread_cond_init(&w->cond, NULL);
+
+        pthread_mutex_lock(&webhook.lock);
+        bool ok = challenge_insert(webhook.waiters, chat_id, nonce, w,
+                                   (uint64_t)(timeout > 0 ? timeout : 0) * 1000);
+        pthread_mutex_unlock(&webhook.lock);
+
+        if (!ok) {
+                pthread_cond_destroy(&w->cond);
+                free(w);
+                return NULL;
+        }
+        return w;
+}
+
+static
+void waiter_free(webhook_waiter *waiter)
+{
+        pthread_cond_destroy(&waiter->cond);
+        free(waiter);
+}
+
+/**
+ * Wait for the button, or for its timeout, and free the waiter.
+ *
+ * @param waiter        returned by webhook_wait_begin()
+ * @param callback_id   filled with id of the callback_query when pressed
+ * @param size          size of callback_id
+ *
+ * @return  TELEGRAM_APPROVAL_APPROVED  approve pressed
+ *          TELEGRAM_APPROVAL_DENIED    deny pressed
+ *          TELEGRAM_APPROVAL_TIMEOUT   nothing pressed before timeout
+ */
+telegram_approval webhook_wait_end(webhook_waiter *waiter, char *callback_id, size_t size)
+{
+        pthread_mutex_lock(&webhook.lock);
+        while (!waiter->done)
+                pthread_cond_wait(&waiter->cond, &webhook.lock);
+        pthread_mutex_unlock(&webhook.lock);
+
+        telegram_approval result = waiter->result;
+        snprintf(callback_id, size, "%s", waiter->callback_id);
+
+        waiter_free(waiter);
+        return result;
+}
+
+/**
+ * Stop waiting without waiting, e.g. when the message couldn't be sent, and
+ * free the waiter.
+ *
+ * @param waiter        returned by webhook_wait_begin()
+ */
+void webhook_wait_cancel(webhook_waiter *waiter)
+{
+        pthread_mutex_lock(&webhook.lock);
+        if (!waiter->done)
+                challenge_remove(webhook.waiters, waiter->chat_id, waiter->nonce);
+        pthread_mutex_unlock(&webhook.lock);
+
+        waiter_free(waiter);
+}
+
+/**
+ * Get counters of the receiver.
+ *
+ * @param stats     filled with current counters
+ */
+void webhook_get_stats(webhook_stats *stats)
+{
+        pthread_mutex_lock(&webhook.lock);
+        *stats = webhook.stats;
+        stats->waiting = webhook.waiters ? challenge_count(webhook.waiters) : 0;
+        pthread_mutex_unlock(&webhook.lock);
+}
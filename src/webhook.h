@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2016 Yen-Chin, Lee <coldnew.tw at gmail.com>.
+ *
+ * This file is part of telegram-authenticator.
+ *
+ * telegram-authenticator is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * telegram-authenticator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with telegram-authenticator.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _TELEGRAM_AUTHENTICATOR_WEBHOOK_H_
+#define _TELEGRAM_AUTHENTICATOR_WEBHOOK_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "telegram.h"
+
+/*
+ * Webhook receiver of telegram-authenticatord.
+ *
+ * Telegram pushes updates of every bot registered with webhook_register() to
+ * a small HTTP listener, and each button press is handed to the thread
+ * waiting for it. Telegram only posts to https, the listener speaks plain
+ * HTTP and is meant to sit behind a reverse proxy terminating TLS.
+ */
+
+typedef struct webhook_waiter webhook_waiter;
+
+typedef struct {
+        size_t received;        /* updates posted to us */
+        size_t dispatched;      /* given to a waiter */
+        size_t unmatched;       /* nobody waiting for it */
+        size_t rejected;        /* bad secret or malformed request */
+        size_t refused;         /* connections over WEBHOOK_CONNECTIONS_MAX */
+        size_t waiting;         /* waiters now */
+} webhook_stats;
+
+/**
+ * Start listening for updates on background threads.
+ *
+ * @param listen    [host:]port to listen on, host defaults to 127.0.0.1
+ * @param url       public https url of the listener, given to setWebhook
+ *
+ * @return  false   invalid address or failed to listen, error printed
+ *          true    listening
+ */
+bool webhook_start(const char *listen, const char *url);
+
+/**
+ * Point the bot's webhook to us, once per bot.
+ *
+ * @param token     telegram bot token
+ *
+ * @return  false   webhook not started or setWebhook failed
+ *          true    updates of the bot come to us
+ */
+bool webhook_register(const char *token);
+
+/**
+ * Delete the webhook of every bot registered, so they can be polled with
+ * getUpdates again.
+ */
+void webhook_unregister_all(void);
+
+/**
+ * Start waiting for a button of telegram_send_approval(), call it before the
+ * message is sent so the press can't arrive before we wait for it.
+ *
+ * @param chat_id   chat the message goes to
+ * @param nonce     nonce of the message
+ * @param timeout   seconds the button is valid
+ *
+ * @return waiter, NULL if out of memory or too many approvals pending
+ */
+webhook_waiter *webhook_wait_begin(const char *chat_id, const char *nonce, int timeout);
+
+/**
+ * Wait for the button, or for its timeout, and free the waiter.
+ *
+ * @param waiter        returned by webhook_wait_begin()
+ * @param callback_id   filled with id of the callback_query when pressed
+ * @param size          size of callback_id
+ *
+ * @return  TELEGRAM_APPROVAL_APPROVED  approve pressed
+ *          TELEGRAM_APPROVAL_DENIED    deny pressed
+ *          TELEGRAM_APPROVAL_TIMEOUT   nothing pressed before timeout
+ */
+telegram_approval webhook_wait_end(webhook_waiter *waiter, char *callback_id, size_t size);
+
+/**
+ * Stop waiting right away, e.g. when the message couldn't be sent, and free
+ * the waiter.
+ *
+ * @param waiter        returned by webhook_wait_begin()
+ */
+void webhook_wait_cancel(webhook_waiter *waiter);
+
+/**
+ * Get counters of the receiver.
+ *
+ * @param stats     filled with current counters
+ */
+void webhook_get_stats(webhook_stats *stats);
+
+#endif /* _TELEGRAM_AUTHENTICATOR_WEBHOOK_H_ */